@@ -0,0 +1,306 @@
+#include "active_scans.hpp"
+
+namespace SimpicServerLib
+{
+    ScanFlight::ScanFlight(const std::string &_path, bool _recursive, uint8_t _types)
+    {
+        path = _path;
+        recursive = _recursive;
+        types = _types;
+        store = nullptr;
+        verifier = nullptr;
+        done = false;
+        error = 0;
+    }
+
+    ScanFlight::~ScanFlight()
+    {
+        for (Video *vid : vids)
+            delete vid;
+
+        for (Audio *aud : auds)
+            delete aud;
+
+        for (Text *txt : txts)
+            delete txt;
+    }
+
+    void ScanFlight::complete(int _error, std::vector<Video*> &_vids, std::vector<Audio*> &_auds, std::vector<Text*> &_txts)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            error = _error;
+            vids = _vids;
+            auds = _auds;
+            txts = _txts;
+            done = true;
+        }
+
+        state_cv.notify_all();
+    }
+
+    void ScanFlight::wait()
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        state_cv.wait(lock, [this]() -> bool { return done; });
+    }
+
+    std::vector<uint32_t> ScanFlight::images_for(const std::string &dir, bool _recursive)
+    {
+        if (dir == path && _recursive == recursive)
+            return imgs.all();
+
+        std::vector<uint32_t> result;
+
+        /* They're sorted by path, so each directory is only looked at once. */
+        uint32_t last = UINT32_MAX;
+        bool within = false;
+
+        for (uint32_t id = 0; id < imgs.size(); id++)
+        {
+            if (imgs[id].path != last)
+            {
+                std::string img_path(imgs.path(id));
+
+                last = imgs[id].path;
+                within = img_path == dir || (_recursive && path_is_within(dir, img_path));
+            }
+
+            if (within)
+                result.push_back(id);
+        }
+
+        return result;
+    }
+
+    std::vector<Video*> ScanFlight::videos_for(const std::string &dir, bool _recursive)
+    {
+        if (dir == path && _recursive == recursive)
+            return vids;
+
+        std::vector<Video*> result;
+
+        for (Video *vid : vids)
+        {
+            if (vid->path == dir || (_recursive && path_is_within(dir, vid->path)))
+                result.push_back(vid);
+        }
+
+        return result;
+    }
+
+    std::vector<Audio*> ScanFlight::audios_for(const std::string &dir, bool _recursive)
+    {
+        if (dir == path && _recursive == recursive)
+            return auds;
+
+        std::vector<Audio*> result;
+
+        for (Audio *aud : auds)
+        {
+            if (aud->path == dir || (_recursive && path_is_within(dir, aud->path)))
+                result.push_back(aud);
+        }
+
+        return result;
+    }
+
+    std::vector<Text*> ScanFlight::texts_for(const std::string &dir, bool _recursive)
+    {
+        if (dir == path && _recursive == recursive)
+            return txts;
+
+        std::vector<Text*> result;
+
+        for (Text *txt : txts)
+        {
+            if (txt->path == dir || (_recursive && path_is_within(dir, txt->path)))
+                result.push_back(txt);
+        }
+
+        return result;
+    }
+
+    SetList ScanFlight::find_similar(const std::string &dir, bool _recursive, uint8_t max_ham,
+            std::function<void(int)> progress_callback)
+    {
+        /* A subset of the flight: nobody else is going to ask for exactly this, don't memoize. */
+        if (dir != path || _recursive != recursive)
+        {
+            SetList results = imgs.find_similar(representatives(images_for(dir, _recursive)), max_ham, progress_callback);
+            return verifier == nullptr ? results : verifier->verify(imgs, results, false);
+        }
+
+        /* Whoever gets here first compares, everyone after them waits and copies. */
+        std::lock_guard<std::mutex> lock(similar_mutex);
+
+        std::map<uint8_t, SetList>::iterator it = similar.find(max_ham);
+
+        if (it == similar.end())
+        {
+            std::vector<uint32_t> unique = representatives(imgs.all());
+
+            SetList found = store == nullptr ?
+                imgs.find_similar(unique, max_ham, progress_callback) :
+                store->find_similar_images(path, recursive, imgs, unique, max_ham, progress_callback);
+
+            if (verifier != nullptr)
+                found = verifier->verify(imgs, found, false);
+
+            it = similar.insert({max_ham, found}).first;
+        }
+
+        return it->second;
+    }
+
+    std::vector<uint32_t> ScanFlight::representatives(const std::vector<uint32_t> &ids)
+    {
+        SetList groups = imgs.group_by_sha256(ids);
+        std::vector<uint32_t> result;
+
+        for (size_t i = 0; i < groups.size(); i++)
+            result.push_back(*groups.begin(i));
+
+        return result;
+    }
+
+    SetList ScanFlight::exact_duplicates(const std::string &dir, bool _recursive)
+    {
+        SetList groups = imgs.group_by_sha256(images_for(dir, _recursive));
+        SetList results;
+
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            if (groups.count(i) < 2)
+                continue;
+
+            for (const uint32_t *id = groups.begin(i); id != groups.end(i); id++)
+                results.push(*id);
+
+            results.end_set();
+        }
+
+        return results;
+    }
+
+    ActiveScans::~ActiveScans()
+    {
+        std::vector<Node*> stack;
+
+        for (auto &[key, value] : root.children)
+            stack.push_back(value);
+
+        while (!stack.empty())
+        {
+            Node *node = stack.back();
+            stack.pop_back();
+
+            for (auto &[key, value] : node->children)
+                stack.push_back(value);
+
+            delete node;
+        }
+    }
+
+    std::vector<std::string> ActiveScans::components(const std::string &path)
+    {
+        std::vector<std::string> result;
+        size_t start = 0;
+
+        /* Empty components (from // or a trailing /) are ignored, so /a//b/ is the same as /a/b. */
+        while (start < path.size())
+        {
+            size_t end = path.find('/', start);
+
+            if (end == std::string::npos)
+                end = path.size();
+
+            if (end != start)
+                result.push_back(path.substr(start, end - start));
+
+            start = end + 1;
+        }
+
+        return result;
+    }
+
+    std::shared_ptr<ScanFlight> ActiveScans::covering(const std::vector<std::shared_ptr<ScanFlight>> &flights, uint8_t types)
+    {
+        for (const std::shared_ptr<ScanFlight> &flight : flights)
+            if ((flight->types & types) == types)
+                return flight;
+
+        return nullptr;
+    }
+
+    std::shared_ptr<ScanFlight> ActiveScans::join(const std::string &path, bool recursive, uint8_t types, bool &leader)
+    {
+        std::lock_guard<std::mutex> lock(trie_mutex);
+
+        Node *node = &root;
+        std::shared_ptr<ScanFlight> flight;
+
+        /* A recursive scan of any parent on the way down already covers this directory. */
+        for (const std::string &component : components(path))
+        {
+            if ((flight = covering(node->recursive, types)) != nullptr)
+            {
+                leader = false;
+                return flight;
+            }
+
+            std::map<std::string, Node*>::iterator it = node->children.find(component);
+
+            if (it == node->children.end())
+                it = node->children.insert({component, new Node()}).first;
+
+            node = it->second;
+        }
+
+        /* The same directory: a recursive scan covers both kinds, a flat one only flat ones. */
+        if ((flight = covering(node->recursive, types)) != nullptr || (!recursive && (flight = covering(node->flat, types)) != nullptr))
+        {
+            leader = false;
+            return flight;
+        }
+
+        flight = std::make_shared<ScanFlight>(path, recursive, types);
+        (recursive ? node->recursive : node->flat).push_back(flight);
+
+        leader = true;
+        return flight;
+    }
+
+    void ActiveScans::leave(const std::shared_ptr<ScanFlight> &flight)
+    {
+        std::lock_guard<std::mutex> lock(trie_mutex);
+
+        std::vector<std::pair<Node*, std::string>> trail;
+        Node *node = &root;
+
+        for (const std::string &component : components(flight->path))
+        {
+            std::map<std::string, Node*>::iterator it = node->children.find(component);
+
+            if (it == node->children.end())
+                return;
+
+            trail.push_back({node, component});
+            node = it->second;
+        }
+
+        std::vector<std::shared_ptr<ScanFlight>> &flights = flight->recursive ? node->recursive : node->flat;
+        flights.erase(std::remove(flights.begin(), flights.end(), flight), flights.end());
+
+        /* Prune the nodes that don't lead anywhere anymore, from the bottom up. */
+        while (!trail.empty() && node->children.empty() && node->flat.empty() && node->recursive.empty())
+        {
+            auto [parent, component] = trail.back();
+            trail.pop_back();
+
+            parent->children.erase(component);
+            delete node;
+            node = parent;
+        }
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "images.hpp"
+#include "videos.hpp"
+#include "audios.hpp"
+#include "texts.hpp"
+#include "similarity.hpp"
+#include "verifier.hpp"
+#include "utils.hpp"
+
+namespace SimpicServerLib
+{
+    /* One directory being collected, which any number of requests can wait on and share (singleflight). Whoever started it (the leader) collects; everyone else just waits for its images and then compares them themselves, through a memo so identical comparisons are only done once. */
+    class ScanFlight
+    {
+    private:
+        std::mutex state_mutex;
+        std::condition_variable state_cv;
+        bool done;
+
+        std::mutex similar_mutex;
+        std::map<uint8_t, SetList> similar;
+
+    public:
+        std::string path;
+        bool recursive;
+        uint8_t types; // the DataTypes collected.
+
+        /* Where the directory's similarity graph is remembered between scans, if anywhere. */
+        SimilarityStore *store;
+
+        /* What checks the matches again with a slower hash, if anything. */
+        Verifier *verifier;
+
+        /* Only valid once done. The leader collects the images straight into imgs. */
+        int error;
+        ImageRecords imgs;
+        std::vector<Video*> vids;
+        std::vector<Audio*> auds;
+        std::vector<Text*> txts;
+
+        ScanFlight(const std::string &_path, bool _recursive, uint8_t _types);
+
+        /* The flight owns its images, videos, audio files and documents. */
+        ~ScanFlight();
+
+        /* Called by the leader when it is done collecting. */
+        void complete(int _error, std::vector<Video*> &_vids, std::vector<Audio*> &_auds, std::vector<Text*> &_txts);
+
+        /* Block until the leader is done collecting. */
+        void wait();
+
+        /* The images (by their id in imgs) a request for 'dir' would have collected itself: the flight may cover more than that, if it is a recursive scan of a parent directory. */
+        std::vector<uint32_t> images_for(const std::string &dir, bool _recursive);
+
+        /* The same, for videos. */
+        std::vector<Video*> videos_for(const std::string &dir, bool _recursive);
+
+        /* The same, for audio files. */
+        std::vector<Audio*> audios_for(const std::string &dir, bool _recursive);
+
+        /* The same, for documents. */
+        std::vector<Text*> texts_for(const std::string &dir, bool _recursive);
+
+        /* The first image of every group of byte-identical ones (by SHA256), in order. */
+        std::vector<uint32_t> representatives(const std::vector<uint32_t> &ids);
+
+        /* The groups of byte-identical images (by SHA256) among images_for(dir, _recursive), as ids in imgs. */
+        SetList exact_duplicates(const std::string &dir, bool _recursive);
+
+        /* ImageRecords::find_similar() over the representatives of images_for(dir, _recursive), so that copies of the same file (see exact_duplicates()) are only compared once, and then through the verifier, as ids in imgs. When it is the flight's own directory, the result is memoized per max_ham and shared by every request on this flight, and (with a store) only the images that are new since the last scan of the directory are compared. */
+        SetList find_similar(const std::string &dir, bool _recursive, uint8_t max_ham,
+                             std::function<void(int)> progress_callback);
+    };
+
+    /* The directories that are currently being collected, in a trie of path components, so that finding a running scan that covers a directory (the same directory, or a parent being scanned recursively) is O(depth) instead of a pass over every active scan. */
+    class ActiveScans
+    {
+    private:
+        /* Several flights of the same directory can run at once, if they collect different types of files. */
+        struct Node
+        {
+            std::map<std::string, Node*> children;
+            std::vector<std::shared_ptr<ScanFlight>> flat;
+            std::vector<std::shared_ptr<ScanFlight>> recursive;
+        };
+
+        Node root;
+        std::mutex trie_mutex;
+
+        static std::vector<std::string> components(const std::string &path);
+
+        /* The first of the flights that collects every one of these types, if any. */
+        static std::shared_ptr<ScanFlight> covering(const std::vector<std::shared_ptr<ScanFlight>> &flights, uint8_t types);
+
+    public:
+        ~ActiveScans();
+
+        /* Attach to a running flight that covers this directory and collects every one of these types (DataTypes), or start a new one. If 'leader' is set to true, the caller has to collect the images and call leave() when done. */
+        std::shared_ptr<ScanFlight> join(const std::string &path, bool recursive, uint8_t types, bool &leader);
+
+        /* Take a flight out of the trie, so new requests don't attach to it anymore. */
+        void leave(const std::shared_ptr<ScanFlight> &flight);
+    };
+}
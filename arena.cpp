@@ -0,0 +1,165 @@
+#include "arena.hpp"
+
+namespace SimpicServerLib
+{
+    Arena::Arena(size_t _block_size)
+    {
+        block_size = _block_size;
+        next = nullptr;
+        left = 0;
+    }
+
+    Arena::~Arena()
+    {
+        for (char *block : blocks)
+            std::free(block);
+    }
+
+    void *Arena::allocate(size_t size, size_t alignment)
+    {
+        size_t padding = (alignment - (uintptr_t) next % alignment) % alignment;
+
+        if (next != nullptr && padding + size <= left)
+        {
+            void *result = next + padding;
+            next += padding + size;
+            left -= padding + size;
+
+            return result;
+        }
+
+        /* Too big for a block: it gets its own, and the current one is kept on with. malloc() aligns for anything. */
+        if (size > block_size / 4)
+        {
+            char *block = (char*) std::malloc(size);
+
+            if (block == nullptr)
+                throw std::bad_alloc();
+
+            blocks.push_back(block);
+            return block;
+        }
+
+        char *block = (char*) std::malloc(block_size);
+
+        if (block == nullptr)
+            throw std::bad_alloc();
+
+        blocks.push_back(block);
+        next = block + size;
+        left = block_size - size;
+
+        return block;
+    }
+
+    size_t Arena::allocations() const
+    {
+        return blocks.size();
+    }
+
+    StringTable::StringTable()
+    {
+
+    }
+
+    void StringTable::grow()
+    {
+        slots.assign(slots.empty() ? 64 : slots.size() * 2, 0);
+        size_t mask = slots.size() - 1;
+
+        for (uint32_t id = 0; id < strings.size(); id++)
+        {
+            size_t slot = std::hash<std::string_view>()(strings[id]) & mask;
+
+            while (slots[slot] != 0)
+                slot = (slot + 1) & mask;
+
+            slots[slot] = id + 1;
+        }
+    }
+
+    uint32_t StringTable::intern(Arena &arena, std::string_view string)
+    {
+        if ((strings.size() + 1) * 2 > slots.size())
+            grow();
+
+        size_t mask = slots.size() - 1;
+        size_t slot = std::hash<std::string_view>()(string) & mask;
+
+        for (; slots[slot] != 0; slot = (slot + 1) & mask)
+        {
+            if (strings[slots[slot] - 1] == string)
+                return slots[slot] - 1;
+        }
+
+        char *copy = arena.allocate<char>(string.size() + 1);
+        std::memcpy(copy, string.data(), string.size());
+        copy[string.size()] = '\0';
+
+        uint32_t id = strings.size();
+        strings.push_back(std::string_view(copy, string.size()));
+        slots[slot] = id + 1;
+
+        return id;
+    }
+
+    std::string_view StringTable::get(uint32_t id) const
+    {
+        return strings[id];
+    }
+
+    size_t StringTable::size() const
+    {
+        return strings.size();
+    }
+
+    SetList::SetList()
+    {
+        offsets.push_back(0);
+    }
+
+    size_t SetList::size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    bool SetList::empty() const
+    {
+        return size() == 0;
+    }
+
+    const uint32_t *SetList::begin(size_t set) const
+    {
+        return members.data() + offsets[set];
+    }
+
+    const uint32_t *SetList::end(size_t set) const
+    {
+        return members.data() + offsets[set + 1];
+    }
+
+    size_t SetList::count(size_t set) const
+    {
+        return offsets[set + 1] - offsets[set];
+    }
+
+    void SetList::push(uint32_t member)
+    {
+        members.push_back(member);
+    }
+
+    size_t SetList::pending() const
+    {
+        return members.size() - offsets.back();
+    }
+
+    void SetList::end_set()
+    {
+        offsets.push_back(members.size());
+    }
+
+    void SetList::discard_set()
+    {
+        members.resize(offsets.back());
+    }
+}
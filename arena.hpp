@@ -0,0 +1,100 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <new>
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* A bump allocator for whatever one request (or scan) needs for as long as it runs: allocating is moving a pointer along a block of ARENA_BLOCK_SIZE, and everything is freed at once, with the arena. Nothing in it is ever destructed, so it only holds things with nothing to free themselves. */
+    class Arena
+    {
+    private:
+        std::vector<char*> blocks;
+        char *next;
+        size_t left;
+        size_t block_size;
+
+    public:
+        Arena(size_t _block_size = ARENA_BLOCK_SIZE);
+        ~Arena();
+
+        Arena(const Arena&) = delete;
+        Arena &operator=(const Arena&) = delete;
+
+        /* Room for size bytes, aligned to alignment (a power of two). Anything bigger than a block gets a block of its own. */
+        void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+        /* Room for count Ts, which aren't constructed. */
+        template <typename T>
+        T *allocate(size_t count)
+        {
+            return (T*) allocate(sizeof(T) * count, alignof(T));
+        }
+
+        /* How many blocks it took from the heap so far. */
+        size_t allocations() const;
+    };
+
+    /* Strings kept once each in an arena, and known by their id (in the order they were first interned) from then on. They are NUL-terminated there, so that they can be sent as they are. */
+    class StringTable
+    {
+    private:
+        std::vector<std::string_view> strings;
+
+        /* Open addressing, by the hash of the string: id + 1 of what is there, or 0. Never more than half full. */
+        std::vector<uint32_t> slots;
+
+        void grow();
+
+    public:
+        StringTable();
+
+        /* The id of this string, copying it into the arena if it isn't there yet. */
+        uint32_t intern(Arena &arena, std::string_view string);
+
+        std::string_view get(uint32_t id) const;
+
+        size_t size() const;
+    };
+
+    /* Sets of ids (of images, or anything else in an array), all of them in one flat buffer, CSR-style: set i is members[offsets[i]..offsets[i + 1]). A set is built by pushing its members and then ending it. */
+    class SetList
+    {
+    public:
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> members;
+
+        SetList();
+
+        /* How many sets have been ended. */
+        size_t size() const;
+
+        bool empty() const;
+
+        /* The members of a set, and how many there are. */
+        const uint32_t *begin(size_t set) const;
+        const uint32_t *end(size_t set) const;
+        size_t count(size_t set) const;
+
+        /* Add a member to the set being built. */
+        void push(uint32_t member);
+
+        /* How many members the set being built has so far. */
+        size_t pending() const;
+
+        /* Finish the set being built, or forget it. */
+        void end_set();
+        void discard_set();
+    };
+}
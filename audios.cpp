@@ -0,0 +1,304 @@
+#include "audios.hpp"
+
+namespace SimpicServerLib
+{
+    /* What is the same for every frame: the window, the FFT's twiddles and bit reversal, and the first bin of every band (and the end of the last one). */
+    struct FrameTables
+    {
+        std::vector<float> window;
+        std::vector<std::complex<float>> twiddles;
+        std::vector<uint32_t> reversed;
+        std::vector<int> edges;
+
+        FrameTables()
+        {
+            static_assert(std::has_single_bit((unsigned) AUDIO_FRAME_SIZE), "The FFT needs a power of two");
+
+            const int bits = std::countr_zero((unsigned) AUDIO_FRAME_SIZE);
+
+            for (int i = 0; i < AUDIO_FRAME_SIZE; i++)
+            {
+                window.push_back(0.5f - 0.5f * std::cos(2 * M_PI * i / (AUDIO_FRAME_SIZE - 1)));
+
+                uint32_t r = 0;
+
+                for (int bit = 0; bit < bits; bit++)
+                    r |= ((i >> bit) & 1) << (bits - 1 - bit);
+
+                reversed.push_back(r);
+            }
+
+            for (int k = 0; k < AUDIO_FRAME_SIZE / 2; k++)
+                twiddles.push_back(std::polar(1.0f, (float) (-2 * M_PI * k / AUDIO_FRAME_SIZE)));
+
+            for (int b = 0; b <= AudioFingerprinter::BANDS; b++)
+            {
+                double hz = AUDIO_LOW_HZ * std::pow((double) AUDIO_HIGH_HZ / AUDIO_LOW_HZ, (double) b / AudioFingerprinter::BANDS);
+                edges.push_back((int) std::lround(hz * AUDIO_FRAME_SIZE / AUDIO_SAMPLE_RATE));
+            }
+        }
+    };
+
+    static const FrameTables &frame_tables()
+    {
+        static const FrameTables tables;
+        return tables;
+    }
+
+    AudioFingerprinter::AudioFingerprinter() : ring(AUDIO_FRAME_SIZE, 0.0f), spectrum(AUDIO_FRAME_SIZE)
+    {
+        head = 0;
+        filled = 0;
+        since = 0;
+        first = true;
+        std::memset(previous, 0, sizeof(previous));
+    }
+
+    void AudioFingerprinter::feed(const int16_t *samples, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            ring[head] = samples[i] / 32768.0f;
+            head = (head + 1) % AUDIO_FRAME_SIZE;
+            since++;
+
+            if (filled < AUDIO_FRAME_SIZE)
+                filled++;
+
+            if (filled == AUDIO_FRAME_SIZE && since >= AUDIO_HOP)
+            {
+                frame();
+                since = 0;
+            }
+        }
+    }
+
+    void AudioFingerprinter::frame()
+    {
+        const FrameTables &tables = frame_tables();
+
+        /* The ring from its oldest sample, windowed and put in bit-reversed order for the FFT. */
+        for (size_t i = 0; i < AUDIO_FRAME_SIZE; i++)
+            spectrum[tables.reversed[i]] = ring[(head + i) % AUDIO_FRAME_SIZE] * tables.window[i];
+
+        for (size_t len = 2; len <= AUDIO_FRAME_SIZE; len <<= 1)
+        {
+            size_t step = AUDIO_FRAME_SIZE / len;
+
+            for (size_t start = 0; start < AUDIO_FRAME_SIZE; start += len)
+            {
+                for (size_t j = 0; j < len / 2; j++)
+                {
+                    std::complex<float> even = spectrum[start + j];
+                    std::complex<float> odd = spectrum[start + j + len / 2] * tables.twiddles[j * step];
+
+                    spectrum[start + j] = even + odd;
+                    spectrum[start + j + len / 2] = even - odd;
+                }
+            }
+        }
+
+        float energy[BANDS];
+
+        for (int b = 0; b < BANDS; b++)
+        {
+            energy[b] = 0;
+
+            for (int k = tables.edges[b]; k < tables.edges[b + 1]; k++)
+                energy[b] += std::norm(spectrum[k]);
+        }
+
+        if (!first)
+        {
+            uint32_t bits = 0;
+
+            for (int m = 0; m < BANDS - 1; m++)
+            {
+                if ((energy[m] - energy[m + 1]) - (previous[m] - previous[m + 1]) > 0)
+                    bits |= (uint32_t) 1 << m;
+            }
+
+            fingerprints.push_back(bits);
+        }
+
+        std::memcpy(previous, energy, sizeof(previous));
+        first = false;
+    }
+
+    Audio::Audio()
+    {
+        length = 0;
+    }
+
+    AudioTypes Audio::type_from_extension(const std::string &extension)
+    {
+        if (extension == "mp3")
+            return AudioTypes::MP3;
+
+        if (extension == "wav")
+            return AudioTypes::WAV;
+
+        if (extension == "flac")
+            return AudioTypes::FLAC;
+
+        if (extension == "ogg" || extension == "oga")
+            return AudioTypes::OGG;
+
+        if (extension == "opus")
+            return AudioTypes::Opus;
+
+        if (extension == "m4a" || extension == "aac")
+            return AudioTypes::M4A;
+
+        return AudioTypes::Undefined;
+    }
+
+    std::optional<std::vector<uint32_t>> Audio::fingerprint(int fd)
+    {
+        pid_t pid;
+        int out = spawn_decoder({
+            AUDIO_DECODER, "-nostdin", "-loglevel", "error", "-i", "/dev/fd/3",
+            "-vn", "-ac", "1", "-ar", std::to_string(AUDIO_SAMPLE_RATE), "-f", "s16le", "pipe:1"
+        }, fd, pid);
+
+        if (out < 0)
+            return std::nullopt;
+
+        AudioFingerprinter fingerprinter;
+        int16_t chunk[AUDIO_CHUNK_SAMPLES];
+
+        while (true)
+        {
+            size_t got = read_fully(out, chunk, sizeof(chunk));
+            fingerprinter.feed(chunk, got / sizeof(int16_t));
+
+            if (got < sizeof(chunk))
+                break;
+        }
+
+        finish_decoder(out, pid);
+
+        /* Shorter than two frames, or not audio at all. */
+        if (fingerprinter.fingerprints.empty())
+            return std::nullopt;
+
+        return std::move(fingerprinter.fingerprints);
+    }
+
+    double Audio::bit_error_rate(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b, int64_t offset, size_t &overlap)
+    {
+        int64_t begin = std::max<int64_t>(0, -offset);
+        int64_t end = std::min<int64_t>(a.size(), (int64_t) b.size() - offset);
+
+        overlap = end > begin ? end - begin : 0;
+
+        if (overlap == 0)
+            return 1;
+
+        uint64_t bits = 0;
+
+        for (int64_t i = begin; i < end; i++)
+            bits += std::popcount(a[i] ^ b[i + offset]);
+
+        return (double) bits / (32 * overlap);
+    }
+
+    std::vector<std::vector<Audio*>*> Audio::find_similar_audios(std::vector<Audio*> &audios, double max_ber)
+    {
+        AudioIndex index(audios);
+        std::vector<std::vector<Audio*>*> results;
+
+        for (uint32_t a = 0; a < audios.size(); a++)
+        {
+            const std::vector<uint32_t> &fingerprints = audios[a]->fingerprints;
+
+            /* How often each later file has a sub-fingerprint of this one, by how far apart they are: (file, offset) packed into one key. */
+            std::unordered_map<uint64_t, uint32_t> votes;
+
+            for (uint32_t i = 0; i < fingerprints.size(); i++)
+            {
+                for (const AudioIndex::Posting &posting : index.lookup(fingerprints[i]))
+                {
+                    if (posting.audio > a)
+                        votes[((uint64_t) posting.audio << 32) | (uint32_t) ((int64_t) posting.position - i)]++;
+                }
+            }
+
+            /* Only the offset they line up at the most often is worth checking, for each of them. */
+            std::map<uint32_t, std::pair<int32_t, uint32_t>> best;
+
+            for (auto &[key, count] : votes)
+            {
+                if (count < AUDIO_MIN_VOTES)
+                    continue;
+
+                uint32_t other = key >> 32;
+                int32_t offset = (int32_t) (uint32_t) key;
+
+                auto it = best.find(other);
+
+                if (it == best.end() || count > it->second.second ||
+                        (count == it->second.second && offset < it->second.first))
+                    best[other] = {offset, count};
+            }
+
+            std::vector<Audio*> *set = new std::vector<Audio*>({audios[a]});
+
+            for (auto &[other, found] : best)
+            {
+                const std::vector<uint32_t> &theirs = audios[other]->fingerprints;
+                size_t overlap;
+
+                double ber = bit_error_rate(fingerprints, theirs, found.first, overlap);
+
+                if (ber <= max_ber && overlap >= AUDIO_MIN_OVERLAP * std::min(fingerprints.size(), theirs.size()))
+                    set->push_back(audios[other]);
+            }
+
+            if (set->size() < 2)
+            {
+                delete set;
+                continue;
+            }
+
+            results.push_back(set);
+        }
+
+        return results;
+    }
+
+    std::string Audio::abspath()
+    {
+        return concatenate_folder(path, filename);
+    }
+
+    AudioIndex::AudioIndex(const std::vector<Audio*> &audios)
+    {
+        for (uint32_t a = 0; a < audios.size(); a++)
+        {
+            const std::vector<uint32_t> &fingerprints = audios[a]->fingerprints;
+
+            for (uint32_t i = 0; i < fingerprints.size(); i++)
+                postings.push_back({fingerprints[i], a, i});
+        }
+
+        std::sort(postings.begin(), postings.end(), [](const Posting &x, const Posting &y) -> bool {
+            return x.value != y.value ? x.value < y.value :
+                (x.audio != y.audio ? x.audio < y.audio : x.position < y.position);
+        });
+    }
+
+    std::span<const AudioIndex::Posting> AudioIndex::lookup(uint32_t value) const
+    {
+        std::vector<Posting>::const_iterator first = std::lower_bound(postings.begin(), postings.end(), value,
+            [](const Posting &posting, uint32_t v) -> bool { return posting.value < v; });
+
+        std::vector<Posting>::const_iterator last = std::upper_bound(first, postings.end(), value,
+            [](uint32_t v, const Posting &posting) -> bool { return v < posting.value; });
+
+        if (last - first > AUDIO_INDEX_MAX_BUCKET)
+            return {};
+
+        return std::span<const Posting>(first, last);
+    }
+}
@@ -1,24 +1,111 @@
 #pragma once
 
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <span>
+#include <optional>
+#include <algorithm>
+#include <unordered_map>
+
+#include <cmath>
+#include <bit>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+
+#include "sha256.hpp"
+#include "utils.hpp"
+
+#include "config.hpp"
+
 namespace SimpicServerLib
 {
     enum class AudioTypes
     {
         MP3,
         WAV,
-        FLAC
+        FLAC,
+        OGG,
+        Opus,
+        M4A,
+        Undefined // <~~ The file isn't a supported file type.
     };
 
-    class Audio
+    /* Turns a stream of mono samples (at AUDIO_SAMPLE_RATE) into 32-bit sub-fingerprints, one every AUDIO_HOP samples, as in Haitsma and Kalker's "A Highly Robust Audio Fingerprinting System": bit m of a sub-fingerprint is whether the energy difference between bands m and m+1 (of 33, spaced logarithmically between AUDIO_LOW_HZ and AUDIO_HIGH_HZ) grew since the frame before. Samples are fed as they are decoded, in chunks of any size; only the last AUDIO_FRAME_SIZE of them are kept (in a ring buffer), so the memory used doesn't depend on how long the track is, other than the 4 bytes of each sub-fingerprint. */
+    class AudioFingerprinter
     {
+    public:
+        static constexpr int BANDS = 33;
+
     private:
+        std::vector<float> ring;
+        size_t head; // where the next sample goes: the oldest one.
+        size_t filled;
+        size_t since; // samples since the last frame.
+
+        std::vector<std::complex<float>> spectrum;
+        float previous[BANDS];
+        bool first;
+
+        void frame();
+
+    public:
+        std::vector<uint32_t> fingerprints;
+
+        AudioFingerprinter();
+
+        void feed(const int16_t *samples, size_t count);
+    };
+
+    class Audio
+    {
+    public:
+        uint64_t length;
+
+        /* One sub-fingerprint (see AudioFingerprinter) every AUDIO_HOP samples, in order. */
+        std::vector<uint32_t> fingerprints;
+
         std::string filename;
         std::string path;
-        AudioTypes type;
 
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+
+        /* Given an extension (without the .), return the audio type. */
+        static AudioTypes type_from_extension(const std::string &extension);
+
+        /* Decode the audio (already opened as fd) with an external decoder (AUDIO_DECODER), mono and at AUDIO_SAMPLE_RATE, and fingerprint it as it is read, AUDIO_CHUNK_SAMPLES at a time. Returns nothing if it can't be decoded. */
+        static std::optional<std::vector<uint32_t>> fingerprint(int fd);
+
+        /* The fraction of bits that differ between a and b where they overlap, a[i] being lined up with b[i + offset]. overlap is set to how many sub-fingerprints were compared; without any, it is 1. */
+        static double bit_error_rate(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b, int64_t offset, size_t &overlap);
+
+        /* Group similar audio files together, the first of each group being what the others are similar to, like Video::find_similar_videos(). A pair is only compared at all if some of their sub-fingerprints are exactly the same (found through an AudioIndex), and then only where those line up the most often: it is similar if at most max_ber of the bits differ there, over at least AUDIO_MIN_OVERLAP of the shorter one. */
+        static std::vector<std::vector<Audio*>*> find_similar_audios(std::vector<Audio*> &audios, double max_ber);
+
+        Audio();
+
+        std::string abspath();
+    };
+
+    /* Every sub-fingerprint of some audio files, sorted by value, so that where a value appears is a binary search away. */
+    class AudioIndex
+    {
     public:
-        Audio(std::string _filename, std::string _path, AudioTypes _type);
+        struct Posting
+        {
+            uint32_t value;
+            uint32_t audio; // its index in the vector the AudioIndex was made from.
+            uint32_t position;
+        };
+
+        AudioIndex(const std::vector<Audio*> &audios);
 
+        /* Every place value appears. Nothing, if it appears more than AUDIO_INDEX_MAX_BUCKET times: a value that common (silence, a steady tone) doesn't say where it came from. */
+        std::span<const Posting> lookup(uint32_t value) const;
 
+    private:
+        std::vector<Posting> postings;
     };
-}
\ No newline at end of file
+}
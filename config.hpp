@@ -4,4 +4,44 @@
 #define STRICT_MAX_HAM 6
 #define RANDOM_CHARS_LENGTH 8
 #define UPDATE_INCREMENTS 5
+#define IMAGE_SNIFF_LENGTH 64
+#define IMAGE_DECODE_MEMORY_BUDGET (256 * 1024 * 1024)
+#define DECODER_WORKER_TIMEOUT_MS 30000
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define EXTERNAL_CLUSTERING_READ_SIZE (1024 * 1024)
+#define UPLOAD_SIZE_LIMIT (128 * 1024 * 1024)
+#define THUMBNAIL_MIN_EDGE 32
+#define THUMBNAIL_MAX_EDGE 2048
+#define THUMBNAIL_QUALITY 85
+#define THUMBNAIL_HASHING_EDGE 512
+#define WALKER_THREADS 4
+#define WATCH_DEBOUNCE_MS 2000
+#define WATCH_RATE_LIMIT 50
+#define WATCH_MAX_IN_FLIGHT 16
+#define WATCH_SAVE_INTERVAL 60
+#define HAMMING_INDEX_MAX_PROBE 2
+#define MH_VERIFY_ABOVE_HAM 2
+#define MH_VERIFY_MAX_HAM 150
+#define VIDEO_DECODER "ffmpeg"
+#define VIDEO_SAMPLE_FPS 2
+#define VIDEO_FRAME_EDGE 64
+#define VIDEO_CUT_THRESHOLD 0.35
+#define VIDEO_FRAME_MAX_HAM 21
+#define VIDEO_INDEX_MAX_HAM 8
+#define VIDEO_MIN_SIMILARITY 0.5
+#define AUDIO_DECODER "ffmpeg"
+#define AUDIO_SAMPLE_RATE 5512
+#define AUDIO_FRAME_SIZE 2048
+#define AUDIO_HOP 256
+#define AUDIO_CHUNK_SAMPLES 4096
+#define AUDIO_LOW_HZ 300
+#define AUDIO_HIGH_HZ 2000
+#define AUDIO_INDEX_MAX_BUCKET 64
+#define AUDIO_MIN_VOTES 4
+#define AUDIO_MAX_BER 0.35
+#define AUDIO_MIN_OVERLAP 0.5
 
+#define TEXT_KGRAM_LENGTH 50
+#define TEXT_WINDOW_LENGTH 100
+#define TEXT_INDEX_MAX_BUCKET 64
+#define TEXT_MIN_SIMILARITY 0.5
@@ -0,0 +1,346 @@
+#include "decoder_workers.hpp"
+#include "decoders.hpp"
+
+namespace SimpicServerLib
+{
+    /* What a worker is asked to decode. The file itself comes along as a file descriptor. */
+    struct DecodeRequest
+    {
+        uint32_t width;
+        uint32_t height;
+        uint8_t variants;
+        char path[PATH_MAX]; // only for messages: the file is decoded from the descriptor.
+        char thumbnail[PATH_MAX]; // empty if none is wanted.
+    };
+
+    /* Send a message, with a file descriptor along with it if fd isn't -1. */
+    static bool send_with_fd(int socket, const void *data, size_t length, int fd)
+    {
+        struct iovec iov = {(void*) data, length};
+        struct msghdr msg = {};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (fd >= 0)
+        {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        return sendmsg(socket, &msg, MSG_NOSIGNAL) == (ssize_t) length;
+    }
+
+    /* Receive a message, and the file descriptor that came with it (or -1). Returns how much was received, 0 once the other end is closed. */
+    static ssize_t receive_with_fd(int socket, void *data, size_t length, int &fd)
+    {
+        struct iovec iov = {data, length};
+        struct msghdr msg = {};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        fd = -1;
+
+        ssize_t amnt;
+
+        do
+        {
+            amnt = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        }
+        while (amnt < 0 && errno == EINTR);
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        return amnt;
+    }
+
+    DecoderWorkers::DecoderWorkers(unsigned int count, int _timeout_ms)
+    {
+        timeout_ms = _timeout_ms;
+        zygote = -1;
+        zygote_pid = -1;
+
+        /* Shared with the zygote, and so with every worker it forks. */
+        void *shared = mmap(nullptr, sizeof(Result) * count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        results = shared == MAP_FAILED ? nullptr : (Result*) shared;
+
+        int control[2];
+
+        if (!results || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) < 0)
+        {
+            std::cerr << "Failed to set up the decoder workers: " << std::strerror(errno) << "\n";
+            return;
+        }
+
+        zygote_pid = fork();
+
+        if (zygote_pid == 0)
+        {
+            close(control[0]);
+            run_zygote(control[1], results);
+            _exit(0);
+        }
+
+        close(control[1]);
+
+        if (zygote_pid < 0)
+        {
+            std::cerr << "Failed to fork the decoder zygote: " << std::strerror(errno) << "\n";
+            close(control[0]);
+            return;
+        }
+
+        zygote = control[0];
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            workers.push_back({-1, -1, false});
+            spawn(i);
+        }
+    }
+
+    DecoderWorkers::~DecoderWorkers()
+    {
+        /* Workers and the zygote leave once their sockets are closed. */
+        for (Worker &worker : workers)
+        {
+            if (worker.socket >= 0)
+                close(worker.socket);
+        }
+
+        if (zygote >= 0)
+        {
+            close(zygote);
+            waitpid(zygote_pid, nullptr, 0);
+        }
+
+        if (results)
+            munmap(results, sizeof(Result) * workers.size());
+    }
+
+    bool DecoderWorkers::running() const
+    {
+        return zygote >= 0;
+    }
+
+    bool DecoderWorkers::spawn(size_t slot)
+    {
+        Worker &worker = workers[slot];
+
+        if (worker.socket >= 0)
+        {
+            close(worker.socket);
+            worker.socket = -1;
+        }
+
+        std::lock_guard<std::mutex> lock(zygote_mutex);
+
+        uint32_t request = slot;
+        pid_t pid = -1;
+        int socket = -1;
+
+        if (zygote < 0 || !send_with_fd(zygote, &request, sizeof(request), -1) ||
+                receive_with_fd(zygote, &pid, sizeof(pid), socket) != sizeof(pid) || socket < 0)
+        {
+            std::cerr << "Failed to start a decoder worker\n";
+
+            if (socket >= 0)
+                close(socket);
+
+            return false;
+        }
+
+        worker.socket = socket;
+        worker.pid = pid;
+        return true;
+    }
+
+    std::optional<std::vector<uint64_t>> DecoderWorkers::hash(int fd, const std::string &path, uint32_t width,
+            uint32_t height, bool variants, const std::string &thumbnail)
+    {
+        if (workers.empty() || path.size() >= PATH_MAX || thumbnail.size() >= PATH_MAX)
+            return std::nullopt;
+
+        size_t slot;
+
+        {
+            std::unique_lock<std::mutex> lock(workers_mutex);
+
+            std::vector<Worker>::iterator free;
+
+            workers_cv.wait(lock, [this, &free]() -> bool {
+                free = std::find_if(workers.begin(), workers.end(), [](const Worker &w) -> bool { return !w.busy; });
+                return free != workers.end();
+            });
+
+            free->busy = true;
+            slot = free - workers.begin();
+        }
+
+        Worker &worker = workers[slot];
+        std::optional<std::vector<uint64_t>> hashes;
+
+        DecodeRequest request = {};
+        request.width = width;
+        request.height = height;
+        request.variants = variants;
+        std::memcpy(request.path, path.c_str(), path.size() + 1);
+        std::memcpy(request.thumbnail, thumbnail.c_str(), thumbnail.size() + 1);
+
+        /* A worker that couldn't be started again after it crashed gets another try. */
+        if (worker.socket >= 0 || spawn(slot))
+        {
+            uint8_t decoded = 0;
+            ssize_t amnt = -1;
+            bool sent = send_with_fd(worker.socket, &request, sizeof(request), fd);
+
+            /* It went away between files, which isn't this file's fault. */
+            if (!sent && spawn(slot))
+                sent = send_with_fd(worker.socket, &request, sizeof(request), fd);
+
+            if (sent)
+            {
+                struct pollfd waiting = {worker.socket, POLLIN, 0};
+                int ready;
+
+                do
+                {
+                    ready = poll(&waiting, 1, timeout_ms);
+                }
+                while (ready < 0 && errno == EINTR);
+
+                if (ready > 0)
+                    amnt = recv(worker.socket, &decoded, sizeof(decoded), 0);
+                else
+                {
+                    std::cerr << "Decoding '" << path << "' took too long, stopping its worker\n";
+                    kill(worker.pid, SIGKILL);
+                }
+            }
+
+            if (amnt == sizeof(decoded))
+            {
+                if (decoded)
+                    hashes = std::vector<uint64_t>(results[slot].hashes, results[slot].hashes + (variants ? DIHEDRAL_TRANSFORMS : 1));
+            }
+            else
+            {
+                if (sent && amnt >= 0)
+                    std::cerr << "A decoder worker crashed on '" << path << "', starting another one\n";
+
+                spawn(slot);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(workers_mutex);
+            worker.busy = false;
+        }
+
+        workers_cv.notify_one();
+        return hashes;
+    }
+
+    void DecoderWorkers::run_zygote(int control, Result *results)
+    {
+        /* Workers that exit are reaped by the kernel, and the zygote goes when the server does. */
+        signal(SIGCHLD, SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        while (true)
+        {
+            uint32_t slot;
+            int unused;
+
+            if (receive_with_fd(control, &slot, sizeof(slot), unused) != sizeof(slot))
+                return;
+
+            int pair[2];
+            pid_t pid = -1;
+
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+            {
+                send_with_fd(control, &pid, sizeof(pid), -1);
+                continue;
+            }
+
+            pid = fork();
+
+            if (pid == 0)
+            {
+                close(control);
+                close(pair[0]);
+                signal(SIGCHLD, SIG_DFL);
+
+                run_worker(pair[1], &results[slot]);
+                _exit(0);
+            }
+
+            close(pair[1]);
+            send_with_fd(control, &pid, sizeof(pid), pid > 0 ? pair[0] : -1);
+            close(pair[0]);
+        }
+    }
+
+    void DecoderWorkers::run_worker(int socket, Result *result)
+    {
+        while (true)
+        {
+            DecodeRequest request;
+            int fd;
+
+            if (receive_with_fd(socket, &request, sizeof(request), fd) <= 0)
+                return;
+
+            uint8_t decoded = 0;
+            std::FILE *fp = fd >= 0 ? fdopen(fd, "rb") : nullptr;
+
+            if (fp)
+            {
+                request.path[PATH_MAX - 1] = '\0';
+                request.thumbnail[PATH_MAX - 1] = '\0';
+
+                ThumbnailSampler sampler(THUMBNAIL_HASHING_EDGE);
+                bool thumbnail = request.thumbnail[0] != '\0';
+
+                std::optional<DCTSampler> samples = DecoderRegistry::builtin().decode_gray(fp, request.path,
+                                                                                          request.width, request.height,
+                                                                                          thumbnail ? &sampler : nullptr);
+
+                if (samples && thumbnail && sampler.complete())
+                    ThumbnailCache::save(sampler.image(), request.thumbnail, THUMBNAIL_HASHING_EDGE);
+
+                if (samples)
+                {
+                    std::vector<uint64_t> hashes = request.variants ? samples->variants() :
+                                                    std::vector<uint64_t>{samples->hash()};
+
+                    std::copy(hashes.begin(), hashes.end(), result->hashes);
+                    decoded = 1;
+                }
+
+                std::fclose(fp);
+            }
+            else if (fd >= 0)
+                close(fd);
+
+            if (send(socket, &decoded, sizeof(decoded), MSG_NOSIGNAL) != sizeof(decoded))
+                return;
+        }
+    }
+}
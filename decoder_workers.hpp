@@ -0,0 +1,78 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "dihedral.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* Images decoded in processes of their own, so that a decoder that crashes on a broken (or malicious) file only takes its own process down, rather than the server, every client connected to it and the cache in its memory. */
+    /* A zygote process is forked before the server starts any thread, and it forks every worker from then on, so that they never inherit a lock some thread held. Files go to a worker as file descriptors over a UNIX socket, and their hashes come back through memory shared with it. A worker that crashes, or takes longer than the timeout, is replaced. */
+    class DecoderWorkers
+    {
+    public:
+        /* Fork the zygote, and have it start count workers. Nothing may have started a thread yet. */
+        DecoderWorkers(unsigned int count, int _timeout_ms = DECODER_WORKER_TIMEOUT_MS);
+        ~DecoderWorkers();
+
+        /* Whether the zygote could be started at all. */
+        bool running() const;
+
+        /* The DCT hash of the image open as fd (at path), or with variants, those of every rotation and mirror image of it (by DihedralTransforms). The size, if it is known, is passed on to DecoderRegistry::decode_gray(). Given a thumbnail path, the worker writes a thumbnail there from the same decode, like DecoderRegistry::hash(). Nothing, if it can't be decoded, or the worker decoding it crashed or took too long. Blocks until a worker is free. */
+        std::optional<std::vector<uint64_t>> hash(int fd, const std::string &path, uint32_t width, uint32_t height,
+                                                  bool variants, const std::string &thumbnail = "");
+
+    private:
+        struct Worker
+        {
+            int socket; // -1 if there is no worker (it couldn't be started).
+            pid_t pid;
+            bool busy;
+        };
+
+        /* What a worker has found, in the memory shared with it. */
+        struct Result
+        {
+            uint64_t hashes[DIHEDRAL_TRANSFORMS];
+        };
+
+        std::vector<Worker> workers;
+        Result *results;
+
+        std::mutex workers_mutex;
+        std::condition_variable workers_cv;
+
+        /* The zygote is asked for one worker at a time. */
+        int zygote;
+        pid_t zygote_pid;
+        std::mutex zygote_mutex;
+
+        int timeout_ms;
+
+        /* Have the zygote fork a worker for this slot, replacing whatever was there. Returns whether it did. */
+        bool spawn(size_t slot);
+
+        static void run_zygote(int control, Result *results);
+        static void run_worker(int socket, Result *result);
+    };
+}
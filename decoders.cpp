@@ -0,0 +1,779 @@
+#include "decoders.hpp"
+#include "decoder_workers.hpp"
+
+namespace SimpicServerLib
+{
+    /* CImg's RGBtoYCbCr(), rounded down to a byte like it is there. */
+    static inline float luma_of(float r, float g, float b)
+    {
+        return (uint8_t) std::clamp((66 * r + 129 * g + 25 * b + 128) / 256 + 16, 0.0f, 255.0f);
+    }
+
+    /* A pixel of grey (1 channel) or colour (at least 3, of which any past the third are ignored, like alpha is). */
+    static inline float luma_of_pixel(const uint8_t *pixel, int channels)
+    {
+        return channels >= 3 ? luma_of(pixel[0], pixel[1], pixel[2]) : pixel[0];
+    }
+
+    /* The luma of the pixels at these columns of a row. */
+    static void luma_of_columns(const uint8_t *row, int channels, const std::vector<int> &columns, float *out)
+    {
+        for (size_t i = 0; i < columns.size(); i++)
+            out[i] = luma_of_pixel(row + (size_t) columns[i] * channels, channels);
+    }
+
+    const char *PNGDecoder::name() const
+    {
+        return "PNG";
+    }
+
+    bool PNGDecoder::probe(const uint8_t *header, size_t length) const
+    {
+        return Image::type_from_magic(header, length) == ImageType::PNG;
+    }
+
+    /* Inflating and unfiltering about three bytes a pixel. */
+    double PNGDecoder::cost(uint32_t width, uint32_t height) const
+    {
+        return 3.0 * width * height;
+    }
+
+    /* A row of up to 8 bytes a pixel (16 bit RGBA) as it's read, and zlib's window. */
+    size_t PNGDecoder::memory(uint32_t width, uint32_t height) const
+    {
+        return (size_t) width * 8 + (1 << 20);
+    }
+
+    bool PNGDecoder::decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const
+    {
+        /* Warnings (about colour profiles, mostly) aren't worth printing. */
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                                 [](png_structp png, png_const_charp message) -> void {});
+
+        if (!png)
+            return false;
+
+        png_infop info = png_create_info_struct(png);
+
+        if (!info)
+        {
+            png_destroy_read_struct(&png, nullptr, nullptr);
+            return false;
+        }
+
+        /* Everything that lives across the longjmp() is made before it. */
+        std::vector<png_byte> row;
+        std::vector<float> kept;
+        std::vector<int> kept_rows;
+        std::vector<float> luma;
+
+        if (setjmp(png_jmpbuf(png)))
+        {
+            std::cerr << "Failed to decode '" << path << "' as a PNG\n";
+            png_destroy_read_struct(&png, &info, nullptr);
+            return false;
+        }
+
+        png_init_io(png, fp);
+        png_read_info(png, info);
+
+        png_byte color_type = png_get_color_type(png, info);
+        png_byte bit_depth = png_get_bit_depth(png, info);
+
+        /* Down to 8 bit grey or RGB, like CImg reads them (but for 16 bits, of which it keeps the low byte: here it is the high one). */
+        if (color_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(png);
+
+        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+            png_set_expand_gray_1_2_4_to_8(png);
+
+        if (bit_depth == 16)
+            png_set_strip_16(png);
+
+        if (color_type & PNG_COLOR_MASK_ALPHA)
+            png_set_strip_alpha(png);
+
+        int passes = png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+
+        out.start(png_get_image_width(png, info), png_get_image_height(png, info));
+
+        const std::vector<int> &columns = out.columns();
+        int channels = png_get_channels(png, info);
+
+        row.resize(png_get_rowbytes(png, info));
+        luma.resize(columns.size());
+
+        if (passes == 1)
+        {
+            for (int y = 0; y < out.height; y++)
+            {
+                png_read_row(png, row.data(), nullptr);
+                out.add_pixels(y, row.data(), channels);
+
+                if (!out.needs_row(y))
+                    continue;
+
+                luma_of_columns(row.data(), channels, columns, luma.data());
+                out.add_row(y, luma.data());
+            }
+        }
+        else
+        {
+            /* Each pass only has some of the pixels of some of the rows: those that are needed are */
+            /* put together as they come. */
+            for (int y = 0; y < out.height; y++)
+                if (out.needs_row(y))
+                    kept_rows.push_back(y);
+
+            kept.resize(kept_rows.size() * columns.size());
+
+            for (int pass = 0; pass < passes; pass++)
+            {
+                std::vector<int>::iterator next = kept_rows.begin();
+
+                for (int y = 0; y < out.height; y++)
+                {
+                    png_read_row(png, row.data(), nullptr);
+
+                    if (next == kept_rows.end() || *next != y)
+                        continue;
+
+                    if (PNG_ROW_IN_INTERLACE_PASS(y, pass))
+                    {
+                        float *to = &kept[(next - kept_rows.begin()) * columns.size()];
+
+                        for (size_t c = 0; c < columns.size(); c++)
+                            if (PNG_COL_IN_INTERLACE_PASS(columns[c], pass))
+                                to[c] = luma_of_pixel(&row[(size_t) columns[c] * channels], channels);
+                    }
+
+                    next++;
+                }
+            }
+
+            for (size_t k = 0; k < kept_rows.size(); k++)
+                out.add_row(kept_rows[k], &kept[k * columns.size()]);
+        }
+
+        png_destroy_read_struct(&png, &info, nullptr);
+        return true;
+    }
+
+    const char *JPEGDecoder::name() const
+    {
+        return "JPEG";
+    }
+
+    bool JPEGDecoder::probe(const uint8_t *header, size_t length) const
+    {
+        return Image::type_from_magic(header, length) == ImageType::JPEG;
+    }
+
+    /* Huffman decoding, the IDCT and colour conversion are cheaper a pixel than inflating a PNG is. */
+    double JPEGDecoder::cost(uint32_t width, uint32_t height) const
+    {
+        return 2.0 * width * height;
+    }
+
+    /* libjpeg calls error_exit() and expects it not to return. */
+    struct JPEGError
+    {
+        jpeg_error_mgr manager;
+        std::jmp_buf jump;
+    };
+
+    /* A baseline JPEG needs a few rows of blocks at a time (a progressive one more, which libjpeg is kept from taking). */
+    size_t JPEGDecoder::memory(uint32_t width, uint32_t height) const
+    {
+        return (size_t) width * 3 * 48 + (1 << 20);
+    }
+
+    bool JPEGDecoder::decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const
+    {
+        jpeg_decompress_struct cinfo;
+        JPEGError error;
+
+        /* Made before the setjmp(), like for libpng. */
+        std::vector<float> luma;
+
+        cinfo.err = jpeg_std_error(&error.manager);
+
+        error.manager.error_exit = [](j_common_ptr cinfo) -> void {
+            std::longjmp(((JPEGError*) cinfo->err)->jump, 1);
+        };
+
+        /* Warnings about corrupt data don't stop it, and aren't worth printing. */
+        error.manager.output_message = [](j_common_ptr cinfo) -> void {};
+
+        if (setjmp(error.jump))
+        {
+            char message[JMSG_LENGTH_MAX];
+            error.manager.format_message((j_common_ptr) &cinfo, message);
+
+            std::cerr << "Failed to decode '" << path << "' as a JPEG: " << message << "\n";
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+
+        /* There's no backing store, so a JPEG that needs more than this fails to decode instead. */
+        cinfo.mem->max_memory_to_use = IMAGE_DECODE_MEMORY_BUDGET;
+
+        jpeg_stdio_src(&cinfo, fp);
+        jpeg_read_header(&cinfo, TRUE);
+
+        /* libjpeg's default output (RGB, grey, or CMYK as it is) is what CImg reads. */
+        jpeg_start_decompress(&cinfo);
+
+        out.start(cinfo.output_width, cinfo.output_height);
+
+        const std::vector<int> &columns = out.columns();
+        luma.resize(columns.size());
+
+        /* Freed along with cinfo, even after a longjmp(). */
+        JSAMPARRAY row = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE,
+                                                     cinfo.output_width * cinfo.output_components, 1);
+
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            int y = cinfo.output_scanline;
+            jpeg_read_scanlines(&cinfo, row, 1);
+
+            /* CMYK isn't colour the thumbnail knows what to do with: it's left incomplete. */
+            if (cinfo.out_color_space != JCS_CMYK)
+                out.add_pixels(y, row[0], cinfo.output_components);
+
+            if (!out.needs_row(y))
+                continue;
+
+            luma_of_columns(row[0], cinfo.output_components, columns, luma.data());
+            out.add_row(y, luma.data());
+        }
+
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+    const char *GIFDecoder::name() const
+    {
+        return "GIF";
+    }
+
+    bool GIFDecoder::probe(const uint8_t *header, size_t length) const
+    {
+        return Image::type_from_magic(header, length) == ImageType::GIF;
+    }
+
+    /* A byte a pixel, through a small table. */
+    double GIFDecoder::cost(uint32_t width, uint32_t height) const
+    {
+        return 1.0 * width * height;
+    }
+
+    /* The bits of the LZW codes, which come least significant first in sub-blocks of up to 255 bytes. */
+    class GIFCodeReader
+    {
+    public:
+        GIFCodeReader(std::FILE *_fp) : fp(_fp), left_in_block(0), bits(0), bit_count(0), ended(false)
+        {
+
+        }
+
+        /* The next code, or -1 once the sub-blocks end. */
+        int next(int size)
+        {
+            while (bit_count < size)
+            {
+                if (left_in_block == 0)
+                {
+                    int block = ended ? EOF : std::fgetc(fp);
+
+                    if (block == EOF || block == 0)
+                    {
+                        ended = true;
+                        return -1;
+                    }
+
+                    left_in_block = block;
+                }
+
+                int byte = std::fgetc(fp);
+
+                if (byte == EOF)
+                {
+                    ended = true;
+                    return -1;
+                }
+
+                left_in_block--;
+                bits |= (uint32_t) byte << bit_count;
+                bit_count += 8;
+            }
+
+            int code = bits & ((1u << size) - 1);
+            bits >>= size;
+            bit_count -= size;
+
+            return code;
+        }
+
+    private:
+        std::FILE *fp;
+
+        int left_in_block;
+        uint32_t bits;
+        int bit_count;
+        bool ended;
+    };
+
+    /* Skip sub-blocks up to the empty one that ends them. */
+    static bool skip_sub_blocks(std::FILE *fp)
+    {
+        while (true)
+        {
+            int size = std::fgetc(fp);
+
+            if (size == EOF)
+                return false;
+
+            if (size == 0)
+                return true;
+
+            if (std::fseek(fp, size, SEEK_CUR) != 0)
+                return false;
+        }
+    }
+
+    /* The luma of every colour in a colour table of 2^(bits + 1) colours. */
+    static bool read_color_table(std::FILE *fp, int bits, float *luma)
+    {
+        int colors = 2 << bits;
+        uint8_t table[256 * 3];
+
+        if (std::fread(table, 3, colors, fp) != (size_t) colors)
+            return false;
+
+        for (int i = 0; i < colors; i++)
+            luma[i] = luma_of(table[3 * i], table[3 * i + 1], table[3 * i + 2]);
+
+        return true;
+    }
+
+    /* Which row of the image the r-th one to come of an interlaced image is: every 8th from 0, every 8th from 4, every 4th from 2, then every other one from 1. */
+    static int interlaced_row(int r, int height)
+    {
+        int first = (height + 7) / 8;
+
+        if (r < first)
+            return r * 8;
+
+        r -= first;
+        int second = (height + 3) / 8;
+
+        if (r < second)
+            return 4 + r * 8;
+
+        r -= second;
+        int third = (height + 1) / 4;
+
+        if (r < third)
+            return 2 + r * 4;
+
+        return 1 + (r - third) * 2;
+    }
+
+    /* Where the pixels that are needed are kept, by row and column, and the LZW tables. */
+    size_t GIFDecoder::memory(uint32_t width, uint32_t height) const
+    {
+        return (size_t) (width + height) * sizeof(int) + (1 << 20);
+    }
+
+    bool GIFDecoder::decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const
+    {
+        /* The signature, then the logical screen descriptor. */
+        uint8_t screen[13];
+
+        if (std::fread(screen, 1, sizeof(screen), fp) != sizeof(screen))
+            return false;
+
+        int screen_width = screen[6] | (screen[7] << 8);
+        int screen_height = screen[8] | (screen[9] << 8);
+
+        if (screen_width == 0 || screen_height == 0)
+            return false;
+
+        float global[256] = {0};
+
+        if ((screen[10] & 0x80) && !read_color_table(fp, screen[10] & 0x07, global))
+            return false;
+
+        out.start(screen_width, screen_height);
+        const std::vector<int> &columns = out.columns();
+
+        /* Where in kept each row and column of the screen is, or -1 if it isn't needed. */
+        std::vector<int> kept_row(screen_height, -1);
+        std::vector<int> kept_column(screen_width, -1);
+        std::vector<int> kept_rows;
+
+        for (int y = 0; y < screen_height; y++)
+        {
+            if (!out.needs_row(y))
+                continue;
+
+            kept_row[y] = kept_rows.size();
+            kept_rows.push_back(y);
+        }
+
+        for (size_t c = 0; c < columns.size(); c++)
+            kept_column[columns[c]] = c;
+
+        /* Whatever the first frame doesn't cover is the background colour. */
+        std::vector<float> kept(kept_rows.size() * columns.size(), (screen[10] & 0x80) ? global[screen[11]] : 0);
+
+        while (true)
+        {
+            int introducer = std::fgetc(fp);
+
+            /* An extension (a comment, the frame's delay and transparency, ...): none of them change the pixels. */
+            if (introducer == 0x21)
+            {
+                if (std::fgetc(fp) == EOF || !skip_sub_blocks(fp))
+                    return false;
+
+                continue;
+            }
+
+            /* The trailer, or the end of the file, before any frame. */
+            if (introducer != 0x2C)
+                return false;
+
+            uint8_t descriptor[9];
+
+            if (std::fread(descriptor, 1, sizeof(descriptor), fp) != sizeof(descriptor))
+                return false;
+
+            int left = descriptor[0] | (descriptor[1] << 8);
+            int top = descriptor[2] | (descriptor[3] << 8);
+            int width = descriptor[4] | (descriptor[5] << 8);
+            int height = descriptor[6] | (descriptor[7] << 8);
+            bool interlaced = descriptor[8] & 0x40;
+
+            float local[256] = {0};
+            const float *palette = global;
+
+            if (descriptor[8] & 0x80)
+            {
+                if (!read_color_table(fp, descriptor[8] & 0x07, local))
+                    return false;
+
+                palette = local;
+            }
+
+            int min_code_size = std::fgetc(fp);
+
+            if (min_code_size < 1 || min_code_size > 11)
+                return false;
+
+            /* The string of every code is the string of its prefix code followed by its suffix. */
+            static thread_local uint16_t prefix[4096];
+            static thread_local uint8_t suffix[4096];
+            static thread_local uint8_t stack[4097];
+
+            const int clear = 1 << min_code_size;
+            const int end = clear + 1;
+
+            for (int i = 0; i < clear; i++)
+                suffix[i] = i;
+
+            GIFCodeReader reader(fp);
+
+            int code_size = min_code_size + 1;
+            int next = clear + 2;
+            int old = -1;
+            uint8_t first = 0;
+
+            size_t pixels = (size_t) width * height;
+            size_t at = 0;
+
+            while (at < pixels)
+            {
+                int code = reader.next(code_size);
+
+                if (code < 0 || code == end)
+                    break;
+
+                if (code == clear)
+                {
+                    code_size = min_code_size + 1;
+                    next = clear + 2;
+                    old = -1;
+                    continue;
+                }
+
+                int depth = 0;
+
+                if (old < 0)
+                {
+                    if (code >= clear)
+                        break;
+
+                    first = code;
+                    stack[depth++] = first;
+                }
+                else
+                {
+                    if (code > next)
+                        break;
+
+                    int in = code;
+
+                    /* The code being defined right now: the previous string and its own first byte. */
+                    if (code == next)
+                    {
+                        stack[depth++] = first;
+                        code = old;
+                    }
+
+                    while (code >= clear)
+                    {
+                        stack[depth++] = suffix[code];
+                        code = prefix[code];
+                    }
+
+                    first = code;
+                    stack[depth++] = first;
+
+                    if (next < 4096)
+                    {
+                        prefix[next] = old;
+                        suffix[next] = first;
+                        next++;
+
+                        if (next == (1 << code_size) && code_size < 12)
+                            code_size++;
+                    }
+
+                    code = in;
+                }
+
+                old = code;
+
+                /* The string comes out back to front. */
+                while (depth > 0 && at < pixels)
+                {
+                    int x = left + at % width;
+                    int y = top + (interlaced ? interlaced_row(at / width, height) : at / width);
+
+                    uint8_t index = stack[--depth];
+
+                    if (x < screen_width && y < screen_height && kept_row[y] >= 0 && kept_column[x] >= 0)
+                        kept[kept_row[y] * columns.size() + kept_column[x]] = palette[index];
+
+                    at++;
+                }
+            }
+
+            /* A frame cut short still has what was decoded of it, like other decoders have it. */
+            for (size_t k = 0; k < kept_rows.size(); k++)
+                out.add_row(kept_rows[k], &kept[k * columns.size()]);
+
+            return true;
+        }
+    }
+
+    const char *CImgDecoder::name() const
+    {
+        return "CImg";
+    }
+
+    bool CImgDecoder::probe(const uint8_t *header, size_t length) const
+    {
+        return length > 0;
+    }
+
+    /* A whole colour image, then its luma, for anything; which can mean running ImageMagick. */
+    double CImgDecoder::cost(uint32_t width, uint32_t height) const
+    {
+        return 12.0 * width * height + 1000000;
+    }
+
+    /* The whole image, in colour. */
+    size_t CImgDecoder::memory(uint32_t width, uint32_t height) const
+    {
+        return (size_t) width * height * 4;
+    }
+
+    bool CImgDecoder::decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const
+    {
+        CImg<uint8_t> src;
+
+        /* The file that was opened, rather than whatever is at path by now. */
+        std::string opened = "/proc/self/fd/" + std::to_string(fileno(fp));
+
+        try
+        {
+            src.load(opened.c_str());
+        }
+        catch (CImgException &ex)
+        {
+            std::cerr << "Failed to decode '" << path << "': " << ex.what() << "\n";
+            return false;
+        }
+
+        if (src.is_empty())
+            return false;
+
+        out.start(src.width(), src.height());
+
+        const std::vector<int> &columns = out.columns();
+        std::vector<float> luma(columns.size());
+
+        /* CImg keeps each channel apart: the thumbnail takes them a pixel at a time. */
+        int channels = src.spectrum() >= 3 ? 3 : 1;
+        std::vector<uint8_t> pixels(out.thumbnail != nullptr ? (size_t) src.width() * channels : 0);
+
+        for (int y = 0; y < src.height(); y++)
+        {
+            if (out.thumbnail != nullptr)
+            {
+                for (int x = 0; x < src.width(); x++)
+                    for (int c = 0; c < channels; c++)
+                        pixels[(size_t) x * channels + c] = src(x, y, 0, c);
+
+                out.add_pixels(y, pixels.data(), channels);
+            }
+
+            if (!out.needs_row(y))
+                continue;
+
+            for (size_t c = 0; c < columns.size(); c++)
+            {
+                int x = columns[c];
+                luma[c] = src.spectrum() >= 3 ? luma_of(src(x, y, 0, 0), src(x, y, 0, 1), src(x, y, 0, 2)) : src(x, y, 0, 0);
+            }
+
+            out.add_row(y, luma.data());
+        }
+
+        return true;
+    }
+
+    DecoderRegistry::DecoderRegistry()
+    {
+        workers = nullptr;
+    }
+
+    DecoderRegistry &DecoderRegistry::builtin()
+    {
+        static DecoderRegistry registry = []() -> DecoderRegistry {
+            DecoderRegistry result;
+
+            result.add(std::make_unique<PNGDecoder>());
+            result.add(std::make_unique<JPEGDecoder>());
+            result.add(std::make_unique<GIFDecoder>());
+            result.add(std::make_unique<CImgDecoder>());
+
+            return result;
+        }();
+
+        return registry;
+    }
+
+    void DecoderRegistry::add(std::unique_ptr<ImageDecoder> decoder)
+    {
+        decoders.push_back(std::move(decoder));
+    }
+
+    std::vector<const ImageDecoder*> DecoderRegistry::candidates(const uint8_t *header, size_t length,
+            uint32_t width, uint32_t height) const
+    {
+        std::vector<const ImageDecoder*> result;
+
+        for (const std::unique_ptr<ImageDecoder> &decoder : decoders)
+        {
+            if (decoder->probe(header, length))
+                result.push_back(decoder.get());
+        }
+
+        std::stable_sort(result.begin(), result.end(), [width, height](const ImageDecoder *a, const ImageDecoder *b) -> bool {
+            return a->cost(width, height) < b->cost(width, height);
+        });
+
+        return result;
+    }
+
+    std::optional<DCTSampler> DecoderRegistry::decode_gray(std::FILE *fp, const std::string &path,
+            uint32_t width, uint32_t height, ThumbnailSampler *thumbnail) const
+    {
+        uint8_t header[IMAGE_SNIFF_LENGTH];
+
+        std::fseek(fp, 0, SEEK_SET);
+        size_t amnt = std::fread(header, 1, sizeof(header), fp);
+
+        bool too_big = false;
+
+        for (const ImageDecoder *decoder : candidates(header, amnt, width, height))
+        {
+            if (width != 0 && height != 0 && decoder->memory(width, height) > IMAGE_DECODE_MEMORY_BUDGET)
+            {
+                too_big = true;
+                continue;
+            }
+
+            DCTSampler samples;
+            samples.thumbnail = thumbnail;
+
+            std::fseek(fp, 0, SEEK_SET);
+            std::clearerr(fp);
+
+            if (decoder->decode_gray(fp, path, samples) && samples.width > 0 && samples.height > 0)
+            {
+                std::fseek(fp, 0, SEEK_SET);
+                return samples;
+            }
+        }
+
+        if (too_big)
+            std::cerr << "'" << path << "' (" << width << "x" << height << ") is too big to decode within " <<
+                IMAGE_DECODE_MEMORY_BUDGET / (1024 * 1024) << " MB\n";
+
+        std::fseek(fp, 0, SEEK_SET);
+        return std::nullopt;
+    }
+
+    void DecoderRegistry::isolate(DecoderWorkers *_workers)
+    {
+        workers = _workers && _workers->running() ? _workers : nullptr;
+    }
+
+    std::optional<std::vector<uint64_t>> DecoderRegistry::hash(std::FILE *fp, const std::string &path, uint32_t width,
+            uint32_t height, bool variants, const std::string &thumbnail) const
+    {
+        if (workers)
+        {
+            /* The worker reads the same open file (sharing where it is in it), from the start. */
+            std::fseek(fp, 0, SEEK_SET);
+            std::optional<std::vector<uint64_t>> hashes = workers->hash(fileno(fp), path, width, height, variants, thumbnail);
+            std::fseek(fp, 0, SEEK_SET);
+
+            return hashes;
+        }
+
+        ThumbnailSampler sampler(THUMBNAIL_HASHING_EDGE);
+        std::optional<DCTSampler> samples = decode_gray(fp, path, width, height, thumbnail.empty() ? nullptr : &sampler);
+
+        if (!samples)
+            return std::nullopt;
+
+        if (!thumbnail.empty() && sampler.complete())
+            ThumbnailCache::save(sampler.image(), thumbnail, THUMBNAIL_HASHING_EDGE);
+
+        if (variants)
+            return samples->variants();
+
+        return std::vector<uint64_t>{samples->hash()};
+    }
+}
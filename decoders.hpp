@@ -0,0 +1,127 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <algorithm>
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <png.h>
+#include <jpeglib.h>
+
+#include "phash/pHash.h"
+#include "images.hpp"
+#include "dihedral.hpp"
+#include "thumbnails.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    class DecoderWorkers;
+
+    /* One way of decoding images to grey. A decoder keeps no state between images, so one is shared by every hashing thread. */
+    class ImageDecoder
+    {
+    public:
+        virtual ~ImageDecoder() = default;
+
+        /* What it's called in error messages. */
+        virtual const char *name() const = 0;
+
+        /* Whether it can decode a file starting with these bytes (IMAGE_SNIFF_LENGTH of them, or all of a shorter file). */
+        virtual bool probe(const uint8_t *header, size_t length) const = 0;
+
+        /* Roughly how long decoding an image this big takes, in about the time it takes to inflate a byte: only compared to the cost of other decoders. The size is 0x0 if it isn't known. */
+        virtual double cost(uint32_t width, uint32_t height) const = 0;
+
+        /* Roughly how many bytes decoding an image this big takes at most, to keep to IMAGE_DECODE_MEMORY_BUDGET. */
+        virtual size_t memory(uint32_t width, uint32_t height) const = 0;
+
+        /* Decode the first frame of the image, straight into the sampler, as the same luma CImg's RGBtoYCbCr() gives pHash (so that the hash is pHash's), only for the pixels the sampler needs. fp is at the start of the file, and is all that is read (in a decoder worker, path may not even be there any more): path only names it in messages. Returns false if it can't be decoded. */
+        virtual bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const = 0;
+    };
+
+    /* libpng, a row at a time, of which only the pixels that are needed are turned into luma. An interlaced image keeps those of every row that is needed until its last pass. */
+    class PNGDecoder : public ImageDecoder
+    {
+    public:
+        const char *name() const override;
+        bool probe(const uint8_t *header, size_t length) const override;
+        double cost(uint32_t width, uint32_t height) const override;
+        size_t memory(uint32_t width, uint32_t height) const override;
+        bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override;
+    };
+
+    /* libjpeg, a scanline at a time. A progressive JPEG is kept in memory as coefficients until it's all there: libjpeg is only allowed IMAGE_DECODE_MEMORY_BUDGET for them. */
+    class JPEGDecoder : public ImageDecoder
+    {
+    public:
+        const char *name() const override;
+        bool probe(const uint8_t *header, size_t length) const override;
+        double cost(uint32_t width, uint32_t height) const override;
+        size_t memory(uint32_t width, uint32_t height) const override;
+        bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override;
+    };
+
+    /* The first frame of a GIF, with our own LZW decoder: pHash has ImageMagick convert them first. Only the pixels that are needed are kept, wherever in the frame they come. */
+    class GIFDecoder : public ImageDecoder
+    {
+    public:
+        const char *name() const override;
+        bool probe(const uint8_t *header, size_t length) const override;
+        double cost(uint32_t width, uint32_t height) const override;
+        size_t memory(uint32_t width, uint32_t height) const override;
+        bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override;
+    };
+
+    /* Whatever CImg can load (by what the file looks like, through /proc/self/fd/, as it only loads by name), which is how pHash decodes everything. It takes any format, but decodes to a whole colour image first, so it is the only decoder that needs memory for the whole image. */
+    class CImgDecoder : public ImageDecoder
+    {
+    public:
+        const char *name() const override;
+        bool probe(const uint8_t *header, size_t length) const override;
+        double cost(uint32_t width, uint32_t height) const override;
+        size_t memory(uint32_t width, uint32_t height) const override;
+        bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override;
+    };
+
+    /* The decoders there are, of which the cheapest one that can read a file decodes it. A format is added by adding its decoder, without the hashing code having to know about it. */
+    class DecoderRegistry
+    {
+    public:
+        DecoderRegistry();
+
+        /* The built-in decoders, and CImg for everything else. */
+        static DecoderRegistry &builtin();
+
+        /* Decoders are only added before any image is decoded. */
+        void add(std::unique_ptr<ImageDecoder> decoder);
+
+        /* The decoders that can read a file starting with these bytes, cheapest first. */
+        std::vector<const ImageDecoder*> candidates(const uint8_t *header, size_t length,
+                                                    uint32_t width, uint32_t height) const;
+
+        /* Decode the file (open as fp, at path) for its DCT hashes with the cheapest decoder that can, or the next cheapest if that fails, and so on. The size, if it is known (from the header), helps to pick, and rules out decoders that would take more than IMAGE_DECODE_MEMORY_BUDGET. Nothing, if none of them can. The thumbnail, if given, is made by the same decode (if the decoder gives it every row). */
+        std::optional<DCTSampler> decode_gray(std::FILE *fp, const std::string &path,
+                                              uint32_t width = 0, uint32_t height = 0,
+                                              ThumbnailSampler *thumbnail = nullptr) const;
+
+        /* From now on, decode in these worker processes rather than in this one (or in this one again, given nullptr). */
+        void isolate(DecoderWorkers *_workers);
+
+        /* The DCT hash of the file (open as fp, at path) or, with variants, the hashes of every rotation and mirror image of it (by DihedralTransforms), decoded like decode_gray() does, by a worker if isolate() was given any. Nothing, if it can't be decoded. Given a thumbnail path, the same decode writes a thumbnail of THUMBNAIL_HASHING_EDGE there, if it can. */
+        std::optional<std::vector<uint64_t>> hash(std::FILE *fp, const std::string &path, uint32_t width, uint32_t height,
+                                                  bool variants, const std::string &thumbnail = "") const;
+
+    private:
+        std::vector<std::unique_ptr<ImageDecoder>> decoders;
+        DecoderWorkers *workers;
+    };
+}
@@ -0,0 +1,353 @@
+#include "dihedral.hpp"
+#include "decoders.hpp"
+
+namespace SimpicServerLib
+{
+    /* The DCT-II matrix of ph_dct_matrix(), by frequency then position. */
+    static const std::vector<std::vector<float>> &dct_matrix()
+    {
+        static std::vector<std::vector<float>> matrix = []() -> std::vector<std::vector<float>> {
+            std::vector<std::vector<float>> m(DCT_SIZE, std::vector<float>(DCT_SIZE));
+
+            for (int u = 0; u < DCT_SIZE; u++)
+                for (int x = 0; x < DCT_SIZE; x++)
+                    m[u][x] = u == 0 ? 1 / std::sqrt((float) DCT_SIZE) :
+                        std::sqrt(2.0f / DCT_SIZE) * std::cos((float) M_PI / 2 / DCT_SIZE * u * (2 * x + 1));
+
+            return m;
+        }();
+
+        return matrix;
+    }
+
+    std::optional<std::vector<uint64_t>> DCTBlock::variants_of_file(const std::string &path)
+    {
+        std::FILE *fp = std::fopen(path.c_str(), "rb");
+
+        if (!fp)
+            return std::nullopt;
+
+        std::optional<std::vector<uint64_t>> hashes = DecoderRegistry::builtin().hash(fp, path, 0, 0, true);
+        std::fclose(fp);
+
+        if (!hashes)
+            std::cerr << "Failed to decode '" << path << "' for its variants\n";
+
+        return hashes;
+    }
+
+    std::vector<float> DCTBlock::blur(const std::vector<float> &luma, int width, int height)
+    {
+        const int reach = DCT_MEAN_FILTER / 2;
+
+        /* A 7x7 box filter (sums, not averages, like CImg's convolution), repeating the edges. */
+        /* It's separable: rows first, then columns. */
+        std::vector<float> rows(luma.size());
+        std::vector<float> blurred(luma.size());
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float sum = 0;
+
+                for (int d = -reach; d <= reach; d++)
+                    sum += luma[(size_t) y * width + std::clamp(x + d, 0, width - 1)];
+
+                rows[(size_t) y * width + x] = sum;
+            }
+        }
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float sum = 0;
+
+                for (int d = -reach; d <= reach; d++)
+                    sum += rows[(size_t) std::clamp(y + d, 0, height - 1) * width + x];
+
+                blurred[(size_t) y * width + x] = sum;
+            }
+        }
+
+        return blurred;
+    }
+
+    DCTBlock DCTBlock::of_blurred(const std::vector<float> &blurred, int width, int height,
+            bool flip_horizontal, bool flip_vertical)
+    {
+        /* Nearest neighbour down (or up) to 32x32, picking pixels like CImg's resize() does. Unless */
+        /* the size is a multiple of 32, the pixels picked from a mirror image aren't the mirror */
+        /* image of those picked from the original, so flipping signs in the block won't do. */
+        float small[DCT_SIZE][DCT_SIZE];
+
+        for (int y = 0; y < DCT_SIZE; y++)
+        {
+            int sy = y * height / DCT_SIZE;
+
+            if (flip_vertical)
+                sy = height - 1 - sy;
+
+            for (int x = 0; x < DCT_SIZE; x++)
+            {
+                int sx = x * width / DCT_SIZE;
+
+                if (flip_horizontal)
+                    sx = width - 1 - sx;
+
+                small[y][x] = blurred[(size_t) sy * width + sx];
+            }
+        }
+
+        return of_small(small);
+    }
+
+    DCTBlock DCTBlock::of_small(const float small[DCT_SIZE][DCT_SIZE])
+    {
+        const std::vector<std::vector<float>> &dct = dct_matrix();
+
+        /* Only the frequencies 1 to 8 are needed, so only those rows of C * image * C^T are worked out. */
+        float half[DCT_BLOCK][DCT_SIZE];
+
+        for (int u = 0; u < DCT_BLOCK; u++)
+        {
+            for (int x = 0; x < DCT_SIZE; x++)
+            {
+                float sum = 0;
+
+                for (int y = 0; y < DCT_SIZE; y++)
+                    sum += dct[u + 1][y] * small[y][x];
+
+                half[u][x] = sum;
+            }
+        }
+
+        DCTBlock block;
+
+        for (int u = 0; u < DCT_BLOCK; u++)
+        {
+            for (int v = 0; v < DCT_BLOCK; v++)
+            {
+                float sum = 0;
+
+                for (int x = 0; x < DCT_SIZE; x++)
+                    sum += half[u][x] * dct[v + 1][x];
+
+                block.coefficients[u][v] = sum;
+            }
+        }
+
+        return block;
+    }
+
+    DCTBlock DCTBlock::transposed() const
+    {
+        DCTBlock result;
+
+        for (int u = 0; u < DCT_BLOCK; u++)
+            for (int v = 0; v < DCT_BLOCK; v++)
+                result.coefficients[u][v] = coefficients[v][u];
+
+        return result;
+    }
+
+    uint64_t DCTBlock::hash() const
+    {
+        std::vector<float> sorted(&coefficients[0][0], &coefficients[0][0] + DCT_BLOCK * DCT_BLOCK);
+        std::sort(sorted.begin(), sorted.end());
+
+        float median = (sorted[sorted.size() / 2 - 1] + sorted[sorted.size() / 2]) / 2;
+        uint64_t value = 0;
+
+        /* Row by row, the first coefficient being the lowest bit. */
+        for (int i = 0; i < DCT_BLOCK * DCT_BLOCK; i++)
+        {
+            if (coefficients[i / DCT_BLOCK][i % DCT_BLOCK] > median)
+                value |= (uint64_t) 1 << i;
+        }
+
+        return value;
+    }
+
+    /* A rotation by 90 degrees clockwise is the diagonal mirror image of the image turned upside */
+    /* down, and so on. */
+    static std::vector<uint64_t> variants_of_mirrors(const DCTBlock &original, const DCTBlock &horizontal,
+            const DCTBlock &vertical, const DCTBlock &both)
+    {
+        std::vector<uint64_t> hashes(DIHEDRAL_TRANSFORMS);
+        hashes[(int) DihedralTransforms::Identity] = original.hash();
+        hashes[(int) DihedralTransforms::FlipHorizontal] = horizontal.hash();
+        hashes[(int) DihedralTransforms::FlipVertical] = vertical.hash();
+        hashes[(int) DihedralTransforms::Rotate180] = both.hash();
+        hashes[(int) DihedralTransforms::Transpose] = original.transposed().hash();
+        hashes[(int) DihedralTransforms::Rotate90] = vertical.transposed().hash();
+        hashes[(int) DihedralTransforms::Rotate270] = horizontal.transposed().hash();
+        hashes[(int) DihedralTransforms::AntiTranspose] = both.transposed().hash();
+
+        return hashes;
+    }
+
+    std::vector<uint64_t> DCTBlock::variants(const std::vector<float> &luma, int width, int height)
+    {
+        std::vector<float> blurred = blur(luma, width, height);
+
+        return variants_of_mirrors(of_blurred(blurred, width, height), of_blurred(blurred, width, height, true, false),
+                                   of_blurred(blurred, width, height, false, true), of_blurred(blurred, width, height, true, true));
+    }
+
+    DCTSampler::DCTSampler()
+    {
+        width = 0;
+        height = 0;
+        thumbnail = nullptr;
+    }
+
+    void DCTSampler::start(int _width, int _height)
+    {
+        const int reach = DCT_MEAN_FILTER / 2;
+
+        width = _width;
+        height = _height;
+
+        if (thumbnail != nullptr)
+            thumbnail->start(width, height);
+
+        picked_rows.clear();
+        picked_columns.clear();
+
+        /* Like of_blurred() picks them, from either side. */
+        for (int i = 0; i < DCT_SIZE; i++)
+        {
+            int sy = (int64_t) i * height / DCT_SIZE;
+            int sx = (int64_t) i * width / DCT_SIZE;
+
+            picked_rows.insert(picked_rows.end(), {sy, height - 1 - sy});
+            picked_columns.insert(picked_columns.end(), {sx, width - 1 - sx});
+        }
+
+        for (std::vector<int> *picked : {&picked_rows, &picked_columns})
+        {
+            std::sort(picked->begin(), picked->end());
+            picked->erase(std::unique(picked->begin(), picked->end()), picked->end());
+        }
+
+        needed_columns.clear();
+
+        for (int x : picked_columns)
+            for (int d = -reach; d <= reach; d++)
+                needed_columns.push_back(std::clamp(x + d, 0, width - 1));
+
+        std::sort(needed_columns.begin(), needed_columns.end());
+        needed_columns.erase(std::unique(needed_columns.begin(), needed_columns.end()), needed_columns.end());
+
+        taps.clear();
+
+        for (int x : picked_columns)
+            for (int d = -reach; d <= reach; d++)
+                taps.push_back(std::lower_bound(needed_columns.begin(), needed_columns.end(),
+                                                std::clamp(x + d, 0, width - 1)) - needed_columns.begin());
+
+        sums.assign(picked_rows.size() * picked_columns.size(), 0);
+        row_sums.resize(picked_columns.size());
+    }
+
+    const std::vector<int> &DCTSampler::columns() const
+    {
+        return needed_columns;
+    }
+
+    bool DCTSampler::needs_row(int y) const
+    {
+        const int reach = DCT_MEAN_FILTER / 2;
+        std::vector<int>::const_iterator it = std::lower_bound(picked_rows.begin(), picked_rows.end(), y - reach);
+
+        return it != picked_rows.end() && *it <= y + reach;
+    }
+
+    void DCTSampler::add_row(int y, const float *luma)
+    {
+        const int reach = DCT_MEAN_FILTER / 2;
+        bool summed = false;
+
+        for (size_t r = 0; r < picked_rows.size(); r++)
+        {
+            /* How many times the box around this picked row has this row in it: more than once at the */
+            /* edges, which are repeated. */
+            int times = 0;
+
+            for (int d = -reach; d <= reach; d++)
+                times += std::clamp(picked_rows[r] + d, 0, height - 1) == y;
+
+            if (times == 0)
+                continue;
+
+            /* The sums across the row, in the same order blur() adds them up (and the rows after */
+            /* that), so that they are exactly the same. */
+            if (!summed)
+            {
+                for (size_t c = 0; c < picked_columns.size(); c++)
+                {
+                    float sum = 0;
+
+                    for (int d = 0; d < DCT_MEAN_FILTER; d++)
+                        sum += luma[taps[c * DCT_MEAN_FILTER + d]];
+
+                    row_sums[c] = sum;
+                }
+
+                summed = true;
+            }
+
+            float *box = &sums[r * picked_columns.size()];
+
+            for (int t = 0; t < times; t++)
+                for (size_t c = 0; c < picked_columns.size(); c++)
+                    box[c] += row_sums[c];
+        }
+    }
+
+    void DCTSampler::add_pixels(int y, const uint8_t *row, int channels)
+    {
+        if (thumbnail != nullptr)
+            thumbnail->add_row(y, row, channels);
+    }
+
+    DCTBlock DCTSampler::block(bool flip_horizontal, bool flip_vertical) const
+    {
+        float small[DCT_SIZE][DCT_SIZE];
+
+        for (int y = 0; y < DCT_SIZE; y++)
+        {
+            int sy = (int64_t) y * height / DCT_SIZE;
+
+            if (flip_vertical)
+                sy = height - 1 - sy;
+
+            size_t r = std::lower_bound(picked_rows.begin(), picked_rows.end(), sy) - picked_rows.begin();
+
+            for (int x = 0; x < DCT_SIZE; x++)
+            {
+                int sx = (int64_t) x * width / DCT_SIZE;
+
+                if (flip_horizontal)
+                    sx = width - 1 - sx;
+
+                size_t c = std::lower_bound(picked_columns.begin(), picked_columns.end(), sx) - picked_columns.begin();
+                small[y][x] = sums[r * picked_columns.size() + c];
+            }
+        }
+
+        return DCTBlock::of_small(small);
+    }
+
+    uint64_t DCTSampler::hash() const
+    {
+        return block(false, false).hash();
+    }
+
+    std::vector<uint64_t> DCTSampler::variants() const
+    {
+        return variants_of_mirrors(block(false, false), block(true, false), block(false, true), block(true, true));
+    }
+}
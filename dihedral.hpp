@@ -0,0 +1,104 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "phash/pHash.h"
+#include "simpic_protocol.hpp"
+
+#define DCT_SIZE 32
+#define DCT_BLOCK 8
+#define DCT_MEAN_FILTER 7
+#define DIHEDRAL_TRANSFORMS 8
+
+namespace SimpicServerLib
+{
+    class ThumbnailSampler;
+
+    /* The 8x8 lowest frequencies (but the first row and column) of the DCT of an image's luma, blurred and shrunk to 32x32, which is what pHash's DCT hash is made of: a bit per coefficient, set if it is above their median. */
+    class DCTBlock
+    {
+    public:
+        /* By vertical, then horizontal frequency, both starting at 1. */
+        float coefficients[DCT_BLOCK][DCT_BLOCK];
+
+        /* Blur the luma (given row by row) the way pHash does, before it is shrunk. */
+        static std::vector<float> blur(const std::vector<float> &luma, int width, int height);
+
+        /* The block of a blurred image, or of its mirror image: shrinking it picks pixels from the other side then. */
+        static DCTBlock of_blurred(const std::vector<float> &blurred, int width, int height,
+                    bool flip_horizontal = false, bool flip_vertical = false);
+
+        /* The block of an image that has been blurred and shrunk to 32x32 already. */
+        static DCTBlock of_small(const float small[DCT_SIZE][DCT_SIZE]);
+
+        /* The block of the image mirrored along its diagonal: the two frequencies swap. */
+        DCTBlock transposed() const;
+
+        /* The DCT hash, exactly as pHash sets its bits. */
+        uint64_t hash() const;
+
+        /* The hash of every rotation and mirror image of the image given by its luma, by DihedralTransforms. */
+        /* It is decoded and blurred once: each mirror image is then only shrunk and transformed again, and the diagonal mirror image of each of those comes from swapping its coefficients. */
+        static std::vector<uint64_t> variants(const std::vector<float> &luma, int width, int height);
+
+        /* Decode the image file and work out the hashes of its rotations and mirror images. */
+        static std::optional<std::vector<uint64_t>> variants_of_file(const std::string &path);
+    };
+
+    /* What the DCT hash needs of an image, gathered a row at a time while it's decoded. pHash blurs the whole image, then keeps 32x32 of its pixels: only the sums of the 7x7 boxes around those (and around the ones its mirror images keep instead) are kept here. That is at most 64x64 sums and 64x7 pixels of a row, however big the image is, and the hashes come out the same as from DCTBlock::variants() of the whole image. */
+    class DCTSampler
+    {
+    public:
+        int width;
+        int height;
+
+        /* If it isn't nullptr, it is started along with this one, and given every row in colour by add_pixels(). */
+        ThumbnailSampler *thumbnail;
+
+        DCTSampler();
+
+        /* Start over, on an image of this size. */
+        void start(int _width, int _height);
+
+        /* The columns of which the luma is needed, left to right. */
+        const std::vector<int> &columns() const;
+
+        /* Whether any of this row is needed. */
+        bool needs_row(int y) const;
+
+        /* Add row y, given by the luma of columns() only, in their order. Rows come top to bottom, but those that aren't needed may be left out. */
+        void add_row(int y, const float *luma);
+
+        /* Give row y, in grey (1 channel) or colour (at least 3), to the thumbnail, if there is one. Every row is given, top to bottom, whether it is needed or not. */
+        void add_pixels(int y, const uint8_t *row, int channels);
+
+        /* Once every row that is needed is in, the DCT hash: the same as ph_dct_imagehash(). */
+        uint64_t hash() const;
+
+        /* The hashes of every rotation and mirror image, by DihedralTransforms. */
+        std::vector<uint64_t> variants() const;
+
+    private:
+        /* The rows and columns the 32x32 pixels are picked from, sorted. */
+        std::vector<int> picked_rows;
+        std::vector<int> picked_columns;
+
+        /* Every column within 3 of a picked one, and where each of the 7 around each picked column is among them. */
+        std::vector<int> needed_columns;
+        std::vector<int> taps;
+
+        /* The box sums, by picked row, then picked column. */
+        std::vector<float> sums;
+        std::vector<float> row_sums;
+
+        DCTBlock block(bool flip_horizontal, bool flip_vertical) const;
+    };
+}
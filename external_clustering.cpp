@@ -0,0 +1,572 @@
+#include "external_clustering.hpp"
+
+namespace SimpicServerLib
+{
+    ExternalClustering::ExternalClustering(const std::string &_directory, uint8_t _max_ham, size_t _memory, size_t _read_size)
+    {
+        directory = _directory;
+        max_ham = _max_ham;
+        memory = _memory;
+        read_size = _read_size;
+
+        count = 0;
+        window_capacity = 0;
+        buffered = 0;
+        overflowed = 0;
+        overflows[0] = -1;
+        overflows[1] = -1;
+
+        pending.reserve(std::max<size_t>(1, read_size / sizeof(ClusterEntry)));
+
+        input = spill();
+        failed = input < 0;
+    }
+
+    ExternalClustering::~ExternalClustering()
+    {
+        for (int fd : {input, overflows[0], overflows[1]})
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    int ExternalClustering::spill()
+    {
+        std::string name = directory + "/spill-XXXXXX";
+        int fd = mkstemp(name.data());
+
+        if (fd < 0)
+        {
+            std::cerr << "Failed to make a spill in '" << directory << "': " << std::strerror(errno) << "\n";
+            return -1;
+        }
+
+        /* Nobody else needs to see it, and it shouldn't outlive us. */
+        unlink(name.c_str());
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        return fd;
+    }
+
+    bool ExternalClustering::read_entries(int fd, ClusterEntry *entries, size_t amnt, size_t offset)
+    {
+        char *at = (char*) entries;
+        size_t left = amnt * sizeof(ClusterEntry);
+        off_t position = (off_t) offset * sizeof(ClusterEntry);
+
+        while (left != 0)
+        {
+            ssize_t done = pread(fd, at, left, position);
+
+            if (done < 0 && errno == EINTR)
+                continue;
+
+            if (done <= 0)
+            {
+                std::cerr << "Failed to read a spill: " << (done < 0 ? std::strerror(errno) : "it ends too soon") << "\n";
+                return false;
+            }
+
+            at += done;
+            left -= done;
+            position += done;
+        }
+
+        return true;
+    }
+
+    bool ExternalClustering::write_entries(int fd, const ClusterEntry *entries, size_t amnt, size_t offset)
+    {
+        const char *at = (const char*) entries;
+        size_t left = amnt * sizeof(ClusterEntry);
+        off_t position = (off_t) offset * sizeof(ClusterEntry);
+
+        while (left != 0)
+        {
+            ssize_t done = pwrite(fd, at, left, position);
+
+            if (done < 0 && errno == EINTR)
+                continue;
+
+            if (done < 0)
+            {
+                std::cerr << "Failed to write a spill: " << std::strerror(errno) << "\n";
+                return false;
+            }
+
+            at += done;
+            left -= done;
+            position += done;
+        }
+
+        return true;
+    }
+
+    uint32_t ExternalClustering::find(uint32_t id)
+    {
+        /* Path halving: every other id on the way up is pointed at its grandparent. */
+        while (parents[id] != id)
+        {
+            parents[id] = parents[parents[id]];
+            id = parents[id];
+        }
+
+        return id;
+    }
+
+    void ExternalClustering::unite(uint32_t a, uint32_t b)
+    {
+        a = find(a);
+        b = find(b);
+
+        /* The smaller id stays the root, so that every component ends up known by its smallest id. */
+        if (a < b)
+            parents[b] = a;
+        else if (b < a)
+            parents[a] = b;
+    }
+
+    void ExternalClustering::budget(size_t &window_entries, size_t &slab_entries, size_t &io_entries) const
+    {
+        io_entries = std::max<size_t>(1, read_size / sizeof(ClusterEntry));
+
+        /* The forest, what's added but not written yet, a write and a read for what doesn't fit in the window, and a read's worth for keeping track of the runs being merged. */
+        size_t fixed = (size_t) count * sizeof(uint32_t) + 4 * io_entries * sizeof(ClusterEntry);
+
+        window_entries = 0;
+        slab_entries = 0;
+
+        if (memory <= fixed)
+            return;
+
+        size_t left = (memory - fixed) / sizeof(ClusterEntry);
+        window_entries = left / 4;
+
+        /* A merge needs at least two runs to read and somewhere to write to. */
+        if (window_entries != 0 && left - window_entries >= 3 * io_entries)
+            slab_entries = left - window_entries;
+    }
+
+    bool ExternalClustering::sort(int from, size_t amnt, int rotation, std::vector<ClusterEntry> &slab, size_t io_entries,
+            const std::function<bool(const ClusterEntry*, size_t)> &each)
+    {
+        auto by_key = [rotation](const ClusterEntry &a, const ClusterEntry &b) -> bool {
+            return std::rotl(a.hash(), rotation) < std::rotl(b.hash(), rotation);
+        };
+
+        /* All of it fits: there's nothing to spill. */
+        if (amnt <= slab.size())
+        {
+            if (!read_entries(from, slab.data(), amnt, 0))
+                return false;
+
+            std::sort(slab.begin(), slab.begin() + amnt, by_key);
+            return each(slab.data(), amnt);
+        }
+
+        int runs_fd = spill();
+
+        if (runs_fd < 0)
+            return false;
+
+        std::vector<Run> runs;
+
+        for (size_t done = 0; done < amnt; done += runs.back().count)
+        {
+            size_t run = std::min(slab.size(), amnt - done);
+
+            if (!read_entries(from, slab.data(), run, done))
+            {
+                close(runs_fd);
+                return false;
+            }
+
+            std::sort(slab.begin(), slab.begin() + run, by_key);
+
+            if (!write_entries(runs_fd, slab.data(), run, done))
+            {
+                close(runs_fd);
+                return false;
+            }
+
+            runs.push_back({done, run});
+        }
+
+        /* One read for each run being merged, and one write. Too many runs for that are merged a few at a time, into fewer, longer ones. */
+        size_t fan_in = slab.size() / io_entries - 1;
+
+        while (runs.size() > fan_in)
+        {
+            int merged_fd = spill();
+
+            if (merged_fd < 0)
+            {
+                close(runs_fd);
+                return false;
+            }
+
+            std::vector<Run> merged;
+            size_t written = 0;
+
+            for (size_t first = 0; first < runs.size(); first += fan_in)
+            {
+                std::vector<Run> some(runs.begin() + first, runs.begin() + std::min(runs.size(), first + fan_in));
+                size_t offset = written;
+
+                bool merging = merge(runs_fd, some, rotation, slab, io_entries,
+                        [merged_fd, &written](const ClusterEntry *entries, size_t amnt) -> bool {
+                    if (!write_entries(merged_fd, entries, amnt, written))
+                        return false;
+
+                    written += amnt;
+                    return true;
+                });
+
+                if (!merging)
+                {
+                    close(merged_fd);
+                    close(runs_fd);
+                    return false;
+                }
+
+                merged.push_back({offset, written - offset});
+            }
+
+            close(runs_fd);
+            runs_fd = merged_fd;
+            runs = merged;
+        }
+
+        bool merging = merge(runs_fd, runs, rotation, slab, io_entries, each);
+        close(runs_fd);
+
+        return merging;
+    }
+
+    bool ExternalClustering::merge(int from, const std::vector<Run> &runs, int rotation, std::vector<ClusterEntry> &slab,
+            size_t io_entries, const std::function<bool(const ClusterEntry*, size_t)> &each)
+    {
+        struct Reader
+        {
+            size_t next;
+            size_t end;
+            ClusterEntry *buffer;
+            size_t amnt;
+            size_t at;
+        };
+
+        /* Each run is read into a part of the slab of its own, and what's merged goes into the part after them. */
+        std::vector<Reader> readers;
+        readers.reserve(runs.size());
+
+        auto refill = [from, io_entries](Reader &reader) -> bool {
+            reader.amnt = std::min(io_entries, reader.end - reader.next);
+            reader.at = 0;
+
+            if (!read_entries(from, reader.buffer, reader.amnt, reader.next))
+                return false;
+
+            reader.next += reader.amnt;
+            return true;
+        };
+
+        /* The key of the next entry of each run that has any left, and which run. */
+        typedef std::pair<uint64_t, size_t> Head;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+            readers.push_back({runs[i].offset, runs[i].offset + runs[i].count, slab.data() + i * io_entries, 0, 0});
+
+            if (!refill(readers[i]))
+                return false;
+
+            if (readers[i].amnt != 0)
+                heads.push({std::rotl(readers[i].buffer[0].hash(), rotation), i});
+        }
+
+        ClusterEntry *out = slab.data() + runs.size() * io_entries;
+        size_t filled = 0;
+
+        while (!heads.empty())
+        {
+            size_t which = heads.top().second;
+            Reader &reader = readers[which];
+            heads.pop();
+
+            out[filled++] = reader.buffer[reader.at++];
+
+            if (filled == io_entries)
+            {
+                if (!each(out, filled))
+                    return false;
+
+                filled = 0;
+            }
+
+            if (reader.at == reader.amnt && !refill(reader))
+                return false;
+
+            if (reader.at < reader.amnt)
+                heads.push({std::rotl(reader.buffer[reader.at].hash(), rotation), which});
+        }
+
+        return filled == 0 || each(out, filled);
+    }
+
+    bool ExternalClustering::look_at(const ClusterEntry &entry)
+    {
+        uint64_t hash = entry.hash();
+
+        for (const ClusterEntry &other : window)
+        {
+            if (std::popcount(hash ^ other.hash()) <= max_ham)
+                unite(other.id, entry.id);
+        }
+
+        if (window.size() < window_capacity)
+        {
+            window.push_back(entry);
+            return true;
+        }
+
+        /* No room: it is compared with whatever comes after it that doesn't fit either, later. */
+        if (overflows[0] < 0 && (overflows[0] = spill()) < 0)
+            return false;
+
+        size_t half = overflow_buffer.size() / 2;
+
+        overflow_buffer[buffered++] = entry;
+        overflowed++;
+
+        if (buffered < half)
+            return true;
+
+        buffered = 0;
+        return write_entries(overflows[0], overflow_buffer.data(), half, overflowed - half);
+    }
+
+    bool ExternalClustering::finish_group()
+    {
+        size_t half = overflow_buffer.size() / 2;
+        ClusterEntry *reading = overflow_buffer.data() + half;
+
+        window.clear();
+
+        /* Read back in order, the first of them to fit go in the window, and the rest into the other spill, for the next time around. */
+        while (overflowed != 0)
+        {
+            if (buffered != 0 && !write_entries(overflows[0], overflow_buffer.data(), buffered, overflowed - buffered))
+                return false;
+
+            size_t amnt = overflowed;
+
+            buffered = 0;
+            overflowed = 0;
+            std::swap(overflows[0], overflows[1]);
+
+            for (size_t done = 0; done < amnt; )
+            {
+                size_t chunk = std::min(half, amnt - done);
+
+                if (!read_entries(overflows[1], reading, chunk, done))
+                    return false;
+
+                for (size_t i = 0; i < chunk; i++)
+                {
+                    if (!look_at(reading[i]))
+                        return false;
+                }
+
+                done += chunk;
+            }
+
+            window.clear();
+        }
+
+        return true;
+    }
+
+    bool ExternalClustering::add(DCTHash hash)
+    {
+        if (failed || count == UINT32_MAX)
+            return false;
+
+        uint64_t value = hash.words[0];
+
+        pending.push_back({count, (uint32_t) value, (uint32_t) (value >> 32)});
+        count++;
+
+        if (pending.size() < std::max<size_t>(1, read_size / sizeof(ClusterEntry)))
+            return true;
+
+        failed = !write_entries(input, pending.data(), pending.size(), count - pending.size());
+        pending.clear();
+
+        return !failed;
+    }
+
+    bool ExternalClustering::ready() const
+    {
+        size_t window_entries, slab_entries, io_entries;
+        budget(window_entries, slab_entries, io_entries);
+
+        return !failed && slab_entries != 0;
+    }
+
+    bool ExternalClustering::components(std::function<bool(const std::vector<uint32_t> &component, bool continues)> callback)
+    {
+        if (!ready())
+        {
+            std::cerr << "Failed to cluster " << count << " hashes in " << memory << " bytes: " <<
+                (failed ? "they couldn't be spilled" : "not enough memory") << "\n";
+            return false;
+        }
+
+        if (!pending.empty())
+        {
+            if (!write_entries(input, pending.data(), pending.size(), count - pending.size()))
+                return false;
+
+            pending.clear();
+        }
+
+        size_t window_entries, slab_entries, io_entries;
+        budget(window_entries, slab_entries, io_entries);
+
+        parents.resize(count);
+
+        for (uint32_t id = 0; id < count; id++)
+            parents[id] = id;
+
+        std::vector<ClusterEntry> slab(slab_entries);
+
+        window.reserve(window_entries);
+        window_capacity = window_entries;
+        overflow_buffer.resize(2 * io_entries);
+
+        /* Every two hashes are that close. */
+        if (max_ham >= DCT_HASH_BITS)
+        {
+            for (uint32_t id = 1; id < count; id++)
+                unite(0, id);
+        }
+
+        int blocks = max_ham >= DCT_HASH_BITS ? 0 : max_ham + 1;
+        int start = 0;
+
+        for (int block = 0; block < blocks; block++)
+        {
+            int width = DCT_HASH_BITS / blocks + (block < DCT_HASH_BITS % blocks);
+
+            /* This block's bits go first, and those after it follow. */
+            int rotation = (DCT_HASH_BITS - start - width) % DCT_HASH_BITS;
+
+            bool first = true;
+            uint64_t group = 0;
+            uint64_t previous_hash = 0;
+            uint32_t previous_id = 0;
+
+            bool sorted = sort(input, count, rotation, slab, io_entries, [&](const ClusterEntry *entries, size_t amnt) -> bool {
+                for (size_t i = 0; i < amnt; i++)
+                {
+                    uint64_t hash = entries[i].hash();
+
+                    /* The same hash again: whatever it is close to, so is the one before it. */
+                    if (!first && hash == previous_hash)
+                    {
+                        unite(previous_id, entries[i].id);
+                        continue;
+                    }
+
+                    uint64_t value = width == DCT_HASH_BITS ? hash : std::rotl(hash, rotation) >> (DCT_HASH_BITS - width);
+
+                    if (!first && value != group && !finish_group())
+                        return false;
+
+                    first = false;
+                    group = value;
+                    previous_hash = hash;
+                    previous_id = entries[i].id;
+
+                    if (!look_at(entries[i]))
+                        return false;
+                }
+
+                return true;
+            });
+
+            if (!sorted || !finish_group())
+                return false;
+
+            start += width;
+        }
+
+        /* The window's memory is the components' now. */
+        std::vector<ClusterEntry>().swap(window);
+        std::vector<ClusterEntry>().swap(overflow_buffer);
+
+        /* Every id, behind the smallest id of its component, sorted: the components, one after the other, each in order. */
+        int roots = spill();
+
+        if (roots < 0)
+            return false;
+
+        for (uint32_t id = 0; id < count; id++)
+        {
+            pending.push_back({id, id, find(id)});
+
+            if (pending.size() == io_entries || id + 1 == count)
+            {
+                if (!write_entries(roots, pending.data(), pending.size(), id + 1 - pending.size()))
+                {
+                    close(roots);
+                    return false;
+                }
+
+                pending.clear();
+            }
+        }
+
+        size_t piece = std::max<size_t>(1, window_entries * sizeof(ClusterEntry) / sizeof(uint32_t));
+        std::vector<uint32_t> component;
+        component.reserve(piece);
+
+        bool more = true;
+        bool continues = false;
+        uint32_t root = 0;
+
+        bool sorted = sort(roots, count, 0, slab, io_entries, [&](const ClusterEntry *entries, size_t amnt) -> bool {
+            for (size_t i = 0; i < amnt; i++)
+            {
+                if (!component.empty() && (entries[i].high != root || component.size() == piece))
+                {
+                    more = callback(component, continues);
+                    continues = entries[i].high == root;
+                    component.clear();
+
+                    if (!more)
+                        return false;
+                }
+
+                root = entries[i].high;
+                component.push_back(entries[i].id);
+            }
+
+            return true;
+        });
+
+        close(roots);
+
+        if (sorted && !component.empty())
+            more = callback(component, continues);
+
+        return sorted || !more;
+    }
+
+    size_t ExternalClustering::size() const
+    {
+        return count;
+    }
+}
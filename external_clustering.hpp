@@ -0,0 +1,115 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <bit>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "perceptual_hash.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* One hash as ExternalClustering has it on disk: its id (the order it was added in) and the hash, in halves, so that it takes 12 bytes and no padding. */
+    struct ClusterEntry
+    {
+        uint32_t id;
+        uint32_t low;
+        uint32_t high;
+
+        uint64_t hash() const
+        {
+            return (uint64_t) high << 32 | low;
+        }
+    };
+
+    /* Groups DCT hashes into connected components, like HammingIndex::components(), for more of them than fit in memory (as indexes, or as Images): it never takes more than the memory it is given, however many there are, and everything else goes through files in a directory of spills, read and written in order. */
+    /* If two hashes are within max_ham bits of each other, they are the same in at least one of max_ham + 1 blocks of their bits (pigeonhole). For each block, the hashes are sorted with that block's bits first (in runs that fit in memory, spilled and then merged as a stream), so that those with the same value there come one after the other, and each is compared with those before it with the same value. Those within max_ham are joined in a union-find forest, which is all that stays in memory: 4 bytes a hash. */
+    class ExternalClustering
+    {
+    private:
+        struct Run
+        {
+            size_t offset;
+            size_t count;
+        };
+
+        std::string directory;
+        uint8_t max_ham;
+        size_t memory;
+        size_t read_size;
+
+        /* Everything added, in the order it was added, and what hasn't been written to it yet. */
+        int input;
+        std::vector<ClusterEntry> pending;
+        uint32_t count;
+        bool failed;
+
+        /* Each id points at a smaller one of its component, or at itself. */
+        std::vector<uint32_t> parents;
+
+        /* Those with the same value in the block being looked at so far, as many as fit, and those that didn't (which still have to be compared with each other) in one spill, with another to take the ones that don't fit the next time around. */
+        std::vector<ClusterEntry> window;
+        size_t window_capacity;
+        std::vector<ClusterEntry> overflow_buffer;
+        size_t buffered;
+        int overflows[2];
+        size_t overflowed;
+
+        /* A file in the directory of spills, gone as soon as it's closed (or the server is), or -1. */
+        int spill();
+
+        static bool read_entries(int fd, ClusterEntry *entries, size_t amnt, size_t offset);
+        static bool write_entries(int fd, const ClusterEntry *entries, size_t amnt, size_t offset);
+
+        uint32_t find(uint32_t id);
+        void unite(uint32_t a, uint32_t b);
+
+        /* How many entries go into the window, the slab (what's sorted and merged in) and a read or write. 0 in the slab if the memory isn't enough. */
+        void budget(size_t &window_entries, size_t &slab_entries, size_t &io_entries) const;
+
+        /* Hand every entry of the file (amnt of them), in order of their hashes rotated left by rotation bits, to each, a buffer at a time. Runs of the size of the slab are sorted and spilled, then merged, as many at once as there are reads of read_size in the slab, in as many passes as it takes. */
+        bool sort(int from, size_t amnt, int rotation, std::vector<ClusterEntry> &slab, size_t io_entries,
+                    const std::function<bool(const ClusterEntry*, size_t)> &each);
+
+        bool merge(int from, const std::vector<Run> &runs, int rotation, std::vector<ClusterEntry> &slab, size_t io_entries,
+                    const std::function<bool(const ClusterEntry*, size_t)> &each);
+
+        /* Compare an entry with the window, and keep it there (or in the overflow). */
+        bool look_at(const ClusterEntry &entry);
+
+        /* Done with one value of the block: compare what overflowed with each other, a window at a time. */
+        bool finish_group();
+
+    public:
+        ExternalClustering(const std::string &_directory, uint8_t _max_ham, size_t _memory,
+                    size_t _read_size = EXTERNAL_CLUSTERING_READ_SIZE);
+        ~ExternalClustering();
+
+        ExternalClustering(const ExternalClustering&) = delete;
+        ExternalClustering &operator=(const ExternalClustering&) = delete;
+
+        /* Add a hash, with the next id. Returns false if it couldn't be spilled. */
+        bool add(DCTHash hash);
+
+        /* Whether everything was spilled so far, and the memory is enough to cluster this many hashes. */
+        bool ready() const;
+
+        /* Call back with every component (including lone hashes), each in the order of its ids, in the order of their smallest ids, like HammingIndex::components(). A component bigger than what is left of the memory comes in several calls, one after the other: continues is true for every one of them but the first, which is when the ids are more of the same component as the call before. Stops early if the callback returns false. Returns false if it couldn't be done at all, or a spill couldn't be read or written. */
+        bool components(std::function<bool(const std::vector<uint32_t> &component, bool continues)> callback);
+
+        size_t size() const;
+    };
+}
@@ -0,0 +1,209 @@
+#include "hamming_index.hpp"
+
+namespace SimpicServerLib
+{
+    template <typename Hash>
+    HammingIndex<Hash>::HammingIndex(const std::vector<Hash> &_hashes)
+    {
+        hashes = _hashes;
+        offsets.resize(Hash::CHUNKS);
+        ids.resize(Hash::CHUNKS);
+
+        /* A counting sort of the ids by each chunk's value. */
+        for (int c = 0; c < Hash::CHUNKS; c++)
+        {
+            std::vector<uint32_t> &offset = offsets[c];
+            offset.assign(65536 + 1, 0);
+
+            for (const Hash &hash : hashes)
+                offset[hash.chunk(c) + 1]++;
+
+            for (size_t v = 0; v < 65536; v++)
+                offset[v + 1] += offset[v];
+
+            std::vector<uint32_t> next(offset.begin(), offset.end() - 1);
+            ids[c].resize(hashes.size());
+
+            for (uint32_t id = 0; id < hashes.size(); id++)
+                ids[c][next[hashes[id].chunk(c)]++] = id;
+        }
+    }
+
+    template <typename Hash>
+    void HammingIndex<Hash>::ring(uint16_t value, int radius, int from, std::function<void(uint16_t)> callback)
+    {
+        if (radius == 0)
+        {
+            callback(value);
+            return;
+        }
+
+        /* Flip one more bit, always above the last one flipped, so each value comes up once. */
+        for (int bit = from; bit < 16; bit++)
+            ring(value ^ (1 << bit), radius - 1, bit + 1, callback);
+    }
+
+    template <typename Hash>
+    void HammingIndex<Hash>::probe(const Hash &hash, int radius, std::function<void(uint32_t)> callback)
+    {
+        for (int c = 0; c < Hash::CHUNKS; c++)
+        {
+            ring(hash.chunk(c), radius, 0, [this, c, &callback](uint16_t value) -> void {
+                for (uint32_t i = offsets[c][value]; i < offsets[c][value + 1]; i++)
+                    callback(ids[c][i]);
+            });
+        }
+    }
+
+    template <typename Hash>
+    void HammingIndex<Hash>::candidates(const Hash &hash, uint16_t max_ham, std::function<void(uint32_t)> callback)
+    {
+        int radius = max_ham / Hash::CHUNKS;
+
+        /* Probing that many buckets isn't any better than looking at everything. */
+        if (radius > HAMMING_INDEX_MAX_PROBE)
+        {
+            for (uint32_t id = 0; id < hashes.size(); id++)
+                callback(id);
+
+            return;
+        }
+
+        for (int r = 0; r <= radius; r++)
+            probe(hash, r, callback);
+    }
+
+    template <typename Hash>
+    std::vector<std::pair<uint32_t, uint16_t>> HammingIndex<Hash>::nearest(const Hash &hash, size_t k,
+            std::function<bool(uint32_t)> accept)
+    {
+        std::vector<std::pair<uint32_t, uint16_t>> found;
+
+        for (IndexMatch &match : nearest(std::vector<Hash>{hash}, k, accept))
+            found.push_back({match.id, match.distance});
+
+        return found;
+    }
+
+    template <typename Hash>
+    std::vector<IndexMatch> HammingIndex<Hash>::nearest(const std::vector<Hash> &queries, size_t k,
+            std::function<bool(uint32_t)> accept)
+    {
+        std::unordered_set<uint32_t> seen;
+        std::vector<IndexMatch> found;
+
+        auto consider = [this, &queries, &seen, &found, &accept](uint32_t id) -> void {
+            if (!seen.insert(id).second)
+                return;
+
+            if (accept != nullptr && !accept(id))
+                return;
+
+            IndexMatch match = {id, UINT16_MAX, 0};
+
+            for (size_t q = 0; q < queries.size(); q++)
+            {
+                uint16_t distance = hamming_distance(queries[q], hashes[id]);
+
+                if (distance < match.distance)
+                    match = {id, distance, (uint8_t) q};
+            }
+
+            found.push_back(match);
+        };
+
+        auto closest_first = [](const IndexMatch &a, const IndexMatch &b) -> bool {
+            return a.distance != b.distance ? a.distance < b.distance : a.id < b.id;
+        };
+
+        for (int radius = 0; radius <= HAMMING_INDEX_MAX_PROBE; radius++)
+        {
+            for (const Hash &query : queries)
+                probe(query, radius, consider);
+
+            /* Once every ring up to this radius is probed, anything not seen yet differs in more */
+            /* than radius bits in every chunk (from every query): more than this many bits in total. */
+            int bound = (radius + 1) * Hash::CHUNKS - 1;
+            size_t within = std::count_if(found.begin(), found.end(),
+                [bound](const IndexMatch &f) -> bool { return f.distance <= bound; });
+
+            if (within >= k)
+            {
+                std::sort(found.begin(), found.end(), closest_first);
+                found.resize(k);
+                return found;
+            }
+        }
+
+        /* Far away from everything: the rest has to be looked at anyway. */
+        for (uint32_t id = 0; id < hashes.size(); id++)
+            consider(id);
+
+        std::sort(found.begin(), found.end(), closest_first);
+
+        if (found.size() > k)
+            found.resize(k);
+
+        return found;
+    }
+
+    template <typename Hash>
+    std::vector<uint32_t> HammingIndex<Hash>::search(const Hash &hash, uint16_t max_ham)
+    {
+        std::vector<uint32_t> found;
+
+        candidates(hash, max_ham, [this, &hash, max_ham, &found](uint32_t id) -> void {
+            if (hamming_distance(hash, hashes[id]) <= max_ham)
+                found.push_back(id);
+        });
+
+        /* The same id can be in the buckets of several chunks. */
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+
+        return found;
+    }
+
+    template <typename Hash>
+    void HammingIndex<Hash>::components(uint16_t max_ham, std::function<bool(const std::vector<uint32_t>&)> callback)
+    {
+        std::vector<bool> visited(hashes.size(), false);
+        std::vector<uint32_t> component;
+
+        for (uint32_t start = 0; start < hashes.size(); start++)
+        {
+            if (visited[start])
+                continue;
+
+            /* A breadth-first search, using the component itself as the queue. */
+            component.clear();
+            component.push_back(start);
+            visited[start] = true;
+
+            for (size_t next = 0; next < component.size(); next++)
+            {
+                const Hash &hash = hashes[component[next]];
+
+                candidates(hash, max_ham, [this, &hash, max_ham, &visited, &component](uint32_t id) -> void {
+                    if (visited[id] || hamming_distance(hash, hashes[id]) > max_ham)
+                        return;
+
+                    visited[id] = true;
+                    component.push_back(id);
+                });
+            }
+
+            if (!callback(component))
+                return;
+        }
+    }
+
+    template <typename Hash>
+    size_t HammingIndex<Hash>::size()
+    {
+        return hashes.size();
+    }
+
+    template class HammingIndex<DCTHash>;
+    template class HammingIndex<MHHash>;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <unordered_set>
+#include <utility>
+
+#include <cstdint>
+
+#include "perceptual_hash.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* One hit of a nearest-neighbour search: which hash, how far away, and which of the queries it is closest to. */
+    struct IndexMatch
+    {
+        uint32_t id;
+        uint16_t distance;
+        uint8_t query;
+    };
+
+    /* A multi-index hashing (MIH) index over perceptual hashes of any width: each hash is split into Hash::CHUNKS 16-bit chunks, and each chunk gets a table of which hashes have which value there. */
+    /* If two hashes are within r bits of each other, at least one of their chunks is within r / Hash::CHUNKS bits (pigeonhole), so a search only has to look at the buckets near each of the query's chunks instead of at every hash. */
+    /* It is instantiated (in hamming_index.cpp) for the hash types in perceptual_hash.hpp. */
+    template <typename Hash>
+    class HammingIndex
+    {
+    private:
+        std::vector<Hash> hashes;
+
+        /* One table per chunk, stored CSR-style: the ids with chunk value v are ids[offsets[v]..offsets[v + 1]). */
+        std::vector<std::vector<uint32_t>> offsets;
+        std::vector<std::vector<uint32_t>> ids;
+
+        /* Call back with every 16-bit value exactly radius bits away from value. */
+        static void ring(uint16_t value, int radius, int from, std::function<void(uint16_t)> callback);
+
+        /* Call back with every id in the buckets exactly radius bits away from each of the hash's chunks. */
+        void probe(const Hash &hash, int radius, std::function<void(uint32_t)> callback);
+
+    public:
+        HammingIndex(const std::vector<Hash> &_hashes);
+
+        /* Every id (index into the hashes given) within max_ham of the hash, possibly more than once and possibly farther away: the caller checks the distance. */
+        void candidates(const Hash &hash, uint16_t max_ham, std::function<void(uint32_t)> callback);
+
+        /* Every id within max_ham of the hash, exactly once. */
+        std::vector<uint32_t> search(const Hash &hash, uint16_t max_ham);
+
+        /* The k ids closest to the hash (and their distances), closest first, however far away they are. The buckets are probed in rings of growing radius, stopping as soon as k hashes are known to be closer than anything left unprobed. Ids for which accept returns false are left out. */
+        std::vector<std::pair<uint32_t, uint16_t>> nearest(const Hash &hash, size_t k,
+                    std::function<bool(uint32_t)> accept = nullptr);
+
+        /* The same, for several queries at once (e.g., the variants of one image): each id's distance is that to its closest query. */
+        std::vector<IndexMatch> nearest(const std::vector<Hash> &queries, size_t k,
+                    std::function<bool(uint32_t)> accept = nullptr);
+
+        /* Group the hashes into connected components (hashes within max_ham of each other are connected, transitively), calling back with each component (including lone hashes) as soon as it is complete. Stops early if the callback returns false. */
+        void components(uint16_t max_ham, std::function<bool(const std::vector<uint32_t>&)> callback);
+
+        size_t size();
+    };
+}
@@ -0,0 +1,126 @@
+#include "hashing_pool.hpp"
+
+namespace SimpicServerLib
+{
+    HashingPool::HashingPool(unsigned int threads)
+    {
+        stopping = false;
+        background_running = 0;
+        background_limit = std::max(1u, threads / 2);
+
+        for (unsigned int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&HashingPool::work, this));
+    }
+
+    HashingPool::~HashingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            stopping = true;
+        }
+
+        jobs_cv.notify_all();
+
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    void HashingPool::work()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            bool background = false;
+
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                jobs_cv.wait(lock, [this]() -> bool {
+                    return stopping || !jobs.empty() ||
+                        (!background_jobs.empty() && background_running < background_limit);
+                });
+
+                if (!jobs.empty())
+                {
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                else if (!stopping)
+                {
+                    job = std::move(background_jobs.front());
+                    background_jobs.pop_front();
+                    background = true;
+                    background_running++;
+                }
+
+                /* Finish what's queued before stopping (but not what's in the background). */
+                else
+                    return;
+            }
+
+            job();
+
+            if (background)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(jobs_mutex);
+                    background_running--;
+                }
+
+                jobs_cv.notify_one();
+            }
+        }
+    }
+
+    void HashingPool::submit(std::function<void()> job, bool background)
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+
+            if (background)
+                background_jobs.push_back(std::move(job));
+            else
+                jobs.push_back(std::move(job));
+        }
+
+        jobs_cv.notify_one();
+    }
+
+    unsigned int HashingPool::default_size()
+    {
+        unsigned int cores = std::thread::hardware_concurrency();
+        return cores == 0 ? 1 : cores;
+    }
+
+    HashingGroup::HashingGroup()
+    {
+        pending = 0;
+    }
+
+    HashingGroup::~HashingGroup()
+    {
+        wait();
+    }
+
+    void HashingGroup::submit(HashingPool *pool, std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending++;
+        }
+
+        pool->submit([this, job]() -> void {
+            job();
+
+            std::lock_guard<std::mutex> lock(pending_mutex);
+
+            if (--pending == 0)
+                pending_cv.notify_all();
+        });
+    }
+
+    void HashingGroup::wait()
+    {
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        pending_cv.wait(lock, [this]() -> bool { return pending == 0; });
+    }
+}
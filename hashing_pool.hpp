@@ -0,0 +1,66 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+namespace SimpicServerLib
+{
+    /* A fixed set of worker threads shared by every client, so that the expensive part of serving a request (reading, SHA256 hashing and decoding files for their perceptual hash) is spread over the cores without every client spawning its own threads. */
+    class HashingPool
+    {
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> jobs;
+        std::deque<std::function<void()>> background_jobs;
+
+        std::mutex jobs_mutex;
+        std::condition_variable jobs_cv;
+        bool stopping;
+
+        /* Background jobs only ever get some of the workers, so there's always one left for clients. */
+        unsigned int background_running;
+        unsigned int background_limit;
+
+        void work();
+
+    public:
+        HashingPool(unsigned int threads);
+        ~HashingPool();
+
+        /* Queue a job for any of the workers. Jobs must not throw. Background jobs (e.g., warming the cache) only run when no other job is waiting, and on at most half of the workers. */
+        void submit(std::function<void()> job, bool background = false);
+
+        /* One worker per core, but at least one. */
+        static unsigned int default_size();
+    };
+
+    /* Keeps track of a batch of jobs submitted to the pool, so that whoever submitted them can wait for all of them to finish (e.g., before a client's request is considered done). */
+    class HashingGroup
+    {
+    private:
+        std::mutex pending_mutex;
+        std::condition_variable pending_cv;
+        int pending;
+
+    public:
+        HashingGroup();
+
+        /* Waits for every job submitted through this group, so that none outlives whatever it refers to, even if the submitter is unwound by an exception. */
+        ~HashingGroup();
+
+        HashingGroup(const HashingGroup&) = delete;
+        HashingGroup &operator=(const HashingGroup&) = delete;
+
+        /* Submit a job to the pool as part of this group. */
+        void submit(HashingPool *pool, std::function<void()> job);
+
+        /* Block until every job submitted through this group has finished. */
+        void wait();
+    };
+}
@@ -1,12 +1,24 @@
 #include "images.hpp"
+#include "decoders.hpp"
+#include "dihedral.hpp"
 
 namespace SimpicServerLib 
 {
-    uint64_t Image::compute_perceptual_hash(std::string &path, std::string &filename)
+    std::optional<uint64_t> Image::compute_perceptual_hash(std::string &path, std::string &filename)
     {
-        uint64_t value;
-        ph_dct_imagehash(concatenate_folder(path, filename).c_str(), value);
-        return value; 
+        std::string source = concatenate_folder(path, filename);
+        std::FILE *fp = std::fopen(source.c_str(), "rb");
+
+        if (!fp)
+            return std::nullopt;
+
+        std::optional<std::vector<uint64_t>> hashes = DecoderRegistry::builtin().hash(fp, source, 0, 0, false);
+        std::fclose(fp);
+
+        if (!hashes)
+            return std::nullopt;
+
+        return (*hashes)[0];
     }
 
     ImageType Image::type_from_extension(const std::string &extension)
@@ -17,98 +29,257 @@ namespace SimpicServerLib
         if (extension == "jpg" || extension == "jpeg")
             return ImageType::JPEG;
 
+        if (extension == "gif")
+            return ImageType::GIF;
+
+        if (extension == "webp")
+            return ImageType::WebP;
+
+        if (extension == "tif" || extension == "tiff")
+            return ImageType::TIFF;
+
         return ImageType::Undefined;
     }
 
+    ImageType Image::type_from_magic(const uint8_t *header, size_t length)
+    {
+        if (length >= sizeof(PNG_MAGIC) && !std::memcmp(header, PNG_MAGIC, sizeof(PNG_MAGIC)))
+            return ImageType::PNG;
+
+        /* Every JPEG starts with the SOI marker followed by another marker, regardless of EXIF/JFIF. */
+        if (length >= sizeof(JPEG_MAGIC) && !std::memcmp(header, JPEG_MAGIC, sizeof(JPEG_MAGIC)))
+            return ImageType::JPEG;
 
-    std::optional<std::pair<uint16_t, uint16_t>> Image::get_png_dimensions(std::FILE *fp)
+        if (length >= sizeof(GIF89_MAGIC) && (!std::memcmp(header, GIF87_MAGIC, sizeof(GIF87_MAGIC)) ||
+                !std::memcmp(header, GIF89_MAGIC, sizeof(GIF89_MAGIC))))
+            return ImageType::GIF;
+
+        if (length >= 12 && !std::memcmp(header, RIFF_MAGIC, sizeof(RIFF_MAGIC)) &&
+                !std::memcmp(header + 8, WEBP_MAGIC, sizeof(WEBP_MAGIC)))
+            return ImageType::WebP;
+
+        if (length >= sizeof(TIFF_LE_MAGIC) && (!std::memcmp(header, TIFF_LE_MAGIC, sizeof(TIFF_LE_MAGIC)) ||
+                !std::memcmp(header, TIFF_BE_MAGIC, sizeof(TIFF_BE_MAGIC))))
+            return ImageType::TIFF;
+
+        return ImageType::Undefined;
+    }
+
+    ImageType Image::type_from_magic(std::FILE *fp)
     {
-        uint32_t width;
-        uint32_t height;
+        uint8_t header[IMAGE_SNIFF_LENGTH];
 
-        char magic[8];
         std::fseek(fp, 0, SEEK_SET);
-        std::fread(magic, 1, sizeof(magic), fp);
+        size_t amnt = std::fread(header, 1, sizeof(header), fp);
+        std::fseek(fp, 0, SEEK_SET);
 
-        if (png_sig_cmp((png_const_bytep)magic, 0, sizeof(8)))
-        {
-            std::cerr << "libPNG: Invalid image\n";
-            return std::nullopt;
-        }
+        return type_from_magic(header, amnt);
+    }
 
-        /*
-        png_error_ptr handler = [](png_structp data, png_const_charp other) -> void {
-            std::cerr << "libPNG error: " << std::endl;
-            //*((png_structp*)other) = nullptr;
-        };
-        */
-        
-        png_structp png = png_create_read_struct(
-            PNG_LIBPNG_VER_STRING, 
-            (void*)&png, 
-            nullptr, 
-            nullptr
-        );
-
-        png_set_sig_bytes(png, 8);
-
-        if (png == nullptr)
+    static uint32_t big_endian(const uint8_t *bytes, int count)
+    {
+        uint32_t value = 0;
+
+        for (int i = 0; i < count; i++)
+            value = (value << 8) | bytes[i];
+
+        return value;
+    }
+
+    static uint32_t little_endian(const uint8_t *bytes, int count)
+    {
+        uint32_t value = 0;
+
+        for (int i = count - 1; i >= 0; i--)
+            value = (value << 8) | bytes[i];
+
+        return value;
+    }
+
+    /* The IHDR chunk always comes first, right after the signature: its width and height are big-endian. */
+    static std::optional<std::pair<uint32_t, uint32_t>> png_dimensions(const uint8_t *header, size_t length)
+    {
+        if (length < 24 || std::memcmp(header + 12, "IHDR", 4))
             return std::nullopt;
 
-        if (setjmp(png_jmpbuf(png)))
-        {
-            std::cerr << "libPNG failed to read image\n";
+        return std::make_pair(big_endian(header + 16, 4), big_endian(header + 20, 4));
+    }
+
+    /* The logical screen descriptor, right after the signature. */
+    static std::optional<std::pair<uint32_t, uint32_t>> gif_dimensions(const uint8_t *header, size_t length)
+    {
+        if (length < 10)
             return std::nullopt;
-        }
 
-        png_infop info = png_create_info_struct(png);
+        return std::make_pair(little_endian(header + 6, 2), little_endian(header + 8, 2));
+    }
 
-        if (info == nullptr)
+    /* The first chunk is a lossy (VP8), lossless (VP8L) or extended (VP8X) one, each with the size somewhere else. */
+    static std::optional<std::pair<uint32_t, uint32_t>> webp_dimensions(const uint8_t *header, size_t length)
+    {
+        if (length < 30)
             return std::nullopt;
 
-        png_init_io(png, fp);
-        png_read_info(png, info);
+        const uint8_t *chunk = header + 12;
+
+        /* After the 3-byte frame tag and the start code of a key frame, two 14-bit sizes. */
+        if (!std::memcmp(chunk, "VP8 ", 4) && header[23] == 0x9D && header[24] == 0x01 && header[25] == 0x2A)
+            return std::make_pair(little_endian(header + 26, 2) & 0x3FFF, little_endian(header + 28, 2) & 0x3FFF);
+
+        /* After the signature byte, the width and height less one, 14 bits each. */
+        if (!std::memcmp(chunk, "VP8L", 4) && header[20] == 0x2F)
+        {
+            uint32_t bits = little_endian(header + 21, 4);
+            return std::make_pair((bits & 0x3FFF) + 1, ((bits >> 14) & 0x3FFF) + 1);
+        }
 
-        width = png_get_image_width(png, info);
-        height = png_get_image_height(png, info);
+        /* The canvas width and height less one, 24 bits each. */
+        if (!std::memcmp(chunk, "VP8X", 4))
+            return std::make_pair(little_endian(header + 24, 3) + 1, little_endian(header + 27, 3) + 1);
 
-        png_destroy_read_struct(&png, &info, nullptr);
-        return std::make_pair<uint16_t, uint16_t>((uint16_t) width, (uint16_t) height);
+        return std::nullopt;
     }
 
-    std::optional<std::pair<uint16_t, uint16_t>> Image::get_jpeg_dimensions(std::FILE *fp)
+    /* Skip from segment to segment (by their lengths) until the start of the frame (SOFn), which has the height and the width. */
+    static std::optional<std::pair<uint32_t, uint32_t>> jpeg_dimensions(std::FILE *fp)
     {
-        /* Read in the magic. */
-        char enough[sizeof(JPEG_EXIF_MAGIC)];
-        std::fseek(fp, 0, SEEK_SET);
-        std::fread(enough, 1, sizeof(enough), fp);
+        std::fseek(fp, 2, SEEK_SET);
 
-        /* Check if the magic aligns with a valid JPEG file. There are generally two magics. */
-        /* If it doesn't, return a null value. */
-        if (!!std::memcmp(enough, JPEG_EXIF_MAGIC, sizeof(JPEG_EXIF_MAGIC)) || 
-                !!std::memcmp(enough, JPEG_MAGIC, sizeof(JPEG_MAGIC)))
+        while (true)
         {
-            return std::nullopt; // null std::optional<T> value. 
+            if (std::fgetc(fp) != 0xFF)
+                return std::nullopt;
+
+            /* A marker may be padded with any number of 0xFF. */
+            int marker;
+
+            do
+            {
+                marker = std::fgetc(fp);
+            }
+            while (marker == 0xFF);
+
+            if (marker == EOF)
+                return std::nullopt;
+
+            /* TEM and RSTn are on their own, without a segment. */
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+                continue;
+
+            /* The image ended, or its data started, without a frame. */
+            if (marker == 0xD8 || marker == 0xD9 || marker == 0xDA)
+                return std::nullopt;
+
+            /* The length (which counts itself), then for SOFn the precision, the height and the width. */
+            uint8_t segment[7];
+
+            if (std::fread(segment, 1, 2, fp) != 2)
+                return std::nullopt;
+
+            uint32_t length = big_endian(segment, 2);
+
+            if (length < 2)
+                return std::nullopt;
+
+            /* C4 (DHT), C8 (JPG) and CC (DAC) aren't frames. */
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+            {
+                if (length < 7 || std::fread(segment + 2, 1, 5, fp) != 5)
+                    return std::nullopt;
+
+                return std::make_pair(big_endian(segment + 5, 2), big_endian(segment + 3, 2));
+            }
+
+            if (std::fseek(fp, length - 2, SEEK_CUR) != 0)
+                return std::nullopt;
         }
+    }
 
-        std::fseek(fp, 0, SEEK_SET);
+    /* ImageWidth (256) and ImageLength (257) in the first IFD, wherever the header says it is. */
+    static std::optional<std::pair<uint32_t, uint32_t>> tiff_dimensions(const uint8_t *header, size_t length, std::FILE *fp)
+    {
+        if (length < 8)
+            return std::nullopt;
 
-        uint32_t height;
-        uint32_t width;
+        bool little = header[0] == 'I';
 
-        struct jpeg_decompress_struct jpeginfo;
-        jpeg_create_decompress(&jpeginfo);
-        jpeg_stdio_src(&jpeginfo, fp);
+        auto word = [little](const uint8_t *bytes, int count) -> uint32_t {
+            return little ? little_endian(bytes, count) : big_endian(bytes, count);
+        };
 
-        jpeg_read_header(&jpeginfo, true);
+        uint8_t count_bytes[2];
 
-        height = jpeginfo.image_height;
-        width = jpeginfo.image_width;
+        if (std::fseek(fp, word(header + 4, 4), SEEK_SET) != 0 || std::fread(count_bytes, 1, 2, fp) != 2)
+            return std::nullopt;
+
+        /* Every entry is 12 bytes: the tag, the type, the count and the value (if it fits). */
+        std::vector<uint8_t> entries(word(count_bytes, 2) * 12);
+
+        if (std::fread(entries.data(), 1, entries.size(), fp) != entries.size())
+            return std::nullopt;
+
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        for (size_t at = 0; at < entries.size(); at += 12)
+        {
+            uint32_t tag = word(&entries[at], 2);
+            uint32_t type = word(&entries[at + 2], 2);
+
+            /* SHORT or LONG. */
+            if (type != 3 && type != 4)
+                continue;
+
+            uint32_t value = type == 3 ? word(&entries[at + 8], 2) : word(&entries[at + 8], 4);
+
+            if (tag == 256)
+                width = value;
+            else if (tag == 257)
+                height = value;
+        }
 
-        jpeg_finish_decompress(&jpeginfo);
-        return std::make_pair<uint16_t, uint16_t>((uint16_t) width, (uint16_t) height);
+        return std::make_pair(width, height);
     }
 
+    std::optional<std::pair<uint16_t, uint16_t>> Image::get_dimensions(ImageType type, const uint8_t *header, size_t length,
+            std::FILE *fp)
+    {
+        std::optional<std::pair<uint32_t, uint32_t>> dims;
+
+        switch (type)
+        {
+            case ImageType::PNG:
+                dims = png_dimensions(header, length);
+                break;
+
+            case ImageType::JPEG:
+                dims = jpeg_dimensions(fp);
+                break;
+
+            case ImageType::GIF:
+                dims = gif_dimensions(header, length);
+                break;
+
+            case ImageType::WebP:
+                dims = webp_dimensions(header, length);
+                break;
+
+            case ImageType::TIFF:
+                dims = tiff_dimensions(header, length, fp);
+                break;
+
+            default:
+                break;
+        }
+
+        std::fseek(fp, 0, SEEK_SET);
+
+        if (!dims || dims->first == 0 || dims->second == 0)
+            return std::nullopt;
+
+        return std::make_pair((uint16_t) std::min<uint32_t>(dims->first, UINT16_MAX),
+                              (uint16_t) std::min<uint32_t>(dims->second, UINT16_MAX));
+    }
 
     std::vector<std::vector<Image*>*> Image::find_similar_images(std::vector<Image*> &images, 
             uint8_t max_ham, std::function<void(int)> progress_callback)
@@ -136,9 +307,9 @@ namespace SimpicServerLib
                 //if (seen.find(j) != seen.end())
                 //    continue;
 
-                uint8_t hamming_distance = ph_hamming_distance(current->phash, images[j]->phash);
+                uint8_t distance = hamming_distance(current->phash, images[j]->phash);
 
-                if (hamming_distance > max_ham)
+                if (distance > max_ham)
                     continue;
 
                 count++;
@@ -179,7 +350,7 @@ namespace SimpicServerLib
 
             for (Image *img2 : haystack)
             {
-                if (ph_hamming_distance(img->phash, img2->phash) > max_ham)
+                if (hamming_distance(img->phash, img2->phash) > max_ham)
                     continue;
 
                 vec->push_back(img2);
@@ -191,6 +362,35 @@ namespace SimpicServerLib
         return results;
     }
 
+    std::vector<std::vector<std::pair<Image*, uint8_t>>> Image::find_nearest(std::vector<Image*> &haystack,
+                                                                            std::vector<Image*> &needles,
+                                                                            size_t k)
+    {
+        std::vector<DCTHash> hashes;
+        hashes.reserve(haystack.size());
+
+        for (Image *img : haystack)
+            hashes.push_back(img->phash);
+
+        /* Built once for every needle. */
+        HammingIndex<DCTHash> index(hashes);
+        std::vector<std::vector<std::pair<Image*, uint8_t>>> results;
+
+        for (Image *needle : needles)
+        {
+            std::vector<std::pair<Image*, uint8_t>> nearest;
+
+            for (auto &[id, distance] : index.nearest(needle->phash, k, [&haystack, needle](uint32_t id) -> bool {
+                        return haystack[id] != needle;
+                    }))
+                nearest.push_back({haystack[id], (uint8_t) distance});
+
+            results.push_back(nearest);
+        }
+
+        return results;
+    }
+
     void Image::add_name(std::string name)
     {
         filename = name;
@@ -221,40 +421,87 @@ namespace SimpicServerLib
         std::memcpy(sha256, hash, SHA256_DIGEST_LENGTH);
     }
 
+    Image::Image(FILE *fp, sha256ptr_t hash)
+    {
+        width = 0;
+        height = 0;
+        phash = 0;
+
+        bad = false;
+        needle = false;
+        type = ImageType::Undefined;
+
+        std::fseek(fp, 0, SEEK_END);
+        length = std::ftell(fp);
+        std::fseek(fp, 0, SEEK_SET);
+
+        std::memcpy(sha256, hash, SHA256_DIGEST_LENGTH);
+    }
+
     bool Image::get_info(std::FILE *fp)
     {
-        switch (type)
+        return get_info(fp, abspath());
+    }
+
+    bool Image::decoded_differently(std::FILE *fp)
+    {
+        uint8_t header[IMAGE_SNIFF_LENGTH];
+
+        std::fseek(fp, 0, SEEK_SET);
+        size_t amnt = std::fread(header, 1, sizeof(header), fp);
+        std::fseek(fp, 0, SEEK_SET);
+
+        switch (Image::type_from_magic(header, amnt))
         {
+            case ImageType::GIF:
+                return true;
+
+            /* The bit depth follows the width and height in the IHDR chunk. */
             case ImageType::PNG:
-            {
-                std::optional<std::pair<uint16_t, uint16_t>> dims = Image::get_png_dimensions(fp);
+                return amnt > 24 && header[24] == 16;
 
-                if (!dims)
-                    return false;
+            default:
+                return false;
+        }
+    }
 
-                std::tie(this->width, this->height) = *dims;
-                break;
-            }
+    bool Image::get_header(std::FILE *fp)
+    {
+        uint8_t header[IMAGE_SNIFF_LENGTH];
 
-            case ImageType::JPEG:
-            {
-                std::optional<std::pair<uint16_t, uint16_t>> dims = Image::get_jpeg_dimensions(fp);
+        std::fseek(fp, 0, SEEK_SET);
+        size_t amnt = std::fread(header, 1, sizeof(header), fp);
 
-                if (!dims)
-                    return false;
+        /* Whatever the file is called, its contents say what it is. */
+        type = Image::type_from_magic(header, amnt);
 
-                std::tie(this->width, this->height) = *dims;
-                break;
-            }
+        std::optional<std::pair<uint16_t, uint16_t>> dims = Image::get_dimensions(type, header, amnt, fp);
 
-            default:
-            {
-                bad = true;
-                return false;
-            }
+        if (!dims)
+        {
+            bad = true;
+            return false;
         }
 
-        phash = Image::compute_perceptual_hash(path, filename);
+        std::tie(this->width, this->height) = *dims;
+        return true;
+    }
+
+    bool Image::get_info(std::FILE *fp, const std::string &source, const std::string &thumbnail)
+    {
+        if (!get_header(fp))
+            return false;
+
+        /* The header says how big it is, which helps to pick the decoder, and rules out those that would need too much memory for it. */
+        std::optional<std::vector<uint64_t>> hashes = DecoderRegistry::builtin().hash(fp, source, width, height, false, thumbnail);
+
+        if (!hashes)
+        {
+            bad = true;
+            return false;
+        }
+
+        phash = (*hashes)[0];
         return true;
     }
 
@@ -262,4 +509,217 @@ namespace SimpicServerLib
     {
         return concatenate_folder(path, filename);
     }
+
+    std::string Location::abspath() const
+    {
+        std::string result(path);
+
+        result += "/";
+        result += filename;
+
+        return result;
+    }
+
+    ImageRecords::ImageRecords()
+    {
+        records = nullptr;
+        count = 0;
+        capacity = 0;
+    }
+
+    uint32_t ImageRecords::intern(std::string_view string)
+    {
+        return strings.intern(arena, string);
+    }
+
+    std::string_view ImageRecords::string(uint32_t id) const
+    {
+        return strings.get(id);
+    }
+
+    uint32_t ImageRecords::add(const Image &img, uint32_t path, uint32_t filename)
+    {
+        /* The old array stays in the arena until it goes: half of what there is at most. */
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            ImageRecord *grown = arena.allocate<ImageRecord>(capacity);
+
+            if (count != 0)
+                std::memcpy(grown, records, sizeof(ImageRecord) * count);
+
+            records = grown;
+        }
+
+        ImageRecord &record = records[count];
+        std::memcpy(record.sha256, img.sha256, SHA256_DIGEST_LENGTH);
+        record.phash = img.phash;
+        record.length = img.length;
+        record.width = img.width;
+        record.height = img.height;
+        record.path = path;
+        record.filename = filename;
+
+        return count++;
+    }
+
+    uint32_t ImageRecords::add(const Image &img, Location where)
+    {
+        uint32_t path_id = intern(where.path);
+        return add(img, path_id, intern(where.filename));
+    }
+
+    uint32_t ImageRecords::add(const ImageRecords &other, uint32_t id)
+    {
+        Image img;
+        const ImageRecord &record = other[id];
+
+        std::memcpy(img.sha256, record.sha256, SHA256_DIGEST_LENGTH);
+        img.phash = record.phash;
+        img.length = record.length;
+        img.width = record.width;
+        img.height = record.height;
+
+        return add(img, other.location(id));
+    }
+
+    uint32_t ImageRecords::size() const
+    {
+        return count;
+    }
+
+    const ImageRecord &ImageRecords::operator[](uint32_t id) const
+    {
+        return records[id];
+    }
+
+    std::string_view ImageRecords::path(uint32_t id) const
+    {
+        return strings.get(records[id].path);
+    }
+
+    std::string_view ImageRecords::filename(uint32_t id) const
+    {
+        return strings.get(records[id].filename);
+    }
+
+    std::string ImageRecords::abspath(uint32_t id) const
+    {
+        return location(id).abspath();
+    }
+
+    Location ImageRecords::location(uint32_t id) const
+    {
+        return {path(id), filename(id)};
+    }
+
+    Image ImageRecords::image(uint32_t id) const
+    {
+        Image img;
+        const ImageRecord &record = records[id];
+
+        img.bad = false;
+        img.needle = false;
+        img.width = record.width;
+        img.height = record.height;
+        img.length = record.length;
+        img.phash = record.phash;
+        img.path = std::string(path(id));
+        img.filename = std::string(filename(id));
+        img.extension = get_extension(img.filename);
+        img.type = Image::type_from_extension(img.extension);
+        std::memcpy(img.sha256, record.sha256, SHA256_DIGEST_LENGTH);
+
+        return img;
+    }
+
+    std::vector<uint32_t> ImageRecords::all() const
+    {
+        std::vector<uint32_t> ids(count);
+
+        for (uint32_t id = 0; id < count; id++)
+            ids[id] = id;
+
+        return ids;
+    }
+
+    SetList ImageRecords::group_by_sha256(const std::vector<uint32_t> &ids) const
+    {
+        /* Positions in ids, by hash and then by position: each hash is a run, in order. */
+        std::vector<uint32_t> order(ids.size());
+
+        for (uint32_t i = 0; i < ids.size(); i++)
+            order[i] = i;
+
+        std::sort(order.begin(), order.end(), [this, &ids](uint32_t a, uint32_t b) -> bool {
+            int compared = std::memcmp(records[ids[a]].sha256, records[ids[b]].sha256, SHA256_DIGEST_LENGTH);
+            return compared != 0 ? compared < 0 : a < b;
+        });
+
+        std::vector<uint32_t> runs;
+
+        for (uint32_t k = 0; k < order.size(); k++)
+        {
+            if (k == 0 || std::memcmp(records[ids[order[k - 1]]].sha256, records[ids[order[k]]].sha256, SHA256_DIGEST_LENGTH) != 0)
+                runs.push_back(k);
+        }
+
+        /* The runs in the order of their first image. */
+        std::vector<uint32_t> by_first(runs.size());
+
+        for (uint32_t r = 0; r < runs.size(); r++)
+            by_first[r] = r;
+
+        std::sort(by_first.begin(), by_first.end(), [&order, &runs](uint32_t a, uint32_t b) -> bool {
+            return order[runs[a]] < order[runs[b]];
+        });
+
+        SetList groups;
+        groups.members.reserve(ids.size());
+        groups.offsets.reserve(runs.size() + 1);
+
+        for (uint32_t r : by_first)
+        {
+            uint32_t end = r + 1 < runs.size() ? runs[r + 1] : order.size();
+
+            for (uint32_t k = runs[r]; k < end; k++)
+                groups.push(ids[order[k]]);
+
+            groups.end_set();
+        }
+
+        return groups;
+    }
+
+    SetList ImageRecords::find_similar(const std::vector<uint32_t> &ids, uint8_t max_ham,
+            std::function<void(int)> progress_callback) const
+    {
+        SetList result;
+        int found = 0;
+
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            uint64_t phash = records[ids[i]].phash;
+            result.push(ids[i]);
+
+            for (size_t j = i + 1; j < ids.size(); j++)
+            {
+                if (hamming_distance(phash, records[ids[j]].phash) > max_ham)
+                    continue;
+
+                result.push(ids[j]);
+                found++;
+            }
+
+            if (found != 0)
+                progress_callback(found);
+
+            if (result.pending() < 2)
+                result.discard_set();
+            else
+                result.end_set();
+        }
+
+        return result;
+    }
 }
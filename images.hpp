@@ -15,23 +15,19 @@
 #include <optional>
 
 #include <openssl/sha.h>
-#include <png.h>
-#include <jpeglib.h>
 
 #include "sha256.hpp"
 #include "phash/pHash.h"
+#include "hamming_index.hpp"
+#include "arena.hpp"
 #include "utils.hpp"
 
+#include "config.hpp"
+
 namespace SimpicServerLib
 {
-    const uint8_t JPEG_EXIF_MAGIC[12] = {
-        0xFF, 0xD8, 0xFF, 0xE0, 
-        0x00, 0x10, 0x4A, 0x46,
-        0x49, 0x46, 0x00, 0x01
-    };
-
-    const uint8_t JPEG_MAGIC[4] = {
-        0xFF, 0xD8, 0xFF, 0xDB
+    const uint8_t JPEG_MAGIC[3] = {
+        0xFF, 0xD8, 0xFF
     };
 
     const uint8_t PNG_MAGIC[] = {
@@ -39,14 +35,28 @@ namespace SimpicServerLib
         0x0D, 0x0A, 0x1A, 0x0A
     };
 
+    const uint8_t GIF87_MAGIC[6] = {'G', 'I', 'F', '8', '7', 'a'};
+    const uint8_t GIF89_MAGIC[6] = {'G', 'I', 'F', '8', '9', 'a'};
+
+    /* "RIFF", the size of the file, then "WEBP". */
+    const uint8_t RIFF_MAGIC[4] = {'R', 'I', 'F', 'F'};
+    const uint8_t WEBP_MAGIC[4] = {'W', 'E', 'B', 'P'};
+
+    /* Little-endian ("II") and big-endian ("MM") TIFF, each followed by 42 in its byte order. */
+    const uint8_t TIFF_LE_MAGIC[4] = {'I', 'I', 0x2A, 0x00};
+    const uint8_t TIFF_BE_MAGIC[4] = {'M', 'M', 0x00, 0x2A};
+
     enum class ImageType
     {
         PNG,
         JPEG,
         GIF,
+        WebP,
+        TIFF,
         Undefined // <~~ The file isn't a supported file type.
     };
 
+    /* An image's contents, and, for one that isn't cached, where it is. What the cache has is the contents alone (no path or filename), shared by every request and never changed once it is in: where each request found it is that request's own, as a Location (or in its ImageRecords). */
     class Image
     {
     public:
@@ -67,17 +77,24 @@ namespace SimpicServerLib
         
         sha256_t sha256[SHA256_DIGEST_LENGTH];
 
-        /* Given an extension (without the .), return the image type. Note: this is a vulnerability/weakness to the simpic_server program--we aren't actually checking MAGIC numbers of the files to determine type, just the extension... perhaps we should just check the magic number? */
+        /* Given an extension (without the .), return the image type. This only decides which files are looked at as images at all: what they are is up to type_from_magic(). */
         static ImageType type_from_extension(const std::string &extension);
 
-        /* Returns a pair containing the width and height of a .png file, from a C FILE* to it.*/
-        static std::optional<std::pair<uint16_t, uint16_t>> get_png_dimensions(std::FILE *fp);
+        /* Determine the image type from the magic number in the first bytes of the file (IMAGE_SNIFF_LENGTH of them are always enough), whatever it is called. */
+        static ImageType type_from_magic(const uint8_t *header, size_t length);
 
-        /* Returns a pair containing the width and height of a .jpg/.jpeg file, from a C FILE* to it. */
-        static std::optional<std::pair<uint16_t, uint16_t>> get_jpeg_dimensions(std::FILE *fp);
+        /* The same, reading the first bytes of the file. The file position is reset to the start. */
+        static ImageType type_from_magic(std::FILE *fp);
 
-        /* Returns a uint64_t (an 8 byte, 64 bit) perceptual image hash of a path and a filename. */
-        static uint64_t compute_perceptual_hash(std::string &path, std::string &filename);
+        /* The width and height of an image of the given type, straight from its header, without a decoder: the IHDR chunk of a PNG, the logical screen descriptor of a GIF and the VP8/VP8L/VP8X header of a WebP are all within the first bytes (header, as read for type_from_magic()); a JPEG's SOFn segment and a TIFF's first IFD are found by seeking through fp. Sizes that don't fit are clamped to 65535. */
+        static std::optional<std::pair<uint16_t, uint16_t>> get_dimensions(ImageType type, const uint8_t *header, size_t length,
+                                                                            std::FILE *fp);
+
+        /* Whether the DecoderRegistry decodes the file to different pixels from pHash's own decode, so that its hash differs from one pHash made: a GIF (ImageMagick's frame against the registry's) or a 16-bit PNG (scaled, rather than cut, to 8 bits). The file position is reset to the start. */
+        static bool decoded_differently(std::FILE *fp);
+
+        /* Returns a uint64_t (an 8 byte, 64 bit) perceptual image hash of a path and a filename (pHash's DCT hash, with the image decoded by the cheapest decoder in the DecoderRegistry that can), or nothing if it can't be decoded. */
+        static std::optional<uint64_t> compute_perceptual_hash(std::string &path, std::string &filename);
 
         /* Group all similar images together. */
         static std::vector<std::vector<Image*>*> find_similar_images(std::vector<Image*> &images, 
@@ -89,22 +106,104 @@ namespace SimpicServerLib
                                                                 std::vector<Image*> &needles,
                                                                 uint8_t max_ham);
 
+        /* For each needle, the k images of the haystack with the closest perceptual hashes (and how many bits away they are), closest first, however far away they are. A needle is never its own neighbour. */
+        static std::vector<std::vector<std::pair<Image*, uint8_t>>> find_nearest(std::vector<Image*> &haystack,
+                                                                                std::vector<Image*> &needles,
+                                                                                size_t k);
+
         /* If there isn't a name to this Image, add a name by value. */
         void add_name(std::string name);
 
         /* Initializes an Image object, getting its extension, and file type. This does not get the image dimensions, nor does it get the perceptual hash. */
         Image(std::string _directory, std::string _filename, std::FILE *fp, sha256ptr_t hash);
 
-		void set_location(std::string path, std::string filename);
-        
+        /* The same, for the contents of a file alone, as the cache keeps them. */
+        Image(std::FILE *fp, sha256ptr_t hash);
 
         /* Bare bones initialization of an image. Useful if using as a structure moreso. */
         Image();
 
-        /* Gets the information that the constructor of this object did not get, like the perceptual hash value and the dimensions of the image. This function returns nothing, but populates this class with the relevant information. It is more convenient to use C-style file handling. */
+        /* Gets the type and the dimensions alone, from the header, without decoding anything (so no perceptual hash). Returns false (and sets bad) if it isn't a supported image. */
+        bool get_header(std::FILE *fp);
+
+        /* Gets the information that the constructor of this object did not get, like the perceptual hash value and the dimensions of the image. The type is sniffed again from the contents, so a misnamed file is still read as what it is. Returns false (and sets bad) if it isn't a supported image or can't be hashed. It is more convenient to use C-style file handling. */
         bool get_info(std::FILE *fp);
 
+        /* The same, for an Image with no location: source is only what the decoders call the file. Given a thumbnail path, a thumbnail is written there from the same decode (see DecoderRegistry::hash()). */
+        bool get_info(std::FILE *fp, const std::string &source, const std::string &thumbnail = "");
+
         /* Useless function*/
         std::string abspath();
     };
+
+    /* Where one request found a file: views of strings that request keeps (in its ImageRecords, mostly), so that a cached Image never has to say where it is. */
+    struct Location
+    {
+        std::string_view path;
+        std::string_view filename;
+
+        std::string abspath() const;
+    };
+
+    /* An image where a scan found it, as a plain record with nothing to free: its contents (as the cached Image has them) and where it is, as ids in the StringTable of the ImageRecords it is in. */
+    struct ImageRecord
+    {
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+        uint64_t phash;
+        uint32_t length;
+        uint16_t width;
+        uint16_t height;
+        uint32_t path;
+        uint32_t filename;
+    };
+
+    /* The images of one scan (or request), known by their id (their place in it), in one array in an arena along with their paths and filenames, interned, instead of an Image and its strings each on the heap. They all go at once, with it. */
+    class ImageRecords
+    {
+    private:
+        Arena arena;
+        StringTable strings;
+
+        ImageRecord *records;
+        uint32_t count;
+        uint32_t capacity;
+
+    public:
+        ImageRecords();
+
+        ImageRecords(const ImageRecords&) = delete;
+        ImageRecords &operator=(const ImageRecords&) = delete;
+
+        /* The id of a path or filename, for add(), and the other way around. */
+        uint32_t intern(std::string_view string);
+        std::string_view string(uint32_t id) const;
+
+        /* Add an image with the contents of img (a cached one, usually), at path/filename (ids from intern()), or at where. Returns its id. */
+        uint32_t add(const Image &img, uint32_t path, uint32_t filename);
+        uint32_t add(const Image &img, Location where);
+
+        /* Add a copy of one of another's images. */
+        uint32_t add(const ImageRecords &other, uint32_t id);
+
+        uint32_t size() const;
+
+        const ImageRecord &operator[](uint32_t id) const;
+
+        std::string_view path(uint32_t id) const;
+        std::string_view filename(uint32_t id) const;
+        std::string abspath(uint32_t id) const;
+        Location location(uint32_t id) const;
+
+        /* An Image of its own for one of them, for what keeps results beyond the request. */
+        Image image(uint32_t id) const;
+
+        /* Every id, in order. */
+        std::vector<uint32_t> all() const;
+
+        /* Group the images (given by id) with the same SHA256 hash (byte-identical files) together, without a heap allocation for each. The groups (including those of one image) are in the order their first image appears in, and so are the images in each. */
+        SetList group_by_sha256(const std::vector<uint32_t> &ids) const;
+
+        /* Every image (given by id), followed by every image after it (in ids) within max_ham bits of it, like Image::find_similar_images(), in order. Sets with nothing but their first image aren't kept. The progress callback is given the number of pairs found so far. */
+        SetList find_similar(const std::vector<uint32_t> &ids, uint8_t max_ham, std::function<void(int)> progress_callback) const;
+    };
 }
@@ -0,0 +1,383 @@
+#include "jobs.hpp"
+
+namespace SimpicServerLib
+{
+    SimpicJobs::SimpicJobs(const std::string &_location, Scanner *_scanner)
+    {
+        location = _location;
+        scanner = _scanner;
+        next_id = 1;
+    }
+
+    SimpicJobs::~SimpicJobs()
+    {
+        for (auto &[key, value] : jobs)
+            delete value;
+    }
+
+    std::string SimpicJobs::path_for(uint32_t id)
+    {
+        return location + std::to_string(id) + SIMPIC_JOB_EXTENSION;
+    }
+
+    bool SimpicJobs::save(Job *job)
+    {
+        /* Write it elsewhere and rename() it into place, so a crash never leaves half a job. */
+        std::string destination = path_for(job->id);
+        std::string tmp = destination + ".tmp";
+        std::ofstream writing(tmp, std::ios::binary | std::ios::trunc);
+
+        struct job_file_header hdr;
+        hdr.magic = SIMPIC_JOB_MAGIC;
+        hdr.id = job->id;
+        hdr.request = (uint8_t) job->request;
+        hdr.max_ham = job->max_ham;
+        hdr.state = (uint8_t) job->state;
+        hdr._errno = job->error;
+        hdr.scanned = job->scanned;
+        hdr.exact_no = job->exact.size();
+        hdr.set_no = job->sets.size();
+        hdr.path_length = job->path.size() + 1;
+
+        writing.write((const char*) &hdr, sizeof(hdr));
+        writing.write(job->path.c_str(), hdr.path_length);
+
+        std::vector<std::vector<Image>> all = job->exact;
+        all.insert(all.end(), job->sets.begin(), job->sets.end());
+
+        for (std::vector<Image> &set : all)
+        {
+            uint16_t count = set.size();
+            writing.write((const char*) &count, sizeof(count));
+
+            for (Image &img : set)
+            {
+                struct job_image_entry ent;
+                std::memcpy(ent.sha256_hash, img.sha256, sizeof(ent.sha256_hash));
+                ent.width = img.width;
+                ent.height = img.height;
+                ent.size = img.length;
+                ent.filename_length = img.filename.size() + 1;
+                ent.path_length = img.path.size() + 1;
+
+                writing.write((const char*) &ent, sizeof(ent));
+                writing.write(img.filename.c_str(), ent.filename_length);
+                writing.write(img.path.c_str(), ent.path_length);
+            }
+        }
+
+        writing.close();
+
+        if (!writing || rename(tmp.c_str(), destination.c_str()) < 0)
+        {
+            std::cerr << "Failed to save job " << job->id << " to '" << destination << "'\n";
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    Job *SimpicJobs::load(const std::string &filename)
+    {
+        std::ifstream reading(filename, std::ios::binary);
+
+        struct job_file_header hdr;
+        reading.read((char*) &hdr, sizeof(hdr));
+
+        if (!reading || hdr.magic != SIMPIC_JOB_MAGIC || hdr.path_length == 0)
+            return nullptr;
+
+        std::string path(hdr.path_length, '\0');
+        reading.read(path.data(), hdr.path_length);
+        path.resize(hdr.path_length - 1);
+
+        Job *job = new Job();
+        job->id = hdr.id;
+        job->request = (ClientRequests) hdr.request;
+        job->max_ham = hdr.max_ham;
+        job->path = path;
+        job->state = (JobStates) hdr.state;
+        job->error = hdr._errno;
+        job->scanned = hdr.scanned;
+
+        for (uint64_t i = 0; i < (uint64_t) hdr.exact_no + hdr.set_no; i++)
+        {
+            uint16_t count = 0;
+            reading.read((char*) &count, sizeof(count));
+
+            std::vector<Image> set;
+
+            for (int j = 0; j < count; j++)
+            {
+                struct job_image_entry ent;
+                reading.read((char*) &ent, sizeof(ent));
+
+                if (!reading || ent.filename_length == 0 || ent.path_length == 0)
+                {
+                    delete job;
+                    return nullptr;
+                }
+
+                Image img;
+                std::memcpy(img.sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
+                img.width = ent.width;
+                img.height = ent.height;
+                img.length = ent.size;
+
+                img.filename.resize(ent.filename_length);
+                reading.read(img.filename.data(), ent.filename_length);
+                img.filename.resize(ent.filename_length - 1);
+
+                img.path.resize(ent.path_length);
+                reading.read(img.path.data(), ent.path_length);
+                img.path.resize(ent.path_length - 1);
+
+                set.push_back(img);
+            }
+
+            if (i < hdr.exact_no)
+                job->exact.push_back(set);
+            else
+                job->sets.push_back(set);
+        }
+
+        if (!reading)
+        {
+            delete job;
+            return nullptr;
+        }
+
+        return job;
+    }
+
+    void SimpicJobs::readall()
+    {
+        DIR *d = opendir(location.c_str());
+
+        if (d == nullptr)
+            return;
+
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+
+        for (struct dirent *ent = readdir(d); ent != nullptr; ent = readdir(d))
+        {
+            std::string name(ent->d_name);
+
+            if (name.size() <= std::strlen(SIMPIC_JOB_EXTENSION) ||
+                    name.compare(name.size() - std::strlen(SIMPIC_JOB_EXTENSION), std::string::npos, SIMPIC_JOB_EXTENSION))
+                continue;
+
+            Job *job = load(location + name);
+
+            if (job == nullptr)
+            {
+                std::cerr << "Ignoring corrupt job file '" << location + name << "'\n";
+                continue;
+            }
+
+            /* It was interrupted by the server going down: start it over. */
+            if (job->state == JobStates::Queued || job->state == JobStates::Running)
+            {
+                job->state = JobStates::Queued;
+                job->scanned = 0;
+                queue.push_back(job->id);
+            }
+
+            jobs[job->id] = job;
+            next_id = std::max(next_id, job->id + 1);
+        }
+
+        closedir(d);
+
+        /* Older jobs first. */
+        std::sort(queue.begin(), queue.end());
+    }
+
+    void SimpicJobs::start()
+    {
+        std::thread runner(&SimpicJobs::run, this);
+        runner.detach();
+    }
+
+    void SimpicJobs::run()
+    {
+        while (true)
+        {
+            Job *job = nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                queue_cv.wait(lock, [this]() -> bool { return !queue.empty(); });
+
+                std::map<uint32_t, Job*>::iterator it = jobs.find(queue.front());
+                queue.pop_front();
+
+                if (it == jobs.end())
+                    continue;
+
+                job = it->second;
+                job->state = JobStates::Running;
+            }
+
+            progress_cv.notify_all();
+            work(job);
+        }
+    }
+
+    void SimpicJobs::work(Job *job)
+    {
+        bool recursive = Scanner::is_recursive(job->request);
+
+        /* A job's results are images alone. */
+        std::shared_ptr<ScanFlight> flight = scanner->scan(job->path, job->request, (uint8_t) DataTypes::Image, [this, job](int count) -> void {
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex);
+                job->scanned = count;
+            }
+
+            progress_cv.notify_all();
+        });
+
+        int error = flight->error;
+        std::vector<std::vector<Image>> exact;
+        std::vector<std::vector<Image>> sets;
+
+        /* Copy them out of the flight, which goes away once everyone is done with it. */
+        auto copy = [&flight](const SetList &results, std::vector<std::vector<Image>> &to) -> void {
+            for (size_t i = 0; i < results.size(); i++)
+            {
+                std::vector<Image> set;
+
+                for (const uint32_t *id = results.begin(i); id != results.end(i); id++)
+                    set.push_back(flight->imgs.image(*id));
+
+                to.push_back(set);
+            }
+        };
+
+        if (error == 0 && (job->request == ClientRequests::Scan || job->request == ClientRequests::ScanRecursive))
+        {
+            copy(flight->exact_duplicates(job->path, recursive), exact);
+            copy(flight->find_similar(job->path, recursive, job->max_ham, [](int) -> void {}), sets);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+
+            job->exact = exact;
+            job->sets = sets;
+            job->error = error;
+            job->state = error == 0 ? JobStates::Done : JobStates::Failed;
+            save(job);
+        }
+
+        progress_cv.notify_all();
+    }
+
+    uint32_t SimpicJobs::submit(ClientRequests request, const std::string &path, uint8_t max_ham)
+    {
+        uint32_t id;
+
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+
+            Job *job = new Job();
+            job->id = id = next_id++;
+            job->request = request;
+            job->max_ham = max_ham;
+            job->path = path;
+            job->state = JobStates::Queued;
+            job->error = 0;
+            job->scanned = 0;
+
+            jobs[id] = job;
+            queue.push_back(id);
+            save(job);
+        }
+
+        queue_cv.notify_one();
+        return id;
+    }
+
+    JobStatus SimpicJobs::status_of(Job *job)
+    {
+        struct JobStatus st;
+        std::memset(&st, 0, sizeof(st));
+
+        if (job == nullptr)
+        {
+            st.state = (uint8_t) JobStates::Unknown;
+            return st;
+        }
+
+        st.state = (uint8_t) job->state;
+        st._errno = job->error;
+        st.scanned = job->scanned;
+        st.set_no = job->sets.size();
+
+        return st;
+    }
+
+    JobStatus SimpicJobs::status(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+
+        std::map<uint32_t, Job*>::iterator it = jobs.find(id);
+        return status_of(it == jobs.end() ? nullptr : it->second);
+    }
+
+    JobStatus SimpicJobs::wait_for_progress(uint32_t id, const JobStatus &last)
+    {
+        std::unique_lock<std::mutex> lock(jobs_mutex);
+
+        /* Don't flood the client with an update for every single file. */
+        progress_cv.wait(lock, [this, id, &last]() -> bool {
+            std::map<uint32_t, Job*>::iterator it = jobs.find(id);
+
+            if (it == jobs.end())
+                return true;
+
+            return (uint8_t) it->second->state != last.state ||
+                it->second->scanned >= last.scanned + UPDATE_INCREMENTS;
+        });
+
+        std::map<uint32_t, Job*>::iterator it = jobs.find(id);
+        return status_of(it == jobs.end() ? nullptr : it->second);
+    }
+
+    bool SimpicJobs::results(uint32_t id, std::vector<std::vector<Image>> &exact, std::vector<std::vector<Image>> &sets)
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+
+        std::map<uint32_t, Job*>::iterator it = jobs.find(id);
+
+        if (it == jobs.end() || it->second->state != JobStates::Done)
+            return false;
+
+        exact = it->second->exact;
+        sets = it->second->sets;
+        return true;
+    }
+
+    bool SimpicJobs::acknowledge(uint32_t id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+
+            std::map<uint32_t, Job*>::iterator it = jobs.find(id);
+
+            /* A job that is still running can't be taken away from under the runner. */
+            if (it == jobs.end() ||
+                    (it->second->state != JobStates::Done && it->second->state != JobStates::Failed))
+                return false;
+
+            delete it->second;
+            jobs.erase(it);
+            unlink(path_for(id).c_str());
+        }
+
+        progress_cv.notify_all();
+        return true;
+    }
+}
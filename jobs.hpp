@@ -0,0 +1,126 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "sha256.hpp"
+#include "simpic_protocol.hpp"
+#include "scanner.hpp"
+#include "images.hpp"
+#include "utils.hpp"
+
+#include "config.hpp"
+
+#define SIMPIC_JOB_MAGIC 0x10DEAD03
+#define SIMPIC_JOB_EXTENSION ".simpic_job"
+
+namespace SimpicServerLib
+{
+    /* File format of a job (one file per job, named after its id). */
+    struct __attribute__((__packed__)) job_file_header
+    {
+        uint32_t magic;
+        uint32_t id;
+        uint8_t request;
+        uint8_t max_ham;
+        uint8_t state;
+        uint8_t _errno;
+        uint32_t scanned;
+        uint32_t exact_no;
+        uint32_t set_no;
+        uint16_t path_length;
+        // path_length bytes for the null-terminated path, then exact_no + set_no sets (the exact
+        // duplicates first), each of which is a uint16_t count followed by count job_image_entrys.
+    };
+
+    struct __attribute__((__packed__)) job_image_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint16_t width;
+        uint16_t height;
+        uint32_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+        // followed by the null-terminated filename and path.
+    };
+
+    /* A Scan/Cache request that runs without being bound to a connection. */
+    struct Job
+    {
+        uint32_t id;
+        ClientRequests request;
+        uint8_t max_ham;
+        std::string path;
+
+        JobStates state;
+        uint8_t error;
+        uint32_t scanned;
+
+        /* Copies, not pointers into the cache: the results must not change under the client. */
+        std::vector<std::vector<Image>> exact; // byte-identical files.
+        std::vector<std::vector<Image>> sets;
+    };
+
+    /* Jobs run one at a time, in the order they were submitted, on their own thread. Every job is written to disk (by default in ~/.simpic/jobs/) when it is submitted and when it finishes, so its results outlive both the connection that submitted it and the server itself, until a client acknowledges them. */
+    class SimpicJobs
+    {
+    private:
+        std::string location;
+        Scanner *scanner;
+
+        std::map<uint32_t, Job*> jobs;
+        std::deque<uint32_t> queue;
+        uint32_t next_id;
+
+        std::mutex jobs_mutex;
+        std::condition_variable queue_cv;
+        std::condition_variable progress_cv;
+
+        std::string path_for(uint32_t id);
+
+        /* Both must be called with jobs_mutex held. */
+        bool save(Job *job);
+        JobStatus status_of(Job *job);
+
+        Job *load(const std::string &filename);
+        void run();
+        void work(Job *job);
+
+    public:
+        SimpicJobs(const std::string &_location, Scanner *_scanner);
+        ~SimpicJobs();
+
+        /* Read every job left on disk; unfinished ones are queued again. */
+        void readall();
+
+        /* Start running queued jobs in the background. */
+        void start();
+
+        /* Queue a job, returning its id. */
+        uint32_t submit(ClientRequests request, const std::string &path, uint8_t max_ham);
+
+        JobStatus status(uint32_t id);
+
+        /* Block until the job has made some progress since 'last' (or finished), then return its status. */
+        JobStatus wait_for_progress(uint32_t id, const JobStatus &last);
+
+        /* Copy the result sets of a finished job into 'exact' (byte-identical files) and 'sets'. Returns false if it isn't done. */
+        bool results(uint32_t id, std::vector<std::vector<Image>> &exact, std::vector<std::vector<Image>> &sets);
+
+        /* Forget a finished job and delete its file. Returns false if there's no such finished job. */
+        bool acknowledge(uint32_t id);
+    };
+}
@@ -0,0 +1,42 @@
+#include "library_index.hpp"
+
+namespace SimpicServerLib
+{
+    LibrarySnapshot::LibrarySnapshot(uint64_t _generation, const std::vector<const Image*> &_images,
+            const std::vector<DCTHash> &hashes) : index(hashes)
+    {
+        generation = _generation;
+        images = _images;
+    }
+
+    LibraryIndex::LibraryIndex(SimpicCache *_cache)
+    {
+        cache = _cache;
+    }
+
+    std::shared_ptr<LibrarySnapshot> LibraryIndex::get()
+    {
+        std::lock_guard<std::mutex> lock(current_mutex);
+
+        /* Read before looking at the cache: if it changes meanwhile, the next query rebuilds it again. */
+        uint64_t generation = cache->generation();
+
+        if (current != nullptr && current->generation == generation)
+            return current;
+
+        std::vector<const Image*> images = cache->all_images();
+        std::vector<DCTHash> hashes;
+        hashes.reserve(images.size());
+
+        for (const Image *img : images)
+            hashes.push_back(img->phash);
+
+        std::shared_ptr<LibrarySnapshot> snapshot = std::make_shared<LibrarySnapshot>(generation, images, hashes);
+
+        for (auto &[location, obj] : cache->all_locations())
+            snapshot->locations[std::string(obj->hash, SHA256_DIGEST_LENGTH)].push_back({location, obj});
+
+        current = snapshot;
+        return current;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <openssl/sha.h>
+
+#include "sha256.hpp"
+#include "images.hpp"
+#include "simpic_cache.hpp"
+#include "hamming_index.hpp"
+
+namespace SimpicServerLib
+{
+    /* Every image in the cache at some point in time, indexed by perceptual hash, along with every path each of them was last seen at. */
+    class LibrarySnapshot
+    {
+    public:
+        uint64_t generation;
+
+        std::vector<const Image*> images;
+        HammingIndex<DCTHash> index;
+
+        /* Keyed by the raw SHA256 hash. */
+        std::unordered_map<std::string, std::vector<std::pair<std::string, SHA256CachedObject*>>> locations;
+
+        LibrarySnapshot(uint64_t _generation, const std::vector<const Image*> &_images, const std::vector<DCTHash> &hashes);
+    };
+
+    /* Keeps an index over the whole cache around between requests, so that a query is a handful of bucket lookups instead of a pass over millions of images. It is only rebuilt (on the next query) once the cache has changed. */
+    class LibraryIndex
+    {
+    private:
+        SimpicCache *cache;
+
+        std::mutex current_mutex;
+        std::shared_ptr<LibrarySnapshot> current;
+
+    public:
+        LibraryIndex(SimpicCache *_cache);
+
+        /* The index as of now. It stays valid for as long as the caller holds onto it, even if it's rebuilt meanwhile. */
+        std::shared_ptr<LibrarySnapshot> get();
+    };
+}
@@ -23,7 +23,11 @@ void help()
     "-f, --force-delete             Don't move to a recycle bin, but completely delete.\n"
     "~~~~~~~^ not recommended.\n"
     "-r, --recycle-bin [PATH]       Set the recycle bin somewhere other than the default.\n"
-    "-c, --cache [PATH]             Change the default directory of the cache.\n";
+    "-c, --cache [PATH]             Change the default directory of the cache.\n"
+    "-w, --watch [PATH]             Keep the cache up to date for everything in PATH, in the background.\n"
+    "~~~~~~~^ can be given more than once.\n"
+    "-d, --decoder-workers [N]      Decode images in N processes of their own, so that a file that crashes a decoder doesn't crash the server. Default: 0 (off)\n"
+    "-m, --library-memory [MB]      Dedupe the library out of core, in no more than MB megabytes, spilling the rest to disk. Default: 0 (in memory)\n";
 
     std::cout << msg << std::endl;
 }
@@ -37,15 +41,24 @@ int main(int argc, char **argv, char **envp)
     std::string default_recycling_bin = simpic_local_folder + "recycling_bin/";
     std::string default_cache = simpic_local_folder + "cache.simpic_cache";
     std::string default_alt_tmp = simpic_local_folder + "tmp/";
+    std::string default_thumbnails = simpic_local_folder + "thumbnails/";
+    std::string default_jobs = simpic_local_folder + "jobs/";
+    std::string default_similar = simpic_local_folder + "similar/";
 
     /* Create the directory for simpic if it does not already exist. */
     mkdir_dir(simpic_local_folder);
     mkdir_dir(default_recycling_bin);
     mkdir_dir(default_alt_tmp);
+    mkdir_dir(default_thumbnails);
+    mkdir_dir(default_jobs);
+    mkdir_dir(default_similar);
 
     char *recycling_bin = nullptr;
+    std::vector<std::string> watched;
     bool force_delete = false;
     uint16_t port = 0;
+    unsigned int decoder_workers = 0;
+    size_t library_memory = 0;
 
     /* Go through each actual terminal argument. */
     for (int i = 1; i < argc; i++)
@@ -100,6 +113,75 @@ int main(int argc, char **argv, char **envp)
 
             port = (uint16_t) tmp_port;
         }
+        else if (!std::strcmp(argv[i], "-w") || !std::strcmp(argv[i], "--watch"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-w/--watch requires an argument (the directory to watch)... exiting..." << "\n";
+                return -7;
+            }
+
+            watched.push_back(std::string(argv[i + 1]));
+        }
+        else if (!std::strcmp(argv[i], "-d") || !std::strcmp(argv[i], "--decoder-workers"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-d/--decoder-workers requires an argument (how many)... exiting..." << "\n";
+                return -8;
+            }
+
+            std::string strcount(argv[i + 1]);
+            int count = 0;
+
+            try
+            {
+                count = std::stoi(strcount);
+            }
+            catch (std::exception &ex)
+            {
+                std::cerr << "Error parsing the number of decoder workers '" << strcount << "' in the arguments: " << ex.what() << "\n";
+                return -9;
+            }
+
+            if (count < 0 || count > 1024)
+            {
+                std::cerr << "The number of decoder workers, " << count << ", has to be between 0 and 1024. Exiting..." << "\n";
+                return -9;
+            }
+
+            decoder_workers = count;
+        }
+        else if (!std::strcmp(argv[i], "-m") || !std::strcmp(argv[i], "--library-memory"))
+        {
+            if (argv[i + 1] == nullptr)
+            {
+                std::cerr << "-m/--library-memory requires an argument (how many megabytes)... exiting..." << "\n";
+                return -10;
+            }
+
+            std::string strmegabytes(argv[i + 1]);
+            long long megabytes = 0;
+
+            try
+            {
+                megabytes = std::stoll(strmegabytes);
+            }
+            catch (std::exception &ex)
+            {
+                std::cerr << "Error parsing the memory for deduping the library '" << strmegabytes << "' in the arguments: " << ex.what() << "\n";
+                return -11;
+            }
+
+            /* Up to a terabyte. */
+            if (megabytes < 0 || megabytes > 1024 * 1024)
+            {
+                std::cerr << "The memory for deduping the library, " << megabytes << "MB, has to be between 0 and 1048576. Exiting..." << "\n";
+                return -11;
+            }
+
+            library_memory = (size_t) megabytes * 1024 * 1024;
+        }
         else if (!std::strcmp(argv[i], "-f") || !std::strcmp(argv[i], "--force-delete"))
             force_delete = true;
 
@@ -140,7 +222,7 @@ int main(int argc, char **argv, char **envp)
     /* Start the actual server after we've done all of the processing...*/
     try
     {
-        SimpicServer sv(port, simpic_local_folder, cpp_recycling_bin);
+        SimpicServer sv(port, simpic_local_folder, cpp_recycling_bin, watched, decoder_workers, library_memory);
         sv.start();
     }
     catch (SimpicMultipleInstanceException &ex)
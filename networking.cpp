@@ -34,12 +34,23 @@ namespace SimpicServerLib
     void new_sendfile(int cfd, int file, size_t file_size)
     {
         off_t offset = 0;
-        int total_amnt = 0;
-        int amnt = 0;
+        size_t total_amnt = 0;
+        ssize_t amnt = 0;
 
         while (total_amnt != file_size)
         {
             amnt = sendfile(cfd, file, &offset, 8192);
+
+            if (amnt < 0 && errno == EINTR)
+                continue;
+
+            /* Nothing more to send (the file got shorter), or the client is gone. */
+            if (amnt <= 0)
+            {
+                uint8_t err = amnt < 0 ? errno : EIO;
+                throw simpic_networking_exception("Error new_sendfile(): " + std::string(std::strerror(err)), err);
+            }
+
             total_amnt += amnt;
         }
     }
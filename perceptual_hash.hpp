@@ -0,0 +1,69 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define DCT_HASH_BITS 64
+#define MH_HASH_LENGTH 72
+
+namespace SimpicServerLib
+{
+    /* A perceptual hash of Bits bits (a multiple of 64), as whole words, the lowest bits first. Two of them are compared by how many of their bits differ, however they were worked out, so every kind of hash can share the same comparison and the same HammingIndex. */
+    template <size_t Bits>
+    struct PerceptualHash
+    {
+        static_assert(Bits % 64 == 0, "Perceptual hashes are made of whole 64-bit words");
+
+        static constexpr size_t WORDS = Bits / 64;
+
+        /* How many 16-bit chunks a HammingIndex splits it into. */
+        static constexpr int CHUNKS = Bits / 16;
+
+        uint64_t words[WORDS];
+
+        PerceptualHash() = default;
+
+        /* The DCT hash is a plain uint64_t everywhere else (pHash, the protocol, the cache). */
+        constexpr PerceptualHash(uint64_t value) requires (Bits == 64) : words{value}
+        {
+        }
+
+        /* From a hash as pHash hands it out, byte by byte. */
+        static PerceptualHash from_bytes(const uint8_t *bytes)
+        {
+            PerceptualHash hash;
+            std::memcpy(hash.words, bytes, sizeof(hash.words));
+            return hash;
+        }
+
+        constexpr uint16_t chunk(int which) const
+        {
+            return (uint16_t)(words[which / 4] >> (16 * (which % 4)));
+        }
+
+        constexpr bool operator==(const PerceptualHash &other) const = default;
+    };
+
+    typedef PerceptualHash<DCT_HASH_BITS> DCTHash;
+    typedef PerceptualHash<MH_HASH_LENGTH * 8> MHHash;
+
+    /* How many bits of two hashes differ: a popcount of their XOR, a word at a time. The width is known when it's compiled, so the loop is unrolled (and vectorized where it's long enough). */
+    template <size_t Bits>
+    constexpr int hamming_distance(const PerceptualHash<Bits> &a, const PerceptualHash<Bits> &b)
+    {
+        int bits = 0;
+
+        for (size_t i = 0; i < PerceptualHash<Bits>::WORDS; i++)
+            bits += std::popcount(a.words[i] ^ b.words[i]);
+
+        return bits;
+    }
+
+    /* The DCT hash is compared millions of times per scan: one XOR, one popcount. It also takes the uint64_t hashes as they are. */
+    constexpr int hamming_distance(DCTHash a, DCTHash b)
+    {
+        return std::popcount(a.words[0] ^ b.words[0]);
+    }
+}
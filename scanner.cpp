@@ -0,0 +1,755 @@
+#include "scanner.hpp"
+
+namespace SimpicServerLib
+{
+    Scanner::Scanner(SimpicCache *_cache, ThumbnailCache *_thumbnails, HashingPool *_pool, SimilarityStore *_similar,
+            Verifier *_verifier)
+    {
+        cache = _cache;
+        thumbnails = _thumbnails;
+        pool = _pool;
+        similar = _similar;
+        verifier = _verifier;
+    }
+
+    const Image *Scanner::load_image(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash,
+            bool thumbnail)
+    {
+        const Image *cached = cache->get_image(hash);
+
+        /* Hashed before the DecoderRegistry was: only hashed again if the registry would make a different hash of it. */
+        if (cached != nullptr && cache->phash_hashed_image(hash))
+        {
+            if (!Image::decoded_differently(fp))
+            {
+                cache->confirm_image(hash);
+                return cached;
+            }
+        }
+        else if (cached != nullptr)
+            return cached;
+
+        /* Whoever else finds the same contents gets this very Image, so it can't keep where this file is. */
+        Image *img = new Image(fp, hash);
+
+        /* Made by the same decode as the hash, rather than decoding the original again once a client asks for one. */
+        std::string thumbnail_path = thumbnail && thumbnails != nullptr ? thumbnails->path_for(hash, THUMBNAIL_HASHING_EDGE) : "";
+
+        if (!img->get_info(fp, dir + "/" + name, thumbnail_path))
+        {
+            delete img;
+            return cached;
+        }
+
+        /* Someone else may have decoded the same contents in the meanwhile, and got theirs cached first. */
+        const Image *winner = cached != nullptr ? cache->replace(img) : cache->insert(img);
+
+        if (winner != img)
+            delete img;
+
+        return winner;
+    }
+
+    Video *Scanner::load_video(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash)
+    {
+        Video *vid = cache->get_video(hash);
+
+        if (vid != nullptr)
+            return vid;
+
+        std::optional<std::vector<uint64_t>> frames = Video::keyframe_hashes(fileno(fp));
+
+        if (!frames.has_value())
+        {
+            std::cerr << "Failed to decode the video '" << dir << "/" << name << "'\n";
+            return nullptr;
+        }
+
+        struct stat info;
+        fstat(fileno(fp), &info);
+
+        vid = new Video();
+        vid->path = dir;
+        vid->filename = name;
+        vid->length = info.st_size;
+        vid->frames = *frames;
+        std::memcpy(vid->sha256, hash, SHA256_DIGEST_LENGTH);
+
+        Video *winner = cache->insert(vid);
+
+        if (winner != vid)
+            delete vid;
+
+        return winner;
+    }
+
+    Audio *Scanner::load_audio(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash)
+    {
+        Audio *aud = cache->get_audio(hash);
+
+        if (aud != nullptr)
+            return aud;
+
+        std::optional<std::vector<uint32_t>> fingerprints = Audio::fingerprint(fileno(fp));
+
+        if (!fingerprints.has_value())
+        {
+            std::cerr << "Failed to decode the audio file '" << dir << "/" << name << "'\n";
+            return nullptr;
+        }
+
+        struct stat info;
+        fstat(fileno(fp), &info);
+
+        aud = new Audio();
+        aud->path = dir;
+        aud->filename = name;
+        aud->length = info.st_size;
+        aud->fingerprints = std::move(*fingerprints);
+        std::memcpy(aud->sha256, hash, SHA256_DIGEST_LENGTH);
+
+        Audio *winner = cache->insert(aud);
+
+        if (winner != aud)
+            delete aud;
+
+        return winner;
+    }
+
+    Text *Scanner::load_text(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash)
+    {
+        Text *txt = cache->get_text(hash);
+
+        if (txt != nullptr)
+            return txt;
+
+        std::optional<std::vector<uint64_t>> points = Text::compute_perceptual_hash(fileno(fp));
+
+        if (!points.has_value())
+            return nullptr;
+
+        struct stat info;
+        fstat(fileno(fp), &info);
+
+        txt = new Text();
+        txt->path = dir;
+        txt->filename = name;
+        txt->length = info.st_size;
+        txt->points = std::move(*points);
+        std::memcpy(txt->sha256, hash, SHA256_DIGEST_LENGTH);
+
+        Text *winner = cache->insert(txt);
+
+        if (winner != txt)
+            delete txt;
+
+        return winner;
+    }
+
+    void Scanner::load(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash, bool thumbnail)
+    {
+        switch (SimpicCache::get_type_from_extension(get_extension(name)))
+        {
+            case CacheEntryTypes::Video:
+                load_video(dir, name, fp, hash);
+                break;
+
+            case CacheEntryTypes::Audio:
+                load_audio(dir, name, fp, hash);
+                break;
+
+            case CacheEntryTypes::Text:
+                load_text(dir, name, fp, hash);
+                break;
+
+            default:
+                load_image(dir, name, fp, hash, thumbnail);
+                break;
+        }
+    }
+
+    DirectoryWalk::DirectoryWalk(int workers) : queues(workers)
+    {
+        pending = 0;
+    }
+
+    void DirectoryWalk::give(int self, const std::string &rel)
+    {
+        /* Queued while idle_mutex is held, so that a walker can't miss it between looking and going to sleep. */
+        {
+            std::lock_guard<std::mutex> idle_lock(idle_mutex);
+            pending++;
+
+            std::lock_guard<std::mutex> lock(queues[self].mutex);
+            queues[self].dirs.push_back(rel);
+        }
+
+        idle_cv.notify_one();
+    }
+
+    void DirectoryWalk::listed()
+    {
+        bool over;
+
+        {
+            std::lock_guard<std::mutex> idle_lock(idle_mutex);
+            over = --pending == 0;
+        }
+
+        if (over)
+            idle_cv.notify_all();
+    }
+
+    bool DirectoryWalk::anything_queued()
+    {
+        for (WalkQueue &queue : queues)
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            if (!queue.dirs.empty())
+                return true;
+        }
+
+        return false;
+    }
+
+    bool DirectoryWalk::wait()
+    {
+        std::unique_lock<std::mutex> idle_lock(idle_mutex);
+        idle_cv.wait(idle_lock, [this]() -> bool { return pending == 0 || anything_queued(); });
+
+        return pending != 0;
+    }
+
+    bool DirectoryWalk::take(int self, std::string &rel)
+    {
+        /* Our own newest directory first: depth-first, so its entries are likely still cached. */
+        {
+            std::lock_guard<std::mutex> lock(queues[self].mutex);
+
+            if (!queues[self].dirs.empty())
+            {
+                rel = std::move(queues[self].dirs.back());
+                queues[self].dirs.pop_back();
+                return true;
+            }
+        }
+
+        /* Otherwise steal someone else's oldest directory, which is likely the biggest subtree. */
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            WalkQueue &victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+
+            if (!victim.dirs.empty())
+            {
+                rel = std::move(victim.dirs.front());
+                victim.dirs.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Scanner::list_directory(DirectoryWalk &walk, int self, const std::string &rel,
+            std::function<void(const std::string&, std::shared_ptr<DirectorySnapshot>, bool)> on_listed)
+    {
+        int dfd = openat(walk.rootfd, rel.empty() ? "." : rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (dfd < 0)
+        {
+            std::cerr << "Error opening directory '" << walk.root << "/" << rel << "': " << std::strerror(errno) << "\n";
+            return;
+        }
+
+        /* Taken before listing: if anything changes while we list, the next scan won't match. */
+        struct stat dirinfo;
+        fstat(dfd, &dirinfo);
+
+        std::string absdir = rel.empty() ? walk.root : walk.root + "/" + rel;
+        std::shared_ptr<DirectorySnapshot> snapshot = cache->get_directory(absdir);
+
+        /* Nothing was added, removed or renamed since the last time: no need to even read it. */
+        if (snapshot != nullptr && snapshot->matches(dirinfo))
+        {
+            close(dfd);
+
+            if (walk.recursive)
+                for (const std::string &name : snapshot->subdirs)
+                    walk.give(self, rel.empty() ? name : rel + "/" + name);
+
+            on_listed(rel, snapshot, false);
+            return;
+        }
+
+        DIR *d = fdopendir(dfd);
+
+        if (d == nullptr)
+        {
+            close(dfd);
+            return;
+        }
+
+        snapshot = std::make_shared<DirectorySnapshot>(dirinfo);
+
+        for (struct dirent *ent = readdir(d); ent != nullptr; ent = readdir(d))
+        {
+            if (!std::strcmp(ent->d_name, ".") || !std::strcmp(ent->d_name, ".."))
+                continue;
+
+            unsigned char type = ent->d_type;
+
+            /* Some filesystems (some NFS servers, older XFS...) don't fill in d_type. */
+            if (type == DT_UNKNOWN)
+            {
+                struct stat info;
+
+                if (fstatat(dfd, ent->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+
+                if (S_ISDIR(info.st_mode))
+                    type = DT_DIR;
+                else if (S_ISREG(info.st_mode))
+                    type = DT_REG;
+            }
+
+            std::string name(ent->d_name);
+
+            /* This is a directory, obviously... */
+            if (type == DT_DIR)
+            {
+                /* Special directories we don't want to traverse. */
+                if (name[0] == '.')
+                    continue;
+
+                snapshot->subdirs.push_back(name);
+
+                if (walk.recursive)
+                    walk.give(self, rel.empty() ? name : rel + "/" + name);
+
+                continue;
+            }
+
+            /* We have no business with other types of files. */
+            if (type != DT_REG)
+                continue;
+
+            /* Unsupported type. */
+            if (SimpicCache::get_type_from_extension(get_extension(name)) == SimpicEntryTypes::Undefined)
+                continue;
+
+            SnapshotFile file;
+            file.name = name;
+            snapshot->files.push_back(file);
+        }
+
+        closedir(d);
+        on_listed(rel, snapshot, true);
+    }
+
+    int Scanner::collect(const std::string &dir, ClientRequests req, uint8_t types, ImageRecords &imgs,
+            std::vector<Video*> &vids, std::vector<Audio*> &auds,
+            std::vector<Text*> &txts, std::function<void(int)> progress_callback, bool make_thumbnails,
+            std::function<void(const ImageRecords&, const SetList&)> exact_callback)
+    {
+        int rootfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (rootfd < 0)
+        {
+            int error = errno;
+            std::cerr << "Error opening directory '" << dir << "': " << std::strerror(error) << "\n";
+            return error;
+        }
+
+        bool recursive = is_recursive(req);
+        int workers = recursive ? WALKER_THREADS : 1;
+
+        DirectoryWalk walk(workers);
+        walk.rootfd = rootfd;
+        walk.root = dir;
+        walk.recursive = recursive;
+        walk.give(0, "");
+
+        HashingGroup group;
+        std::mutex imgs_mutex;
+        int count = 0;
+
+        /* Where every file is, by its SHA256 hash; the images are only looked up once everything is hashed. */
+        std::vector<FileLocation> located;
+
+        /* Contents that somebody is already going to decode: a copy of a file doesn't need decoding again. */
+        std::unordered_set<std::string> claimed;
+
+        /* One file of each of them, decoded once everything is hashed. */
+        struct Undecoded
+        {
+            std::string relname;
+            std::string parent;
+            std::string name;
+            DirectorySnapshot *snapshot;
+            sha256_t hash[SHA256_DIGEST_LENGTH];
+        };
+
+        std::vector<Undecoded> undecoded;
+
+        /* Snapshots of the directories that had to be read, and whether every file in them could be hashed. */
+        std::vector<std::pair<std::string, std::shared_ptr<DirectorySnapshot>>> fresh;
+        std::map<DirectorySnapshot*, bool> complete;
+
+        auto found = [&](const std::string &parent, const std::string &name, const sha256_t *hash) -> void {
+            std::lock_guard<std::mutex> lock(imgs_mutex);
+
+            if (hash != nullptr)
+            {
+                located.push_back({imgs.intern(parent), imgs.intern(name)});
+                std::memcpy(located.back().sha256, hash, SHA256_DIGEST_LENGTH);
+            }
+
+            progress_callback(++count);
+        };
+
+        /* Every file is handed to the hashing pool as soon as its directory is listed, so hashing */
+        /* starts long before the walk is over. Everything is opened relative to the root directory. */
+        /* Nothing is decoded yet: the byte-identical files are known (and can be sent) before that. */
+        auto on_listed = [&](const std::string &rel, std::shared_ptr<DirectorySnapshot> snapshot, bool changed) -> void {
+            std::string parent = rel.empty() ? dir : dir + "/" + rel;
+
+            /* Unchanged: the images are all in the cache already (or weren't images last time either). */
+            if (!changed)
+            {
+                for (SnapshotFile &file : snapshot->files)
+                    if (collects(types, SimpicCache::get_type_from_extension(get_extension(file.name))))
+                        found(parent, file.name, file.hash);
+
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(imgs_mutex);
+                fresh.push_back({parent, snapshot});
+                complete[snapshot.get()] = true;
+            }
+
+            for (size_t i = 0; i < snapshot->files.size(); i++)
+            {
+                /* A file that isn't hashed leaves the snapshot incomplete, so it's hashed once somebody wants it. */
+                if (!collects(types, SimpicCache::get_type_from_extension(get_extension(snapshot->files[i].name))))
+                {
+                    std::lock_guard<std::mutex> lock(imgs_mutex);
+                    complete[snapshot.get()] = false;
+                    continue;
+                }
+
+                group.submit(pool, [&, rel, parent, snapshot, i]() -> void {
+                    SnapshotFile &file = snapshot->files[i];
+                    std::string relname = rel.empty() ? file.name : rel + "/" + file.name;
+                    std::string absname = parent + "/" + file.name;
+
+                    int ffd = openat(rootfd, relname.c_str(), O_RDONLY | O_CLOEXEC);
+                    std::FILE *fp = ffd < 0 ? nullptr : fdopen(ffd, "rb");
+
+                    /* The file didn't open for some reason? */
+                    if (fp == nullptr)
+                    {
+                        std::cerr << "Error opening (valid?) file (" << absname << "): " << std::strerror(errno) << std::endl;
+
+                        if (ffd >= 0)
+                            close(ffd);
+
+                        {
+                            std::lock_guard<std::mutex> lock(imgs_mutex);
+                            complete[snapshot.get()] = false;
+                        }
+
+                        found(parent, file.name, nullptr);
+                        return;
+                    }
+
+                    struct stat fileinfo;
+                    fstat(ffd, &fileinfo);
+
+                    /* Attempt to pull the SHA256 hash from the cache, otherwise compute and cache it. */
+                    SHA256CachedObject *sha256_obj = cache->sha256_of(absname, fp, fileinfo);
+                    std::memcpy(file.hash, sha256_obj->hash, SHA256_DIGEST_LENGTH);
+
+                    std::fclose(fp);
+
+                    {
+                        std::lock_guard<std::mutex> lock(imgs_mutex);
+
+                        if (claimed.insert(std::string(file.hash, SHA256_DIGEST_LENGTH)).second)
+                        {
+                            undecoded.push_back({relname, parent, file.name, snapshot.get()});
+                            std::memcpy(undecoded.back().hash, file.hash, SHA256_DIGEST_LENGTH);
+                        }
+                    }
+
+                    found(parent, file.name, file.hash);
+                });
+            }
+        };
+
+        std::vector<std::thread> walkers;
+
+        for (int i = 0; i < workers; i++)
+        {
+            walkers.push_back(std::thread([&, i]() -> void {
+                std::string rel;
+
+                while (true)
+                {
+                    if (walk.take(i, rel))
+                    {
+                        list_directory(walk, i, rel, on_listed);
+                        walk.listed();
+                        continue;
+                    }
+
+                    /* Nothing queued anywhere and nobody listing anything: the walk is over. */
+                    if (!walk.wait())
+                        return;
+                }
+            }));
+        }
+
+        for (std::thread &walker : walkers)
+            walker.join();
+
+        group.wait();
+
+        /* The order things were hashed in is arbitrary; results shouldn't be. */
+        std::sort(located.begin(), located.end(), [&imgs](const FileLocation &a, const FileLocation &b) -> bool {
+            return a.path != b.path ? imgs.string(a.path) < imgs.string(b.path) : imgs.string(a.filename) < imgs.string(b.filename);
+        });
+
+        /* If the image (or video, audio file or document) does not exist in the cache, make one, then put it into the cache. */
+        /* If it does not have the magic or does not pass the test, it is skipped. */
+        for (Undecoded &file : undecoded)
+        {
+            group.submit(pool, [&]() -> void {
+                int ffd = openat(rootfd, file.relname.c_str(), O_RDONLY | O_CLOEXEC);
+                std::FILE *fp = ffd < 0 ? nullptr : fdopen(ffd, "rb");
+
+                if (fp == nullptr)
+                {
+                    std::cerr << "Error opening (valid?) file (" << file.parent << "/" << file.name << "): " << std::strerror(errno) << std::endl;
+
+                    if (ffd >= 0)
+                        close(ffd);
+
+                    std::lock_guard<std::mutex> lock(imgs_mutex);
+                    complete[file.snapshot] = false;
+                    return;
+                }
+
+                load(file.parent, file.name, fp, file.hash, make_thumbnails);
+                std::fclose(fp);
+            });
+        }
+
+        /* The byte-identical images don't have to wait for any of that. */
+        if (exact_callback)
+        {
+            ImageRecords dups;
+            SetList exact = hashed_duplicates(imgs, located, dups);
+            exact_callback(dups, exact);
+        }
+
+        group.wait();
+        close(rootfd);
+
+        /* A directory with a file we couldn't open isn't remembered, so that file gets another chance. */
+        for (auto &[parent, snapshot] : fresh)
+            if (complete[snapshot.get()])
+                cache->insert(parent, snapshot);
+
+        /* Every location gets a record (or video, audio file or document) of its own, since several can have the same contents. */
+        for (FileLocation &location : located)
+        {
+            const Image *img = cache->get_image(location.sha256);
+
+            if (img != nullptr)
+            {
+                imgs.add(*img, location.path, location.filename);
+                continue;
+            }
+
+            std::string path(imgs.string(location.path));
+            std::string filename(imgs.string(location.filename));
+
+            Video *vid = cache->get_video(location.sha256);
+
+            if (vid != nullptr)
+            {
+                Video *copy = new Video(*vid);
+                copy->path = path;
+                copy->filename = filename;
+                vids.push_back(copy);
+                continue;
+            }
+
+            Audio *aud = cache->get_audio(location.sha256);
+
+            if (aud != nullptr)
+            {
+                Audio *copy = new Audio(*aud);
+                copy->path = path;
+                copy->filename = filename;
+                auds.push_back(copy);
+                continue;
+            }
+
+            Text *txt = cache->get_text(location.sha256);
+
+            if (txt != nullptr)
+            {
+                Text *copy = new Text(*txt);
+                copy->path = path;
+                copy->filename = filename;
+                txts.push_back(copy);
+            }
+        }
+
+        cache->saveall();
+        return 0;
+    }
+
+    SetList Scanner::hashed_duplicates(const ImageRecords &imgs, std::vector<FileLocation> &located, ImageRecords &dups)
+    {
+        /* Sorted by contents, each group in the order of the locations (a stable sort), and then the groups in the order of their first. */
+        std::vector<uint32_t> order(located.size());
+
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        std::stable_sort(order.begin(), order.end(), [&located](uint32_t a, uint32_t b) -> bool {
+            return std::memcmp(located[a].sha256, located[b].sha256, SHA256_DIGEST_LENGTH) < 0;
+        });
+
+        std::vector<std::pair<size_t, size_t>> groups;
+
+        for (size_t begin = 0, end; begin < order.size(); begin = end)
+        {
+            for (end = begin + 1; end < order.size(); end++)
+                if (std::memcmp(located[order[begin]].sha256, located[order[end]].sha256, SHA256_DIGEST_LENGTH) != 0)
+                    break;
+
+            std::string_view name = imgs.string(located[order[begin]].filename);
+
+            if (end - begin > 1 && SimpicCache::get_type_from_extension(get_extension(std::string(name))) == CacheEntryTypes::Image)
+                groups.push_back({begin, end});
+        }
+
+        std::sort(groups.begin(), groups.end(), [&order](const std::pair<size_t, size_t> &a, const std::pair<size_t, size_t> &b) -> bool {
+            return order[a.first] < order[b.first];
+        });
+
+        SetList exact;
+
+        for (auto &[begin, end] : groups)
+        {
+            FileLocation &first = located[order[begin]];
+            const Image *cached = cache->get_image(first.sha256);
+            Image img;
+
+            /* Not cached yet: the header is enough to say what it is, and how big. If it can't be */
+            /* decoded after all, it is in no other results. */
+            if (cached == nullptr)
+            {
+                std::string abspath = std::string(imgs.string(first.path)) + "/" + std::string(imgs.string(first.filename));
+                std::FILE *fp = std::fopen(abspath.c_str(), "rb");
+
+                if (fp == nullptr)
+                    continue;
+
+                img = Image(fp, first.sha256);
+                bool valid = img.get_header(fp);
+                std::fclose(fp);
+
+                if (!valid)
+                    continue;
+
+                cached = &img;
+            }
+
+            for (size_t i = begin; i < end; i++)
+                exact.push(dups.add(*cached, {imgs.string(located[order[i]].path), imgs.string(located[order[i]].filename)}));
+
+            exact.end_set();
+        }
+
+        return exact;
+    }
+
+    std::shared_ptr<ScanFlight> Scanner::scan(const std::string &dir, ClientRequests req, uint8_t types,
+            std::function<void(int)> progress_callback, bool make_thumbnails,
+            std::function<void(const ImageRecords&, const SetList&)> exact_callback)
+    {
+        bool leader = false;
+        std::shared_ptr<ScanFlight> flight = active.join(dir, is_recursive(req), types, leader);
+
+        if (!leader)
+        {
+            flight->wait();
+            return flight;
+        }
+
+        /* Nobody looks at the images before complete(). */
+        std::vector<Video*> vids;
+        std::vector<Audio*> auds;
+        std::vector<Text*> txts;
+        int error;
+
+        /* Whoever joined the flight waits for it to complete, however collecting ends: an exception becomes its error. */
+        try
+        {
+            error = collect(dir, req, types, flight->imgs, vids, auds, txts, progress_callback, make_thumbnails, exact_callback);
+        }
+        catch (std::bad_alloc &ex)
+        {
+            std::cerr << "Failed to collect '" << dir << "': out of memory\n";
+            error = ENOMEM;
+        }
+        catch (...)
+        {
+            std::cerr << "Failed to collect '" << dir << "'\n";
+            error = EIO;
+        }
+
+        /* From now on, new requests start over, because files may be deleted in the meanwhile. */
+        active.leave(flight);
+        flight->store = similar;
+        flight->verifier = verifier;
+        flight->complete(error, vids, auds, txts);
+
+        return flight;
+    }
+
+    bool Scanner::is_recursive(ClientRequests req)
+    {
+        return req == ClientRequests::ScanRecursive || req == ClientRequests::CheckRecursive ||
+            req == ClientRequests::CacheRecursive;
+    }
+
+    bool Scanner::collects(uint8_t types, CacheEntryTypes type)
+    {
+        switch (type)
+        {
+            case CacheEntryTypes::Image:
+                return types & (uint8_t) DataTypes::Image;
+
+            case CacheEntryTypes::Video:
+                return types & (uint8_t) DataTypes::Video;
+
+            case CacheEntryTypes::Audio:
+                return types & (uint8_t) DataTypes::Audio;
+
+            case CacheEntryTypes::Text:
+                return types & (uint8_t) DataTypes::Text;
+
+            default:
+                return false;
+        }
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sha256.hpp"
+#include "simpic_cache.hpp"
+#include "simpic_protocol.hpp"
+#include "images.hpp"
+#include "active_scans.hpp"
+#include "hashing_pool.hpp"
+#include "thumbnails.hpp"
+
+#include "config.hpp"
+#include "utils.hpp"
+
+namespace SimpicServerLib
+{
+    /* A file found during a walk, and its contents. The path and filename are ids in the StringTable of the images being collected. */
+    struct FileLocation
+    {
+        uint32_t path;
+        uint32_t filename;
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+    };
+
+    /* The directories of one walker thread, which the others steal from when they run dry. */
+    struct WalkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::string> dirs; // relative to the root of the walk.
+    };
+
+    /* The state of one (possibly recursive) walk through a directory tree, shared by its walker threads. */
+    class DirectoryWalk
+    {
+    public:
+        int rootfd;
+        std::string root;
+        bool recursive;
+
+        std::vector<WalkQueue> queues;
+
+        /* Directories queued or being listed right now, and what walkers with nothing to do wait on: a directory being queued, or the walk being over. */
+        int pending;
+        std::mutex idle_mutex;
+        std::condition_variable idle_cv;
+
+        DirectoryWalk(int workers);
+
+        /* Queue a directory (relative to the root) on this walker's own queue. */
+        void give(int self, const std::string &rel);
+
+        /* Take a directory from this walker's own queue, or steal one from another's. */
+        bool take(int self, std::string &rel);
+
+        /* A directory that was taken is listed (and its subdirectories given). */
+        void listed();
+
+        /* Sleep until there may be a directory to take, and return true; or false, once nothing is queued anywhere and nobody is listing anything (the walk is over). */
+        bool wait();
+
+    private:
+        bool anything_queued();
+    };
+
+    /* Turns directories on the server into lists of hashed media, through the cache. It knows nothing about sockets, so that it can serve a connected client just as well as a job running with nobody connected. */
+    class Scanner
+    {
+    private:
+        SimpicCache *cache;
+        ThumbnailCache *thumbnails;
+        HashingPool *pool;
+        SimilarityStore *similar;
+        Verifier *verifier;
+        ActiveScans active;
+
+        /* List one directory of a walk (given relative to the root), queueing its subdirectories if the walk is recursive. If the directory is unchanged since its snapshot was taken, the snapshot is reused without reading the directory; otherwise a new one is made, with the names of the supported files in it but no hashes yet. Either way it is given to on_listed, along with whether it is new. */
+        void list_directory(DirectoryWalk &walk, int self, const std::string &rel,
+                    std::function<void(const std::string&, std::shared_ptr<DirectorySnapshot>, bool)> on_listed);
+
+        /* The groups of byte-identical images among located (in order, as they are sorted), added to dups with what their header says (or the cache, if it has them already), without decoding anything. */
+        SetList hashed_duplicates(const ImageRecords &imgs, std::vector<FileLocation> &located, ImageRecords &dups);
+
+    public:
+        Scanner(SimpicCache *_cache, ThumbnailCache *_thumbnails, HashingPool *_pool, SimilarityStore *_similar,
+                    Verifier *_verifier);
+
+        /* Get an image from the cache by its SHA256 hash, or decode it from fp and cache it. Returns nullptr if it isn't a valid image. The image is the cache's, with no location: dir and name are only what it is called while it's decoded. With thumbnail, a decode also writes a thumbnail of THUMBNAIL_HASHING_EDGE to the thumbnail cache, for ThumbnailCache::get() to start from. */
+        const Image *load_image(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash,
+                    bool thumbnail = false);
+
+        /* Get a video from the cache by its SHA256 hash, or decode its keyframes from fp and cache it. Returns nullptr if it can't be decoded. */
+        Video *load_video(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash);
+
+        /* Get an audio file from the cache by its SHA256 hash, or fingerprint it from fp and cache it. Returns nullptr if it can't be decoded. */
+        Audio *load_audio(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash);
+
+        /* Get a document from the cache by its SHA256 hash, or hash it from fp and cache it. Returns nullptr if it has nothing to hash. */
+        Text *load_text(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash);
+
+        /* load_image(), load_video(), load_audio() or load_text(), by the file's extension. */
+        void load(const std::string &dir, const std::string &name, std::FILE *fp, sha256ptr_t hash, bool thumbnail = false);
+
+        /* Go through a directory (and its subdirectories, if req is recursive, with several walker threads), getting every supported file of the given types (DataTypes) from the cache or hashing it on the pool (without opening anything in directories that haven't changed since the last scan), and add a record for each image to imgs (and put a video for each video into vids, an audio file for each audio file into auds, and a text for each document into txts), sorted by path. Files with the same contents are decoded once, but each gets a record (or Video, Audio or Text) of its own (a copy of the cached one, with its own name), which the caller owns. The progress callback is given the number of files gone through so far. With make_thumbnails, images that are decoded also get thumbnails (see load_image()). Everything is hashed before anything is decoded: then the groups of byte-identical images are given to exact_callback, if any (see hashed_duplicates()), while the pool decodes. Returns 0, or an errno if the directory couldn't be opened. */
+        int collect(const std::string &dir, ClientRequests req, uint8_t types, ImageRecords &imgs, std::vector<Video*> &vids,
+                    std::vector<Audio*> &auds, std::vector<Text*> &txts, std::function<void(int)> progress_callback,
+                    bool make_thumbnails = false,
+                    std::function<void(const ImageRecords&, const SetList&)> exact_callback = nullptr);
+
+        /* Like collect(), but if the directory is already being collected (for at least these types) by another request (or covered by a recursive scan of a parent), wait for that and share its results instead of doing the same work twice. Only the request that does the collecting gets progress callbacks and exact callbacks, and only its thumbnails are made. If collecting throws, the flight fails with ENOMEM (for std::bad_alloc) or EIO, for everyone. */
+        std::shared_ptr<ScanFlight> scan(const std::string &dir, ClientRequests req, uint8_t types,
+                    std::function<void(int)> progress_callback, bool make_thumbnails = false,
+                    std::function<void(const ImageRecords&, const SetList&)> exact_callback = nullptr);
+
+        static bool is_recursive(ClientRequests req);
+
+        /* Whether files of this type are among these types (DataTypes). */
+        static bool collects(uint8_t types, CacheEntryTypes type);
+    };
+}
@@ -25,6 +25,43 @@ namespace SimpicServerLib
         return where;
     }
 
+    SHA256Stream::SHA256Stream()
+    {
+        ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    }
+
+    SHA256Stream::~SHA256Stream()
+    {
+        EVP_MD_CTX_free(ctx);
+    }
+
+    void SHA256Stream::update(const void *data, size_t length)
+    {
+        EVP_DigestUpdate(ctx, data, length);
+    }
+
+    sha256ptr_t SHA256Stream::finish(sha256ptr_t where)
+    {
+        EVP_DigestFinal_ex(ctx, (unsigned char*) where, nullptr);
+        return where;
+    }
+
+    std::string sha256_hex(const sha256_t *hash)
+    {
+        const char digits[] = "0123456789abcdef";
+        std::string result;
+
+        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        {
+            uint8_t byte = (uint8_t) hash[i];
+            result += digits[byte >> 4];
+            result += digits[byte & 0x0F];
+        }
+
+        return result;
+    }
+
     SHA256CachedObject::SHA256CachedObject(sha256ptr_t _hash, int64_t _timestamp, uint64_t _length)
     {
         std::memcpy(hash, _hash, SHA256_DIGEST_LENGTH);
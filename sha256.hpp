@@ -7,6 +7,7 @@
 #include <cstring>
 
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "config.hpp"
 
@@ -29,6 +30,29 @@ namespace SimpicServerLib
     /* Writes to a block of memory pointed to by 'where'. Make sure it can hold at least 32 bytes! */
     sha256ptr_t calculate_sha256(std::FILE *fp, sha256ptr_t where);
 
+    /* The SHA256 hash of data that comes in pieces (through the EVP API), for when there is no file to hand to calculate_sha256() yet. */
+    class SHA256Stream
+    {
+    private:
+        EVP_MD_CTX *ctx;
+
+    public:
+        SHA256Stream();
+        ~SHA256Stream();
+
+        SHA256Stream(const SHA256Stream&) = delete;
+        SHA256Stream &operator=(const SHA256Stream&) = delete;
+
+        /* Hash the next 'length' bytes. */
+        void update(const void *data, size_t length);
+
+        /* Write the hash of everything so far to 'where' (at least 32 bytes). */
+        sha256ptr_t finish(sha256ptr_t where);
+    };
+
+    /* Get the lowercase hexadecimal representation of a SHA256 hash, for use in filenames. */
+    std::string sha256_hex(const sha256_t *hash);
+
     struct SHA256CachedObject
     {
         sha256_t hash[SHA256_DIGEST_LENGTH];
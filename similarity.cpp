@@ -0,0 +1,219 @@
+#include "similarity.hpp"
+
+namespace SimpicServerLib
+{
+    SimilarityStore::SimilarityStore(const std::string &_location)
+    {
+        location = _location;
+    }
+
+    std::string SimilarityStore::path_for(const std::string &dir, bool recursive)
+    {
+        std::string key = dir + (recursive ? "/**" : "");
+
+        sha256_t hash[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char*) key.c_str(), key.size(), (unsigned char*) hash);
+
+        return location + sha256_hex(hash) + SIMPIC_SIMILARITY_EXTENSION;
+    }
+
+    bool SimilarityStore::load(const std::string &dir, bool recursive, SimilarityGraph &graph)
+    {
+        std::ifstream reading(path_for(dir, recursive), std::ios::binary);
+
+        struct similarity_file_header hdr;
+        reading.read((char*) &hdr, sizeof(hdr));
+
+        if (!reading || hdr.magic != SIMPIC_SIMILARITY_MAGIC || hdr.max_distance != STRICT_MAX_HAM ||
+                hdr.recursive != recursive || hdr.path_length == 0)
+            return false;
+
+        std::string path(hdr.path_length, '\0');
+        reading.read(path.data(), hdr.path_length);
+        path.resize(hdr.path_length - 1);
+
+        /* Somebody else's, which happens to have the same hash of its path. */
+        if (path != dir)
+            return false;
+
+        graph.keys.resize(hdr.keys);
+
+        for (std::string &key : graph.keys)
+        {
+            key.resize(SHA256_DIGEST_LENGTH);
+            reading.read(key.data(), SHA256_DIGEST_LENGTH);
+        }
+
+        graph.edges.resize(hdr.edges);
+        reading.read((char*) graph.edges.data(), sizeof(struct similarity_edge) * hdr.edges);
+
+        if (!reading)
+            return false;
+
+        for (struct similarity_edge &edge : graph.edges)
+            if (edge.a >= hdr.keys || edge.b >= hdr.keys)
+                return false;
+
+        return true;
+    }
+
+    bool SimilarityStore::save(const std::string &dir, bool recursive, const SimilarityGraph &graph)
+    {
+        /* Write it elsewhere and rename() it into place, so a crash never leaves half a graph. */
+        std::string destination = path_for(dir, recursive);
+        std::string tmp = destination + "." + random_chars(RANDOM_CHARS_LENGTH) + ".tmp";
+        std::ofstream writing(tmp, std::ios::binary | std::ios::trunc);
+
+        struct similarity_file_header hdr;
+        hdr.magic = SIMPIC_SIMILARITY_MAGIC;
+        hdr.recursive = recursive;
+        hdr.max_distance = STRICT_MAX_HAM;
+        hdr.keys = graph.keys.size();
+        hdr.edges = graph.edges.size();
+        hdr.path_length = dir.size() + 1;
+
+        writing.write((const char*) &hdr, sizeof(hdr));
+        writing.write(dir.c_str(), hdr.path_length);
+
+        for (const std::string &key : graph.keys)
+            writing.write(key.data(), SHA256_DIGEST_LENGTH);
+
+        writing.write((const char*) graph.edges.data(), sizeof(struct similarity_edge) * graph.edges.size());
+        writing.close();
+
+        if (!writing || rename(tmp.c_str(), destination.c_str()) < 0)
+        {
+            std::cerr << "Failed to save the similarity graph of '" << dir << "' to '" << destination << "'\n";
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    SetList SimilarityStore::find_similar_images(const std::string &dir, bool recursive, const ImageRecords &images,
+            const std::vector<uint32_t> &ids, uint8_t max_ham, std::function<void(int)> progress_callback)
+    {
+        if (max_ham > STRICT_MAX_HAM)
+            return images.find_similar(ids, max_ham, progress_callback);
+
+        /* Images with the same contents are the same node: they're always at distance 0. */
+        SimilarityGraph graph;
+        std::unordered_map<std::string, uint32_t> index;
+        std::vector<uint32_t> unique;
+        std::vector<uint32_t> node_of(ids.size());
+
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            std::string key(images[ids[i]].sha256, SHA256_DIGEST_LENGTH);
+            std::unordered_map<std::string, uint32_t>::iterator it = index.find(key);
+
+            if (it == index.end())
+            {
+                it = index.insert({key, (uint32_t) unique.size()}).first;
+                unique.push_back(ids[i]);
+                graph.keys.push_back(key);
+            }
+
+            node_of[i] = it->second;
+        }
+
+        /* Keep the edges between images that are still here; whatever wasn't here last time is new. */
+        SimilarityGraph previous;
+        std::vector<bool> known(unique.size(), false);
+
+        if (load(dir, recursive, previous))
+        {
+            std::vector<int64_t> remap(previous.keys.size(), -1);
+
+            for (size_t k = 0; k < previous.keys.size(); k++)
+            {
+                std::unordered_map<std::string, uint32_t>::iterator it = index.find(previous.keys[k]);
+
+                if (it == index.end())
+                    continue;
+
+                remap[k] = it->second;
+                known[it->second] = true;
+            }
+
+            for (struct similarity_edge &edge : previous.edges)
+            {
+                if (remap[edge.a] < 0 || remap[edge.b] < 0)
+                    continue;
+
+                graph.edges.push_back({(uint32_t) remap[edge.a], (uint32_t) remap[edge.b], edge.distance});
+            }
+        }
+
+        /* New images against everything, but each pair of new images only once. */
+        for (uint32_t n = 0; n < unique.size(); n++)
+        {
+            if (known[n])
+                continue;
+
+            for (uint32_t m = 0; m < unique.size(); m++)
+            {
+                if (m == n || (!known[m] && m < n))
+                    continue;
+
+                uint8_t distance = hamming_distance(images[unique[n]].phash, images[unique[m]].phash);
+
+                if (distance <= STRICT_MAX_HAM)
+                    graph.edges.push_back({n, m, distance});
+            }
+        }
+
+        save(dir, recursive, graph);
+
+        /* Where each node appears in the images (in order), and its neighbours within max_ham. */
+        std::vector<std::vector<uint32_t>> positions(unique.size());
+        std::vector<std::vector<uint32_t>> neighbours(unique.size());
+
+        for (uint32_t i = 0; i < ids.size(); i++)
+            positions[node_of[i]].push_back(i);
+
+        for (struct similarity_edge &edge : graph.edges)
+        {
+            if (edge.distance > max_ham)
+                continue;
+
+            neighbours[edge.a].push_back(edge.b);
+            neighbours[edge.b].push_back(edge.a);
+        }
+
+        /* Like ImageRecords::find_similar(): every image, followed by every image after it that is close enough. */
+        SetList result;
+        int count = 0;
+
+        for (uint32_t i = 0; i < ids.size(); i++)
+        {
+            std::vector<uint32_t> after;
+
+            for (uint32_t j : positions[node_of[i]])
+                if (j > i)
+                    after.push_back(j);
+
+            for (uint32_t neighbour : neighbours[node_of[i]])
+                for (uint32_t j : positions[neighbour])
+                    if (j > i)
+                        after.push_back(j);
+
+            if (after.empty())
+                continue;
+
+            std::sort(after.begin(), after.end());
+            count += after.size();
+
+            result.push(ids[i]);
+
+            for (uint32_t j : after)
+                result.push(ids[j]);
+
+            result.end_set();
+            progress_callback(count);
+        }
+
+        return result;
+    }
+}
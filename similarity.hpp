@@ -0,0 +1,73 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#include "sha256.hpp"
+#include "images.hpp"
+#include "utils.hpp"
+
+#include "config.hpp"
+
+/* Graphs older than the DecoderRegistry's hashes (see ImageHashVersion) aren't read: they were compared by pHash's hashes. */
+#define SIMPIC_SIMILARITY_MAGIC 0x5EDEAD06
+#define SIMPIC_SIMILARITY_EXTENSION ".simpic_similar"
+
+namespace SimpicServerLib
+{
+    /* File format of a directory's similarity graph (one file per directory and recursiveness). */
+    struct __attribute__((__packed__)) similarity_file_header
+    {
+        uint32_t magic;
+        uint8_t recursive;
+        uint8_t max_distance;
+        uint32_t keys;
+        uint32_t edges;
+        uint16_t path_length;
+        // path_length bytes for the null-terminated path, then keys SHA256 hashes, then edges similarity_edges.
+    };
+
+    /* Two of the keys (by index) and the Hamming distance between their perceptual hashes. */
+    struct __attribute__((__packed__)) similarity_edge
+    {
+        uint32_t a;
+        uint32_t b;
+        uint8_t distance;
+    };
+
+    /* Every pair of distinct images (by SHA256) in a directory whose perceptual hashes are within STRICT_MAX_HAM of each other, as of the last scan. */
+    struct SimilarityGraph
+    {
+        std::vector<std::string> keys; // raw 32 byte SHA256 hashes.
+        std::vector<struct similarity_edge> edges;
+    };
+
+    /* Remembers the similarity graph of every directory that is scanned (by default in ~/.simpic/similar/), so that scanning it again only has to compare the images that are new since then against the rest, instead of every pair all over again. */
+    class SimilarityStore
+    {
+    private:
+        std::string location;
+
+        std::string path_for(const std::string &dir, bool recursive);
+
+        bool load(const std::string &dir, bool recursive, SimilarityGraph &graph);
+        bool save(const std::string &dir, bool recursive, const SimilarityGraph &graph);
+
+    public:
+        SimilarityStore(const std::string &_location);
+
+        /* Exactly what ImageRecords::find_similar() returns for these images (ids in images, which must be in the order they were collected in), but only comparing the images that weren't there the last time this directory was scanned against the others. The graph is then updated for next time. Only works for max_ham up to STRICT_MAX_HAM; anything else is compared in full. */
+        SetList find_similar_images(const std::string &dir, bool recursive, const ImageRecords &images,
+                    const std::vector<uint32_t> &ids, uint8_t max_ham, std::function<void(int)> progress_callback);
+    };
+}
@@ -23,10 +23,36 @@ namespace SimpicServerLib
         return msg;
     }
 
+    DirectorySnapshot::DirectorySnapshot()
+    {
+        device = inode = 0;
+        mtime_sec = mtime_nsec = ctime_sec = ctime_nsec = 0;
+    }
+
+    DirectorySnapshot::DirectorySnapshot(const struct stat &info)
+    {
+        device = info.st_dev;
+        inode = info.st_ino;
+        mtime_sec = info.st_mtim.tv_sec;
+        mtime_nsec = info.st_mtim.tv_nsec;
+        ctime_sec = info.st_ctim.tv_sec;
+        ctime_nsec = info.st_ctim.tv_nsec;
+    }
+
+    bool DirectorySnapshot::matches(const struct stat &info)
+    {
+        return device == info.st_dev && inode == info.st_ino &&
+            mtime_sec == info.st_mtim.tv_sec && mtime_nsec == info.st_mtim.tv_nsec &&
+            ctime_sec == info.st_ctim.tv_sec && ctime_nsec == info.st_ctim.tv_nsec;
+    }
+
     SimpicCache::SimpicCache(std::string filename)
     {
         location = filename;
         sha256_location = filename + (std::string)"_sha256";
+        dirs_location = filename + (std::string)"_dirs";
+        changes = 0;
+        outdated = false;
 
         /* The Simpic cache will get corrupted if multiple server instances are ran. */
         /* We use a UNIX socket to determine if an instance is running, to avoid */
@@ -97,9 +123,27 @@ namespace SimpicServerLib
 
         for (auto &[key, value] : cached)
             delete value;
+
+        for (Image *img : replaced)
+            delete img;
         
         for (auto &[key, value] : sha256_cached)
             delete value;
+
+        for (auto &[key, value] : variants_cached)
+            delete value;
+
+        for (auto &[key, value] : mh_cached)
+            delete value;
+
+        for (auto &[key, value] : video_cached)
+            delete value;
+
+        for (auto &[key, value] : audio_cached)
+            delete value;
+
+        for (auto &[key, value] : text_cached)
+            delete value;
     }
 
     int SimpicCache::readall()
@@ -155,6 +199,8 @@ namespace SimpicServerLib
             std::fclose(fp2);
         }
 
+        read_dirs();
+
         if (fp != nullptr)
         {
             struct cache_header ch;
@@ -162,7 +208,7 @@ namespace SimpicServerLib
             input.read((char*) &ch, sizeof(ch));
 
             /* Erroneous magic. */
-            if (ch.magic != SIMPIC_CACHE_MAGIC)
+            if (ch.magic < SIMPIC_CACHE_MAGIC_OLDEST || ch.magic > SIMPIC_CACHE_MAGIC)
             {
                 input.close();
 
@@ -182,8 +228,27 @@ namespace SimpicServerLib
                     case CacheEntryTypes::Image: 
                     {
                         struct cache_image_entry ent;
-                        input.read((char*) &ent, sizeof(ent));
-                        ent.sha256_hash[sizeof(ent.sha256_hash)];
+
+                        if (ch.magic < SIMPIC_CACHE_MAGIC_HASH_VERSIONS)
+                        {
+                            struct cache_old_image_entry old;
+                            input.read((char*) &old, sizeof(old));
+
+                            std::memcpy(ent.sha256_hash, old.sha256_hash, sizeof(ent.sha256_hash));
+                            ent.perceptual_hash = old.perceptual_hash;
+                            ent.width = old.width;
+                            ent.height = old.height;
+                            ent.size = old.size;
+                            ent.hash_version = (uint8_t) ImageHashVersion::PHash;
+                        }
+                        else
+                            input.read((char*) &ent, sizeof(ent));
+
+                        /* A later entry for the same contents (hashed again) replaces an earlier one. */
+                        if (ent.hash_version == (uint8_t) ImageHashVersion::PHash)
+                            phash_hashed.insert(std::string(ent.sha256_hash, SHA256_DIGEST_LENGTH));
+                        else
+                            phash_hashed.erase(std::string(ent.sha256_hash, SHA256_DIGEST_LENGTH));
 
                         Image *img = new Image();
 
@@ -193,7 +258,125 @@ namespace SimpicServerLib
                         std::memcpy(img->sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
                         img->length = ent.size;
 
-                        cached[img->sha256] = img;
+                        /* The map keeps the first one's sha256 as its key, so that one stays, with what the later one says. */
+                        std::map<sha256ptr_t, Image*, SHA256Comparator>::iterator existing = cached.find(img->sha256);
+
+                        if (existing != cached.end())
+                        {
+                            *existing->second = *img;
+                            delete img;
+                        }
+                        else
+                            cached[img->sha256] = img;
+
+                        break;
+                    }
+
+                    case CacheEntryTypes::ImageVariants:
+                    {
+                        struct cache_image_variants_entry ent;
+                        input.read((char*) &ent, sizeof(ent));
+
+                        /* Made by pHash's decode, before the DecoderRegistry: they're made again when they're needed. */
+                        if (ch.magic < SIMPIC_CACHE_MAGIC_HASH_VERSIONS)
+                            break;
+
+                        ImageVariants *variants = new ImageVariants();
+                        std::memcpy(variants->sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
+                        std::memcpy(variants->hashes, ent.variants, sizeof(variants->hashes));
+
+                        variants_cached[variants->sha256] = variants;
+                        break;
+                    }
+
+                    case CacheEntryTypes::ImageMH:
+                    {
+                        cache_image_mh_entry ent;
+                        input.read((char*) &ent, sizeof(ent));
+
+                        ImageMH *mh = new ImageMH();
+                        std::memcpy(mh->sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
+                        std::memcpy(mh->hash.words, ent.hash, sizeof(ent.hash));
+
+                        mh_cached[mh->sha256] = mh;
+                        break;
+                    }
+
+                    case CacheEntryTypes::Video:
+                    {
+                        struct cache_video_entry ent;
+
+                        if (ch.magic < SIMPIC_CACHE_MAGIC_WIDE_VIDEOS)
+                        {
+                            struct cache_old_video_entry old;
+                            input.read((char*) &old, sizeof(old));
+
+                            std::memcpy(ent.sha256_hash, old.sha256_hash, sizeof(ent.sha256_hash));
+                            ent.size = old.size;
+                            ent.frame_no = old.frame_no;
+                        }
+                        else
+                            input.read((char*) &ent, sizeof(ent));
+
+                        Video *vid = new Video();
+                        std::memcpy(vid->sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
+                        vid->length = ent.size;
+                        vid->frames.resize(ent.frame_no);
+                        input.read((char*) vid->frames.data(), ent.frame_no * sizeof(uint64_t));
+
+                        video_cached[vid->sha256] = vid;
+                        break;
+                    }
+
+                    case CacheEntryTypes::Audio:
+                    {
+                        struct cache_audio_entry ent;
+
+                        if (ch.magic < SIMPIC_CACHE_MAGIC_WIDE_AUDIO)
+                        {
+                            struct cache_old_audio_entry old;
+                            input.read((char*) &old, sizeof(old));
+
+                            std::memcpy(ent.sha256_hash, old.sha256_hash, sizeof(ent.sha256_hash));
+                            ent.size = old.size;
+                            ent.fingerprint_no = old.fingerprint_no;
+                        }
+                        else
+                            input.read((char*) &ent, sizeof(ent));
+
+                        Audio *aud = new Audio();
+                        std::memcpy(aud->sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
+                        aud->length = ent.size;
+                        aud->fingerprints.resize(ent.fingerprint_no);
+                        input.read((char*) aud->fingerprints.data(), ent.fingerprint_no * sizeof(uint32_t));
+
+                        audio_cached[aud->sha256] = aud;
+                        break;
+                    }
+
+                    case CacheEntryTypes::Text:
+                    {
+                        struct cache_text_entry ent;
+
+                        if (ch.magic < SIMPIC_CACHE_MAGIC_WIDE_TEXTS)
+                        {
+                            struct cache_old_text_entry old;
+                            input.read((char*) &old, sizeof(old));
+
+                            std::memcpy(ent.sha256_hash, old.sha256_hash, sizeof(ent.sha256_hash));
+                            ent.size = old.size;
+                            ent.point_no = old.point_no;
+                        }
+                        else
+                            input.read((char*) &ent, sizeof(ent));
+
+                        Text *txt = new Text();
+                        std::memcpy(txt->sha256, ent.sha256_hash, SHA256_DIGEST_LENGTH);
+                        txt->length = ent.size;
+                        txt->points.resize(ent.point_no);
+                        input.read((char*) txt->points.data(), ent.point_no * sizeof(uint64_t));
+
+                        text_cached[txt->sha256] = txt;
                         break;
                     }
                 }
@@ -201,19 +384,212 @@ namespace SimpicServerLib
 
             input.close();
             std::fclose(fp);
+
+            /* Every file has to be looked at once more, to see whether its image was hashed by pHash */
+            /* differently from how the DecoderRegistry would: that is only done when it is loaded. */
+            if (ch.magic < SIMPIC_CACHE_MAGIC_HASH_VERSIONS)
+            {
+                dirs_cached.clear();
+                std::ofstream(dirs_location, std::ios::binary | std::ios::trunc);
+            }
+
+            /* Everything is written out again in the current layout, so that what is added later matches. */
+            if (ch.magic != SIMPIC_CACHE_MAGIC)
+            {
+                outdated = true;
+
+                for (auto &[key, value] : cached)
+                    new_entries.push_back({key, value});
+
+                for (auto &[key, value] : variants_cached)
+                    new_variants_entries.push_back(value);
+
+                for (auto &[key, value] : mh_cached)
+                    new_mh_entries.push_back(value);
+
+                for (auto &[key, value] : video_cached)
+                    new_video_entries.push_back({key, value});
+
+                for (auto &[key, value] : audio_cached)
+                    new_audio_entries.push_back({key, value});
+
+                for (auto &[key, value] : text_cached)
+                    new_text_entries.push_back({key, value});
+            }
         }
         return 0;
     }
 
+    /* Open a cache file to add entries to its end and rewrite the header at its beginning. */
+    /* (std::ios::app can't be used for that: it puts every single write at the end.) */
+    static std::fstream open_cache_file(const std::string &path)
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+
+        if (!file)
+        {
+            file.clear();
+            file.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+        }
+
+        return file;
+    }
+
+    void SimpicCache::read_dirs()
+    {
+        std::ifstream reading(dirs_location, std::ios::binary);
+
+        if (!reading)
+            return;
+
+        struct cache_dirs_header hdr;
+        reading.read((char*) &hdr, sizeof(hdr));
+
+        /* Older snapshots only have the files that were supported back then: start over, so the rest are found too. */
+        if (reading && hdr.magic >= SIMPIC_DIRS_CACHE_MAGIC_OLDEST && hdr.magic < SIMPIC_DIRS_CACHE_MAGIC)
+        {
+            reading.close();
+            std::ofstream(dirs_location, std::ios::binary | std::ios::trunc);
+            return;
+        }
+
+        if (!reading || hdr.magic != SIMPIC_DIRS_CACHE_MAGIC)
+            throw SimpicCacheException("The directory cache magic isn't right; it is corrupt.", -1);
+
+        /* Newer snapshots of the same directory come later in the file and replace the older ones. */
+        for (uint64_t i = 0; i < hdr.entries; i++)
+        {
+            struct cache_dir_entry ent;
+            reading.read((char*) &ent, sizeof(ent));
+
+            if (!reading || ent.path_len == 0)
+                throw SimpicCacheException("The directory cache is truncated; it is corrupt.", -1);
+
+            std::string path(ent.path_len, '\0');
+            reading.read(path.data(), ent.path_len);
+            path.resize(ent.path_len - 1);
+
+            std::shared_ptr<DirectorySnapshot> snapshot = std::make_shared<DirectorySnapshot>();
+            snapshot->device = ent.device;
+            snapshot->inode = ent.inode;
+            snapshot->mtime_sec = ent.mtime_sec;
+            snapshot->mtime_nsec = ent.mtime_nsec;
+            snapshot->ctime_sec = ent.ctime_sec;
+            snapshot->ctime_nsec = ent.ctime_nsec;
+
+            for (uint32_t j = 0; j < ent.subdirs && reading; j++)
+            {
+                uint16_t name_len = 0;
+                reading.read((char*) &name_len, sizeof(name_len));
+
+                std::string name(name_len, '\0');
+                reading.read(name.data(), name_len);
+                name.resize(name_len > 0 ? name_len - 1 : 0);
+
+                snapshot->subdirs.push_back(name);
+            }
+
+            for (uint32_t j = 0; j < ent.files && reading; j++)
+            {
+                struct cache_dir_file_entry fent;
+                reading.read((char*) &fent, sizeof(fent));
+
+                SnapshotFile file;
+                std::memcpy(file.hash, fent.hash, SHA256_DIGEST_LENGTH);
+                file.name.resize(fent.name_len);
+                reading.read(file.name.data(), fent.name_len);
+                file.name.resize(fent.name_len > 0 ? fent.name_len - 1 : 0);
+
+                snapshot->files.push_back(file);
+            }
+
+            if (!reading)
+                throw SimpicCacheException("The directory cache is truncated; it is corrupt.", -1);
+
+            dirs_cached[path] = snapshot;
+        }
+    }
+
+    void SimpicCache::save_dirs()
+    {
+        if (new_dirs_entries.size() == 0)
+            return;
+
+        std::fstream writing = open_cache_file(dirs_location);
+
+        struct cache_dirs_header hdr;
+        writing.read((char*) &hdr, sizeof(hdr));
+
+        if (!writing || hdr.magic != SIMPIC_DIRS_CACHE_MAGIC)
+            hdr.entries = 0;
+
+        writing.clear();
+        hdr.magic = SIMPIC_DIRS_CACHE_MAGIC;
+        hdr.entries += new_dirs_entries.size();
+
+        writing.seekp(0, std::ios::beg);
+        writing.write((const char*) &hdr, sizeof(hdr));
+        writing.seekp(0, std::ios::end);
+
+        for (const auto &[path, snapshot] : new_dirs_entries)
+        {
+            struct cache_dir_entry ent;
+            ent.path_len = path.size() + 1;
+            ent.device = snapshot->device;
+            ent.inode = snapshot->inode;
+            ent.mtime_sec = snapshot->mtime_sec;
+            ent.mtime_nsec = snapshot->mtime_nsec;
+            ent.ctime_sec = snapshot->ctime_sec;
+            ent.ctime_nsec = snapshot->ctime_nsec;
+            ent.subdirs = snapshot->subdirs.size();
+            ent.files = snapshot->files.size();
+
+            writing.write((const char*) &ent, sizeof(ent));
+            writing.write(path.c_str(), ent.path_len);
+
+            for (const std::string &name : snapshot->subdirs)
+            {
+                uint16_t name_len = name.size() + 1;
+                writing.write((const char*) &name_len, sizeof(name_len));
+                writing.write(name.c_str(), name_len);
+            }
+
+            for (const SnapshotFile &file : snapshot->files)
+            {
+                struct cache_dir_file_entry fent;
+                fent.name_len = file.name.size() + 1;
+                std::memcpy(fent.hash, file.hash, SHA256_DIGEST_LENGTH);
+
+                writing.write((const char*) &fent, sizeof(fent));
+                writing.write(file.name.c_str(), fent.name_len);
+            }
+        }
+
+        new_dirs_entries.clear();
+        writing.close();
+    }
+
     void SimpicCache::saveall()
     {
         saving_mutex.lock();
 
+        save_dirs();
+
         /* Write updated header to SHA256 Cache file. */
+        /* It counts every entry in the file, including the outdated ones that newer ones replace. */
+        std::fstream sha256_write = open_cache_file(sha256_location);
+
         struct cache_sha256_header shahdr;
+        sha256_write.read((char*) &shahdr, sizeof(shahdr));
+
+        if (!sha256_write || shahdr.magic != SIMPIC_SHA256_CACHE_MAGIC)
+            shahdr.entries = 0;
+
+        sha256_write.clear();
         shahdr.magic = SIMPIC_SHA256_CACHE_MAGIC;
-        shahdr.entries = sha256_cached.size() + new_sha256_entries.size();
-        std::ofstream sha256_write(sha256_location, std::ios::binary | std::ios::app);
+        shahdr.entries += new_sha256_entries.size();
+
+        sha256_write.seekp(0, std::ios::beg);
         sha256_write.write((const char*)&shahdr, sizeof(shahdr));
         sha256_write.seekp(0, std::ios::end);
 
@@ -234,17 +610,31 @@ namespace SimpicServerLib
         new_sha256_entries.clear();
         sha256_write.close();
 
-        if (new_entries.size() == 0)
+        if (new_entries.size() == 0 && new_variants_entries.size() == 0 && new_mh_entries.size() == 0 &&
+                new_video_entries.size() == 0 && new_audio_entries.size() == 0 && new_text_entries.size() == 0)
         {
             saving_mutex.unlock();
             return;
         }
 
+        if (outdated)
+        {
+            std::ofstream(location, std::ios::binary | std::ios::trunc);
+            outdated = false;
+        }
+
+        std::fstream writing = open_cache_file(location);
+
         struct cache_header chdr;
-        chdr.magic = SIMPIC_CACHE_MAGIC;
-        chdr.entries = cached.size();
+        writing.read((char*) &chdr, sizeof(chdr));
 
-        std::ofstream writing(location, std::ios::binary | std::ios::app);
+        if (!writing || chdr.magic != SIMPIC_CACHE_MAGIC)
+            chdr.entries = 0;
+
+        writing.clear();
+        chdr.magic = SIMPIC_CACHE_MAGIC;
+        chdr.entries += new_entries.size() + new_variants_entries.size() + new_mh_entries.size() +
+            new_video_entries.size() + new_audio_entries.size() + new_text_entries.size();
 
         /* Go to the beginning of the file and overwrite/write the header.*/
         writing.seekp(0, std::ios::beg);
@@ -269,35 +659,144 @@ namespace SimpicServerLib
             entry.width = value->width;
             entry.size = value->length;
             entry.perceptual_hash = value->phash;
+            entry.hash_version = (uint8_t) (phash_hashed.count(std::string(key, SHA256_DIGEST_LENGTH)) ?
+                                             ImageHashVersion::PHash : ImageHashVersion::DecoderRegistry);
             
             writing.write((char*) &entry, sizeof(entry));
         }
 
+        for (ImageVariants *variants : new_variants_entries)
+        {
+            struct cache_entry main_entry;
+            main_entry.type = (uint8_t) CacheEntryTypes::ImageVariants;
+            writing.write((char*) &main_entry, sizeof(main_entry));
+
+            struct cache_image_variants_entry entry;
+            std::memcpy(entry.sha256_hash, variants->sha256, sizeof(entry.sha256_hash));
+            std::memcpy(entry.variants, variants->hashes, sizeof(entry.variants));
+
+            writing.write((char*) &entry, sizeof(entry));
+        }
+
+        for (ImageMH *mh : new_mh_entries)
+        {
+            struct cache_entry main_entry;
+            main_entry.type = (uint8_t) CacheEntryTypes::ImageMH;
+            writing.write((char*) &main_entry, sizeof(main_entry));
+
+            cache_image_mh_entry entry;
+            std::memcpy(entry.sha256_hash, mh->sha256, sizeof(entry.sha256_hash));
+            std::memcpy(entry.hash, mh->hash.words, sizeof(entry.hash));
+
+            writing.write((char*) &entry, sizeof(entry));
+        }
+
+        for (const auto &[key, value] : new_video_entries)
+        {
+            struct cache_entry main_entry;
+            main_entry.type = (uint8_t) CacheEntryTypes::Video;
+            writing.write((char*) &main_entry, sizeof(main_entry));
+
+            struct cache_video_entry entry;
+            std::memcpy(entry.sha256_hash, key, sizeof(entry.sha256_hash));
+            entry.size = value->length;
+            entry.frame_no = value->frames.size();
+
+            writing.write((char*) &entry, sizeof(entry));
+            writing.write((char*) value->frames.data(), entry.frame_no * sizeof(uint64_t));
+        }
+
+        for (const auto &[key, value] : new_audio_entries)
+        {
+            struct cache_entry main_entry;
+            main_entry.type = (uint8_t) CacheEntryTypes::Audio;
+            writing.write((char*) &main_entry, sizeof(main_entry));
+
+            struct cache_audio_entry entry;
+            std::memcpy(entry.sha256_hash, key, sizeof(entry.sha256_hash));
+            entry.size = value->length;
+            entry.fingerprint_no = value->fingerprints.size();
+
+            writing.write((char*) &entry, sizeof(entry));
+            writing.write((char*) value->fingerprints.data(), entry.fingerprint_no * sizeof(uint32_t));
+        }
+
+        for (const auto &[key, value] : new_text_entries)
+        {
+            struct cache_entry main_entry;
+            main_entry.type = (uint8_t) CacheEntryTypes::Text;
+            writing.write((char*) &main_entry, sizeof(main_entry));
+
+            struct cache_text_entry entry;
+            std::memcpy(entry.sha256_hash, key, sizeof(entry.sha256_hash));
+            entry.size = value->length;
+            entry.point_no = value->points.size();
+
+            writing.write((char*) &entry, sizeof(entry));
+            writing.write((char*) value->points.data(), entry.point_no * sizeof(uint64_t));
+        }
+
         new_entries.clear();
+        new_variants_entries.clear();
+        new_mh_entries.clear();
+        new_video_entries.clear();
+        new_audio_entries.clear();
+        new_text_entries.clear();
         writing.flush();
         writing.close();
 
         saving_mutex.unlock();
     }
 
-    void SimpicCache::insert(Image *img)
+    const Image *SimpicCache::insert(Image *img)
     {
-        //entries_mutex.lock();
-
         /* DATA RACE!!! If someone updates the new_entries list at the same time
            another thread saves the cache, then information will be lost! 
            thus, after all, we must use the same mutex when inserting and saving. */
+        std::lock_guard<std::mutex> lock(saving_mutex);
 
-        saving_mutex.lock();
+        /* Whoever decoded the same contents first keeps theirs, which others may be using already. */
+        std::map<sha256ptr_t, Image*, SHA256Comparator>::iterator it = cached.find(img->sha256);
 
-        /* If it is not already a part of the cache, make sure it is marked as a new entry. */
-        if (cached.find(img->sha256) == cached.end())
-            new_entries.push_back({img->sha256, img});
+        if (it != cached.end())
+            return it->second;
 
+        new_entries.push_back({img->sha256, img});
+        changes++;
+
+        entries_mutex.lock();
         cached[img->sha256] = img;
+        entries_mutex.unlock();
+
+        return img;
+    }
+
+    void SimpicCache::insert(ImageVariants *variants)
+    {
+        saving_mutex.lock();
+
+        if (variants_cached.find(variants->sha256) == variants_cached.end())
+            new_variants_entries.push_back(variants);
+
+        entries_mutex.lock();
+        variants_cached[variants->sha256] = variants;
+        entries_mutex.unlock();
+
+        saving_mutex.unlock();
+    }
+
+    void SimpicCache::insert(ImageMH *mh)
+    {
+        saving_mutex.lock();
+
+        if (mh_cached.find(mh->sha256) == mh_cached.end())
+            new_mh_entries.push_back(mh);
+
+        entries_mutex.lock();
+        mh_cached[mh->sha256] = mh;
+        entries_mutex.unlock();
 
         saving_mutex.unlock();
-        //entries_mutex.unlock();
     }
 
     void SimpicCache::insert(std::pair<std::string, SHA256CachedObject*> shaobj)
@@ -305,13 +804,131 @@ namespace SimpicServerLib
         saving_mutex.lock();
 
         new_sha256_entries.push_back(shaobj);
+
+        entries_mutex.lock();
+
+        /* A file that was only touched (or rewritten with the same contents) is still the same image where it was. */
+        std::unordered_map<std::string, SHA256CachedObject*>::iterator it = sha256_cached.find(shaobj.first);
+
+        if (it == sha256_cached.end() || std::memcmp(it->second->hash, shaobj.second->hash, SHA256_DIGEST_LENGTH) != 0)
+            changes++;
+
         sha256_cached[shaobj.first] = shaobj.second;
+        entries_mutex.unlock();
+
+        saving_mutex.unlock();
+    }
+
+    void SimpicCache::insert(const std::string &path, std::shared_ptr<DirectorySnapshot> snapshot)
+    {
+        saving_mutex.lock();
+
+        new_dirs_entries.push_back({path, snapshot});
+
+        entries_mutex.lock();
+        dirs_cached[path] = snapshot;
+        entries_mutex.unlock();
 
         saving_mutex.unlock();
     }
 
-    Image *SimpicCache::get_image(sha256ptr_t hash)
+    std::shared_ptr<DirectorySnapshot> SimpicCache::get_directory(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::unordered_map<std::string, std::shared_ptr<DirectorySnapshot>>::iterator it = dirs_cached.find(path);
+
+        if (it == dirs_cached.end())
+            return nullptr;
+
+        return it->second;
+    }
+
+    uint64_t SimpicCache::generation()
+    {
+        return changes;
+    }
+
+    std::vector<const Image*> SimpicCache::all_images()
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::vector<const Image*> result;
+        result.reserve(cached.size());
+
+        for (auto &[key, value] : cached)
+            result.push_back(value);
+
+        return result;
+    }
+
+    std::vector<std::pair<std::string, SHA256CachedObject*>> SimpicCache::all_locations()
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        return std::vector<std::pair<std::string, SHA256CachedObject*>>(sha256_cached.begin(), sha256_cached.end());
+    }
+
+    bool SimpicCache::phash_hashed_image(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        return phash_hashed.count(std::string(hash, SHA256_DIGEST_LENGTH)) != 0;
+    }
+
+    void SimpicCache::confirm_image(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(saving_mutex);
+        std::map<sha256ptr_t, Image*, SHA256Comparator>::iterator it = cached.find(hash);
+
+        if (it == cached.end())
+            return;
+
+        {
+            std::lock_guard<std::mutex> entries_lock(entries_mutex);
+
+            if (phash_hashed.erase(std::string(hash, SHA256_DIGEST_LENGTH)) == 0)
+                return;
+        }
+
+        /* Written again, with the new version, which replaces the old entry when the cache is read. */
+        new_entries.push_back({it->first, it->second});
+    }
+
+    const Image *SimpicCache::replace(Image *img)
+    {
+        std::lock_guard<std::mutex> lock(saving_mutex);
+        std::map<sha256ptr_t, Image*, SHA256Comparator>::iterator it = cached.find(img->sha256);
+
+        if (it == cached.end())
+        {
+            new_entries.push_back({img->sha256, img});
+            changes++;
+
+            std::lock_guard<std::mutex> entries_lock(entries_mutex);
+            cached[img->sha256] = img;
+            return img;
+        }
+
+        std::lock_guard<std::mutex> entries_lock(entries_mutex);
+
+        if (phash_hashed.erase(std::string(img->sha256, SHA256_DIGEST_LENGTH)) == 0)
+            return it->second;
+
+        /* The key is the old image's own hash, so it goes too. */
+        replaced.push_back(it->second);
+        cached.erase(it);
+        cached[img->sha256] = img;
+
+        new_entries.push_back({img->sha256, img});
+        changes++;
+
+        return img;
+    }
+
+    const Image *SimpicCache::get_image(sha256ptr_t hash)
     {
+        /* Lookups happen from the hashing pool's threads while others insert. */
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
         std::map<sha256ptr_t, Image*, SHA256Comparator>::iterator it = cached.find(hash);
 
         if (it == cached.end())
@@ -320,8 +937,124 @@ namespace SimpicServerLib
         return it->second;
     }
 
+    ImageVariants *SimpicCache::get_variants(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::map<sha256ptr_t, ImageVariants*, SHA256Comparator>::iterator it = variants_cached.find(hash);
+
+        if (it == variants_cached.end())
+            return nullptr;
+
+        return it->second;
+    }
+
+    Video *SimpicCache::insert(Video *vid)
+    {
+        std::lock_guard<std::mutex> lock(saving_mutex);
+
+        std::map<sha256ptr_t, Video*, SHA256Comparator>::iterator it = video_cached.find(vid->sha256);
+
+        if (it != video_cached.end())
+            return it->second;
+
+        new_video_entries.push_back({vid->sha256, vid});
+
+        entries_mutex.lock();
+        video_cached[vid->sha256] = vid;
+        entries_mutex.unlock();
+
+        return vid;
+    }
+
+    Audio *SimpicCache::insert(Audio *aud)
+    {
+        std::lock_guard<std::mutex> lock(saving_mutex);
+
+        std::map<sha256ptr_t, Audio*, SHA256Comparator>::iterator it = audio_cached.find(aud->sha256);
+
+        if (it != audio_cached.end())
+            return it->second;
+
+        new_audio_entries.push_back({aud->sha256, aud});
+
+        entries_mutex.lock();
+        audio_cached[aud->sha256] = aud;
+        entries_mutex.unlock();
+
+        return aud;
+    }
+
+    Text *SimpicCache::insert(Text *txt)
+    {
+        std::lock_guard<std::mutex> lock(saving_mutex);
+
+        std::map<sha256ptr_t, Text*, SHA256Comparator>::iterator it = text_cached.find(txt->sha256);
+
+        if (it != text_cached.end())
+            return it->second;
+
+        new_text_entries.push_back({txt->sha256, txt});
+
+        entries_mutex.lock();
+        text_cached[txt->sha256] = txt;
+        entries_mutex.unlock();
+
+        return txt;
+    }
+
+    ImageMH *SimpicCache::get_mh(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::map<sha256ptr_t, ImageMH*, SHA256Comparator>::iterator it = mh_cached.find(hash);
+
+        if (it == mh_cached.end())
+            return nullptr;
+
+        return it->second;
+    }
+
+    Video *SimpicCache::get_video(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::map<sha256ptr_t, Video*, SHA256Comparator>::iterator it = video_cached.find(hash);
+
+        if (it == video_cached.end())
+            return nullptr;
+
+        return it->second;
+    }
+
+    Audio *SimpicCache::get_audio(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::map<sha256ptr_t, Audio*, SHA256Comparator>::iterator it = audio_cached.find(hash);
+
+        if (it == audio_cached.end())
+            return nullptr;
+
+        return it->second;
+    }
+
+    Text *SimpicCache::get_text(sha256ptr_t hash)
+    {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
+        std::map<sha256ptr_t, Text*, SHA256Comparator>::iterator it = text_cached.find(hash);
+
+        if (it == text_cached.end())
+            return nullptr;
+
+        return it->second;
+    }
+
     SHA256CachedObject *SimpicCache::get_sha256(const std::string &path, uint64_t length, uint64_t timestamp)
     {
+        std::lock_guard<std::mutex> lock(entries_mutex);
+
         std::unordered_map<std::string, SHA256CachedObject*>::iterator 
                 it = sha256_cached.find(path);
 
@@ -352,11 +1085,37 @@ namespace SimpicServerLib
         return obj;
     }
 
+    SHA256CachedObject *SimpicCache::sha256_of(const std::string &path, std::FILE *fp, const struct stat &fileinfo)
+    {
+        SHA256CachedObject *obj = get_sha256(path, fileinfo.st_size, fileinfo.st_mtim.tv_sec);
+
+        if (obj != nullptr)
+            return obj;
+
+        sha256_t buffer[SHA256_DIGEST_LENGTH];
+        calculate_sha256(fp, buffer);
+        std::fseek(fp, 0, SEEK_SET);
+
+        obj = new SHA256CachedObject(buffer, fileinfo.st_mtim.tv_sec, fileinfo.st_size);
+        insert({path, obj});
+
+        return obj;
+    }
+
     CacheEntryTypes SimpicCache::get_type_from_extension(const std::string &ext)
     {
         if (Image::type_from_extension(ext) != ImageType::Undefined)
             return CacheEntryTypes::Image;
 
+        if (Video::type_from_extension(ext) != VideoTypes::Undefined)
+            return CacheEntryTypes::Video;
+
+        if (Audio::type_from_extension(ext) != AudioTypes::Undefined)
+            return CacheEntryTypes::Audio;
+
+        if (Text::type_from_extension(ext) != TextTypes::Undefined)
+            return CacheEntryTypes::Text;
+
         return CacheEntryTypes::Undefined;
     }
 }
\ No newline at end of file
@@ -3,12 +3,14 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
 #include <mutex>
 #include <thread>
+#include <atomic>
 
 #include <cstdio>
 #include <errno.h>
@@ -18,6 +20,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 
 #include <openssl/sha.h>
 
@@ -25,9 +28,19 @@
 #include "images.hpp"
 #include "videos.hpp"
 #include "audios.hpp"
+#include "texts.hpp"
+#include "dihedral.hpp"
+#include "perceptual_hash.hpp"
 
 #define SIMPIC_SHA256_CACHE_MAGIC 0xAADEADAA
-#define SIMPIC_CACHE_MAGIC 0x00DEAD00
+#define SIMPIC_CACHE_MAGIC 0x00DEAD04
+#define SIMPIC_CACHE_MAGIC_OLDEST 0x00DEAD00
+#define SIMPIC_CACHE_MAGIC_WIDE_VIDEOS 0x00DEAD01
+#define SIMPIC_CACHE_MAGIC_WIDE_AUDIO 0x00DEAD02
+#define SIMPIC_CACHE_MAGIC_HASH_VERSIONS 0x00DEAD03
+#define SIMPIC_CACHE_MAGIC_WIDE_TEXTS 0x00DEAD04
+#define SIMPIC_DIRS_CACHE_MAGIC 0xDDDEADE0
+#define SIMPIC_DIRS_CACHE_MAGIC_OLDEST 0xDDDEADDD
 
 
 namespace SimpicServerLib
@@ -45,6 +58,8 @@ namespace SimpicServerLib
         Video,
         Audio,
         Text,
+        ImageVariants, // the hashes of an image's rotations and mirror images.
+        ImageMH, // the Marr-Hildreth hash of an image, to verify perceptual matches with.
         Undefined
     };
 
@@ -55,6 +70,13 @@ namespace SimpicServerLib
         uint8_t type;
     };
 
+    /* What the DCT hash of a cached image was made from: pHash's own decode (CImg, and ImageMagick for GIFs), or the DecoderRegistry's, which comes out differently for GIFs and 16-bit PNGs. */
+    enum class ImageHashVersion : uint8_t
+    {
+        PHash = 0,
+        DecoderRegistry = 1
+    };
+
     struct __attribute__((__packed__)) cache_image_entry
     {
         char sha256_hash[SHA256_DIGEST_LENGTH];
@@ -64,6 +86,83 @@ namespace SimpicServerLib
         uint16_t height;
 
         uint32_t size;
+        uint8_t hash_version; // ImageHashVersion.
+    };
+
+    /* The same, in caches older than SIMPIC_CACHE_MAGIC_HASH_VERSIONS, all of them hashed by pHash. */
+    struct __attribute__((__packed__)) cache_old_image_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t perceptual_hash;
+
+        uint16_t width;
+        uint16_t height;
+
+        uint32_t size;
+    };
+
+    struct __attribute__((__packed__)) cache_image_variants_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t variants[DIHEDRAL_TRANSFORMS]; // by DihedralTransforms.
+    };
+
+    /* One perceptual hash (of any width, by its words) of the file with the given SHA256. */
+    template <typename Hash>
+    struct __attribute__((__packed__)) cache_hash_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t hash[Hash::WORDS];
+    };
+
+    typedef cache_hash_entry<MHHash> cache_image_mh_entry;
+
+    /* Followed by frame_no uint64_t keyframe hashes, in order. */
+    struct __attribute__((__packed__)) cache_video_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t size;
+        uint32_t frame_no;
+    };
+
+    /* The same, in caches older than SIMPIC_CACHE_MAGIC_WIDE_VIDEOS. */
+    struct __attribute__((__packed__)) cache_old_video_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint32_t size;
+        uint32_t frame_no;
+    };
+
+    /* Followed by fingerprint_no uint32_t sub-fingerprints, in order. */
+    struct __attribute__((__packed__)) cache_audio_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t size;
+        uint32_t fingerprint_no;
+    };
+
+    /* The same, in caches older than SIMPIC_CACHE_MAGIC_WIDE_AUDIO. */
+    struct __attribute__((__packed__)) cache_old_audio_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint32_t size;
+        uint32_t fingerprint_no;
+    };
+
+    /* Followed by point_no uint64_t hash points, sorted. */
+    struct __attribute__((__packed__)) cache_text_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t size;
+        uint32_t point_no;
+    };
+
+    /* The same, in caches older than SIMPIC_CACHE_MAGIC_WIDE_TEXTS. */
+    struct __attribute__((__packed__)) cache_old_text_entry
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint32_t size;
+        uint32_t point_no;
     };
 
     struct __attribute__((__packed__)) cache_sha256_header
@@ -80,6 +179,76 @@ namespace SimpicServerLib
         uint64_t length;
     };
 
+    struct __attribute__((__packed__)) cache_dirs_header
+    {
+        uint32_t magic;
+        uint64_t entries;
+    };
+
+    /* Followed by the path, then each subdirectory (a uint16_t length and the name), then each file. */
+    struct __attribute__((__packed__)) cache_dir_entry
+    {
+        uint16_t path_len;
+        uint64_t device;
+        uint64_t inode;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t ctime_sec;
+        int64_t ctime_nsec;
+        uint32_t subdirs;
+        uint32_t files;
+    };
+
+    /* Followed by the name. */
+    struct __attribute__((__packed__)) cache_dir_file_entry
+    {
+        uint16_t name_len;
+        sha256_t hash[SHA256_DIGEST_LENGTH];
+    };
+
+    struct SnapshotFile
+    {
+        std::string name;
+        sha256_t hash[SHA256_DIGEST_LENGTH];
+    };
+
+    /* The perceptual hashes of every rotation and mirror image of an image, which are only worked out for images that are asked about that way. */
+    struct ImageVariants
+    {
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+        uint64_t hashes[DIHEDRAL_TRANSFORMS]; // by DihedralTransforms.
+    };
+
+    /* pHash's 576-bit Marr-Hildreth hash of an image, which is much slower to work out but tells images apart much better than the DCT hash, so it is only worked out for images that the DCT hash says are close to another. */
+    struct ImageMH
+    {
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+        MHHash hash;
+    };
+
+    /* What a directory looked like the last time it was scanned: its identity and timestamps, its (non-hidden) subdirectories and the SHA256 of each supported file in it. */
+    /* Adding, removing or renaming anything in a directory changes its mtime, so if that (and the rest) still matches, the listing can be reused without opening a single file. */
+    /* Overwriting a file's contents in place does NOT touch the directory, so that is only noticed once something else in the directory changes. */
+    class DirectorySnapshot
+    {
+    public:
+        uint64_t device;
+        uint64_t inode;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t ctime_sec;
+        int64_t ctime_nsec;
+
+        std::vector<std::string> subdirs;
+        std::vector<SnapshotFile> files;
+
+        DirectorySnapshot();
+        DirectorySnapshot(const struct stat &info);
+
+        /* Whether the directory (as given by stat()) is still the one this was taken of. */
+        bool matches(const struct stat &info);
+    };
+
     class SimpicCacheException : std::exception
     {
     public:
@@ -106,27 +275,56 @@ namespace SimpicServerLib
 
         std::string location;
         std::string sha256_location;
+        std::string dirs_location;
 
         std::ofstream output;
         std::ifstream input;
 
+        /* The cache was read from an older layout: the next saveall() writes all of it again, instead of adding to it. */
+        bool outdated;
+
         /* For images */
         std::map<sha256ptr_t, Image*, SHA256Comparator> cached;
         std::vector<std::pair<sha256ptr_t, Image*>> new_entries;
 
-        /* For audio */
+        /* The images (by SHA256) whose hash was made by ImageHashVersion::PHash, and those replace() took the place of (which someone may still be using). */
+        std::unordered_set<std::string> phash_hashed;
+        std::vector<Image*> replaced;
 
+        /* For the variants of images */
+        std::map<sha256ptr_t, ImageVariants*, SHA256Comparator> variants_cached;
+        std::vector<ImageVariants*> new_variants_entries;
+
+        /* For the Marr-Hildreth hashes of images */
+        std::map<sha256ptr_t, ImageMH*, SHA256Comparator> mh_cached;
+        std::vector<ImageMH*> new_mh_entries;
+
+        /* For audio (sub-fingerprints) */
         std::map<sha256ptr_t, Audio*, SHA256Comparator> audio_cached;
         std::vector<std::pair<sha256ptr_t, Audio*>> new_audio_entries;
 
-        /* For video */
+        /* For video (keyframe hashes) */
         std::map<sha256ptr_t, Video*, SHA256Comparator> video_cached;
         std::vector<std::pair<sha256ptr_t, Video*>> new_video_entries;
 
+        /* For text (hash points) */
+        std::map<sha256ptr_t, Text*, SHA256Comparator> text_cached;
+        std::vector<std::pair<sha256ptr_t, Text*>> new_text_entries;
+
         /* For SHA256 */
         std::unordered_map<std::string, SHA256CachedObject*> sha256_cached;
         std::vector<std::pair<std::string, SHA256CachedObject*>> new_sha256_entries;
 
+        /* For directory snapshots */
+        std::unordered_map<std::string, std::shared_ptr<DirectorySnapshot>> dirs_cached;
+        std::vector<std::pair<std::string, std::shared_ptr<DirectorySnapshot>>> new_dirs_entries;
+
+        /* Bumped whenever an image or a location is added (or a location's contents change), so that whatever is derived from them knows when to redo it. */
+        std::atomic<uint64_t> changes;
+
+        void read_dirs();
+        void save_dirs();
+
     public:
         std::mutex saving_mutex;
         std::mutex entries_mutex;
@@ -140,18 +338,53 @@ namespace SimpicServerLib
         /* Also can throw an exception. */
         void saveall();
 
-        void insert(Image *img);
-        void insert(Video *vid);
-        void insert(Audio *aud);
+        /* Cache an image (or a video, audio file or document) unless another one with the same contents got there first, and return the one that is cached: if it isn't the one given, that one is still the caller's. */
+        const Image *insert(Image *img);
+        void insert(ImageVariants *variants);
+        void insert(ImageMH *mh);
+        Video *insert(Video *vid);
+        Audio *insert(Audio *aud);
+        Text *insert(Text *txt);
         void insert(std::pair<std::string, SHA256CachedObject*> shaobj);
+        void insert(const std::string &path, std::shared_ptr<DirectorySnapshot> snapshot);
+
+        /* Whether a cached image's hash was made by pHash rather than the DecoderRegistry (see ImageHashVersion). */
+        bool phash_hashed_image(sha256ptr_t hash);
+
+        /* The DecoderRegistry hashes this image the same as pHash did (it isn't a GIF or a 16-bit PNG): remember it as hashed by the registry. */
+        void confirm_image(sha256ptr_t hash);
+
+        /* Cache the same contents hashed again by the DecoderRegistry in place of one hashed by pHash, and return it; or, if somebody did that (or confirm_image()) first, return the one that is cached, like insert(). The one replaced stays valid. */
+        const Image *replace(Image *img);
 
-        Image *get_image(sha256ptr_t hash);
+        /* Cached images are contents only, and shared: see Image. */
+        const Image *get_image(sha256ptr_t hash);
+        ImageVariants *get_variants(sha256ptr_t hash);
+        ImageMH *get_mh(sha256ptr_t hash);
+        Video *get_video(sha256ptr_t hash);
+        Audio *get_audio(sha256ptr_t hash);
+        Text *get_text(sha256ptr_t hash);
 
         /* See if we have a SHA256 hash cached for a file at path, but check if has been differed. */
         /* If it has been differed, this function will return nullptr. */
         /* If the SHA256 hash isn't cached, this function will also return nullptr. */
         SHA256CachedObject *get_sha256(const std::string &path, uint64_t length, uint64_t timestamp);
 
+        /* Get the SHA256 hash of the file at path (already opened as fp) from the cache, or compute it and cache it if it's missing or outdated. */
+        SHA256CachedObject *sha256_of(const std::string &path, std::FILE *fp, const struct stat &fileinfo);
+
+        /* Every image in the cache, at the moment. */
+        std::vector<const Image*> all_images();
+
+        /* Every path with a cached SHA256 hash, at the moment. The paths may be outdated. */
+        std::vector<std::pair<std::string, SHA256CachedObject*>> all_locations();
+
+        /* Changes whenever an image or a location is added. */
+        uint64_t generation();
+
+        /* The last snapshot taken of the directory at path, or nullptr. Whether it still matches the directory is up to the caller. */
+        std::shared_ptr<DirectorySnapshot> get_directory(const std::string &path);
+
         /* Ascertain what kind of file it is from the extension. */
         static CacheEntryTypes get_type_from_extension(const std::string &ext);
     };
@@ -2,13 +2,20 @@
 
 namespace SimpicServerLib
 {
-    SimpicClient::SimpicClient(SimpicCache *_cache, const std::string &recycle_bin, 
+    SimpicClient::SimpicClient(SimpicCache *_cache, ThumbnailCache *_thumbnails, HashingPool *_pool,
+			Scanner *_scanner, LibraryIndex *_library, Verifier *_verifier, const std::string &recycle_bin,
 			Logger *main, Logger *moving)
 	{
 		cache = _cache;
+		thumbnails = _thumbnails;
+		pool = _pool;
+		scanner = _scanner;
+		library = _library;
+		verifier = _verifier;
 		recycling_bin = recycle_bin;
 		main_log = main;
 		moving_log = moving;
+		extensions = 0;
 	}
 
 	void SimpicClient::deal_with_file(const std::string &path, const std::string &filename)
@@ -37,43 +44,107 @@ namespace SimpicServerLib
 	}
 
 	void SimpicClient::set_of_pics(std::vector<Image*> *pics)
+	{
+		ImageRecords records;
+		SetList set;
+
+		for (Image *pic : *pics)
+			set.push(records.add(*pic, {pic->path, pic->filename}));
+
+		set.end_set();
+		set_of_pics(records, set, 0);
+	}
+
+	void SimpicClient::exact_duplicates(const ImageRecords &pics, const SetList &exact)
+	{
+		if (!uses(ProtocolExtensions::ExactDuplicates) || exact.empty())
+			return;
+
+		struct MainHeader ehdr;
+		ehdr.code = (uint8_t) MainHeaderCodes::ExactDuplicates;
+		ehdr._errno = 0;
+		ehdr.set_no = exact.size();
+		sendall(fd, &ehdr, sizeof(ehdr));
+
+		for (size_t i = 0; i < exact.size(); i++)
+			set_of_pics(pics, exact, i);
+	}
+
+	void SimpicClient::set_of_pics(const ImageRecords &pics, const SetList &sets, size_t set)
 	{
 		/* Tell the client that we are sending a set of pictures. */
 		struct SetHeader sethdr;
-		sethdr.count = pics->size();
+		sethdr.count = sets.count(set);
 		sethdr.type = (uint8_t) DataTypes::Image;
 		sendall(fd, &sethdr, sizeof(sethdr));
 
-		for (Image *pic : *pics)
+		for (const uint32_t *id = sets.begin(set); id != sets.end(set); id++)
 		{
+			const ImageRecord &pic = pics[*id];
+			std::string_view filename = pics.filename(*id);
+			std::string_view path = pics.path(*id);
+
 			/* Give valuable information about each picture. */
 			struct ImageHeader imghdr;
 
-			imghdr.filename_length = pic->filename.size() + 1;
-			std::memcpy(imghdr.sha256_hash, pic->sha256, sizeof(imghdr.sha256_hash));
+			imghdr.filename_length = filename.size() + 1;
+			std::memcpy(imghdr.sha256_hash, pic.sha256, sizeof(imghdr.sha256_hash));
 			// inefficient ~~~^
 
-			imghdr.size = pic->length;
+			/* A needle the client only gave the hash (or the contents) of has no file here to send. */
+			bool located = !filename.empty();
+			imghdr.size = located ? pic.length : 0;
 			
-			imghdr.path_length = pic->path.size() + 1;
-			imghdr.width = pic->width;
-			imghdr.height = pic->height;
+			imghdr.path_length = path.size() + 1;
+			imghdr.width = pic.width;
+			imghdr.height = pic.height;
 
 			sendall(fd, &imghdr, sizeof(imghdr));
 
-			/* Send the filename and then the path. */
-			sendall(fd, (char*) pic->filename.c_str(), imghdr.filename_length);
-			sendall(fd, (char*) pic->path.c_str(), imghdr.path_length);
+			/* Send the filename and then the path (both NUL-terminated in the string table). */
+			sendall(fd, (char*) filename.data(), imghdr.filename_length);
+			sendall(fd, (char*) path.data(), imghdr.path_length);
 
 			
 			/* Receive the plea from the client which states what else they want from us. */
 			struct ClientPlea plea;
-			recvall(fd, &plea, sizeof(plea));
+			uint16_t thumbnail;
+			receive_plea(plea, thumbnail);
+
+			/* The client would rather have a thumbnail than the whole file. */
+			if (!plea.no_data && thumbnail != 0)
+			{
+				if (located)
+					send_thumbnail(pic.sha256, pics.abspath(*id), thumbnail);
+				else
+				{
+					uint32_t none = 0;
+					sendall(fd, &none, sizeof(none));
+				}
+
+				continue;
+			}
 
 			/* If the client didn't make a plea for no data... Self-explanatory.*/
-			if (!plea.no_data)
+			if (!plea.no_data && located)
 			{
-				std::FILE *fp = std::fopen(pic->abspath().c_str(), "rb");
+				std::FILE *fp = std::fopen(pics.abspath(*id).c_str(), "rb");
+
+				/* Gone since it was found: the size was promised in the header, so the client gets zeroes instead. */
+				if (fp == nullptr)
+				{
+					char zeroes[BUFFER_SIZE] = {0};
+
+					for (uint64_t left = imghdr.size; left != 0; )
+					{
+						uint32_t amnt = std::min(left, (uint64_t) sizeof(zeroes));
+						sendall(fd, zeroes, amnt);
+						left -= amnt;
+					}
+
+					continue;
+				}
+
 				std::fseek(fp, 0, SEEK_END);
 				size_t file_size = std::ftell(fp);
 
@@ -86,6 +157,179 @@ namespace SimpicServerLib
 			}
 		}
 
+		std::vector<std::pair<std::string, std::string>> files;
+
+		for (const uint32_t *id = sets.begin(set); id != sets.end(set); id++)
+			files.push_back({std::string(pics.path(*id)), std::string(pics.filename(*id))});
+
+		act_on_set(files);
+	}
+
+	void SimpicClient::set_of_videos(std::vector<Video*> *vids)
+	{
+		struct SetHeader sethdr;
+		sethdr.count = vids->size();
+		sethdr.type = (uint8_t) DataTypes::Video;
+		sendall(fd, &sethdr, sizeof(sethdr));
+
+		std::vector<std::pair<std::string, std::string>> files;
+
+		for (Video *vid : *vids)
+		{
+			struct VideoHeader vidhdr;
+			std::memcpy(vidhdr.sha256_hash, vid->sha256, sizeof(vidhdr.sha256_hash));
+			vidhdr.keyframes = vid->frames.size();
+			vidhdr.size = vid->length;
+			vidhdr.filename_length = vid->filename.size() + 1;
+			vidhdr.path_length = vid->path.size() + 1;
+
+			sendall(fd, &vidhdr, sizeof(vidhdr));
+			sendall(fd, (char*) vid->filename.c_str(), vidhdr.filename_length);
+			sendall(fd, (char*) vid->path.c_str(), vidhdr.path_length);
+
+			files.push_back({vid->path, vid->filename});
+
+			struct ClientPlea plea;
+			uint16_t thumbnail;
+			receive_plea(plea, thumbnail);
+
+			send_media_file(vid->abspath(), vid->length, plea, thumbnail);
+		}
+
+		act_on_set(files);
+	}
+
+	void SimpicClient::set_of_audios(std::vector<Audio*> *auds)
+	{
+		struct SetHeader sethdr;
+		sethdr.count = auds->size();
+		sethdr.type = (uint8_t) DataTypes::Audio;
+		sendall(fd, &sethdr, sizeof(sethdr));
+
+		std::vector<std::pair<std::string, std::string>> files;
+
+		for (Audio *aud : *auds)
+		{
+			struct AudioHeader audhdr;
+			std::memcpy(audhdr.sha256_hash, aud->sha256, sizeof(audhdr.sha256_hash));
+			audhdr.fingerprints = aud->fingerprints.size();
+			audhdr.size = aud->length;
+			audhdr.filename_length = aud->filename.size() + 1;
+			audhdr.path_length = aud->path.size() + 1;
+
+			sendall(fd, &audhdr, sizeof(audhdr));
+			sendall(fd, (char*) aud->filename.c_str(), audhdr.filename_length);
+			sendall(fd, (char*) aud->path.c_str(), audhdr.path_length);
+
+			files.push_back({aud->path, aud->filename});
+
+			struct ClientPlea plea;
+			uint16_t thumbnail;
+			receive_plea(plea, thumbnail);
+
+			send_media_file(aud->abspath(), aud->length, plea, thumbnail);
+		}
+
+		act_on_set(files);
+	}
+
+	void SimpicClient::set_of_texts(std::vector<Text*> *txts)
+	{
+		struct SetHeader sethdr;
+		sethdr.count = txts->size();
+		sethdr.type = (uint8_t) DataTypes::Text;
+		sendall(fd, &sethdr, sizeof(sethdr));
+
+		std::vector<std::pair<std::string, std::string>> files;
+
+		for (Text *txt : *txts)
+		{
+			struct TextHeader txthdr;
+			std::memcpy(txthdr.sha256_hash, txt->sha256, sizeof(txthdr.sha256_hash));
+			txthdr.points = txt->points.size();
+			txthdr.size = txt->length;
+			txthdr.filename_length = txt->filename.size() + 1;
+			txthdr.path_length = txt->path.size() + 1;
+
+			sendall(fd, &txthdr, sizeof(txthdr));
+			sendall(fd, (char*) txt->filename.c_str(), txthdr.filename_length);
+			sendall(fd, (char*) txt->path.c_str(), txthdr.path_length);
+
+			files.push_back({txt->path, txt->filename});
+
+			struct ClientPlea plea;
+			uint16_t thumbnail;
+			receive_plea(plea, thumbnail);
+
+			send_media_file(txt->abspath(), txt->length, plea, thumbnail);
+		}
+
+		act_on_set(files);
+	}
+
+	bool SimpicClient::uses(ProtocolExtensions extension) const
+	{
+		return (extensions & (uint32_t) extension) != 0;
+	}
+
+	void SimpicClient::negotiate_extensions()
+	{
+		uint32_t wanted = 0;
+		recvall(fd, &wanted, sizeof(wanted));
+
+		extensions = wanted & ((uint32_t) ProtocolExtensions::Thumbnails | (uint32_t) ProtocolExtensions::ExactDuplicates);
+		sendall(fd, &extensions, sizeof(extensions));
+	}
+
+	void SimpicClient::receive_plea(struct ClientPlea &plea, uint16_t &thumbnail)
+	{
+		recvall(fd, &plea, sizeof(plea));
+		thumbnail = 0;
+
+		if (uses(ProtocolExtensions::Thumbnails))
+			recvall(fd, &thumbnail, sizeof(thumbnail));
+	}
+
+	void SimpicClient::send_media_file(const std::string &path, uint64_t length, const struct ClientPlea &plea, uint16_t thumbnail)
+	{
+		if (plea.no_data)
+			return;
+
+		/* There are no thumbnails of videos, audio or documents. */
+		if (thumbnail != 0)
+		{
+			uint32_t none = 0;
+			sendall(fd, &none, sizeof(none));
+			return;
+		}
+
+		int mfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat info;
+
+		if (mfd < 0 || fstat(mfd, &info) < 0)
+		{
+			if (mfd >= 0)
+				close(mfd);
+
+			/* The size was promised in the header: the client is owed that many bytes regardless. */
+			char zeroes[BUFFER_SIZE] = {0};
+
+			for (uint64_t left = length; left != 0; )
+			{
+				uint32_t amnt = std::min(left, (uint64_t) sizeof(zeroes));
+				sendall(fd, zeroes, amnt);
+				left -= amnt;
+			}
+
+			return;
+		}
+
+		new_sendfile(fd, mfd, length);
+		close(mfd);
+	}
+
+	void SimpicClient::act_on_set(const std::vector<std::pair<std::string, std::string>> &files)
+	{
 		struct ClientAction act;
 		recvall(fd, &act, sizeof(act));
 
@@ -107,137 +351,373 @@ namespace SimpicServerLib
 
 			try 
 			{
-				Image *img = (*pics)[index];
-				deal_with_file(img->path, img->filename);
+				const std::pair<std::string, std::string> &file = files.at(index);
+
+				/* Not a file on the server (a needle that was only uploaded or offered). */
+				if (file.second.empty())
+					continue;
+
+				deal_with_file(file.first, file.second);
 			}
 			catch (std::out_of_range &ex)
 			{
-				std::cerr << "Incorrect index given in set_of_pics(): " << index << "\n";
+				std::cerr << "Incorrect index given for a set: " << (int) index << "\n";
 			}
 		}
 	}
 
-	int SimpicClient::simpic_in_directory(const std::string &dir, ClientRequests req, uint8_t max_ham)
+	bool SimpicClient::receive_upload(uint32_t length, CheckUpload &upload)
 	{
-		std::vector<Image*> imgs;
-		std::map<sha256ptr_t, Image*, SHA256Comparator> hash2img;
+		/* It would all have to be read to skip over it, so the connection is given up on instead. */
+		if (length > UPLOAD_SIZE_LIMIT)
+		{
+			struct MainHeader mh;
+			mh.code = (uint8_t) MainHeaderCodes::UnreasonablyLongFileSize;
+			mh._errno = EFBIG;
+			mh.set_no = -1;
 
-		DIR *d = opendir(dir.c_str());
+			{
+				std::lock_guard<std::mutex> lock(send_mutex);
+				sendall(fd, &mh, sizeof(mh));
+			}
 
-		if (d == nullptr)
-		{
-			int error = errno;
-			std::cerr << "Error opening directory '" << dir << "': " << std::strerror(error) << "\n";
-			return error;
+			throw simpic_networking_exception("upload of " + std::to_string(length) + " bytes is over the limit of " +
+				std::to_string(UPLOAD_SIZE_LIMIT), EFBIG);
 		}
 
-		/* Go through every file in the directory given, using C's <dirent.h> interface. */
-		for (struct dirent *ent = readdir(d); ent != nullptr; ent = readdir(d))
+		upload.fd = memfd_create("simpic_upload", MFD_CLOEXEC);
+
+		if (upload.fd < 0)
+			std::cerr << "[" << to_string() << "]: memfd_create() failed: " << std::strerror(errno) << "\n";
+
+		SHA256Stream hashing;
+
+		char buffer[BUFFER_SIZE];
+		uint32_t remaining = length;
+
+		/* Even if we have nowhere to put the data, it still has to be drained from the socket. */
+		while (remaining != 0)
 		{
-			/* We have no business with other types of files. */
-			if (ent->d_type != DT_DIR && ent->d_type != DT_REG)
+			uint32_t amnt = std::min(remaining, (uint32_t) sizeof(buffer));
+			recvall(fd, buffer, amnt);
+			remaining -= amnt;
+
+			if (upload.fd < 0)
 				continue;
 
-			/* This is a directory, obviously... */
-			if (ent->d_type == DT_DIR)
+			hashing.update(buffer, amnt);
+
+			if (write(upload.fd, buffer, amnt) != amnt)
 			{
-				/* Special directories we don't want to traverse. */
-				if (ent->d_name[0] == '.')
-					continue;
+				std::cerr << "[" << to_string() << "]: failed to buffer upload: " << std::strerror(errno) << "\n";
+				close(upload.fd);
+				upload.fd = -1;
+			}
+		}
 
-				if (req != ClientRequests::ScanRecursive || req != ClientRequests::CheckRecursive)
-					continue;
+		if (upload.fd < 0)
+			return false;
 
+		hashing.finish(upload.hash);
+		return true;
+	}
 
-				continue;
-			}
+	void SimpicClient::receive_check_data(uint32_t length)
+	{
+		CheckUpload upload;
 
-			std::string cpp_name(ent->d_name);
-			
-			SimpicEntryTypes type = SimpicCache::get_type_from_extension(get_extension(cpp_name));
+		if (receive_upload(length, upload))
+			check_uploads.push_back(upload);
+	}
 
-			/* Unsupported type. */
-			if (type == SimpicEntryTypes::Undefined)
-				continue;
+	void SimpicClient::receive_check_offer(uint32_t length)
+	{
+		sha256_t offered[SHA256_DIGEST_LENGTH];
+		recvall(fd, offered, sizeof(offered));
+
+		struct CheckOfferReply reply;
+
+		if (cache->get_image(offered) == nullptr)
+		{
+			reply.reply = (uint8_t) CheckOfferReplies::Unknown;
+			sendall(fd, &reply, sizeof(reply));
+
+			receive_check_data(length);
+			return;
+		}
+
+		reply.reply = (uint8_t) CheckOfferReplies::Known;
+		sendall(fd, &reply, sizeof(reply));
 
-			/* C-style file handling works more nicely with the libraries we're using. */
-			/* ... plus I think it's better than <fstream>. */
+		CheckUpload upload;
+		upload.fd = -1;
+		std::memcpy(upload.hash, offered, SHA256_DIGEST_LENGTH);
+		check_uploads.push_back(upload);
+	}
+
+	void SimpicClient::clear_check()
+	{
+		for (CheckUpload &upload : check_uploads)
+		{
+			if (upload.fd >= 0)
+				close(upload.fd);
+		}
+
+		check_uploads.clear();
+		check_files.clear();
+		check_files_dct_phash.clear();
+	}
+
+	void SimpicClient::send_hash_response(uint32_t id, HashResponseCodes code, const Image *img)
+	{
+		struct HashResponse resp;
+		std::memset(&resp, 0, sizeof(resp));
+
+		resp.id = id;
+		resp.code = (uint8_t) code;
+
+		if (img != nullptr)
+		{
+			std::memcpy(resp.sha256_hash, img->sha256, sizeof(resp.sha256_hash));
+			resp.phash = img->phash;
+			resp.width = img->width;
+			resp.height = img->height;
+			resp.size = img->length;
+		}
 
-			std::string absname = dir + "/" + std::string(ent->d_name);
-			std::FILE *fp = std::fopen(absname.c_str(), "rb");
+		/* Called from the hashing pool, where nothing may throw: if the client went away, the */
+		/* handler will find out on its next recvall(). */
+		std::lock_guard<std::mutex> lock(send_mutex);
+
+		try
+		{
+			sendall(fd, &resp, sizeof(resp));
+		}
+		catch (simpic_networking_exception &ex)
+		{
+			std::cerr << "[" << to_string() << "]: failed to send hash response: " << ex.what() << "\n";
+		}
+	}
+
+	void SimpicClient::hash_path(uint32_t id, const std::string &abspath, HashingGroup &group)
+	{
+		struct stat fileinfo;
+
+		if (stat(abspath.c_str(), &fileinfo) < 0 || !S_ISREG(fileinfo.st_mode))
+		{
+			send_hash_response(id, HashResponseCodes::Failure, nullptr);
+			return;
+		}
+
+		if (SimpicCache::get_type_from_extension(get_extension(abspath)) != SimpicEntryTypes::Image)
+		{
+			send_hash_response(id, HashResponseCodes::Unsupported, nullptr);
+			return;
+		}
+
+		/* A cache hit costs a stat() and two lookups, so don't bother the pool with it. */
+		SHA256CachedObject *sha256_obj = cache->get_sha256(abspath, fileinfo.st_size, fileinfo.st_mtim.tv_sec);
+		const Image *img = nullptr;
+
+		if (sha256_obj != nullptr && (img = cache->get_image(sha256_obj->hash)) != nullptr)
+		{
+			send_hash_response(id, HashResponseCodes::Success, img);
+			return;
+		}
+
+		group.submit(pool, [this, id, abspath]() -> void {
+			std::FILE *fp = std::fopen(abspath.c_str(), "rb");
 
-			/* The file didn't open for some reason? */
 			if (fp == nullptr)
 			{
-				std::cerr << "(" << to_string() << "): Error opening (valid?) file (" << absname << "): " 
-					<< std::strerror(errno) << std::endl;
-
-				continue;
+				send_hash_response(id, HashResponseCodes::Failure, nullptr);
+				return;
 			}
 
-			struct stat fileinfo;
-			stat(absname.c_str(), &fileinfo);
+			struct stat info;
+			fstat(fileno(fp), &info);
 
-			sha256_t image_hash_buffer[SHA256_DIGEST_LENGTH];
-			SHA256CachedObject *sha256_obj = nullptr;
+			SHA256CachedObject *obj = cache->sha256_of(abspath, fp, info);
 
-			/* Attempt to pull the SHA256 hash from the cache. */
-			if ((sha256_obj = cache->get_sha256(absname, fileinfo.st_size, fileinfo.st_mtim.tv_sec)) 
-					== nullptr)
-			{
-				calculate_sha256(fp, image_hash_buffer);
+			size_t slash = abspath.rfind('/');
+			std::string dir = slash == std::string::npos ? "." : abspath.substr(0, slash);
+			std::string name = slash == std::string::npos ? abspath : abspath.substr(slash + 1);
 
-				sha256_obj = new SHA256CachedObject(
-					image_hash_buffer,
-					fileinfo.st_mtim.tv_sec,
-					fileinfo.st_size
-				);
+			const Image *result = scanner->load_image(dir, name, fp, obj->hash);
+			std::fclose(fp);
 
-				/* Update the cache with a new one. */
-				cache->insert({absname, sha256_obj});
-			}
+			send_hash_response(id, result != nullptr ? HashResponseCodes::Success : HashResponseCodes::Failure, result);
+		});
+	}
+
+	void SimpicClient::hash_files(uint16_t count)
+	{
+		/* The jobs reference this client, so they have to finish before it can be freed: however this returns, */
+		/* even by an exception, the group waits for them as it goes. */
+		HashingGroup group;
 
-			sha256ptr_t image_hash = sha256_obj->hash;
+		for (int i = 0; i < count; i++)
+		{
+			struct ClientHashRequest hreq;
+			recvall(fd, &hreq, sizeof(hreq));
 
-			switch (type) 
+			uint32_t id = hreq.id;
+
+			switch ((ClientCheckRequestTypes) hreq.method)
 			{
-				case SimpicEntryTypes::Image: 
+				case ClientCheckRequestTypes::ByPath:
 				{
-					Image *img = nullptr;
+					if (hreq.length == 0)
+					{
+						send_hash_response(id, HashResponseCodes::Failure, nullptr);
+						break;
+					}
 
-					/* The image does not exist in the cache: make one, then put it into the cache. */
-					if ((img = cache->get_image(image_hash)) == nullptr)
+					char *h_path = new char[hreq.length];
+					recvall(fd, h_path, hreq.length);
+					h_path[hreq.length - 1] = '\0';
+
+					std::string abspath(h_path);
+					delete[] h_path;
+
+					hash_path(id, abspath, group);
+					break;
+				}
+
+				case ClientCheckRequestTypes::ByData:
+				{
+					CheckUpload upload;
+
+					if (!receive_upload(hreq.length, upload))
+					{
+						send_hash_response(id, HashResponseCodes::Failure, nullptr);
+						break;
+					}
+
+					const Image *img = cache->get_image(upload.hash);
+
+					if (img != nullptr)
 					{
-						img = new Image(dir, cpp_name, fp, image_hash);
+						close(upload.fd);
+						send_hash_response(id, HashResponseCodes::Success, img);
+						break;
+					}
 
-						/* If it does not have the magic or does not pass the test. */
-						/* This isn't very expensive, because it's actually really rare that this */
-						/* would happen. */
-						if (!img->get_info(fp))
-						{
-							std::fclose(fp);
-							delete img;
+					group.submit(pool, [this, id, upload]() mutable -> void {
+						std::FILE *fp = fdopen(upload.fd, "rb");
 
-							continue;
+						if (fp == nullptr)
+						{
+							close(upload.fd);
+							send_hash_response(id, HashResponseCodes::Failure, nullptr);
+							return;
 						}
 
-						cache->insert(img);
+						/* pHash wants a path, and /proc/self/fd/ gives the in-memory file one. */
+						const Image *result = scanner->load_image("/proc/self/fd", std::to_string(upload.fd), fp, upload.hash);
+						std::fclose(fp);
+
+						send_hash_response(id, result != nullptr ? HashResponseCodes::Success : HashResponseCodes::Failure, result);
+					});
+
+					break;
+				}
+
+				case ClientCheckRequestTypes::BySHA256:
+				{
+					sha256_t hash[SHA256_DIGEST_LENGTH];
+					recvall(fd, hash, sizeof(hash));
+
+					const Image *img = cache->get_image(hash);
+					send_hash_response(id, img != nullptr ? HashResponseCodes::Success : HashResponseCodes::NotFound, img);
+					break;
+				}
+
+				default:
+				{
+					/* Whatever was sent still has to be skipped over. */
+					char buffer[BUFFER_SIZE];
+					uint32_t remaining = hreq.length;
+
+					while (remaining != 0)
+					{
+						uint32_t amnt = std::min(remaining, (uint32_t) sizeof(buffer));
+						recvall(fd, buffer, amnt);
+						remaining -= amnt;
 					}
-			
-					img->filename = cpp_name;
-					img->path = dir;
 
-					imgs.push_back(img);
-					hash2img[img->sha256] = img;
+					send_hash_response(id, HashResponseCodes::Unsupported, nullptr);
 					break;
 				}
 			}
-
-			std::fclose(fp);
 		}
 
+		group.wait();
 		cache->saveall();
-		closedir(d);
+	}
+
+	void SimpicClient::send_thumbnail(const sha256_t *sha256, const std::string &abspath, uint16_t max_edge)
+	{
+		max_edge = ThumbnailCache::clamp_edge(max_edge);
+		std::optional<std::string> thumb = thumbnails->get(sha256, abspath, max_edge);
+
+		uint32_t length = 0;
+		std::FILE *fp = nullptr;
+
+		if (thumb && (fp = std::fopen(thumb->c_str(), "rb")) != nullptr)
+		{
+			std::fseek(fp, 0, SEEK_END);
+			length = std::ftell(fp);
+			std::fseek(fp, 0, SEEK_SET);
+		}
+
+		/* A length of 0 tells the client that no thumbnail is coming. */
+		sendall(fd, &length, sizeof(length));
+
+		if (fp == nullptr)
+			return;
+
+		new_sendfile(fd, fileno(fp), length);
+		std::fclose(fp);
+	}
+
+	int SimpicClient::simpic_in_directory(const std::string &dir, ClientRequests req, uint8_t max_ham, uint8_t types)
+	{
+		bool scanning = req == ClientRequests::Scan || req == ClientRequests::ScanRecursive;
+		bool checking = req == ClientRequests::Check || req == ClientRequests::CheckRecursive;
+
+		/* Images are always collected (a scan's results start with them); a check has nothing else to compare. */
+		uint8_t collecting = checking ? (uint8_t) DataTypes::Image : types | (uint8_t) DataTypes::Image;
+		bool exact_sent = false;
+		bool disconnected = false;
+
+		/* Whoever collects the directory sends the byte-identical images as soon as everything is hashed. */
+		auto on_hashed = [this, &exact_sent, &disconnected](const ImageRecords &dups, const SetList &exact) -> void {
+			exact_sent = true;
+
+			/* Everyone else on the flight still wants it collected. */
+			try
+			{
+				exact_duplicates(dups, exact);
+			}
+			catch (simpic_networking_exception &ex)
+			{
+				std::cerr << "(" << to_string() << "): Network error: " << ex.what() << std::endl;
+				disconnected = true;
+			}
+		};
+
+		/* If someone else is already collecting this directory, this waits for them. A client that may want thumbnails */
+		/* has them made by the decode that hashes the images. */
+		std::shared_ptr<ScanFlight> flight = scanner->scan(dir, req, collecting, [](int) -> void {}, uses(ProtocolExtensions::Thumbnails),
+			scanning && uses(ProtocolExtensions::ExactDuplicates) ? on_hashed : std::function<void(const ImageRecords&, const SetList&)>());
+		bool recursive = Scanner::is_recursive(req);
+
+		if (disconnected)
+			return -1;
+
+		if (flight->error != 0)
+			return flight->error;
 
 		/* If caching, no further actions need to be done. */
 		if (req == ClientRequests::Cache || req == ClientRequests::CacheRecursive)
@@ -251,55 +731,158 @@ namespace SimpicServerLib
 			return 0;
 		}
 
-		int total_images = 0;
-
 		struct UpdateHeader uh;
 		std::memset(&uh, 0, sizeof(uh));
 
-		if (req == ClientRequests::Check || req == ClientRequests::CheckRecursive)
+		if (checking)
 		{
-			std::vector<Image*> needles;
+			/* The needles, and then the images they are compared to: this request's own. */
+			/* A needle is where this request says it is, whoever else has the same contents cached. */
+			ImageRecords found;
+
 			for (const std::string &path : check_files)
 			{
 				std::FILE *fp = std::fopen(path.c_str(), "rb");
 				sha256_t ndl_hash[SHA256_DIGEST_LENGTH];
 				calculate_sha256(fp, (sha256ptr_t)ndl_hash);
 
-				Image *ndl_img = nullptr;
-				if ((ndl_img = cache->get_image(ndl_hash)) == nullptr)
+				size_t slash = path.rfind('/');
+				Location where = slash == std::string::npos ? Location{".", path} :
+					Location{std::string_view(path).substr(0, slash), std::string_view(path).substr(slash + 1)};
+
+				const Image *ndl_img = cache->get_image(ndl_hash);
+
+				if (ndl_img != nullptr)
+					found.add(*ndl_img, where);
+				else
 				{
-					ndl_img = new Image(
-						(const std::string)path,
-						(const std::string)path,
-						fp,
-						ndl_hash
-					);
-
-					if (!ndl_img->get_info(fp))
-					{
-						delete ndl_img;
-						goto check_explicit_cleanup;
-					}
+					Image img(fp, ndl_hash);
+
+					if (img.get_info(fp, path))
+						found.add(img, where);
+				}
+
+				std::fclose(fp);
+			}
+
+			/* Where the contents of an uploaded or offered needle were last seen (and still are), if anywhere: */
+			/* the in-memory file isn't anywhere the client could ask for, or ask to delete. */
+			std::shared_ptr<LibrarySnapshot> library_now = check_uploads.empty() ? nullptr : library->get();
+
+			auto seen_at = [&library_now](const sha256_t *sha256) -> Location {
+				auto it = library_now->locations.find(std::string(sha256, SHA256_DIGEST_LENGTH));
+
+				if (it == library_now->locations.end())
+					return {"", ""};
+
+				for (auto &[location, obj] : it->second)
+				{
+					struct stat info;
+
+					if (stat(location.c_str(), &info) < 0 || (uint64_t) info.st_size != obj->length ||
+							info.st_mtim.tv_sec != obj->timestamp)
+						continue;
+
+					size_t slash = location.rfind('/');
+					return {std::string_view(location).substr(0, slash), std::string_view(location).substr(slash + 1)};
+				}
+
+				return {"", ""};
+			};
+
+			/* Uploaded needles are already hashed, and probably already in the cache. */
+			for (CheckUpload &upload : check_uploads)
+			{
+				std::string name = std::to_string(upload.fd);
+				const Image *ndl_img = cache->get_image(upload.hash);
+
+				if (ndl_img != nullptr)
+				{
+					found.add(*ndl_img, seen_at(upload.hash));
+					continue;
 				}
 
-				needles.push_back(ndl_img);
+				if (upload.fd < 0)
+					continue;
+
+				std::FILE *fp = fdopen(dup(upload.fd), "rb");
+
+				if (fp == nullptr)
+					continue;
 
-check_explicit_cleanup:
+				/* pHash wants a path, and /proc/self/fd/ gives the in-memory file one. */
+				/* It's cached so that the next time this file is offered, it doesn't have to be uploaded. */
+				ndl_img = scanner->load_image("/proc/self/fd", name, fp, upload.hash);
 				std::fclose(fp);
+
+				if (ndl_img != nullptr)
+					found.add(*ndl_img, {"", ""});
 			}
 
+			uint32_t content_needles = found.size();
+
 			for (uint64_t ndl_hash : check_files_dct_phash)
 			{
-				Image *ndl_img = new Image();
-				ndl_img->phash = ndl_hash;
-				needles.push_back(ndl_img);
+				Image ndl_img;
+				ndl_img.phash = ndl_hash;
+				ndl_img.length = 0;
+				ndl_img.width = 0;
+				ndl_img.height = 0;
+				std::memset(ndl_img.sha256, 0, SHA256_DIGEST_LENGTH);
+
+				found.add(ndl_img, {"", ""});
+			}
+
+			uint32_t needles = found.size();
+
+			/* Byte-identical files first, in O(n); only one of each goes into the perceptual stage. */
+			/* Each group is copied in after the needles, its first image at first_of. */
+			SetList groups = flight->imgs.group_by_sha256(flight->images_for(dir, recursive));
+			std::vector<uint32_t> first_of(groups.size());
+
+			for (size_t g = 0; g < groups.size(); g++)
+			{
+				first_of[g] = found.size();
+
+				for (const uint32_t *id = groups.begin(g); id != groups.end(g); id++)
+					found.add(flight->imgs, *id);
 			}
 
-			std::vector<std::vector<Image*>*> results = Image::find_duplicates(
-				imgs,
-				needles,
-				max_ham
-			);
+			SetList exact;
+			SetList results;
+
+			for (uint32_t needle = 0; needle < needles; needle++)
+			{
+				results.push(needle);
+
+				for (size_t g = 0; g < groups.size(); g++)
+				{
+					uint32_t first = first_of[g];
+
+					/* Needles given by their perceptual hash have no contents to compare. */
+					if (needle < content_needles &&
+							std::memcmp(found[needle].sha256, found[first].sha256, SHA256_DIGEST_LENGTH) == 0)
+					{
+						exact.push(needle);
+
+						for (uint32_t id = first; id < first + groups.count(g); id++)
+							exact.push(id);
+
+						exact.end_set();
+						continue;
+					}
+
+					if (hamming_distance(found[needle].phash, found[first].phash) <= max_ham)
+						results.push(first);
+				}
+
+				results.end_set();
+			}
+
+			/* Every needle keeps its set, even if nothing is left in it. */
+			results = verifier->verify(found, results, true);
+
+			exact_duplicates(found, exact);
 
 			struct MainHeader mhdr;
 			mhdr.code = (uint8_t)MainHeaderCodes::Success;
@@ -308,16 +891,29 @@ check_explicit_cleanup:
 
 			sendall(fd, &mhdr, sizeof(mhdr));
 
-			for (std::vector<Image*>* result : results)
-			{
-				set_of_pics(result);
-				delete result;
-			}
+			for (size_t i = 0; i < results.size(); i++)
+				set_of_pics(found, results, i);
 		}
 
-		if (req == ClientRequests::Scan || req == ClientRequests::ScanRecursive)
+		if (scanning)
 		{
-			std::vector<std::vector<Image*>*> results = Image::find_similar_images(imgs, max_ham, [this, &uh](int x){
+			/* Someone else collected the directory: theirs were sent to them. */
+			if (!exact_sent)
+			{
+				try
+				{
+					exact_duplicates(flight->imgs, flight->exact_duplicates(dir, recursive));
+				}
+				catch (simpic_networking_exception &ex)
+				{
+					std::cerr << "(" << to_string() << "): Network error: " << ex.what() << std::endl;
+
+					cache->saveall();
+					return -1;
+				}
+			}
+
+			SetList results = flight->find_similar(dir, recursive, max_ham, [this, &uh](int x){
 				uh.images = x;
 
 				if (x % UPDATE_INCREMENTS == 0)
@@ -338,35 +934,494 @@ check_explicit_cleanup:
 					struct MainHeader hdr;
 					hdr.code = (uint8_t)MainHeaderCodes::NoResults;
 					sendall(fd, &hdr, sizeof(hdr));
-					cache->saveall();
-					return 0;
 				}
-
-				/* We need to tell the client how many results we've gotten. */
-				struct MainHeader hdr;
-				hdr.code = (uint8_t) MainHeaderCodes::Success;
-				hdr._errno = 0;
-				hdr.set_no = total;
-				sendall(fd, &hdr, sizeof(hdr));
-
-				/* Serve the client with a set of pictures that we've ascertained are close. */
-				/* Also prevent a memory leak by freeing the memory. */
-				for (std::vector<Image*>* set : results) 
+				else
 				{
-					set_of_pics(set);
-					delete set;
+					/* We need to tell the client how many results we've gotten. */
+					struct MainHeader hdr;
+					hdr.code = (uint8_t) MainHeaderCodes::Success;
+					hdr._errno = 0;
+					hdr.set_no = total;
+					sendall(fd, &hdr, sizeof(hdr));
 				}
+
+				/* Serve the client with a set of pictures that we've ascertained are close. */
+				for (size_t i = 0; i < results.size(); i++)
+					set_of_pics(flight->imgs, results, i);
+
+				if (types & (uint8_t) DataTypes::Video)
+					similar_videos(flight, dir, recursive);
+
+				if (types & (uint8_t) DataTypes::Audio)
+					similar_audios(flight, dir, recursive);
+
+				if (types & (uint8_t) DataTypes::Text)
+					similar_texts(flight, dir, recursive);
 			}
 			catch (simpic_networking_exception &ex)
 			{
 				std::cerr << "(" << to_string() << "): Network error: " << ex.what() << std::endl;
+
 				cache->saveall();
 				return -1;
 			}
 		}
 
-	end:
 		cache->saveall();
 		return 0;
 	}
-}
\ No newline at end of file
+
+	void SimpicClient::similar_videos(std::shared_ptr<ScanFlight> flight, const std::string &dir, bool recursive)
+	{
+		std::vector<Video*> vids = flight->videos_for(dir, recursive);
+		std::vector<std::vector<Video*>*> results = Video::find_similar_videos(vids, VIDEO_MIN_SIMILARITY);
+
+		struct MainHeader hdr;
+		hdr.code = (uint8_t) (results.empty() ? MainHeaderCodes::NoResults : MainHeaderCodes::Success);
+		hdr._errno = 0;
+		hdr.set_no = results.size();
+		sendall(fd, &hdr, sizeof(hdr));
+
+		for (std::vector<Video*> *set : results)
+		{
+			set_of_videos(set);
+			delete set;
+		}
+	}
+
+	void SimpicClient::similar_audios(std::shared_ptr<ScanFlight> flight, const std::string &dir, bool recursive)
+	{
+		std::vector<Audio*> auds = flight->audios_for(dir, recursive);
+		std::vector<std::vector<Audio*>*> results = Audio::find_similar_audios(auds, AUDIO_MAX_BER);
+
+		struct MainHeader hdr;
+		hdr.code = (uint8_t) (results.empty() ? MainHeaderCodes::NoResults : MainHeaderCodes::Success);
+		hdr._errno = 0;
+		hdr.set_no = results.size();
+		sendall(fd, &hdr, sizeof(hdr));
+
+		for (std::vector<Audio*> *set : results)
+		{
+			set_of_audios(set);
+			delete set;
+		}
+	}
+
+	void SimpicClient::similar_texts(std::shared_ptr<ScanFlight> flight, const std::string &dir, bool recursive)
+	{
+		std::vector<Text*> txts = flight->texts_for(dir, recursive);
+		std::vector<std::vector<Text*>*> results = Text::find_similar_texts(txts, TEXT_MIN_SIMILARITY);
+
+		struct MainHeader hdr;
+		hdr.code = (uint8_t) (results.empty() ? MainHeaderCodes::NoResults : MainHeaderCodes::Success);
+		hdr._errno = 0;
+		hdr.set_no = results.size();
+		sendall(fd, &hdr, sizeof(hdr));
+
+		for (std::vector<Text*> *set : results)
+		{
+			set_of_texts(set);
+			delete set;
+		}
+	}
+
+	int SimpicClient::dedupe_library(const std::string &within, uint8_t max_ham, size_t memory, const std::string &spills)
+	{
+		/* Where each image (by SHA256) was last seen, according to the SHA256 path cache. */
+		std::unordered_map<std::string, std::vector<std::pair<std::string, SHA256CachedObject*>>> locations;
+
+		for (auto &[location, obj] : cache->all_locations())
+		{
+			if (!within.empty() && !path_is_within(within, location))
+				continue;
+
+			locations[std::string(obj->hash, SHA256_DIGEST_LENGTH)].push_back({location, obj});
+		}
+
+		std::vector<const Image*> nodes;
+		std::vector<DCTHash> hashes;
+
+		/* Out of core, the hashes go straight to its spills, and there's no index (nor a copy of them) in memory. */
+		std::unique_ptr<ExternalClustering> clustering;
+
+		if (memory != 0)
+			clustering = std::make_unique<ExternalClustering>(spills, max_ham, memory);
+
+		for (const Image *img : cache->all_images())
+		{
+			if (locations.find(std::string(img->sha256, SHA256_DIGEST_LENGTH)) == locations.end())
+				continue;
+
+			nodes.push_back(img);
+
+			if (clustering != nullptr)
+				clustering->add(img->phash);
+			else
+				hashes.push_back(img->phash);
+		}
+
+		std::unique_ptr<HammingIndex<DCTHash>> index;
+
+		if (clustering == nullptr)
+			index = std::make_unique<HammingIndex<DCTHash>>(hashes);
+
+		try
+		{
+			/* Too many for the memory it may take, or nowhere to spill them. */
+			if (clustering != nullptr && !clustering->ready())
+			{
+				struct MainHeader hdr;
+				hdr.code = (uint8_t) MainHeaderCodes::Failure;
+				hdr._errno = ENOMEM;
+				hdr.set_no = 0;
+				sendall(fd, &hdr, sizeof(hdr));
+
+				return 0;
+			}
+
+			/* How many sets there will be isn't known until the very end. */
+			struct MainHeader hdr;
+			hdr.code = (uint8_t) MainHeaderCodes::Success;
+			hdr._errno = 0;
+			hdr.set_no = -1;
+			sendall(fd, &hdr, sizeof(hdr));
+
+			/* What of the component so far hasn't been sent yet (less than a set), and how much of it has. */
+			std::unique_ptr<ImageRecords> records = std::make_unique<ImageRecords>();
+			size_t sent = 0;
+			bool more = true;
+
+			/* Send what there is as one set, and see whether the client wants any more. */
+			auto send_records = [&]() -> bool {
+				SetList set;
+
+				for (uint32_t id = 0; id < records->size(); id++)
+					set.push(id);
+
+				set.end_set();
+				set_of_pics(*records, set, 0);
+
+				sent += records->size();
+				records = std::make_unique<ImageRecords>();
+
+				struct ClientMainPlea plea;
+				recvall(fd, &plea, sizeof(plea));
+				more = plea.plea == (uint8_t) ClientMainPleas::Continue;
+
+				return more;
+			};
+
+			/* Done with a component: the rest of it, unless it was a lone image. */
+			auto finish_component = [&]() -> bool {
+				if (records->size() != 0 && sent + records->size() > 1)
+					send_records();
+
+				records = std::make_unique<ImageRecords>();
+				sent = 0;
+
+				return more;
+			};
+
+			/* Out of core, a component too big for the memory comes in several pieces: it is still sent as one cluster. */
+			auto send_component = [&](const std::vector<uint32_t> &component, bool continues) -> bool {
+				if (!continues && !finish_component())
+					return false;
+
+				/* Every location of every image in the cluster that still has what we think it has. */
+				/* The cached images are shared: each location is a record of this cluster's, with their contents. */
+				for (uint32_t id : component)
+				{
+					for (auto &[location, obj] : locations[std::string(nodes[id]->sha256, SHA256_DIGEST_LENGTH)])
+					{
+						struct stat info;
+
+						if (stat(location.c_str(), &info) < 0 || (uint64_t) info.st_size != obj->length ||
+								info.st_mtim.tv_sec != obj->timestamp)
+							continue;
+
+						size_t slash = location.rfind('/');
+						std::string_view where(location);
+
+						records->add(*nodes[id], {where.substr(0, slash), where.substr(slash + 1)});
+
+						/* A SetHeader can't count more than 255 images, so huge clusters come in pieces. */
+						if (records->size() == UINT8_MAX && !send_records())
+							return false;
+					}
+				}
+
+				return true;
+			};
+
+			if (clustering == nullptr)
+				index->components(max_ham, [&send_component](const std::vector<uint32_t> &component) -> bool {
+					return send_component(component, false);
+				});
+			else if (!clustering->components(send_component))
+				std::cerr << "(" << to_string() << "): Failed to dedupe the library out of core, so not every set was sent." << std::endl;
+
+			if (more)
+				finish_component();
+
+			/* The end of the sets, whether the client stopped early or not. */
+			struct SetHeader end;
+			end.type = (uint8_t) DataTypes::Image;
+			end.count = 0;
+			end.check_id = 0;
+			sendall(fd, &end, sizeof(end));
+		}
+		catch (simpic_networking_exception &ex)
+		{
+			std::cerr << "(" << to_string() << "): Network error: " << ex.what() << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	std::vector<uint64_t> SimpicClient::variants_of(const Image *img, const std::string &source)
+	{
+		ImageVariants *cached = cache->get_variants((sha256ptr_t) img->sha256);
+
+		if (cached == nullptr && !source.empty())
+		{
+			std::optional<std::vector<uint64_t>> hashes = DCTBlock::variants_of_file(source);
+
+			if (hashes.has_value())
+			{
+				cached = new ImageVariants();
+				std::memcpy(cached->sha256, img->sha256, SHA256_DIGEST_LENGTH);
+				std::copy(hashes->begin(), hashes->end(), cached->hashes);
+				cache->insert(cached);
+			}
+		}
+
+		if (cached == nullptr)
+			return {img->phash};
+
+		std::vector<uint64_t> variants(cached->hashes, cached->hashes + DIHEDRAL_TRANSFORMS);
+
+		/* pHash's own hash is what every other image was hashed with, so it stays the original's. */
+		variants[(int) DihedralTransforms::Identity] = img->phash;
+		return variants;
+	}
+
+	const Image *SimpicClient::nearest_query(const struct ClientNearestRequest &nreq, HashResponseCodes &code, uint64_t &phash,
+			std::vector<uint64_t> &variants)
+	{
+		code = HashResponseCodes::Success;
+
+		switch ((ClientCheckRequestTypes) nreq.method)
+		{
+			case ClientCheckRequestTypes::ByPHash:
+			{
+				recvall(fd, &phash, sizeof(phash));
+				return nullptr;
+			}
+
+			case ClientCheckRequestTypes::BySHA256:
+			{
+				sha256_t hash[SHA256_DIGEST_LENGTH];
+				recvall(fd, hash, sizeof(hash));
+
+				const Image *img = cache->get_image(hash);
+
+				if (img == nullptr)
+					code = HashResponseCodes::NotFound;
+				else if (nreq.dihedral)
+					variants = variants_of(img, "");
+
+				return img;
+			}
+
+			case ClientCheckRequestTypes::ByPath:
+			{
+				if (nreq.length == 0)
+				{
+					code = HashResponseCodes::Failure;
+					return nullptr;
+				}
+
+				char *n_path = new char[nreq.length];
+				recvall(fd, n_path, nreq.length);
+				n_path[nreq.length - 1] = '\0';
+
+				std::string abspath(n_path);
+				delete[] n_path;
+
+				if (SimpicCache::get_type_from_extension(get_extension(abspath)) != SimpicEntryTypes::Image)
+				{
+					code = HashResponseCodes::Unsupported;
+					return nullptr;
+				}
+
+				std::FILE *fp = std::fopen(abspath.c_str(), "rb");
+
+				if (fp == nullptr)
+				{
+					code = HashResponseCodes::Failure;
+					return nullptr;
+				}
+
+				struct stat info;
+				fstat(fileno(fp), &info);
+
+				/* One file: not worth handing to the pool and waiting for it. */
+				SHA256CachedObject *obj = cache->sha256_of(abspath, fp, info);
+				const Image *img = cache->get_image(obj->hash);
+
+				if (img == nullptr)
+				{
+					size_t slash = abspath.rfind('/');
+					std::string dir = slash == std::string::npos ? "." : abspath.substr(0, slash);
+					std::string name = slash == std::string::npos ? abspath : abspath.substr(slash + 1);
+
+					img = scanner->load_image(dir, name, fp, obj->hash);
+				}
+
+				std::fclose(fp);
+
+				if (img == nullptr)
+					code = HashResponseCodes::Failure;
+				else if (nreq.dihedral)
+					variants = variants_of(img, abspath);
+
+				return img;
+			}
+
+			case ClientCheckRequestTypes::ByData:
+			{
+				CheckUpload upload;
+
+				if (!receive_upload(nreq.length, upload))
+				{
+					code = HashResponseCodes::Failure;
+					return nullptr;
+				}
+
+				const Image *img = cache->get_image(upload.hash);
+				std::FILE *fp = img != nullptr ? nullptr : fdopen(upload.fd, "rb");
+
+				if (fp != nullptr)
+					img = scanner->load_image("/proc/self/fd", std::to_string(upload.fd), fp, upload.hash);
+
+				if (img == nullptr)
+					code = HashResponseCodes::Failure;
+				else if (nreq.dihedral)
+					variants = variants_of(img, "/proc/self/fd/" + std::to_string(upload.fd));
+
+				if (fp != nullptr)
+					std::fclose(fp);
+				else
+					close(upload.fd);
+
+				return img;
+			}
+
+			default:
+			{
+				/* Whatever was sent still has to be skipped over. */
+				char buffer[BUFFER_SIZE];
+				uint32_t remaining = nreq.length;
+
+				while (remaining != 0)
+				{
+					uint32_t amnt = std::min(remaining, (uint32_t) sizeof(buffer));
+					recvall(fd, buffer, amnt);
+					remaining -= amnt;
+				}
+
+				code = HashResponseCodes::Unsupported;
+				return nullptr;
+			}
+		}
+	}
+
+	void SimpicClient::nearest_images(const std::string &within)
+	{
+		struct ClientNearestRequest nreq;
+		recvall(fd, &nreq, sizeof(nreq));
+
+		HashResponseCodes code;
+		uint64_t phash = 0;
+		std::vector<uint64_t> variants;
+		const Image *query = nearest_query(nreq, code, phash, variants);
+
+		if (query != nullptr)
+			phash = query->phash;
+
+		/* Without variants, the one query is the image itself, untransformed. */
+		if (variants.empty())
+			variants.push_back(phash);
+
+		std::vector<IndexMatch> nearest;
+		std::shared_ptr<LibrarySnapshot> library_now = library->get();
+
+		/* Where each of them was last seen (and still is): the first place that matches. */
+		auto seen_at = [&library_now, &within](const Image *img, bool live) -> std::optional<std::string> {
+			auto it = library_now->locations.find(std::string(img->sha256, SHA256_DIGEST_LENGTH));
+
+			if (it == library_now->locations.end())
+				return std::nullopt;
+
+			for (auto &[location, obj] : it->second)
+			{
+				if (!within.empty() && !path_is_within(within, location))
+					continue;
+
+				struct stat info;
+
+				if (live && (stat(location.c_str(), &info) < 0 || (uint64_t) info.st_size != obj->length ||
+						info.st_mtim.tv_sec != obj->timestamp))
+					continue;
+
+				return location;
+			}
+
+			return std::nullopt;
+		};
+
+		if (code == HashResponseCodes::Success)
+		{
+			nearest = library_now->index.nearest(std::vector<DCTHash>(variants.begin(), variants.end()), nreq.k, [&](uint32_t id) -> bool {
+				const Image *img = library_now->images[id];
+
+				/* The query's own file, wherever it is, isn't much of an answer. */
+				if (query != nullptr && std::memcmp(img->sha256, query->sha256, SHA256_DIGEST_LENGTH) == 0)
+					return false;
+
+				/* Without a directory, even images that are nowhere to be found anymore are fair game. */
+				return within.empty() || seen_at(img, false).has_value();
+			});
+		}
+
+		struct NearestHeader hdr;
+		hdr.code = (uint8_t) code;
+		hdr.count = nearest.size();
+		sendall(fd, &hdr, sizeof(hdr));
+
+		for (IndexMatch &match : nearest)
+		{
+			const Image *img = library_now->images[match.id];
+			std::optional<std::string> location = seen_at(img, true);
+
+			struct NearestNeighbour nb;
+			std::memcpy(nb.sha256_hash, img->sha256, sizeof(nb.sha256_hash));
+			nb.phash = img->phash;
+			nb.distance = match.distance;
+			nb.transform = match.query;
+			nb.width = img->width;
+			nb.height = img->height;
+			nb.size = img->length;
+			nb.path_length = location.has_value() ? location->size() + 1 : 0;
+
+			sendall(fd, &nb, sizeof(nb));
+
+			if (location.has_value())
+				sendall(fd, (char*) location->c_str(), nb.path_length);
+		}
+
+		/* The query (and its variants) may be new to the cache. */
+		cache->saveall();
+	}
+}
@@ -8,6 +8,7 @@
 #include <set>
 #include <unordered_set>
 #include <mutex>
+#include <memory>
 
 #include <cstdlib>
 #include <cerrno>
@@ -17,6 +18,7 @@
 #include <unistd.h>
 
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
@@ -28,33 +30,58 @@
 #include "sha256.hpp"
 #include "phash/pHash.h"
 #include "simpic_cache.hpp"
+#include "thumbnails.hpp"
+#include "hashing_pool.hpp"
+#include "scanner.hpp"
+#include "hamming_index.hpp"
+#include "external_clustering.hpp"
+#include "library_index.hpp"
+#include "verifier.hpp"
 #include "simpic_protocol.hpp"
 #include "networking.hpp"
 
 #include "images.hpp"
 #include "videos.hpp"
 #include "audios.hpp"
+#include "texts.hpp"
 #include "utils.hpp"
 
 #include "config.hpp"
 
 namespace SimpicServerLib
 {
+    /* A needle for a check request that the client uploaded or offered by its SHA256 hash. */
+    struct CheckUpload
+    {
+        int fd; // an in-memory file (memfd) with the data, or -1 if the cache already had it.
+        sha256_t hash[SHA256_DIGEST_LENGTH];
+    };
+
     class SimpicClient
     {
     public:
         std::vector<std::string> check_files;
         std::vector<uint64_t> check_files_dct_phash;
+        std::vector<CheckUpload> check_uploads;
         ClientCheckRequestTypes check_mode;
 
         SimpicCache *cache; 
+        ThumbnailCache *thumbnails;
+        HashingPool *pool;
+        Scanner *scanner;
+        LibraryIndex *library;
+        Verifier *verifier;
         Logger *moving_log;
         Logger *main_log;
 
         std::string recycling_bin;
 
+        /* The ProtocolExtensions in use on this connection. */
+        uint32_t extensions;
+
         struct sockaddr_in addr;
         int fd;
+        std::mutex send_mutex; // for when the hashing pool answers on behalf of this client.
 
         
 
@@ -67,10 +94,88 @@ namespace SimpicServerLib
         /* Given a pointer to a vector of Image pointers, send them to the client. */
         void set_of_pics(std::vector<Image*> *pics);
 
-        /* Go through a directory, grab all of its files, and then send them to the client (simplified)*/
-        int simpic_in_directory(const std::string &dir, ClientRequests req, uint8_t max_ham);
+        /* The same, for one of the sets of a request's (or scan's) images. */
+        void set_of_pics(const ImageRecords &pics, const SetList &sets, size_t set);
+
+        /* Send the groups of byte-identical images after a MainHeader of ExactDuplicates: only if there are any, and only to a client that uses ProtocolExtensions::ExactDuplicates. */
+        void exact_duplicates(const ImageRecords &pics, const SetList &exact);
+
+        /* The same, for a set of similar videos. */
+        void set_of_videos(std::vector<Video*> *vids);
+
+        /* The same, for a set of similar audio files. */
+        void set_of_audios(std::vector<Audio*> *auds);
+
+        /* The same, for a set of similar documents. */
+        void set_of_texts(std::vector<Text*> *txts);
+
+        /* Whether the client asked for this extension to the protocol. */
+        bool uses(ProtocolExtensions extension) const;
+
+        /* Agree to those of the extensions the client asked for (with ClientRequests::Extensions) that the server knows of, and tell it which. */
+        void negotiate_extensions();
+
+        /* Receive the client's plea for a file, and the edge of the thumbnail it wants instead of it (0 if none, as always without ProtocolExtensions::Thumbnails). */
+        void receive_plea(struct ClientPlea &plea, uint16_t &thumbnail);
+
+        /* Send a video, an audio file or a document after its header, as the client's plea asks: there is no thumbnail of any of them, and if the file can't be opened anymore, zeroes are sent in its place. */
+        void send_media_file(const std::string &path, uint64_t length, const struct ClientPlea &plea, uint16_t thumbnail);
+
+        /* Receive the client's ClientAction for a set it was sent, and move the files it wants deleted (given by their index in the set) to the recycling bin. */
+        void act_on_set(const std::vector<std::pair<std::string, std::string>> &files);
+
+        /* Receive 'length' bytes of file data into an in-memory file, hashing it while it streams in. Returns false if it couldn't be stored (it's still drained from the socket). More than UPLOAD_SIZE_LIMIT isn't received at all: the client is sent a MainHeader of UnreasonablyLongFileSize, and a simpic_networking_exception closes the connection. */
+        bool receive_upload(uint32_t length, CheckUpload &upload);
+
+        /* Receive 'length' bytes of file data for a check into an in-memory file, hashing it while it streams in. No temporary file is ever written. */
+        void receive_check_data(uint32_t length);
+
+        /* The client offered the SHA256 hash of a file to check. If the cache knows it, tell the client to skip the upload, otherwise receive it like receive_check_data(). */
+        void receive_check_offer(uint32_t length);
+
+        /* Forget (and close) everything received for the last check request. */
+        void clear_check();
+
+        /* Send one HashResponse, safe to call from the hashing pool. */
+        void send_hash_response(uint32_t id, HashResponseCodes code, const Image *img);
+
+        /* Answer a hash request for a path on the server, from the cache if possible, otherwise through the hashing pool. */
+        void hash_path(uint32_t id, const std::string &abspath, HashingGroup &group);
+
+        /* Serve a ClientRequests::Hash request of 'count' files. Returns once every response was sent. */
+        void hash_files(uint16_t count);
+
+        /* Send a thumbnail of the picture (with these contents, at abspath) instead of its data, prefixed by its length. */
+        void send_thumbnail(const sha256_t *sha256, const std::string &abspath, uint16_t max_edge);
+
+        /* Go through a directory, grab all of its files, and then send them to the client (simplified). Similar videos, audio files and documents are only looked for if types (from DataTypes) asks for them. */
+        int simpic_in_directory(const std::string &dir, ClientRequests req, uint8_t max_ham, uint8_t types);
+
+        /* Send the sets of similar videos of a scan, after its images. */
+        void similar_videos(std::shared_ptr<ScanFlight> flight, const std::string &dir, bool recursive);
+
+        /* The same, for audio files, after the videos. */
+        void similar_audios(std::shared_ptr<ScanFlight> flight, const std::string &dir, bool recursive);
+
+        /* The same, for documents, after the audio files. */
+        void similar_texts(std::shared_ptr<ScanFlight> flight, const std::string &dir, bool recursive);
+
+        /* Serve a ClientRequests::Dedupe: cluster every image in the cache that was last seen within 'within' (or anywhere, if it is empty), and stream the clusters with their locations as they are found. With memory, they are clustered out of core (see ExternalClustering) in no more than that, spilling into the directory spills. Returns 0, or -1 if the connection died. */
+        int dedupe_library(const std::string &within, uint8_t max_ham, size_t memory = 0, const std::string &spills = "");
+
+        /* The hashes of the image's rotations and mirror images (by DihedralTransforms), from the cache or worked out from the file at source. If that fails, only its own hash. */
+        std::vector<uint64_t> variants_of(const Image *img, const std::string &source);
+
+        /* The image a ClientNearestRequest is about, hashed if the cache doesn't know it yet, or nullptr (and why, in code). The data that came with it is always read. If the request asks for it, the variants of the image are put in variants. */
+        const Image *nearest_query(const struct ClientNearestRequest &nreq, HashResponseCodes &code, uint64_t &phash,
+                    std::vector<uint64_t> &variants);
+
+        /* Serve a ClientRequests::Nearest: read the query and send the k images closest to it that were last seen within 'within' (or anywhere, if it is empty). */
+        void nearest_images(const std::string &within);
 
         /* A class for representing a connected client. */
-        SimpicClient(SimpicCache *_cache, const std::string &recycle_bin, Logger *main, Logger *moving);
+        SimpicClient(SimpicCache *_cache, ThumbnailCache *_thumbnails, HashingPool *_pool, Scanner *_scanner,
+                    LibraryIndex *_library, Verifier *_verifier, const std::string &recycle_bin,
+                    Logger *main, Logger *moving);
     };
 }
\ No newline at end of file
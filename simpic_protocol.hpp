@@ -15,7 +15,10 @@ namespace SimpicServerLib
         NoResults = 3,
         UnreasonablyLongPath = 4, 
         UnreasonablyLongMaxHam = 5,
-        UnreasonablyLongFileSize = 6
+        UnreasonablyLongFileSize = 6,
+        ExactDuplicates = 7 // byte-identical files (by SHA256), with set_no sets following it, only
+                            // with ProtocolExtensions::ExactDuplicates. Only one file of each of
+                            // these sets takes part in the perceptual comparison.
     };
 
     enum class DataTypes
@@ -78,6 +81,42 @@ namespace SimpicServerLib
         // read/send size bytes for the whole file data. 
     };
 
+    /* Every video of a set of similar videos. Like an ImageHeader, it's followed by the filename and the path, then the client's ClientPlea (a thumbnail can't be made of a video: asking for one gets a length of 0), and every set ends with a ClientAction. */
+    struct __attribute__((__packed__)) VideoHeader
+    {
+        // Not null terminated
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+
+        uint16_t keyframes; // how many keyframes (one per shot) it was compared by.
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
+    /* Every audio file of a set of similar ones, exactly like a VideoHeader. */
+    struct __attribute__((__packed__)) AudioHeader
+    {
+        // Not null terminated
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+
+        uint32_t fingerprints; // how many sub-fingerprints (one every AUDIO_HOP samples) it was compared by.
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
+    /* Every document of a set of similar ones, exactly like a VideoHeader. */
+    struct __attribute__((__packed__)) TextHeader
+    {
+        // Not null terminated
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+
+        uint32_t points; // how many hash points it was compared by.
+        uint64_t size;
+        uint16_t filename_length;
+        uint16_t path_length;
+    };
+
     enum class ClientRequests
     {
         Exit, // Close the connection, no more requests. 
@@ -90,14 +129,46 @@ namespace SimpicServerLib
                // for speed and efficiency related reasons.
         CacheRecursive, // ~~^^ Same thing, but recursively, starting from a directory. 
                         // Should have used bitwise flags, but too late now!
-        Hash // Compute the perceptual hash of a given file and send it back, taking
-             // advantage of the efficiency of the cache and the C/C++ language. 
+        Hash, // Compute the perceptual hash of a given file and send it back, taking
+              // advantage of the efficiency of the cache and the C/C++ language. 
+        Submit, // Run a Scan, ScanRecursive, Cache or CacheRecursive as a job, which keeps running
+                // even if the client disconnects. Replies with a JobHeader containing the job id.
+        Poll, // Get the JobStatus of a job, once.
+        Subscribe, // Get a JobStatus every time a job makes progress, until it is done or failed.
+        Fetch, // Get the results of a finished job, exactly like the results of a Scan.
+        Acknowledge, // The client has the results: forget the job and delete its results.
+        // ~~~^ all of these, except Submit, are followed by a uint32_t with the job id.
+        Dedupe, // Find every set of similar images the cache knows of, wherever they were last seen.
+               // The path, if given, limits it to locations within that directory.
+               // ~~~^ replies with a MainHeader whose set_no is -1, since the sets are streamed
+               // as they are found: each set is followed by a ClientMainPlea from the client,
+               // and the end is marked by a SetHeader with a count of 0.
+        Nearest, // The k images in the cache closest to a given one, however far away they are.
+                 // The path, if given, limits it to images last seen within that directory.
+                 // ~~~^ followed by a ClientNearestRequest, replied to with a NearestHeader.
+        Extensions // Use extensions to the protocol for the rest of the connection.
+                   // ~~~^ followed by a uint32_t of ProtocolExtensions the client understands,
+                   // replied to with a uint32_t of those the server will use from now on.
+    };
+
+    /* Changes to the protocol that a client has to ask for with ClientRequests::Extensions (bitwise flags), so that a client that doesn't know about them is spoken to exactly as before. */
+    enum class ProtocolExtensions : uint32_t
+    {
+        Thumbnails = 1, // each ClientPlea is followed by a uint16_t (see ClientPlea).
+        ExactDuplicates = 2 // a Scan sends the byte-identical images (MainHeaderCodes::ExactDuplicates)
+                            // as soon as everything is hashed, before anything is decoded and before
+                            // its UpdateHeaders; a Check or Fetch sends them before its usual MainHeader.
     };
 
     struct __attribute__((__packed__)) ClientRequest
     {
         uint8_t request;
         uint8_t types; // bitwise field for the file types the client wants.
+        // ~~~^ if DataTypes::Video is set on a Scan or ScanRecursive, the results for images are
+        // followed by a MainHeader for videos (NoResults if there aren't any similar ones), and
+        // its sets, whose SetHeaders are of type DataTypes::Video. DataTypes::Audio does the same
+        // for audio files, after the videos (if any), with SetHeaders of type DataTypes::Audio, and
+        // DataTypes::Text for documents, after those, with SetHeaders of type DataTypes::Text.
         uint8_t max_ham; // maximum hamming distance that the client is willing to take. 
         uint16_t path_length; // of where to start searching
 
@@ -106,13 +177,59 @@ namespace SimpicServerLib
         // will be sent subsequent to this. 
     };
 
+    /* Sent after the ClientRequest handshake (whose path and max_ham are used) for ClientRequests::Submit. */
+    struct __attribute__((__packed__)) ClientJobSubmit
+    {
+        uint8_t request; // which ClientRequests to run as a job.
+    };
+
+    /* The reply to ClientRequests::Submit. */
+    struct __attribute__((__packed__)) JobHeader
+    {
+        uint8_t code; // an enum from MainHeaderCodes
+        uint8_t _errno;
+        uint32_t job_id;
+    };
+
+    enum class JobStates
+    {
+        Queued,
+        Running,
+        Done,
+        Failed,
+        Unknown // there's no such job (or it was acknowledged already).
+    };
+
+    /* The reply to ClientRequests::Poll and ClientRequests::Subscribe. */
+    struct __attribute__((__packed__)) JobStatus
+    {
+        uint8_t state; // an enum from JobStates
+        uint8_t _errno; // if it failed, why.
+        uint32_t scanned; // how many files were gone through so far.
+        uint32_t set_no; // once done, how many sets of results there are to fetch.
+    };
+
     enum class ClientCheckRequestTypes
     {
         ByData, // the client shall send the file data for the server to check.
         // ^~~~ not recommended for large files
         ByPath, // the client shall send the path of the file that already exists on the server
-        ByPHash // the client shall send the standard perceptual hash for that format.
+        ByPHash, // the client shall send the standard perceptual hash for that format.
         // ~~~^ for images, it's the 64-bit perceptual hash from the DCT of the image.
+        BySHA256 // the client offers the SHA256 hash of the file (SHA256_DIGEST_LENGTH bytes)
+        // ~~~^ the server replies with a CheckOfferReply. If it is Unknown, the client then sends
+        // the file data, length bytes of it, exactly like ByData. Otherwise, nothing is uploaded.
+    };
+
+    enum class CheckOfferReplies
+    {
+        Known, // the server already has this file cached, no need to upload it.
+        Unknown // the server needs the file data.
+    };
+
+    struct __attribute__((__packed__)) CheckOfferReply
+    {
+        uint8_t reply; // an enum from CheckOfferReplies
     };
 
     /* When doing a check, the server needs to be given the file to check, along with its type. */
@@ -134,6 +251,91 @@ namespace SimpicServerLib
     // where the first index of the each set will be the file supplied to the check request
     // (called the needle)
 
+    /* For ClientRequests::Hash: after the ClientRequest handshake (path_length may be 0), the client */
+    /* sends a uint16_t with the number of files to hash, then that many ClientHashRequests, each */
+    /* followed by its data according to method (a null-terminated path for ByPath, length bytes of */
+    /* file data for ByData, or SHA256_DIGEST_LENGTH bytes for BySHA256). ByPHash is meaningless here. */
+    struct __attribute__((__packed__)) ClientHashRequest
+    {
+        uint32_t id; // chosen by the client, echoed back in the HashResponse.
+        uint32_t length;
+        uint8_t method; // an enum from ClientCheckRequestTypes
+    };
+
+    enum class HashResponseCodes
+    {
+        Success,
+        Failure, // the file couldn't be opened or decoded.
+        NotFound, // BySHA256: the hash isn't in the cache.
+        Unsupported // not a supported type of file, or a method that makes no sense.
+    };
+
+    /* Exactly one per ClientHashRequest, but NOT necessarily in the order they were requested: cache */
+    /* hits are answered straight away, while misses are answered when the hashing pool gets to them. */
+    /* Responses may arrive before the client is done sending requests, so read them concurrently. */
+    struct __attribute__((__packed__)) HashResponse
+    {
+        uint32_t id;
+        uint8_t code; // an enum from HashResponseCodes
+        
+        // the fields below are only meaningful if code == Success.
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t phash;
+
+        uint16_t width;
+        uint16_t height;
+        uint32_t size;
+    };
+
+    /* For ClientRequests::Nearest: after the ClientRequest handshake (whose max_ham is ignored), the */
+    /* query, followed by its data according to method, exactly like a ClientHashRequest (ByPHash */
+    /* sends the uint64_t perceptual hash). */
+    struct __attribute__((__packed__)) ClientNearestRequest
+    {
+        uint16_t k; // how many images at most.
+        uint32_t length;
+        uint8_t method; // an enum from ClientCheckRequestTypes
+        uint8_t dihedral; // if not 0, rotated and mirrored copies of the query are looked for too.
+        // ~~~^ not possible ByPHash, and BySHA256 only if the server worked them out before.
+    };
+
+    /* The ways to rotate or mirror an image, i.e., the symmetries of a square. */
+    enum class DihedralTransforms
+    {
+        Identity,
+        FlipHorizontal, // left and right swapped.
+        FlipVertical, // upside down, mirrored.
+        Rotate180,
+        Transpose, // mirrored along the diagonal from the top left corner.
+        Rotate90, // clockwise.
+        Rotate270, // clockwise, i.e., 90 degrees counterclockwise.
+        AntiTranspose // mirrored along the diagonal from the top right corner.
+    };
+
+    /* The reply to ClientRequests::Nearest, followed by count NearestNeighbours, closest first. */
+    /* Unless the query was ByPHash, the query's own file (or copies of it) is never among them. */
+    struct __attribute__((__packed__)) NearestHeader
+    {
+        uint8_t code; // an enum from HashResponseCodes
+        uint16_t count;
+    };
+
+    struct __attribute__((__packed__)) NearestNeighbour
+    {
+        char sha256_hash[SHA256_DIGEST_LENGTH];
+        uint64_t phash;
+        uint8_t distance; // from the query, in bits.
+        uint8_t transform; // an enum from DihedralTransforms: the query, transformed like this, is
+                           // what looks like this image. Always Identity unless dihedral was asked for.
+
+        uint16_t width;
+        uint16_t height;
+        uint32_t size;
+
+        uint16_t path_length; // of the null-terminated path where it was last seen, which follows.
+        // ~~~^ 0 if it isn't known to be anywhere anymore.
+    };
+
     /* A plea containing bitwise flags (abstracted through bitfields) of what the client does not want from the file or whether they want to skip the file entirely. */
     struct __attribute__((__packed__)) ClientPlea
     {
@@ -141,6 +343,12 @@ namespace SimpicServerLib
         bool skip_file;
     };
 
+    // ~~^ with ProtocolExtensions::Thumbnails, each plea is followed by a uint16_t: if it isn't 0 (and
+    // no_data is false), instead of the whole file, the server sends a JPEG thumbnail whose longest
+    // edge is at most this many pixels. Since its size isn't in the ImageHeader, a uint32_t with the
+    // length of the thumbnail is sent first, then that many bytes. A length of 0 means it couldn't
+    // be generated (and there never is one of a video, an audio file or a document).
+
     enum class ClientMainPleas
     {
         Continue,
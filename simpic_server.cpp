@@ -2,12 +2,23 @@
 
 namespace SimpicServerLib
 {
-	SimpicServer::SimpicServer(uint16_t _port, const std::string &simpic_dir, const std::string &_recycle_bin)
+	SimpicServer::SimpicServer(uint16_t _port, const std::string &simpic_dir, const std::string &_recycle_bin,
+			const std::vector<std::string> &watched, unsigned int decoder_workers, size_t _library_memory)
 	{
 		std::cout << "Simpic server successfully initialized. " << std::endl;
+
+		/* Forked before anything starts a thread. Without any, images are decoded in this process. */
+		decoders = nullptr;
+
+		if (decoder_workers)
+		{
+			decoders = new DecoderWorkers(decoder_workers);
+			DecoderRegistry::builtin().isolate(decoders);
+		}
 		recycle_bin_on = _recycle_bin != "";
 		recycle_bin = _recycle_bin;
 		alt_tmp = simpic_dir + "tmp/";
+		library_memory = _library_memory;
 		port = _port;
 
 		/* Initialize and read everything into the cache, if it is present. */
@@ -15,6 +26,36 @@ namespace SimpicServerLib
 		cache->readall();
 		std::cout << "Cache successfully initialized." << std::endl;
 
+		/* Thumbnails are generated on demand, keyed by their SHA256 hash and size. */
+		thumbnails = new ThumbnailCache(simpic_dir + "thumbnails/");
+
+		/* Decoding and hashing is shared between every client, one worker per core. */
+		pool = new HashingPool(HashingPool::default_size());
+		/* Directories that were scanned before only have their new images compared. */
+		similar = new SimilarityStore(simpic_dir + "similar/");
+		/* Matches the DCT hash isn't sure about are checked again with a slower one. */
+		verifier = new Verifier(cache, pool);
+		scanner = new Scanner(cache, thumbnails, pool, similar, verifier);
+
+		/* Built on the first Nearest request, then kept up to date with the cache. */
+		library = new LibraryIndex(cache);
+
+		/* Jobs left over from before are picked back up. */
+		jobs = new SimpicJobs(simpic_dir + "jobs/", scanner);
+		jobs->readall();
+		jobs->start();
+
+		/* Keep the cache warm for the directories we were told to watch. */
+		watcher = new Watcher(cache, scanner, pool);
+
+		for (const std::string &dir : watched)
+		{
+			if (!watcher->add_root(normalize_path(dir)))
+				std::cerr << "Cannot watch '" << dir << "', it is not a directory." << std::endl;
+		}
+
+		watcher->start();
+
 		new_moving_log.open("/var/log/simpic_moving_log");
 		new_moving_log.open(simpic_dir + "moving_log");
 
@@ -32,6 +73,8 @@ namespace SimpicServerLib
 	SimpicServer::SimpicServer(uint16_t _port)
 	{
 		port = _port;
+		decoders = nullptr;
+		library_memory = 0;
 		recycle_bin_on = false;
 	}
 
@@ -90,7 +133,7 @@ namespace SimpicServerLib
 			}
 
 			/* The client object needs to transcend the stack, so we need to heap allocate it. */
-			SimpicClient *sc = new SimpicClient(cache, recycle_bin, &new_activity_log, &new_moving_log);
+			SimpicClient *sc = new SimpicClient(cache, thumbnails, pool, scanner, library, verifier, recycle_bin, &new_activity_log, &new_moving_log);
 			
 			sc->addr = client;
 			sc->fd = cfd;
@@ -105,6 +148,160 @@ namespace SimpicServerLib
 		}	
 	}
 
+	void SimpicServer::job_request(SimpicClient *client, struct ClientRequest &req, const char *path)
+	{
+		if (req.request == (uint8_t)ClientRequests::Submit)
+		{
+			struct ClientJobSubmit submit;
+			recvall(client->fd, &submit, sizeof(submit));
+
+			struct JobHeader jh;
+			jh.code = (uint8_t) MainHeaderCodes::Success;
+			jh._errno = 0;
+			jh.job_id = 0;
+
+			/* Checks need the needles of a connection, so they can't be jobs. */
+			switch ((ClientRequests) submit.request)
+			{
+				case ClientRequests::Scan:
+				case ClientRequests::ScanRecursive:
+				case ClientRequests::Cache:
+				case ClientRequests::CacheRecursive:
+					break;
+
+				default:
+					jh.code = (uint8_t) MainHeaderCodes::Failure;
+					jh._errno = EINVAL;
+			}
+
+			if (path == nullptr)
+			{
+				jh.code = (uint8_t) MainHeaderCodes::Failure;
+				jh._errno = EINVAL;
+			}
+
+			if (jh.code == (uint8_t) MainHeaderCodes::Success)
+			{
+				jh.job_id = jobs->submit((ClientRequests) submit.request, normalize_path(std::string(path)), req.max_ham);
+				new_activity_log.write("Client " + client->to_string() + " submitted job " + std::to_string(jh.job_id) +
+					" for '" + std::string(path) + "'");
+			}
+
+			sendall(client->fd, &jh, sizeof(jh));
+			return;
+		}
+
+		uint32_t id = 0;
+		recvall(client->fd, &id, sizeof(id));
+
+		switch ((ClientRequests) req.request)
+		{
+			case ClientRequests::Poll:
+			{
+				struct JobStatus st = jobs->status(id);
+				sendall(client->fd, &st, sizeof(st));
+				break;
+			}
+
+			case ClientRequests::Subscribe:
+			{
+				struct JobStatus st = jobs->status(id);
+				sendall(client->fd, &st, sizeof(st));
+
+				/* Keep the client informed until there's nothing left to say. */
+				while (st.state == (uint8_t)JobStates::Queued || st.state == (uint8_t)JobStates::Running)
+				{
+					st = jobs->wait_for_progress(id, st);
+					sendall(client->fd, &st, sizeof(st));
+				}
+
+				break;
+			}
+
+			case ClientRequests::Fetch:
+			{
+				std::vector<std::vector<Image>> exact;
+				std::vector<std::vector<Image>> sets;
+				struct MainHeader mh;
+				mh._errno = 0;
+
+				if (!jobs->results(id, exact, sets))
+				{
+					mh.code = (uint8_t) MainHeaderCodes::Failure;
+					mh._errno = ENOENT;
+					mh.set_no = -1;
+					sendall(client->fd, &mh, sizeof(mh));
+					break;
+				}
+
+				/* Exactly like a Scan: byte-identical files first, to a client that asked for them. */
+				if (!exact.empty() && client->uses(ProtocolExtensions::ExactDuplicates))
+				{
+					struct MainHeader eh;
+					eh.code = (uint8_t) MainHeaderCodes::ExactDuplicates;
+					eh._errno = 0;
+					eh.set_no = exact.size();
+					sendall(client->fd, &eh, sizeof(eh));
+
+					for (std::vector<Image> &set : exact)
+					{
+						std::vector<Image*> pics;
+
+						for (Image &img : set)
+							pics.push_back(&img);
+
+						client->set_of_pics(&pics);
+					}
+				}
+
+				if (sets.empty())
+				{
+					mh.code = (uint8_t) MainHeaderCodes::NoResults;
+					mh.set_no = 0;
+					sendall(client->fd, &mh, sizeof(mh));
+					break;
+				}
+
+				mh.code = (uint8_t) MainHeaderCodes::Success;
+				mh.set_no = sets.size();
+				sendall(client->fd, &mh, sizeof(mh));
+
+				for (std::vector<Image> &set : sets)
+				{
+					std::vector<Image*> pics;
+
+					for (Image &img : set)
+						pics.push_back(&img);
+
+					client->set_of_pics(&pics);
+				}
+
+				break;
+			}
+
+			case ClientRequests::Acknowledge:
+			{
+				struct MainHeader mh;
+				mh.code = (uint8_t) (jobs->acknowledge(id) ? MainHeaderCodes::Success : MainHeaderCodes::Failure);
+				mh._errno = 0;
+				mh.set_no = 0;
+				sendall(client->fd, &mh, sizeof(mh));
+				break;
+			}
+
+			/* Only the requests above are about jobs, but the client is still owed a reply. */
+			default:
+			{
+				struct MainHeader mh;
+				mh.code = (uint8_t) MainHeaderCodes::Failure;
+				mh._errno = EINVAL;
+				mh.set_no = -1;
+				sendall(client->fd, &mh, sizeof(mh));
+				break;
+			}
+		}
+	}
+
 	void SimpicServer::handler(SimpicClient *client)
 	{
 		signal(SIGPIPE, SIG_IGN);
@@ -165,24 +362,14 @@ namespace SimpicServerLib
 							/* The client is going to send us raw file data. */
 							case ClientCheckRequestTypes::ByData:
 							{
-								std::string tmp_path = alt_tmp + "/" + random_chars(16);
-								std::ofstream of(tmp_path, std::ios::binary);
-
-								char buffer[BUFFER_SIZE];
-								int whole = ccreq.length / sizeof(buffer);
-								int frac = ccreq.length % sizeof(buffer);
-
-								for (int j = 0; j < whole; j++)
-								{
-									recvall(client->fd, buffer, sizeof(buffer));
-									of.write(buffer, sizeof(buffer));
-								}
-
-								recvall(client->fd, buffer, frac);
-								of.write(buffer, frac);
-								of.close();
+								client->receive_check_data(ccreq.length);
+								break;
+							}
 
-								client->check_files.push_back(tmp_path);
+							/* The client would rather not upload anything we already have. */
+							case ClientCheckRequestTypes::BySHA256:
+							{
+								client->receive_check_offer(ccreq.length);
 								break;
 							}
 
@@ -210,73 +397,74 @@ namespace SimpicServerLib
 					}
 				}
 
-				bool recursive = (req.request == (uint8_t)ClientRequests::CheckRecursive ||
-								req.request == (uint8_t)ClientRequests::CacheRecursive ||
-									req.request == (uint8_t)ClientRequests::ScanRecursive);
-
 				/* The client's request. */
 				switch ((ClientRequests) req.request)
 				{
 					case ClientRequests::Exit:
 						goto cleanup;
 
-					case ClientRequests::Check:
-					case ClientRequests::Cache:
-					case ClientRequests::Scan:
+					case ClientRequests::Submit:
+					case ClientRequests::Poll:
+					case ClientRequests::Subscribe:
+					case ClientRequests::Fetch:
+					case ClientRequests::Acknowledge:
 					{
-						struct MainHeader mh;
-						std::string ppath(path);
-
-						/* Another client is already doing this. */
-						/* When recursive mode becomes supported, this algorithm will be harder. */
+						job_request(client, req, path);
+						break;
+					}
 
-						client_mutex.lock();
+					/* Many files to hash, answered out of order through the cache and the pool. */
+					case ClientRequests::Hash:
+					{
+						uint16_t hreq_no = 0;
+						recvall(client->fd, &hreq_no, sizeof(hreq_no));
+						client->hash_files(hreq_no);
+						break;
+					}
 
-						/* If we have a directory conflict*/
-						bool exists = false;
+					/* Every image the cache knows of, clustered through an index (or out of core, with --library-memory) and streamed. */
+					case ClientRequests::Dedupe:
+					{
+						std::string within = path == nullptr ? "" : normalize_path(std::string(path));
 
-						for (std::pair<std::string, bool> item : active_folders)
-						{
-							/* If they're equal, it*/
-							/* definitely is a conflict. */
-							if (item.first == ppath)
-							{
-								exists = true;
-								break;
-							}
+						if (client->dedupe_library(within, req.max_ham, library_memory, alt_tmp) != 0)
+							goto cleanup;
 
-							/* If the requested path is a child node of an existing */
-							/* directory and that existing directory is being scanned */
-							/* recursively, NO! */
-							if (dir_is_child(item.first, ppath) && item.second)
-							{
-								exists = true;
-								break; 
-							}
-						}
+						break;
+					}
 
-						if (exists)
-						{
-							/* Report such a crippling error. */
-							mh.code = (uint8_t) MainHeaderCodes::DirectoryAlreadyActive;
-							mh._errno = 0;
-							mh.set_no = -1;
-							sendall(client->fd, &mh, sizeof(mh));
-							goto cleanup;
-						}
-						
-						client_mutex.unlock();
+					/* The closest images in the whole cache, through the index kept over it. */
+					case ClientRequests::Nearest:
+					{
+						std::string within = path == nullptr ? "" : normalize_path(std::string(path));
+						client->nearest_images(within);
+						break;
+					}
 
-						int error = 0;
+					/* From now on, the client is spoken to with whichever extensions both sides know. */
+					case ClientRequests::Extensions:
+					{
+						client->negotiate_extensions();
+						break;
+					}
 
+					case ClientRequests::Check:
+					case ClientRequests::CheckRecursive:
+					case ClientRequests::Cache:
+					case ClientRequests::CacheRecursive:
+					case ClientRequests::Scan:
+					case ClientRequests::ScanRecursive:
+					{
+						struct MainHeader mh;
+						std::string ppath = normalize_path(std::string(path));
 
-						client_mutex.lock();
-						active_folders.insert({ppath, recursive});
-						client_mutex.unlock();
+						int error = 0;
 
 						/* Call the function that handles this. If it exited with 0, an error occured! */
+						/* If another client is already scanning this directory (or a parent of it, */
+						/* recursively), this request attaches to that scan instead of redoing it. */
 						if ((error = 
-							client->simpic_in_directory(ppath, (ClientRequests)req.request, req.max_ham)) 
+							client->simpic_in_directory(ppath, (ClientRequests)req.request, req.max_ham, req.types)) 
 							!= 0)
 						{
 							/* An error of -1 indicates the connection died. */
@@ -290,10 +478,6 @@ namespace SimpicServerLib
 							}
 						}
 
-						client_mutex.lock();
-						active_folders.erase({ppath, recursive});
-						client_mutex.unlock();
-
 						/* If there was an error, escape from the loop and free resources. */
 						if (error != 0)
 							goto cleanup;
@@ -302,6 +486,8 @@ namespace SimpicServerLib
 					}
 				}
 
+				client->clear_check();
+
 				delete path;
 				path = nullptr;
 			} 
@@ -323,6 +509,7 @@ cleanup:
 		
 		if (client != nullptr)
 		{
+			client->clear_check();
 			close(client->fd);
 			delete client;
 		}
@@ -36,6 +36,11 @@
 #include "audios.hpp"
 #include "utils.hpp"
 #include "simpic_client.hpp"
+#include "scanner.hpp"
+#include "jobs.hpp"
+#include "watcher.hpp"
+#include "decoders.hpp"
+#include "decoder_workers.hpp"
 
 #include "config.hpp"
 
@@ -46,6 +51,18 @@ namespace SimpicServerLib
     {
     private:
         SimpicCache *cache;
+        ThumbnailCache *thumbnails;
+        HashingPool *pool;
+        SimilarityStore *similar;
+        Verifier *verifier;
+        Scanner *scanner;
+        LibraryIndex *library;
+        SimpicJobs *jobs;
+        Watcher *watcher;
+        DecoderWorkers *decoders;
+
+        /* How much memory a Dedupe request may cluster the library in, out of core, or 0 to cluster it in memory. */
+        size_t library_memory;
 
         Logger new_moving_log;
         Logger new_activity_log;
@@ -60,16 +77,18 @@ namespace SimpicServerLib
 
         std::vector<SimpicClient*> clients;
         std::mutex cache_mutex;
-        std::mutex client_mutex;
-
-        std::set<std::pair<std::string, bool>> active_folders;
     public:
         std::function<void()> on_ready;
 
-        SimpicServer(uint16_t _port, const std::string &simpic_dir, const std::string &_recycle_bin);
+        SimpicServer(uint16_t _port, const std::string &simpic_dir, const std::string &_recycle_bin,
+                    const std::vector<std::string> &watched = {}, unsigned int decoder_workers = 0,
+                    size_t _library_memory = 0);
         SimpicServer(uint16_t _port);
         void start();
         void handler(SimpicClient *client);
+
+        /* Serve the requests that deal with jobs: Submit, Poll, Subscribe, Fetch and Acknowledge. */
+        void job_request(SimpicClient *client, struct ClientRequest &req, const char *path);
         void save_cache();
     };
 }
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+
+#include "../active_scans.hpp"
+#include "../simpic_protocol.hpp"
+
+using namespace SimpicServerLib;
+
+/* Which requests attach to a running scan, and which have to start their own. */
+int main(int argc, char **argv, char **envp)
+{
+    ActiveScans active;
+    bool leader = false;
+    int failures = 0;
+
+    uint8_t images = (uint8_t) DataTypes::Image;
+    uint8_t videos = (uint8_t) DataTypes::Video;
+
+    auto expect = [&failures](const char *what, bool value, bool expected) -> void {
+        std::cout << what << ": " << (value ? "true" : "false");
+
+        if (value != expected)
+        {
+            std::cout << " (WRONG)";
+            failures++;
+        }
+
+        std::cout << "\n";
+    };
+
+    std::shared_ptr<ScanFlight> pics = active.join("/home/user/pics", true, images, leader);
+    expect("First scan of /home/user/pics leads", leader, true);
+
+    std::shared_ptr<ScanFlight> same = active.join("/home/user/pics/", false, images, leader);
+    expect("/home/user/pics/ (flat) attaches to the recursive scan", !leader && same == pics, true);
+
+    std::shared_ptr<ScanFlight> child = active.join("/home/user/pics/2021", true, images, leader);
+    expect("/home/user/pics/2021 attaches to the recursive scan of its parent", !leader && child == pics, true);
+
+    std::shared_ptr<ScanFlight> sibling = active.join("/home/user/picsold", false, images, leader);
+    expect("/home/user/picsold is not under /home/user/pics and leads", leader, true);
+
+    std::shared_ptr<ScanFlight> parent = active.join("/home/user", false, images, leader);
+    expect("/home/user is a parent, not a child, and leads", leader, true);
+
+    std::shared_ptr<ScanFlight> parent_recursive = active.join("/home/user", true, images, leader);
+    expect("/home/user (recursive) isn't covered by a flat scan and leads", leader && parent_recursive != parent, true);
+
+    std::shared_ptr<ScanFlight> pics_videos = active.join("/home/user/pics", false, images | videos, leader);
+    expect("/home/user/pics for videos too isn't covered by a scan for images and leads", leader && pics_videos != pics, true);
+
+    std::shared_ptr<ScanFlight> pics_video = active.join("/home/user/pics", false, videos, leader);
+    expect("/home/user/pics for videos attaches to the scan for images and videos", !leader && pics_video == pics_videos, true);
+
+    active.leave(pics_videos);
+
+    std::shared_ptr<ScanFlight> pics_image = active.join("/home/user/pics", false, images, leader);
+    expect("/home/user/pics for images still attaches to the recursive scan of its parent", !leader && pics_image == parent_recursive, true);
+
+    active.leave(pics);
+    active.leave(parent_recursive);
+
+    std::shared_ptr<ScanFlight> again = active.join("/home/user/pics", false, images, leader);
+    expect("/home/user/pics leads again once the scans covering it are done", leader && again != pics, true);
+
+    expect("Paths within each other", path_is_within("/a/b", "/a/b/c") && !path_is_within("/a/b", "/a/bc") &&
+        path_is_within("/", "/a") && path_is_within(normalize_path("/a//b/"), "/a/b"), true);
+
+    return failures != 0;
+}
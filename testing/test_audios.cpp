@@ -0,0 +1,137 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+
+#include "../audios.hpp"
+
+using namespace SimpicServerLib;
+
+static double noise()
+{
+    return (double) std::rand() / RAND_MAX - 0.5;
+}
+
+/* A few seconds of notes (a random one every fifth of a second) over a bit of noise. */
+static std::vector<int16_t> track(int seconds)
+{
+    std::vector<int16_t> samples;
+    double frequency = 0;
+
+    for (int i = 0; i < seconds * AUDIO_SAMPLE_RATE; i++)
+    {
+        if (i % (AUDIO_SAMPLE_RATE / 5) == 0)
+            frequency = AUDIO_LOW_HZ + std::rand() % (AUDIO_HIGH_HZ - AUDIO_LOW_HZ);
+
+        double value = 0.3 * std::sin(2 * M_PI * frequency * i / AUDIO_SAMPLE_RATE) +
+            0.2 * std::sin(2 * M_PI * frequency * 1.5 * i / AUDIO_SAMPLE_RATE) + 0.05 * noise();
+
+        samples.push_back((int16_t) (value * 32767));
+    }
+
+    return samples;
+}
+
+/* The same track, quieter and noisier, starting a few hops in. */
+static std::vector<int16_t> copy_of(const std::vector<int16_t> &samples, int hops)
+{
+    std::vector<int16_t> result;
+
+    for (size_t i = hops * AUDIO_HOP; i < samples.size(); i++)
+        result.push_back((int16_t) (0.7 * samples[i] + 0.02 * 32767 * noise()));
+
+    return result;
+}
+
+static std::vector<uint32_t> fingerprint(const std::vector<int16_t> &samples, bool chunked)
+{
+    AudioFingerprinter fingerprinter;
+
+    if (!chunked)
+    {
+        fingerprinter.feed(samples.data(), samples.size());
+        return fingerprinter.fingerprints;
+    }
+
+    /* However the decoder happens to hand them out. */
+    for (size_t at = 0; at < samples.size(); )
+    {
+        size_t count = std::min(samples.size() - at, (size_t) (1 + std::rand() % 5000));
+        fingerprinter.feed(samples.data() + at, count);
+        at += count;
+    }
+
+    return fingerprinter.fingerprints;
+}
+
+/* Fingerprints don't depend on how the samples are chunked, copies of a track are close to it and nothing else is, and the index finds them. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2042);
+
+    int failures = 0;
+
+    std::vector<int16_t> samples = track(10);
+    std::vector<uint32_t> whole = fingerprint(samples, false);
+
+    size_t expected = (samples.size() - AUDIO_FRAME_SIZE) / AUDIO_HOP;
+
+    std::cout << whole.size() << " sub-fingerprints (" << expected << " expected)\n";
+
+    if (whole.size() != expected)
+        failures++;
+
+    if (fingerprint(samples, true) != whole)
+    {
+        std::cout << "Chunked sub-fingerprints differ\n";
+        failures++;
+    }
+
+    size_t overlap;
+    double copy_ber = Audio::bit_error_rate(whole, fingerprint(copy_of(samples, 7), true), -7, overlap);
+    double other_ber = Audio::bit_error_rate(whole, fingerprint(track(10), true), 0, overlap);
+
+    std::cout << "Bit error rate of a copy: " << copy_ber << ", of another track: " << other_ber << "\n";
+
+    if (copy_ber > AUDIO_MAX_BER / 2 || other_ber < AUDIO_MAX_BER)
+        failures++;
+
+    /* Every odd track is a copy of the one before it, every even one is unrelated to the rest. */
+    std::vector<Audio*> audios;
+
+    for (int a = 0; a < 20; a++)
+    {
+        Audio *aud = new Audio();
+
+        if (a % 2 == 1)
+            aud->fingerprints = fingerprint(copy_of(samples, a), true);
+        else
+        {
+            samples = track(8 + std::rand() % 8);
+            aud->fingerprints = fingerprint(samples, true);
+        }
+
+        audios.push_back(aud);
+    }
+
+    std::vector<std::vector<Audio*>*> sets = Audio::find_similar_audios(audios, AUDIO_MAX_BER);
+    int wrong = 0;
+
+    for (std::vector<Audio*> *set : sets)
+    {
+        if (set->size() != 2 || (*set)[1] != audios[(std::find(audios.begin(), audios.end(), (*set)[0]) - audios.begin()) + 1])
+            wrong++;
+
+        delete set;
+    }
+
+    std::cout << sets.size() << " sets of similar audio files (10 expected), " << wrong << " wrong\n";
+
+    if (sets.size() != 10 || wrong != 0)
+        failures++;
+
+    for (Audio *aud : audios)
+        delete aud;
+
+    return failures != 0;
+}
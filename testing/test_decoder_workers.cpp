@@ -0,0 +1,161 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+
+#include "../decoders.hpp"
+#include "../decoder_workers.hpp"
+
+using namespace SimpicServerLib;
+
+/* A grey PNG of random pixels. */
+static std::FILE *png(int width, int height)
+{
+    std::FILE *fp = std::tmpfile();
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    std::vector<uint8_t> row(width);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (uint8_t &value : row)
+            value = std::rand() % 256;
+
+        png_write_row(png, row.data());
+    }
+
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+
+    std::fflush(fp);
+    std::fseek(fp, 0, SEEK_SET);
+    return fp;
+}
+
+/* A file that starts with these bytes. */
+static std::FILE *starting_with(const char *magic)
+{
+    std::FILE *fp = std::tmpfile();
+
+    std::fputs(magic, fp);
+    std::fflush(fp);
+    std::fseek(fp, 0, SEEK_SET);
+    return fp;
+}
+
+/* Takes its process down on any file starting with "CRASH". */
+class CrashingDecoder : public ImageDecoder
+{
+public:
+    const char *name() const override { return "crashing"; }
+    bool probe(const uint8_t *header, size_t length) const override { return length >= 5 && !std::memcmp(header, "CRASH", 5); }
+    double cost(uint32_t width, uint32_t height) const override { return 0; }
+    size_t memory(uint32_t width, uint32_t height) const override { return 0; }
+    bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override { std::abort(); }
+};
+
+/* Never finishes with any file starting with "HANG". */
+class HangingDecoder : public ImageDecoder
+{
+public:
+    const char *name() const override { return "hanging"; }
+    bool probe(const uint8_t *header, size_t length) const override { return length >= 4 && !std::memcmp(header, "HANG", 4); }
+    double cost(uint32_t width, uint32_t height) const override { return 0; }
+    size_t memory(uint32_t width, uint32_t height) const override { return 0; }
+
+    bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override
+    {
+        while (true)
+            pause();
+    }
+};
+
+/* Images decoded in worker processes hash the same as in this one, and a worker that crashes or hangs only loses the file it was on. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2047);
+
+    int failures = 0;
+
+    /* Added before the workers are forked, so that they have them too. */
+    DecoderRegistry::builtin().add(std::make_unique<CrashingDecoder>());
+    DecoderRegistry::builtin().add(std::make_unique<HangingDecoder>());
+
+    std::vector<std::FILE*> images;
+    std::vector<std::vector<uint64_t>> expected;
+
+    for (int i = 0; i < 8; i++)
+    {
+        images.push_back(png(64 + i * 13, 48 + i * 7));
+        expected.push_back(*DecoderRegistry::builtin().hash(images.back(), "test", 0, 0, true));
+    }
+
+    DecoderWorkers workers(2, 500);
+    DecoderRegistry::builtin().isolate(&workers);
+
+    bool same = true;
+
+    for (size_t i = 0; i < images.size(); i++)
+        same = same && DecoderRegistry::builtin().hash(images[i], "test", 0, 0, true) == expected[i] &&
+            DecoderRegistry::builtin().hash(images[i], "test", 0, 0, false) == std::vector<uint64_t>{expected[i][0]};
+
+    std::cout << "Hashing in a worker: " << (same ? "right" : "WRONG") << "\n";
+    failures += !same;
+
+    /* Crashing both of them, one after the other, and then hashing with whichever was started again. */
+    std::FILE *fp = starting_with("CRASH");
+    bool crashed = !DecoderRegistry::builtin().hash(fp, "crash", 0, 0, false) &&
+        !DecoderRegistry::builtin().hash(fp, "crash", 0, 0, false) &&
+        !DecoderRegistry::builtin().hash(fp, "crash", 0, 0, false);
+    std::fclose(fp);
+
+    bool survived = crashed && DecoderRegistry::builtin().hash(images[0], "test", 0, 0, true) == expected[0];
+
+    std::cout << "Surviving a crash: " << (survived ? "right" : "WRONG") << "\n";
+    failures += !survived;
+
+    fp = starting_with("HANG");
+    bool stopped = !DecoderRegistry::builtin().hash(fp, "hang", 0, 0, false) &&
+        DecoderRegistry::builtin().hash(images[1], "test", 0, 0, true) == expected[1];
+    std::fclose(fp);
+
+    std::cout << "Stopping a worker that hangs: " << (stopped ? "right" : "WRONG") << "\n";
+    failures += !stopped;
+
+    /* More threads than workers, each with its own image. */
+    std::vector<std::thread> threads;
+    std::vector<uint8_t> right(images.size(), false);
+
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        threads.emplace_back([&images, &expected, &right, i]() -> void {
+            for (int j = 0; j < 5; j++)
+                right[i] = DecoderRegistry::builtin().hash(images[i], "test", 0, 0, true) == expected[i] && (j == 0 || right[i]);
+        });
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    bool concurrent = std::find(right.begin(), right.end(), false) == right.end();
+
+    std::cout << "Hashing from many threads: " << (concurrent ? "right" : "WRONG") << "\n";
+    failures += !concurrent;
+
+    DecoderRegistry::builtin().isolate(nullptr);
+
+    for (std::FILE *image : images)
+        std::fclose(image);
+
+    return failures != 0;
+}
@@ -0,0 +1,476 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <bit>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "../decoders.hpp"
+#include "../dihedral.hpp"
+
+using namespace SimpicServerLib;
+
+typedef std::vector<uint8_t> Bytes;
+
+/* Random colours, as RGB. */
+static Bytes picture(int width, int height)
+{
+    Bytes rgb((size_t) width * height * 3);
+
+    for (uint8_t &value : rgb)
+        value = std::rand() % 256;
+
+    return rgb;
+}
+
+/* The luma every decoder should come up with for these colours. */
+static std::vector<float> expected_luma(const Bytes &rgb)
+{
+    std::vector<float> luma;
+
+    for (size_t i = 0; i < rgb.size(); i += 3)
+        luma.push_back((uint8_t) std::clamp((66.0f * rgb[i] + 129.0f * rgb[i + 1] + 25.0f * rgb[i + 2] + 128) / 256 + 16,
+                                            0.0f, 255.0f));
+
+    return luma;
+}
+
+static std::FILE *png(const Bytes &rgb, int width, int height, bool alpha, bool interlaced)
+{
+    std::FILE *fp = std::tmpfile();
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, width, height, 8, alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+                 interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    int channels = alpha ? 4 : 3;
+    Bytes rows((size_t) width * height * channels);
+    std::vector<png_bytep> pointers;
+
+    for (size_t i = 0, j = 0; i < rgb.size(); i += 3)
+    {
+        rows[j++] = rgb[i];
+        rows[j++] = rgb[i + 1];
+        rows[j++] = rgb[i + 2];
+
+        if (alpha)
+            rows[j++] = std::rand() % 256;
+    }
+
+    for (int y = 0; y < height; y++)
+        pointers.push_back(&rows[(size_t) y * width * channels]);
+
+    png_write_image(png, pointers.data());
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+
+    std::fflush(fp);
+    std::fseek(fp, 0, SEEK_SET);
+    return fp;
+}
+
+static std::FILE *jpeg(const Bytes &rgb, int width, int height)
+{
+    std::FILE *fp = std::tmpfile();
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr error;
+
+    cinfo.err = jpeg_std_error(&error);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 100, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = (JSAMPROW) &rgb[(size_t) cinfo.next_scanline * width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    std::fflush(fp);
+    std::fseek(fp, 0, SEEK_SET);
+    return fp;
+}
+
+/* A GIF of colour indices into a palette of 256 colours, a frame within a bigger screen. The LZW codes are all literals, with a clear code often enough that they stay 9 bits long. */
+static std::FILE *gif(const Bytes &palette, const Bytes &indices, int screen_width, int screen_height,
+        int left, int top, int width, int height, bool interlaced)
+{
+    Bytes bytes = {'G', 'I', 'F', '8', '9', 'a'};
+
+    auto word = [&bytes](int value) -> void {
+        bytes.push_back(value & 0xFF);
+        bytes.push_back(value >> 8);
+    };
+
+    word(screen_width);
+    word(screen_height);
+    bytes.insert(bytes.end(), {0xF7, 0, 0});
+    bytes.insert(bytes.end(), palette.begin(), palette.end());
+
+    /* A comment, to be skipped. */
+    bytes.insert(bytes.end(), {0x21, 0xFE, 3, 'h', 'e', 'y', 0});
+
+    bytes.push_back(0x2C);
+    word(left);
+    word(top);
+    word(width);
+    word(height);
+    bytes.push_back(interlaced ? 0x40 : 0);
+    bytes.push_back(8);
+
+    Bytes data;
+    uint32_t bits = 0;
+    int bit_count = 0;
+
+    auto code = [&](int value) -> void {
+        bits |= (uint32_t) value << bit_count;
+
+        for (bit_count += 9; bit_count >= 8; bit_count -= 8, bits >>= 8)
+            data.push_back(bits & 0xFF);
+    };
+
+    /* Interlaced rows come every 8th from 0, every 8th from 4, every 4th from 2, then every other one. */
+    std::vector<std::pair<int, int>> passes = {{0, 8}, {4, 8}, {2, 4}, {1, 2}};
+    std::vector<int> rows;
+
+    if (!interlaced)
+        passes = {{0, 1}};
+
+    for (auto [start, step] : passes)
+        for (int y = start; y < height; y += step)
+            rows.push_back(y);
+
+    int since_clear = 0;
+
+    for (int y : rows)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            if (since_clear++ % 250 == 0)
+                code(256);
+
+            code(indices[(size_t) y * width + x]);
+        }
+    }
+
+    code(257);
+
+    if (bit_count > 0)
+        data.push_back(bits & 0xFF);
+
+    for (size_t at = 0; at < data.size(); at += 255)
+    {
+        size_t size = std::min<size_t>(255, data.size() - at);
+        bytes.push_back(size);
+        bytes.insert(bytes.end(), data.begin() + at, data.begin() + at + size);
+    }
+
+    bytes.insert(bytes.end(), {0, 0x3B});
+
+    std::FILE *fp = std::tmpfile();
+    std::fwrite(bytes.data(), 1, bytes.size(), fp);
+    std::fflush(fp);
+    std::fseek(fp, 0, SEEK_SET);
+    return fp;
+}
+
+/* The whole JPEG as libjpeg decodes it (and CImg reads it), to compare the decoder to. */
+static std::vector<float> jpeg_luma(std::FILE *fp)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr error;
+
+    cinfo.err = jpeg_std_error(&error);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+
+    Bytes rgb((size_t) cinfo.output_width * cinfo.output_height * 3);
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = (JSAMPROW) &rgb[(size_t) cinfo.output_scanline * cinfo.output_width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    std::fseek(fp, 0, SEEK_SET);
+    return expected_luma(rgb);
+}
+
+/* A huge grey PNG, written a row at a time. */
+static std::FILE *huge_png(int width, int height)
+{
+    std::FILE *fp = std::tmpfile();
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+
+    png_init_io(png, fp);
+    png_set_compression_level(png, 1);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    Bytes row(width);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+            row[x] = (x / 700 * 37 + y / 500 * 91) % 256;
+
+        png_write_row(png, row.data());
+    }
+
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+
+    std::fflush(fp);
+    std::fseek(fp, 0, SEEK_SET);
+    return fp;
+}
+
+/* A baseline TIFF: uncompressed RGB, little-endian, in one strip. */
+static std::FILE *tiff(const Bytes &rgb, int width, int height)
+{
+    std::FILE *fp = std::tmpfile();
+
+    auto u16 = [fp](uint16_t value) { std::fputc(value & 0xFF, fp); std::fputc(value >> 8, fp); };
+    auto u32 = [&u16](uint32_t value) { u16(value & 0xFFFF); u16(value >> 16); };
+    auto entry = [&](uint16_t tag, uint16_t type, uint32_t count, uint32_t value) { u16(tag); u16(type); u32(count); u32(value); };
+
+    /* The header, the directory (of ten entries), the bits per sample and then the pixels. */
+    const uint32_t directory = 8, bits = directory + 2 + 10 * 12 + 4, pixels = bits + 6;
+
+    std::fputs("II", fp);
+    u16(42);
+    u32(directory);
+
+    u16(10);
+    entry(256, 4, 1, width);            // ImageWidth
+    entry(257, 4, 1, height);           // ImageLength
+    entry(258, 3, 3, bits);             // BitsPerSample
+    entry(259, 3, 1, 1);                // Compression: none
+    entry(262, 3, 1, 2);                // PhotometricInterpretation: RGB
+    entry(273, 4, 1, pixels);           // StripOffsets
+    entry(277, 3, 1, 3);                // SamplesPerPixel
+    entry(278, 4, 1, height);           // RowsPerStrip
+    entry(279, 4, 1, rgb.size());       // StripByteCounts
+    entry(284, 3, 1, 1);                // PlanarConfiguration: chunky
+    u32(0);
+
+    u16(8);
+    u16(8);
+    u16(8);
+
+    std::fwrite(rgb.data(), 1, rgb.size(), fp);
+    std::rewind(fp);
+    return fp;
+}
+
+/* Whether the registry hashes a file within a couple of bits (rounding) of pHash decoding it itself, which it needs to be given by name, as name in directory. */
+static bool cross_check(const std::string &name, std::FILE *fp, int width, int height, const std::string &directory,
+                        const std::string &filename)
+{
+    std::string path = directory + "/" + filename;
+    std::FILE *named = std::fopen(path.c_str(), "wb");
+    char buffer[4096];
+    size_t amnt;
+
+    while ((amnt = std::fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        std::fwrite(buffer, 1, amnt, named);
+
+    std::fclose(named);
+    std::rewind(fp);
+
+    std::optional<std::vector<uint64_t>> hashes = DecoderRegistry::builtin().hash(fp, path, width, height, false);
+    std::fclose(fp);
+
+    ulong64 phash;
+    bool good = hashes && ph_dct_imagehash(path.c_str(), phash) == 0 && std::popcount((*hashes)[0] ^ phash) <= 2;
+
+    std::cout << name << " as pHash hashes it: " << (good ? "right" : "WRONG") << "\n";
+    std::remove(path.c_str());
+    return good;
+}
+
+/* Whether decoding the file gives the same hashes as hashing the whole image, given by its luma. */
+static bool check(const std::string &name, std::FILE *fp, const std::vector<float> &expected, int width, int height)
+{
+    std::optional<DCTSampler> samples = DecoderRegistry::builtin().decode_gray(fp, "test");
+    std::fclose(fp);
+
+    bool good = samples && samples->width == width && samples->height == height &&
+        samples->variants() == DCTBlock::variants(expected, width, height);
+
+    std::cout << name << ": " << (good ? "right" : "WRONG") << "\n";
+    return good;
+}
+
+/* A decoder that claims everything for nearly nothing, but decodes nothing. */
+class BrokenDecoder : public ImageDecoder
+{
+public:
+    const char *name() const override { return "broken"; }
+    bool probe(const uint8_t *header, size_t length) const override { return true; }
+    double cost(uint32_t width, uint32_t height) const override { return 0; }
+    size_t memory(uint32_t width, uint32_t height) const override { return 0; }
+    bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override { return false; }
+};
+
+/* A decoder that needs the whole image in memory, and "decodes" it as black. */
+class WholeImageDecoder : public ImageDecoder
+{
+public:
+    const char *name() const override { return "whole"; }
+    bool probe(const uint8_t *header, size_t length) const override { return true; }
+    double cost(uint32_t width, uint32_t height) const override { return 0; }
+    size_t memory(uint32_t width, uint32_t height) const override { return (size_t) width * height * 4; }
+
+    bool decode_gray(std::FILE *fp, const std::string &path, DCTSampler &out) const override
+    {
+        out.start(10, 10);
+        std::vector<float> luma(out.columns().size(), 0);
+
+        for (int y = 0; y < 10; y++)
+            out.add_row(y, luma.data());
+
+        return true;
+    }
+};
+
+/* Every built-in decoder hashes an image the same as hashing all of its luma (the luma CImg gives pHash), without ever having all of it in memory, and the registry hashes files as pHash does, tries the cheapest decoder first, falls back to the next one and keeps to the memory budget. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2045);
+
+    int failures = 0;
+
+    Bytes rgb = picture(203, 131);
+    std::vector<float> luma = expected_luma(rgb);
+
+    failures += !check("PNG", png(rgb, 203, 131, false, false), luma, 203, 131);
+    failures += !check("Interlaced PNG with alpha", png(rgb, 203, 131, true, true), luma, 203, 131);
+
+    std::FILE *fp = jpeg(rgb, 203, 131);
+    failures += !check("JPEG", fp, jpeg_luma(fp), 203, 131);
+
+    Bytes palette = picture(256, 1);
+    std::vector<float> palette_luma = expected_luma(palette);
+
+    Bytes indices((size_t) 137 * 93);
+    std::vector<float> gif_luma;
+
+    for (uint8_t &index : indices)
+    {
+        index = std::rand() % 256;
+        gif_luma.push_back(palette_luma[index]);
+    }
+
+    failures += !check("GIF", gif(palette, indices, 137, 93, 0, 0, 137, 93, false), gif_luma, 137, 93);
+    failures += !check("Interlaced GIF", gif(palette, indices, 137, 93, 0, 0, 137, 93, true), gif_luma, 137, 93);
+
+    /* The frame in the middle of a screen of the background colour (index 0). */
+    std::vector<float> framed(150 * 100, palette_luma[0]);
+
+    for (int y = 0; y < 93; y++)
+        for (int x = 0; x < 137; x++)
+            framed[(y + 4) * 150 + x + 6] = gif_luma[y * 137 + x];
+
+    failures += !check("GIF frame within its screen", gif(palette, indices, 150, 100, 6, 4, 137, 93, false), framed, 150, 100);
+
+    /* Hashed the same as by pHash's own decode, from a file. */
+    char location[] = "/tmp/simpic_test_decoders_XXXXXX";
+
+    if (mkdtemp(location) == nullptr)
+    {
+        std::cerr << "Failed to make a temporary directory.\n";
+        return 1;
+    }
+
+    failures += !cross_check("PNG", png(rgb, 203, 131, false, false), 203, 131, location, "picture.png");
+    failures += !cross_check("JPEG", jpeg(rgb, 203, 131), 203, 131, location, "picture.jpg");
+    failures += !cross_check("TIFF", tiff(rgb, 203, 131), 203, 131, location, "picture.tiff");
+    failures += !cross_check("GIF", gif(palette, indices, 137, 93, 0, 0, 137, 93, false), 137, 93, location, "picture.gif");
+
+    rmdir(location);
+
+    /* The built-in decoder comes before CImg, and only CImg would try something it doesn't know. */
+    uint8_t png_header[8];
+    std::memcpy(png_header, PNG_MAGIC, sizeof(PNG_MAGIC));
+
+    std::vector<const ImageDecoder*> candidates = DecoderRegistry::builtin().candidates(png_header, sizeof(png_header), 640, 480);
+    bool ordered = candidates.size() == 2 && std::string(candidates[0]->name()) == "PNG" && std::string(candidates[1]->name()) == "CImg";
+
+    const uint8_t text[] = "Not an image";
+    candidates = DecoderRegistry::builtin().candidates(text, sizeof(text), 0, 0);
+    ordered = ordered && candidates.size() == 1 && std::string(candidates[0]->name()) == "CImg";
+
+    std::cout << "Decoders in order of cost: " << (ordered ? "right" : "WRONG") << "\n";
+    failures += !ordered;
+
+    /* A cheaper decoder that fails doesn't stop the PNG being decoded. */
+    DecoderRegistry registry;
+    registry.add(std::make_unique<PNGDecoder>());
+    registry.add(std::make_unique<BrokenDecoder>());
+
+    fp = png(rgb, 203, 131, false, false);
+    std::optional<DCTSampler> samples = registry.decode_gray(fp, "test");
+    std::fclose(fp);
+
+    bool fell_back = samples && samples->hash() == DCTBlock::variants(luma, 203, 131)[0];
+
+    std::cout << "Falling back to the next decoder: " << (fell_back ? "right" : "WRONG") << "\n";
+    failures += !fell_back;
+
+    /* A decoder that would need too much memory for an image that big isn't used for it. */
+    DecoderRegistry greedy;
+    greedy.add(std::make_unique<WholeImageDecoder>());
+
+    fp = png(rgb, 203, 131, false, false);
+    bool budgeted = greedy.decode_gray(fp, "test", 203, 131) && !greedy.decode_gray(fp, "test", 60000, 60000);
+    std::fclose(fp);
+
+    std::cout << "Keeping to the memory budget: " << (budgeted ? "right" : "WRONG") << "\n";
+    failures += !budgeted;
+
+    /* 160 megapixels, hashed in a few MB. */
+    fp = huge_png(16000, 10000);
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+
+    samples = DecoderRegistry::builtin().decode_gray(fp, "huge", 16000, 10000);
+    std::fclose(fp);
+
+    getrusage(RUSAGE_SELF, &after);
+    long grown = (after.ru_maxrss - before.ru_maxrss) / 1024;
+
+    std::cout << "A huge PNG took " << grown << " MB more at most\n";
+
+    if (!samples || samples->width != 16000 || grown > 16)
+        failures++;
+
+    return failures != 0;
+}
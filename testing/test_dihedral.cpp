@@ -0,0 +1,141 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+
+#include "../dihedral.hpp"
+
+using namespace SimpicServerLib;
+
+/* A random picture: a 12x12 grid of random greys, smoothly blended into each other. */
+static std::vector<float> picture(int width, int height)
+{
+    float grid[13][13];
+
+    for (auto &row : grid)
+        for (float &value : row)
+            value = std::rand() % 256;
+
+    std::vector<float> luma((size_t) width * height);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float gx = 12.0f * x / width, gy = 12.0f * y / height;
+            int ix = gx, iy = gy;
+            float fx = gx - ix, fy = gy - iy;
+
+            luma[(size_t) y * width + x] = (grid[iy][ix] * (1 - fx) + grid[iy][ix + 1] * fx) * (1 - fy) +
+                (grid[iy + 1][ix] * (1 - fx) + grid[iy + 1][ix + 1] * fx) * fy;
+        }
+    }
+
+    return luma;
+}
+
+/* Rotate or mirror the pixels themselves. */
+static std::vector<float> transform(const std::vector<float> &luma, int width, int height, DihedralTransforms t,
+        int &new_width, int &new_height)
+{
+    bool swap = t >= DihedralTransforms::Transpose;
+    new_width = swap ? height : width;
+    new_height = swap ? width : height;
+
+    std::vector<float> result(luma.size());
+
+    for (int y = 0; y < new_height; y++)
+    {
+        for (int x = 0; x < new_width; x++)
+        {
+            int sx = x, sy = y;
+
+            switch (t)
+            {
+                case DihedralTransforms::Identity: break;
+                case DihedralTransforms::FlipHorizontal: sx = width - 1 - x; break;
+                case DihedralTransforms::FlipVertical: sy = height - 1 - y; break;
+                case DihedralTransforms::Rotate180: sx = width - 1 - x; sy = height - 1 - y; break;
+                case DihedralTransforms::Transpose: sx = y; sy = x; break;
+                case DihedralTransforms::Rotate90: sx = y; sy = height - 1 - x; break;
+                case DihedralTransforms::Rotate270: sx = width - 1 - y; sy = x; break;
+                case DihedralTransforms::AntiTranspose: sx = width - 1 - y; sy = height - 1 - x; break;
+            }
+
+            result[(size_t) y * new_width + x] = luma[(size_t) sy * width + sx];
+        }
+    }
+
+    return result;
+}
+
+/* The variants worked out from one picture are the hashes of the rotated or mirrored pictures, and come out the same from a DCTSampler. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(1234);
+
+    int failures = 0;
+
+    /* Sums of floats in another order may round differently, and a coefficient right at the median */
+    /* may end up on the other side of it. */
+    const int allowed = 1;
+    int sizes[][2] = {{32, 32}, {200, 120}, {75, 301}, {64, 48}};
+
+    for (auto &[width, height] : sizes)
+    {
+        int worst = 0;
+
+        for (int round = 0; round < 20; round++)
+        {
+            std::vector<float> luma = picture(width, height);
+            std::vector<uint64_t> variants = DCTBlock::variants(luma, width, height);
+
+            for (int t = 0; t < DIHEDRAL_TRANSFORMS; t++)
+            {
+                int w, h;
+                std::vector<float> moved = transform(luma, width, height, (DihedralTransforms) t, w, h);
+
+                int distance = ph_hamming_distance(variants[t],
+                    DCTBlock::of_blurred(DCTBlock::blur(moved, w, h), w, h).hash());
+                worst = std::max(worst, distance);
+            }
+        }
+
+        std::cout << width << "x" << height << ": at most " << worst << " bits off\n";
+
+        if (worst > allowed)
+            failures++;
+    }
+
+    /* Sampling the image a row at a time, keeping only what the hash needs, gives exactly the same hashes. */
+    int streamed_sizes[][2] = {{32, 32}, {200, 120}, {75, 301}, {3, 2}, {1, 1}, {5000, 40}};
+
+    for (auto &[width, height] : streamed_sizes)
+    {
+        std::vector<float> luma = picture(width, height);
+
+        DCTSampler sampler;
+        sampler.start(width, height);
+
+        std::vector<float> row(sampler.columns().size());
+
+        for (int y = 0; y < height; y++)
+        {
+            if (!sampler.needs_row(y))
+                continue;
+
+            for (size_t c = 0; c < row.size(); c++)
+                row[c] = luma[(size_t) y * width + sampler.columns()[c]];
+
+            sampler.add_row(y, row.data());
+        }
+
+        bool same = sampler.variants() == DCTBlock::variants(luma, width, height);
+        std::cout << width << "x" << height << " a row at a time: " << (same ? "the same" : "DIFFERENT") << "\n";
+
+        if (!same)
+            failures++;
+    }
+
+    return failures != 0;
+}
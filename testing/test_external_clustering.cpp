@@ -0,0 +1,222 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "../external_clustering.hpp"
+#include "../hamming_index.hpp"
+
+using namespace SimpicServerLib;
+
+/* How much is allocated through new, and the most there has been since the last reset(), to show that clustering stays within its memory. */
+static size_t live = 0;
+static size_t peak = 0;
+static bool counting = false;
+
+static void reset()
+{
+    peak = live;
+}
+
+void *operator new(size_t size)
+{
+    /* The size goes in front, for delete to take off again. */
+    size_t *block = (size_t*) std::malloc(size + sizeof(std::max_align_t));
+
+    if (block == nullptr)
+        throw std::bad_alloc();
+
+    *block = size;
+
+    if (counting)
+    {
+        live += size;
+        peak = std::max(peak, live);
+    }
+
+    return (char*) block + sizeof(std::max_align_t);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    if (pointer == nullptr)
+        return;
+
+    size_t *block = (size_t*) ((char*) pointer - sizeof(std::max_align_t));
+
+    if (counting)
+        live -= std::min(live, *block);
+
+    std::free(block);
+}
+
+void operator delete(void *pointer, size_t size) noexcept
+{
+    operator delete(pointer);
+}
+
+/* The components as HammingIndex finds them, each in order. */
+static std::vector<std::vector<uint32_t>> in_memory(const std::vector<DCTHash> &hashes, uint8_t max_ham)
+{
+    std::vector<std::vector<uint32_t>> result;
+    HammingIndex<DCTHash> index(hashes);
+
+    index.components(max_ham, [&result](const std::vector<uint32_t> &component) -> bool {
+        result.push_back(component);
+        std::sort(result.back().begin(), result.back().end());
+        return true;
+    });
+
+    return result;
+}
+
+/* The same, out of core, in no more than memory (more than what is allocated already), with the pieces of each component put back together, and how many calls it took. */
+static std::vector<std::vector<uint32_t>> external(const std::string &spills, const std::vector<DCTHash> &hashes, uint8_t max_ham,
+                                                   size_t memory, size_t read_size, bool &within, size_t *calls = nullptr)
+{
+    std::vector<std::vector<uint32_t>> result;
+    ExternalClustering clustering(spills, max_ham, memory, read_size);
+    size_t called = 0;
+
+    for (const DCTHash &hash : hashes)
+        clustering.add(hash);
+
+    counting = true;
+    size_t before = live;
+    reset();
+
+    bool clustered = clustering.components([&](const std::vector<uint32_t> &component, bool continues) -> bool {
+        counting = false;
+        called++;
+
+        if (continues && !result.empty())
+            result.back().insert(result.back().end(), component.begin(), component.end());
+        else
+            result.push_back(component);
+
+        counting = true;
+        return true;
+    });
+
+    within = clustered && peak - before <= memory;
+    counting = false;
+
+    if (calls != nullptr)
+        *calls = called;
+
+    return result;
+}
+
+/* Clusters of near-duplicates around random hashes: a few bits flipped from each. */
+static std::vector<DCTHash> clustered(size_t count, size_t centres, int flips)
+{
+    std::vector<uint64_t> around;
+
+    for (size_t i = 0; i < centres; i++)
+        around.push_back((uint64_t) std::rand() << 42 ^ (uint64_t) std::rand() << 21 ^ std::rand());
+
+    std::vector<DCTHash> hashes;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t hash = around[std::rand() % centres];
+
+        for (int flip = std::rand() % (flips + 1); flip > 0; flip--)
+            hash ^= (uint64_t) 1 << (std::rand() % 64);
+
+        hashes.push_back(hash);
+    }
+
+    return hashes;
+}
+
+static bool empty_directory(const std::string &path)
+{
+    DIR *d = opendir(path.c_str());
+    int entries = 0;
+
+    while (readdir(d) != nullptr)
+        entries++;
+
+    closedir(d);
+    return entries == 2;
+}
+
+/* Out of core, the components are exactly those HammingIndex finds, in the same order, however little memory (and however many runs and merges) it takes. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2050);
+
+    int failures = 0;
+
+    char name[] = "/tmp/test_external_clustering-XXXXXX";
+    std::string spills = mkdtemp(name);
+
+    /* 50000 hashes in 400KB, 200KB of which is the forest: six runs, merged five at a time, then two. */
+    std::vector<DCTHash> hashes = clustered(50000, 4000, 4);
+    bool within = false;
+
+    bool same = external(spills, hashes, 3, 400000, 16384, within) == in_memory(hashes, 3);
+
+    std::cout << "Clustering out of core: " << (same ? "right" : "WRONG") << "\n";
+    std::cout << "Within the memory: " << (within ? "right" : "WRONG") << "\n";
+    failures += !same + !within;
+
+    /* Only 13 bits that differ: most of them have the same value in most blocks, more than twice what the window holds (but they are one component, and that fits). */
+    std::vector<DCTHash> alike;
+
+    for (int i = 0; i < 6000; i++)
+        alike.push_back((uint64_t) (std::rand() % 8192));
+
+    bool overflowing = external(spills, alike, 2, 124800, 1200, within) == in_memory(alike, 2) && within;
+
+    std::cout << "Clustering more alike than fit at once: " << (overflowing ? "right" : "WRONG") << "\n";
+    failures += !overflowing;
+
+    /* One component of 20000, in far fewer ids at a time: it comes in pieces, but as one component. */
+    std::vector<DCTHash> same_hash(20000, 0x5151515151515151ULL);
+    size_t pieces = 0;
+
+    bool split = external(spills, same_hash, 3, 200000, 1200, within, &pieces) == in_memory(same_hash, 3) && within && pieces > 1;
+
+    std::cout << "Continuing a component too big for the memory: " << (split ? "right" : "WRONG") << "\n";
+    failures += !split;
+
+    /* Not even room for the forest. */
+    ExternalClustering cramped(spills, 3, 1000);
+
+    for (const DCTHash &hash : hashes)
+        cramped.add(hash);
+
+    bool refused = !cramped.ready() && !cramped.components([](const std::vector<uint32_t> &component, bool continues) -> bool { return true; });
+
+    std::cout << "Refusing with too little memory: " << (refused ? "right" : "WRONG") << "\n";
+    failures += !refused;
+
+    /* Stopping after the first component. */
+    ExternalClustering stopping(spills, 3, 400000, 16384);
+    int calls = 0;
+
+    for (const DCTHash &hash : hashes)
+        stopping.add(hash);
+
+    bool stopped = stopping.components([&calls](const std::vector<uint32_t> &component, bool continues) -> bool { return ++calls < 1; }) &&
+        calls == 1;
+
+    std::cout << "Stopping early: " << (stopped ? "right" : "WRONG") << "\n";
+    failures += !stopped;
+
+    /* Nothing is left behind. */
+    bool cleaned = empty_directory(spills);
+    rmdir(spills.c_str());
+
+    std::cout << "Leaving no spills: " << (cleaned ? "right" : "WRONG") << "\n";
+    failures += !cleaned;
+
+    return failures != 0;
+}
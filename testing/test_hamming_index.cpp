@@ -0,0 +1,147 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "../hamming_index.hpp"
+
+using namespace SimpicServerLib;
+
+/* The index finds exactly what comparing against every hash finds. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(4321);
+
+    std::vector<DCTHash> hashes;
+    int failures = 0;
+
+    /* A few clusters of hashes a few bits apart, and some noise. */
+    for (int i = 0; i < 2000; i++)
+    {
+        uint64_t hash = ((uint64_t) std::rand() << 32) | (uint64_t) std::rand();
+
+        if (i % 3 != 0 && !hashes.empty())
+        {
+            hash = hashes[std::rand() % hashes.size()].words[0];
+
+            for (int flips = std::rand() % 4; flips > 0; flips--)
+                hash ^= (uint64_t) 1 << (std::rand() % 64);
+        }
+
+        hashes.push_back(hash);
+    }
+
+    HammingIndex<DCTHash> index(hashes);
+
+    for (uint8_t max_ham : {0, 3, 6, 10, 13})
+    {
+        int mismatches = 0;
+
+        for (uint32_t q = 0; q < hashes.size(); q += 7)
+        {
+            std::vector<uint32_t> expected;
+
+            for (uint32_t id = 0; id < hashes.size(); id++)
+                if (hamming_distance(hashes[q], hashes[id]) <= max_ham)
+                    expected.push_back(id);
+
+            if (index.search(hashes[q], max_ham) != expected)
+                mismatches++;
+        }
+
+        /* Components cover every hash exactly once. */
+        std::vector<int> seen(hashes.size(), 0);
+        index.components(max_ham, [&seen](const std::vector<uint32_t> &component) -> bool {
+            for (uint32_t id : component)
+                seen[id]++;
+
+            return true;
+        });
+
+        bool covered = std::all_of(seen.begin(), seen.end(), [](int count) -> bool { return count == 1; });
+
+        std::cout << "max_ham " << (int) max_ham << ": " << mismatches << " wrong searches, components "
+            << (covered ? "cover everything once" : "DON'T cover everything once") << "\n";
+
+        if (mismatches != 0 || !covered)
+            failures++;
+    }
+
+    /* The nearest ones are the first k of every hash sorted by distance, wherever they are. */
+    for (size_t k : {1, 5, 50, 3000})
+    {
+        int mismatches = 0;
+
+        for (uint32_t q = 0; q < hashes.size(); q += 11)
+        {
+            /* Half the queries aren't in the index at all, and may be far from everything. */
+            DCTHash hash = q % 2 ? hashes[q] : DCTHash(((uint64_t) std::rand() << 32) | (uint64_t) std::rand());
+            std::vector<std::pair<uint32_t, uint16_t>> expected;
+
+            for (uint32_t id = 0; id < hashes.size(); id++)
+                expected.push_back({id, (uint16_t) hamming_distance(hash, hashes[id])});
+
+            std::sort(expected.begin(), expected.end(),
+                [](const std::pair<uint32_t, uint16_t> &a, const std::pair<uint32_t, uint16_t> &b) -> bool {
+                    return a.second != b.second ? a.second < b.second : a.first < b.first;
+                });
+
+            expected.resize(std::min(k, expected.size()));
+
+            if (index.nearest(hash, k) != expected)
+                mismatches++;
+        }
+
+        std::cout << "k " << k << ": " << mismatches << " wrong nearest searches\n";
+
+        if (mismatches != 0)
+            failures++;
+    }
+
+    /* Wider hashes (the 576-bit Marr-Hildreth ones) go through the very same index. */
+    std::vector<MHHash> wide;
+
+    for (int i = 0; i < 500; i++)
+    {
+        MHHash hash;
+
+        for (uint64_t &word : hash.words)
+            word = ((uint64_t) std::rand() << 32) | (uint64_t) std::rand();
+
+        if (i % 2 != 0 && !wide.empty())
+        {
+            hash = wide[std::rand() % wide.size()];
+
+            for (int flips = std::rand() % 80; flips > 0; flips--)
+                hash.words[std::rand() % MHHash::WORDS] ^= (uint64_t) 1 << (std::rand() % 64);
+        }
+
+        wide.push_back(hash);
+    }
+
+    HammingIndex<MHHash> wide_index(wide);
+
+    for (uint16_t max_ham : {0, 40, 71, 150})
+    {
+        int mismatches = 0;
+
+        for (uint32_t q = 0; q < wide.size(); q += 3)
+        {
+            std::vector<uint32_t> expected;
+
+            for (uint32_t id = 0; id < wide.size(); id++)
+                if (hamming_distance(wide[q], wide[id]) <= max_ham)
+                    expected.push_back(id);
+
+            if (wide_index.search(wide[q], max_ham) != expected)
+                mismatches++;
+        }
+
+        std::cout << "576 bits, max_ham " << max_ham << ": " << mismatches << " wrong searches\n";
+
+        if (mismatches != 0)
+            failures++;
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,148 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+#include "../images.hpp"
+
+using namespace SimpicServerLib;
+
+typedef std::vector<uint8_t> Bytes;
+
+static void append(Bytes &bytes, std::initializer_list<int> values)
+{
+    for (int value : values)
+        bytes.push_back((uint8_t) value);
+}
+
+static void append(Bytes &bytes, const char *text)
+{
+    while (*text)
+        bytes.push_back((uint8_t) *text++);
+}
+
+static Bytes png(uint32_t width, uint32_t height)
+{
+    Bytes bytes(PNG_MAGIC, PNG_MAGIC + sizeof(PNG_MAGIC));
+    append(bytes, {0, 0, 0, 13});
+    append(bytes, "IHDR");
+    append(bytes, {(int) (width >> 24), (int) (width >> 16) & 0xFF, (int) (width >> 8) & 0xFF, (int) width & 0xFF});
+    append(bytes, {(int) (height >> 24), (int) (height >> 16) & 0xFF, (int) (height >> 8) & 0xFF, (int) height & 0xFF});
+    append(bytes, {8, 6, 0, 0, 0, 0x12, 0x34, 0x56, 0x78});
+    return bytes;
+}
+
+/* An EXIF segment far bigger than the first bytes, padding before a marker, and a progressive frame. */
+static Bytes jpeg(int width, int height)
+{
+    Bytes bytes;
+    append(bytes, {0xFF, 0xD8, 0xFF, 0xE1, 0x10, 0x02});
+    append(bytes, "Exif");
+    bytes.resize(bytes.size() + 0x1000 - 4, 0);
+    append(bytes, {0xFF, 0xDB, 0x00, 0x04, 0x00, 0x00});
+    append(bytes, {0xFF, 0xFF, 0xFF, 0xC2, 0x00, 0x11, 0x08, height >> 8, height & 0xFF, width >> 8, width & 0xFF, 3});
+    bytes.resize(bytes.size() + 9, 0);
+    append(bytes, {0xFF, 0xDA, 0x00, 0x02, 0xFF, 0xD9});
+    return bytes;
+}
+
+static Bytes gif(int width, int height)
+{
+    Bytes bytes;
+    append(bytes, "GIF89a");
+    append(bytes, {width & 0xFF, width >> 8, height & 0xFF, height >> 8, 0xF7, 0, 0});
+    return bytes;
+}
+
+static Bytes webp(const char *kind, int width, int height)
+{
+    Bytes bytes;
+    append(bytes, "RIFF");
+    append(bytes, {0x40, 0, 0, 0});
+    append(bytes, "WEBP");
+    append(bytes, kind);
+    append(bytes, {0x20, 0, 0, 0});
+
+    if (std::string(kind) == "VP8 ")
+        append(bytes, {0x30, 0x01, 0x00, 0x9D, 0x01, 0x2A, width & 0xFF, width >> 8, height & 0xFF, height >> 8});
+    else if (std::string(kind) == "VP8L")
+    {
+        uint32_t bits = (uint32_t) (width - 1) | ((uint32_t) (height - 1) << 14);
+        append(bytes, {0x2F, (int) bits & 0xFF, (int) (bits >> 8) & 0xFF, (int) (bits >> 16) & 0xFF, (int) (bits >> 24)});
+    }
+    else
+        append(bytes, {0, 0, 0, 0, (width - 1) & 0xFF, (width - 1) >> 8, 0, (height - 1) & 0xFF, (height - 1) >> 8, 0});
+
+    bytes.resize(64, 0);
+    return bytes;
+}
+
+/* The IFD after some image data, with the width as a SHORT and the height as a LONG. */
+static Bytes tiff(bool little, int width, int height)
+{
+    auto put = [little](Bytes &bytes, uint32_t value, int count) -> void {
+        for (int i = 0; i < count; i++)
+            bytes.push_back((uint8_t) (value >> (8 * (little ? i : count - 1 - i))));
+    };
+
+    Bytes bytes;
+    append(bytes, little ? "II" : "MM");
+    put(bytes, 42, 2);
+    put(bytes, 300, 4);
+    bytes.resize(300, 0x55);
+
+    put(bytes, 3, 2);
+    put(bytes, 254, 2); put(bytes, 4, 2); put(bytes, 1, 4); put(bytes, 0, 4);
+    put(bytes, 256, 2); put(bytes, 3, 2); put(bytes, 1, 4); put(bytes, width, 2); put(bytes, 0, 2);
+    put(bytes, 257, 2); put(bytes, 4, 2); put(bytes, 1, 4); put(bytes, height, 4);
+    put(bytes, 0, 4);
+    return bytes;
+}
+
+static bool check(const std::string &name, const Bytes &bytes, ImageType type, int width, int height)
+{
+    std::FILE *fp = std::tmpfile();
+    std::fwrite(bytes.data(), 1, bytes.size(), fp);
+
+    uint8_t header[IMAGE_SNIFF_LENGTH];
+    std::fseek(fp, 0, SEEK_SET);
+    size_t amnt = std::fread(header, 1, sizeof(header), fp);
+
+    ImageType found = Image::type_from_magic(header, amnt);
+    std::optional<std::pair<uint16_t, uint16_t>> dims = Image::get_dimensions(found, header, amnt, fp);
+
+    bool good = found == type && (width == 0 ? !dims : dims && dims->first == width && dims->second == height);
+
+    std::cout << name << ": " << (good ? "right" : "WRONG") << "\n";
+
+    std::fclose(fp);
+    return good;
+}
+
+/* Every format is recognized by its contents and measured from its header alone, and broken ones aren't measured at all. */
+int main(int argc, char **argv, char **envp)
+{
+    int failures = 0;
+
+    failures += !check("PNG", png(1920, 1080), ImageType::PNG, 1920, 1080);
+    failures += !check("Huge PNG", png(100000, 3), ImageType::PNG, 65535, 3);
+    failures += !check("JPEG behind a big EXIF segment", jpeg(4032, 3024), ImageType::JPEG, 4032, 3024);
+    failures += !check("GIF", gif(320, 200), ImageType::GIF, 320, 200);
+    failures += !check("Lossy WebP", webp("VP8 ", 550, 368), ImageType::WebP, 550, 368);
+    failures += !check("Lossless WebP", webp("VP8L", 1000, 16383), ImageType::WebP, 1000, 16383);
+    failures += !check("Extended WebP", webp("VP8X", 4000, 3000), ImageType::WebP, 4000, 3000);
+    failures += !check("Little-endian TIFF", tiff(true, 640, 480), ImageType::TIFF, 640, 480);
+    failures += !check("Big-endian TIFF", tiff(false, 800, 600), ImageType::TIFF, 800, 600);
+
+    Bytes truncated = jpeg(10, 10);
+    truncated.resize(100);
+
+    failures += !check("Truncated JPEG", truncated, ImageType::JPEG, 0, 0);
+    failures += !check("Truncated PNG", Bytes(PNG_MAGIC, PNG_MAGIC + sizeof(PNG_MAGIC)), ImageType::PNG, 0, 0);
+
+    Bytes text;
+    append(text, "Not an image at all, whatever it's called.");
+    failures += !check("Text", text, ImageType::Undefined, 0, 0);
+
+    return failures != 0;
+}
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+
+#include "../images.hpp"
+
+using namespace SimpicServerLib;
+
+/* Every allocation through new, to show that adding images doesn't take one (or several) each. */
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations++;
+
+    void *result = std::malloc(size == 0 ? 1 : size);
+
+    if (result == nullptr)
+        throw std::bad_alloc();
+
+    return result;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t size) noexcept
+{
+    std::free(pointer);
+}
+
+static Image image(uint64_t phash, int contents)
+{
+    Image img;
+
+    img.phash = phash;
+    img.length = contents;
+    img.width = 640;
+    img.height = 480;
+    std::memset(img.sha256, 0, SHA256_DIGEST_LENGTH);
+    std::memcpy(img.sha256, &contents, sizeof(contents));
+
+    return img;
+}
+
+/* Records keep their strings once, their images in a handful of allocations, and group and compare like Image's did. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2048);
+
+    int failures = 0;
+
+    Arena arena(1024);
+    bool aligned = true;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        arena.allocate(std::rand() % 7 + 1, 1);
+        aligned = aligned && (uintptr_t) arena.allocate<uint64_t>(3) % alignof(uint64_t) == 0;
+    }
+
+    /* Something too big for a block doesn't waste the one being filled. */
+    size_t before = arena.allocations();
+    arena.allocate(4096, 8);
+    arena.allocate(8, 8);
+    aligned = aligned && arena.allocations() == before + 1;
+
+    std::cout << "Allocating from an arena: " << (aligned ? "right" : "WRONG") << "\n";
+    failures += !aligned;
+
+    /* Interning the same strings again, while the table grows, gives the same ids. */
+    StringTable table;
+    std::vector<uint32_t> ids;
+    bool interned = true;
+
+    for (int i = 0; i < 5000; i++)
+        ids.push_back(table.intern(arena, "/pics/" + std::to_string(i)));
+
+    for (int i = 0; i < 5000; i++)
+    {
+        std::string name = "/pics/" + std::to_string(i);
+        interned = interned && table.intern(arena, name) == ids[i] && table.get(ids[i]) == name &&
+            table.get(ids[i]).data()[name.size()] == '\0';
+    }
+
+    interned = interned && table.size() == 5000;
+
+    std::cout << "Interning strings: " << (interned ? "right" : "WRONG") << "\n";
+    failures += !interned;
+
+    /* 200000 images in 100 directories. */
+    std::vector<std::string> dirs;
+    std::vector<std::string> names;
+
+    for (int i = 0; i < 100; i++)
+        dirs.push_back("/pictures/from/the/camera/" + std::to_string(i));
+
+    for (int i = 0; i < 200000; i++)
+        names.push_back("a picture from the camera, " + std::to_string(i) + ".png");
+
+    Image img = image(0, 0);
+    ImageRecords records;
+
+    size_t allocated = allocations;
+
+    for (int i = 0; i < 200000; i++)
+    {
+        img.phash = (uint64_t) std::rand() << 32 | std::rand();
+        records.add(img, {dirs[i % 100], names[i]});
+    }
+
+    allocated = allocations - allocated;
+
+    std::cout << "Adding 200000 images took " << allocated << " allocations\n";
+
+    if (allocated > 100 || records.size() != 200000 || records.path(12345) != dirs[45] || records.filename(12345) != names[12345])
+        failures++;
+
+    /* Several copies of the same contents, scattered about. */
+    ImageRecords small;
+    std::vector<int> contents;
+
+    for (int i = 0; i < 500; i++)
+    {
+        contents.push_back(std::rand() % 150);
+        small.add(image((uint64_t) std::rand() % 64, contents.back()), {"/pics", "img" + std::to_string(i)});
+    }
+
+    /* Groups in the order of their first image, each image in order. */
+    std::vector<std::vector<uint32_t>> expected;
+    std::map<int, size_t> group_of;
+
+    for (uint32_t id = 0; id < contents.size(); id++)
+    {
+        if (group_of.find(contents[id]) == group_of.end())
+        {
+            group_of[contents[id]] = expected.size();
+            expected.push_back({});
+        }
+
+        expected[group_of[contents[id]]].push_back(id);
+    }
+
+    SetList groups = small.group_by_sha256(small.all());
+    bool grouped = groups.size() == expected.size();
+
+    for (size_t i = 0; grouped && i < groups.size(); i++)
+        grouped = std::vector<uint32_t>(groups.begin(i), groups.end(i)) == expected[i];
+
+    std::cout << "Grouping by SHA256: " << (grouped ? "right" : "WRONG") << "\n";
+    failures += !grouped;
+
+    /* Every image and what comes after it within max_ham, leaving those that have nothing out. */
+    std::vector<uint32_t> every_other;
+
+    for (uint32_t id = 0; id < small.size(); id += 2)
+        every_other.push_back(id);
+
+    std::vector<std::vector<uint32_t>> close;
+
+    for (size_t i = 0; i < every_other.size(); i++)
+    {
+        std::vector<uint32_t> set = {every_other[i]};
+
+        for (size_t j = i + 1; j < every_other.size(); j++)
+            if (hamming_distance(small[every_other[i]].phash, small[every_other[j]].phash) <= 2)
+                set.push_back(every_other[j]);
+
+        if (set.size() > 1)
+            close.push_back(set);
+    }
+
+    int pairs = 0;
+    SetList similar = small.find_similar(every_other, 2, [&pairs](int count) -> void { pairs = count; });
+    bool compared = similar.size() == close.size();
+
+    for (size_t i = 0; compared && i < similar.size(); i++)
+        compared = std::vector<uint32_t>(similar.begin(i), similar.end(i)) == close[i];
+
+    compared = compared && (size_t) pairs == similar.members.size() - similar.size();
+
+    std::cout << "Finding similar images: " << (compared ? "right" : "WRONG") << "\n";
+    failures += !compared;
+
+    /* Copied into another request's records, with its strings. */
+    ImageRecords copied;
+    uint32_t copy = copied.add(small, 123);
+    bool same = copied.filename(copy) == "img123" && copied.path(copy) == "/pics" && copied.abspath(copy) == "/pics/img123" &&
+        !std::memcmp(copied[copy].sha256, small[123].sha256, SHA256_DIGEST_LENGTH) && copied[copy].phash == small[123].phash &&
+        copied.image(copy).filename == "img123" && copied.image(copy).width == 640;
+
+    std::cout << "Copying a record: " << (same ? "right" : "WRONG") << "\n";
+    failures += !same;
+
+    /* One cached image, found by several requests at once, each somewhere else: theirs are their own, and it stays as it was. */
+    const Image shared = image(0xF00D, 77);
+    std::vector<std::thread> threads;
+    std::vector<uint8_t> own(4, false);
+
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&shared, &own, t]() -> void {
+            ImageRecords request;
+            std::string dir = "/request/" + std::to_string(t);
+
+            for (int i = 0; i < 1000; i++)
+                request.add(shared, {dir, std::to_string(i) + ".png"});
+
+            bool right = request.size() == 1000;
+
+            for (uint32_t id = 0; right && id < request.size(); id++)
+                right = request.location(id).abspath() == dir + "/" + std::to_string(id) + ".png" && request[id].phash == 0xF00D;
+
+            own[t] = right;
+        });
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    bool shared_right = std::find(own.begin(), own.end(), false) == own.end() && shared.path.empty() && shared.filename.empty();
+
+    std::cout << "Sharing a cached image between requests: " << (shared_right ? "right" : "WRONG") << "\n";
+    failures += !shared_right;
+
+    return failures != 0;
+}
@@ -0,0 +1,126 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#include "../similarity.hpp"
+
+using namespace SimpicServerLib;
+
+/* Sets as comparable lists of filenames, regardless of the order they were found in. */
+static std::vector<std::vector<std::string>> names(std::vector<std::vector<Image*>*> sets)
+{
+    std::vector<std::vector<std::string>> result;
+
+    for (std::vector<Image*> *set : sets)
+    {
+        std::vector<std::string> set_names;
+
+        for (Image *img : *set)
+            set_names.push_back(img->filename);
+
+        result.push_back(set_names);
+        delete set;
+    }
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+/* The same, for sets of records. */
+static std::vector<std::vector<std::string>> names(const ImageRecords &records, const SetList &sets)
+{
+    std::vector<std::vector<std::string>> result;
+
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        std::vector<std::string> set_names;
+
+        for (const uint32_t *id = sets.begin(i); id != sets.end(i); id++)
+            set_names.push_back(std::string(records.filename(*id)));
+
+        result.push_back(set_names);
+    }
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+/* Scanning a growing (and shrinking) directory incrementally finds exactly what comparing everything finds. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(1234);
+
+    char location[] = "/tmp/simpic_test_similarity_XXXXXX";
+
+    if (mkdtemp(location) == nullptr)
+    {
+        std::cerr << "Failed to make a temporary directory.\n";
+        return 1;
+    }
+
+    SimilarityStore store(std::string(location) + "/");
+    std::vector<Image*> library;
+    int failures = 0;
+
+    auto add = [&library](int count) -> void {
+        for (int i = 0; i < count; i++)
+        {
+            Image *img = new Image();
+            img->filename = "img" + std::to_string(library.size());
+
+            /* Clustered hashes, so that there is something to find, and some exact duplicates (same SHA256) too. */
+            img->phash = (uint64_t)(std::rand() % 8) << 56 | (uint64_t)(std::rand() % 16);
+
+            std::memset(img->sha256, 0, SHA256_DIGEST_LENGTH);
+            std::snprintf(img->sha256, SHA256_DIGEST_LENGTH, "%lx-%d", img->phash, std::rand() % 3);
+
+            library.push_back(img);
+        }
+    };
+
+    for (int round = 0; round < 5; round++)
+    {
+        add(40);
+
+        /* Something got deleted. */
+        if (round == 3)
+            library.erase(library.begin() + 10, library.begin() + 20);
+
+        ImageRecords records;
+
+        for (Image *img : library)
+            records.add(*img, {"/pics", img->filename});
+
+        for (uint8_t max_ham : {0, 2, 4})
+        {
+            auto full = names(Image::find_similar_images(library, max_ham, [](int) -> void {}));
+            auto compact = names(records, records.find_similar(records.all(), max_ham, [](int) -> void {}));
+            auto incremental = names(records, store.find_similar_images("/pics", false, records, records.all(), max_ham,
+                                                                        [](int) -> void {}));
+
+            std::cout << "Round " << round << ", " << library.size() << " images, max_ham " << (int) max_ham << ": "
+                << full.size() << " sets";
+
+            if (full != compact)
+            {
+                std::cout << " (WRONG: " << compact.size() << " as records)";
+                failures++;
+            }
+
+            if (full != incremental)
+            {
+                std::cout << " (WRONG: " << incremental.size() << " incrementally)";
+                failures++;
+            }
+
+            std::cout << "\n";
+        }
+    }
+
+    std::system(((std::string) "rm -rf " + location).c_str());
+    return failures != 0;
+}
@@ -75,13 +75,18 @@ int main(int argc, char **argv, char **envp)
             cache.insert({cpp_dir, image_hash_ptr});
         }
 
-        if ((img = cache.get_image(image_hash_ptr->hash)) == nullptr || !use_cache)
+        const Image *cached = cache.get_image(image_hash_ptr->hash);
+
+        if (cached == nullptr || !use_cache)
         {
-            img = new Image(testing_directory, cpp_name, reading, image_hash_ptr->hash);
-            cache.insert(img);
-            img->get_info(reading);
+            Image *content = new Image(reading, image_hash_ptr->hash);
+            content->get_info(reading, testing_directory + "/" + cpp_name);
+            cache.insert(content);
+            cached = content;
         }
 
+        /* The cache's is shared, so the name goes on a copy. */
+        img = new Image(*cached);
         img->add_name(cpp_name);
 
         std::cout << cpp_name << "\n";
@@ -0,0 +1,260 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+
+#include "../texts.hpp"
+#include "../simpic_client.hpp"
+
+using namespace SimpicServerLib;
+
+static std::string word()
+{
+    std::string result;
+
+    for (int i = 2 + std::rand() % 8; i > 0; i--)
+        result += 'a' + std::rand() % 26;
+
+    return result;
+}
+
+static std::string document(int words)
+{
+    std::string result;
+
+    for (int i = 0; i < words; i++)
+        result += word() + (std::rand() % 12 == 0 ? ".\n" : " ");
+
+    return result;
+}
+
+/* The same words, reflowed and recapitalized, with a few sentences changed and some cut out. */
+static std::string edited(const std::string &text)
+{
+    std::string result;
+    size_t start = 0;
+
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        end = end == std::string::npos ? text.size() : end + 1;
+
+        std::string sentence = text.substr(start, end - start);
+        start = end;
+
+        int roll = std::rand() % 10;
+
+        if (roll == 0)
+            continue;
+
+        if (roll == 1)
+            sentence = document(8);
+
+        for (char &c : sentence)
+        {
+            if (c == ' ' && std::rand() % 5 == 0)
+                c = '\n';
+            else if (std::rand() % 7 == 0)
+                c = std::toupper(c);
+        }
+
+        result += sentence;
+    }
+
+    return result;
+}
+
+/* A document in /docs, with these hash points. */
+static Text *text_with(const std::string &filename, uint64_t from, uint64_t to, uint64_t more_from, uint64_t more_to)
+{
+    Text *txt = new Text();
+    txt->path = "/docs";
+    txt->filename = filename;
+    std::memset(txt->sha256, 0, SHA256_DIGEST_LENGTH);
+
+    for (uint64_t point = from; point < to; point++)
+        txt->points.push_back(point);
+
+    for (uint64_t point = more_from; point < more_to; point++)
+        txt->points.push_back(point);
+
+    return txt;
+}
+
+/* The sets of similar documents a scan of /docs sends, as filenames. */
+static std::vector<std::vector<std::string>> scanned_sets(std::vector<Text*> txts)
+{
+    std::shared_ptr<ScanFlight> flight = std::make_shared<ScanFlight>("/docs", false, (uint8_t) DataTypes::Text);
+    std::vector<Video*> vids;
+    std::vector<Audio*> auds;
+    flight->complete(0, vids, auds, txts);
+
+    int sockets[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+
+    /* The server's side of the connection, answered below like a client that wants no data and keeps everything. */
+    SimpicClient client(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "", nullptr, nullptr);
+    client.fd = sockets[0];
+
+    std::thread server([&client, &flight]() {
+        client.similar_texts(flight, "/docs", false);
+    });
+
+    struct MainHeader hdr;
+    recvall(sockets[1], &hdr, sizeof(hdr));
+
+    std::vector<std::vector<std::string>> sets;
+
+    for (int set = 0; hdr.code == (uint8_t) MainHeaderCodes::Success && set < hdr.set_no; set++)
+    {
+        struct SetHeader sethdr;
+        recvall(sockets[1], &sethdr, sizeof(sethdr));
+        sets.emplace_back();
+
+        for (int i = 0; i < sethdr.count; i++)
+        {
+            struct TextHeader txthdr;
+            recvall(sockets[1], &txthdr, sizeof(txthdr));
+
+            std::vector<char> filename(txthdr.filename_length), path(txthdr.path_length);
+            recvall(sockets[1], filename.data(), filename.size());
+            recvall(sockets[1], path.data(), path.size());
+
+            sets.back().push_back(filename.data());
+
+            struct ClientPlea plea = {true, false};
+            sendall(sockets[1], &plea, sizeof(plea));
+        }
+
+        struct ClientAction action = {(uint8_t) ClientActions::Keep, UINT8_MAX};
+        sendall(sockets[1], &action, sizeof(action));
+    }
+
+    server.join();
+    close(sockets[0]);
+    close(sockets[1]);
+    return sets;
+}
+
+/* Reflowing and recapitalizing doesn't matter, mapping a file is the same as hashing it in memory, copies are found through the index and boilerplate doesn't make documents similar. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2043);
+
+    int failures = 0;
+
+    std::string text = document(2000);
+    std::vector<uint64_t> points = Text::compute_perceptual_hash(text.data(), text.size());
+
+    std::string shouted = text;
+
+    for (char &c : shouted)
+        c = c == ' ' ? '\t' : std::toupper(c);
+
+    if (Text::compute_perceptual_hash(shouted.data(), shouted.size()) != points)
+    {
+        std::cout << "Changing spacing and case changed the hash points\n";
+        failures++;
+    }
+
+    char name[] = "/tmp/test_texts_XXXXXX";
+    int fd = mkstemp(name);
+
+    if (fd < 0 || write(fd, text.data(), text.size()) != (ssize_t) text.size() ||
+            Text::compute_perceptual_hash(fd) != points)
+    {
+        std::cout << "The mapped document doesn't have the same hash points\n";
+        failures++;
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+        unlink(name);
+    }
+
+    std::string copy = edited(text);
+    std::string other = document(2000);
+
+    double copy_similarity = Text::similarity(points, Text::compute_perceptual_hash(copy.data(), copy.size()));
+    double other_similarity = Text::similarity(points, Text::compute_perceptual_hash(other.data(), other.size()));
+
+    std::cout << points.size() << " hash points, similarity of a copy: " << copy_similarity <<
+        ", of another document: " << other_similarity << "\n";
+
+    if (copy_similarity < TEXT_MIN_SIMILARITY || other_similarity > 0.05)
+        failures++;
+
+    /* Every odd document is an edited copy of the one before it, every even one is unrelated to the rest. */
+    std::vector<Text*> texts;
+
+    for (int t = 0; t < 40; t++)
+    {
+        Text *txt = new Text();
+        text = t % 2 == 1 ? edited(text) : document(300 + std::rand() % 1000);
+        txt->points = Text::compute_perceptual_hash(text.data(), text.size());
+        texts.push_back(txt);
+    }
+
+    std::vector<std::vector<Text*>*> sets = Text::find_similar_texts(texts, TEXT_MIN_SIMILARITY);
+    int wrong = 0;
+
+    for (std::vector<Text*> *set : sets)
+    {
+        if (set->size() != 2 || (*set)[1] != texts[(std::find(texts.begin(), texts.end(), (*set)[0]) - texts.begin()) + 1])
+            wrong++;
+
+        delete set;
+    }
+
+    std::cout << sets.size() << " sets of similar documents (20 expected), " << wrong << " wrong\n";
+
+    if (sets.size() != 20 || wrong != 0)
+        failures++;
+
+    for (Text *txt : texts)
+        delete txt;
+
+    texts.clear();
+
+    /* Short, unrelated documents that all start with the same long license. */
+    std::string license = document(150);
+
+    for (int t = 0; t < TEXT_INDEX_MAX_BUCKET + 10; t++)
+    {
+        Text *txt = new Text();
+        text = license + document(150);
+        txt->points = Text::compute_perceptual_hash(text.data(), text.size());
+        texts.push_back(txt);
+    }
+
+    sets = Text::find_similar_texts(texts, TEXT_MIN_SIMILARITY);
+
+    std::cout << sets.size() << " sets of documents that only share a license (0 expected)\n";
+
+    if (!sets.empty())
+        failures++;
+
+    for (std::vector<Text*> *set : sets)
+        delete set;
+
+    for (Text *txt : texts)
+        delete txt;
+
+    /* A scan only reports documents that share at least TEXT_MIN_SIMILARITY of their hash points: 0.6 is, 0.42 isn't. */
+    std::vector<std::vector<std::string>> scanned = scanned_sets({text_with("alike.txt", 0, 100, 0, 0),
+                                                                  text_with("copy.txt", 0, 60, 1000, 1040),
+                                                                  text_with("loose.txt", 5000, 5100, 0, 0),
+                                                                  text_with("looser.txt", 5000, 5042, 6000, 6058)});
+
+    bool thresholded = scanned == std::vector<std::vector<std::string>>{{"alike.txt", "copy.txt"}};
+
+    std::cout << "Scanning for similar documents: " << (thresholded ? "right" : "WRONG") << "\n";
+    failures += !thresholded;
+
+    return failures != 0;
+}
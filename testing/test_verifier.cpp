@@ -0,0 +1,182 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#include "../verifier.hpp"
+
+using namespace SimpicServerLib;
+
+/* An image with these contents (by its SHA256, or a made-up one) and this DCT hash, at path/filename. */
+static uint32_t add(ImageRecords &records, const std::string &sha256, uint64_t phash, const std::string &path,
+                    const std::string &filename)
+{
+    Image img;
+    img.phash = phash;
+    img.length = 0;
+    img.width = 64;
+    img.height = 64;
+
+    std::memset(img.sha256, 0, SHA256_DIGEST_LENGTH);
+    std::memcpy(img.sha256, sha256.data(), std::min<size_t>(sha256.size(), SHA256_DIGEST_LENGTH));
+
+    return records.add(img, {path, filename});
+}
+
+/* Cache a Marr-Hildreth hash for the contents of an image: some other hash, with its first bits flipped. */
+static void cache_mh(SimpicCache &cache, const ImageRecords &records, uint32_t id, const MHHash &from, int flips)
+{
+    ImageMH *mh = new ImageMH();
+    std::memcpy(mh->sha256, records[id].sha256, SHA256_DIGEST_LENGTH);
+    mh->hash = from;
+
+    for (int bit = 0; bit < flips; bit++)
+        mh->hash.words[bit / 64] ^= (uint64_t) 1 << (bit % 64);
+
+    cache.insert(mh);
+}
+
+/* The SHA256 of a file, as the 32 bytes it is. */
+static std::string sha256_of(const std::string &path)
+{
+    sha256_t hash[SHA256_DIGEST_LENGTH];
+    std::FILE *fp = std::fopen(path.c_str(), "rb");
+
+    calculate_sha256(fp, hash);
+    std::fclose(fp);
+
+    return std::string(hash, SHA256_DIGEST_LENGTH);
+}
+
+/* The sets as lists of filenames, in order. */
+static std::vector<std::vector<std::string>> names(const ImageRecords &records, const SetList &sets)
+{
+    std::vector<std::vector<std::string>> result;
+
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        std::vector<std::string> set_names;
+
+        for (const uint32_t *id = sets.begin(i); id != sets.end(i); id++)
+            set_names.push_back(std::string(records.filename(*id)));
+
+        result.push_back(set_names);
+    }
+
+    return result;
+}
+
+static int expect(const std::string &what, const std::vector<std::vector<std::string>> &got,
+                  const std::vector<std::vector<std::string>> &wanted)
+{
+    std::cout << what << ": " << (got == wanted ? "right" : "WRONG") << "\n";
+    return got != wanted;
+}
+
+/* Matches within MH_VERIFY_ABOVE_HAM DCT bits are taken as they are; the others are kept if their Marr-Hildreth hashes (cached, or computed from files that still have their contents and then cached) are within MH_VERIFY_MAX_HAM bits, or if either can't be had. */
+int main(int argc, char **argv, char **envp)
+{
+    char location[] = "/tmp/simpic_test_verifier_XXXXXX";
+
+    if (mkdtemp(location) == nullptr)
+    {
+        std::cerr << "Failed to make a temporary directory.\n";
+        return 1;
+    }
+
+    std::string dir = location;
+
+    /* A grey gradient, as a binary PGM, which every decoder CImg has reads, and the same with a comment (so other contents). */
+    for (const std::string &name : {"gradient.pgm", "commented.pgm"})
+    {
+        std::ofstream pgm(dir + "/" + name, std::ios::binary);
+        pgm << (name == "gradient.pgm" ? "P5\n64 64\n255\n" : "P5\n# A copy\n64 64\n255\n");
+
+        for (int y = 0; y < 64; y++)
+            for (int x = 0; x < 64; x++)
+                pgm.put((char) (x * 2 + y * 2));
+    }
+
+    SimpicCache cache(dir + "/cache.simpic_cache");
+    HashingPool pool(2);
+    Verifier verifier(&cache, &pool);
+    int failures = 0;
+
+    /* The two gradients, a file that isn't there and one that doesn't have the contents it had anymore. */
+    uint64_t far = 0xFFULL;
+    ImageRecords records;
+    uint32_t first = add(records, sha256_of(dir + "/gradient.pgm"), 0, dir, "gradient.pgm");
+    add(records, sha256_of(dir + "/commented.pgm"), far, dir, "commented.pgm");
+    add(records, "missing", far, dir, "missing.pgm");
+    uint32_t replaced = add(records, "replaced", far, dir, "gradient.pgm");
+
+    SetList sets;
+
+    for (uint32_t id = 0; id < 4; id++)
+        sets.push(id);
+
+    sets.end_set();
+
+    failures += expect("Computing what isn't cached", names(records, verifier.verify(records, sets, false)),
+                       {{"gradient.pgm", "commented.pgm", "missing.pgm", "gradient.pgm"}});
+
+    ImageMH *computed = cache.get_mh((sha256ptr_t) records[first].sha256);
+    bool cached = computed != nullptr && cache.get_mh((sha256ptr_t) records[1].sha256) != nullptr;
+
+    std::cout << "Caching what was computed: " << (cached ? "right" : "WRONG") << "\n";
+    failures += !cached;
+
+    /* Whatever is at its path now isn't what it had. */
+    bool untouched = cache.get_mh((sha256ptr_t) records[replaced].sha256) == nullptr;
+
+    std::cout << "Not caching a file that changed: " << (untouched ? "right" : "WRONG") << "\n";
+    failures += !untouched;
+
+    if (computed == nullptr)
+    {
+        std::system(("rm -rf " + dir).c_str());
+        return 1;
+    }
+
+    /* From now on, the cache has the word: none of these files are there to be decoded. */
+    ImageRecords cached_records;
+    first = add(cached_records, sha256_of(dir + "/gradient.pgm"), 0, dir, "gone.pgm");
+
+    uint32_t close_dct = add(cached_records, "close_dct", (1ULL << MH_VERIFY_ABOVE_HAM) - 1, dir, "close_dct");
+    uint32_t at_max = add(cached_records, "at_max", far, dir, "at_max");
+    uint32_t past_max = add(cached_records, "past_max", far, dir, "past_max");
+    uint32_t past_close = add(cached_records, "past_close", (1ULL << (MH_VERIFY_ABOVE_HAM + 1)) - 1, dir, "past_close");
+
+    cache_mh(cache, cached_records, close_dct, computed->hash, MH_VERIFY_MAX_HAM + 1);
+    cache_mh(cache, cached_records, at_max, computed->hash, MH_VERIFY_MAX_HAM);
+    cache_mh(cache, cached_records, past_max, computed->hash, MH_VERIFY_MAX_HAM + 1);
+    cache_mh(cache, cached_records, past_close, computed->hash, MH_VERIFY_MAX_HAM + 1);
+
+    SetList thresholds;
+
+    for (uint32_t id : {first, close_dct, at_max, past_max, past_close})
+        thresholds.push(id);
+
+    thresholds.end_set();
+
+    /* Only MH_VERIFY_ABOVE_HAM DCT bits away isn't checked at all; MH_VERIFY_MAX_HAM bits of the slow hash are still alike. */
+    failures += expect("Thresholds", names(cached_records, verifier.verify(cached_records, thresholds, false)),
+                       {{"gone.pgm", "close_dct", "at_max"}});
+
+    /* A set that nothing is left in but its first image. */
+    SetList alone;
+    alone.push(first);
+    alone.push(past_max);
+    alone.end_set();
+
+    failures += expect("Dropping what is left alone", names(cached_records, verifier.verify(cached_records, alone, false)), {});
+    failures += expect("Keeping what is left alone", names(cached_records, verifier.verify(cached_records, alone, true)),
+                       {{"gone.pgm"}});
+
+    std::system(("rm -rf " + dir).c_str());
+    return failures != 0;
+}
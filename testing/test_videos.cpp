@@ -0,0 +1,120 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include "../videos.hpp"
+
+using namespace SimpicServerLib;
+
+/* pHash's ph_dct_videohash_dist(), with the whole table. */
+static double reference(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b, int threshold)
+{
+    std::vector<std::vector<int>> table(a.size() + 1, std::vector<int>(b.size() + 1, 0));
+
+    for (size_t i = 1; i <= a.size(); i++)
+    {
+        for (size_t j = 1; j <= b.size(); j++)
+        {
+            if (hamming_distance(a[i - 1], b[j - 1]) <= threshold)
+                table[i][j] = table[i - 1][j - 1] + 1;
+            else
+                table[i][j] = std::max(table[i - 1][j], table[i][j - 1]);
+        }
+    }
+
+    return (double) table[a.size()][b.size()] / std::min(a.size(), b.size());
+}
+
+static uint64_t random_hash()
+{
+    return ((uint64_t) std::rand() << 32) | (uint64_t) std::rand();
+}
+
+/* A copy of the keyframes, re-encoded (a few bits off each) and with shots cut out or added. */
+static std::vector<uint64_t> edited(const std::vector<uint64_t> &frames)
+{
+    std::vector<uint64_t> result;
+
+    for (uint64_t frame : frames)
+    {
+        if (std::rand() % 5 == 0)
+            continue;
+
+        for (int flips = std::rand() % 6; flips > 0; flips--)
+            frame ^= (uint64_t) 1 << (std::rand() % 64);
+
+        result.push_back(frame);
+
+        if (std::rand() % 7 == 0)
+            result.push_back(random_hash());
+    }
+
+    return result;
+}
+
+/* The two-row similarity is exactly pHash's, and copies of a video are found among unrelated ones. */
+int main(int argc, char **argv, char **envp)
+{
+    std::srand(2024);
+
+    int failures = 0;
+    int mismatches = 0;
+
+    for (int trial = 0; trial < 300; trial++)
+    {
+        std::vector<uint64_t> a;
+
+        for (int i = 1 + std::rand() % 40; i > 0; i--)
+            a.push_back(random_hash());
+
+        std::vector<uint64_t> b = trial % 2 ? edited(a) : std::vector<uint64_t>{random_hash(), random_hash()};
+
+        if (b.empty())
+            continue;
+
+        if (Video::similarity(a, b) != reference(a, b, VIDEO_FRAME_MAX_HAM))
+            mismatches++;
+    }
+
+    std::cout << mismatches << " similarities differ from pHash's\n";
+
+    if (mismatches != 0)
+        failures++;
+
+    /* Every even video is an edited copy of the one before it, every odd one is unrelated to the rest. */
+    std::vector<Video*> videos;
+
+    for (int v = 0; v < 40; v++)
+    {
+        Video *vid = new Video();
+
+        if (v % 2 == 1)
+            vid->frames = edited(videos.back()->frames);
+        else
+            for (int i = 20 + std::rand() % 20; i > 0; i--)
+                vid->frames.push_back(random_hash());
+
+        videos.push_back(vid);
+    }
+
+    std::vector<std::vector<Video*>*> sets = Video::find_similar_videos(videos, VIDEO_MIN_SIMILARITY);
+    int wrong = 0;
+
+    for (std::vector<Video*> *set : sets)
+    {
+        if (set->size() != 2 || (*set)[1] != videos[(std::find(videos.begin(), videos.end(), (*set)[0]) - videos.begin()) + 1])
+            wrong++;
+
+        delete set;
+    }
+
+    std::cout << sets.size() << " sets of similar videos (20 expected), " << wrong << " wrong\n";
+
+    if (sets.size() != 20 || wrong != 0)
+        failures++;
+
+    for (Video *vid : videos)
+        delete vid;
+
+    return failures != 0;
+}
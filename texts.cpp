@@ -2,13 +2,240 @@
 
 namespace SimpicServerLib
 {
-    void Texts::compute_perceptual_hash(std::string &text)
+    /* A random 64-bit key for every byte, for the rolling hash: always the same ones, so that hash points stay comparable with the cached ones. */
+    static const uint64_t *text_keys()
     {
-        
+        static const std::vector<uint64_t> keys = []() -> std::vector<uint64_t> {
+            std::vector<uint64_t> result;
+            uint64_t state = 0x5EED5EED5EED5EEDULL;
+
+            /* splitmix64 */
+            for (int i = 0; i < 256; i++)
+            {
+                uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                result.push_back(z ^ (z >> 31));
+            }
+
+            return result;
+        }();
+
+        return keys.data();
+    }
+
+    Text::Text()
+    {
+        length = 0;
+    }
+
+    TextTypes Text::type_from_extension(const std::string &extension)
+    {
+        if (extension == "txt" || extension == "text")
+            return TextTypes::TXT;
+
+        if (extension == "md" || extension == "markdown")
+            return TextTypes::Markdown;
+
+        if (extension == "csv" || extension == "tsv")
+            return TextTypes::CSV;
+
+        if (extension == "tex")
+            return TextTypes::TeX;
+
+        if (extension == "rst")
+            return TextTypes::RST;
+
+        return TextTypes::Undefined;
+    }
+
+    std::vector<uint64_t> Text::compute_perceptual_hash(const char *text, size_t length)
+    {
+        const uint64_t *keys = text_keys();
+
+        /* The last TEXT_KGRAM_LENGTH bytes that were hashed, to take them back out of the hash. */
+        uint8_t kgram[TEXT_KGRAM_LENGTH];
+        size_t filled = 0;
+        size_t oldest = 0;
+        uint64_t hash = 0;
+
+        /* The k-gram hashes of the current window that could still be its smallest, smallest first. */
+        std::deque<std::pair<uint64_t, uint64_t>> window;
+        uint64_t kgrams = 0;
+        uint64_t recorded = UINT64_MAX;
+
+        std::vector<uint64_t> points;
+
+        for (size_t i = 0; i < length; i++)
+        {
+            uint8_t c = text[i];
+
+            /* Only letters and digits, whatever the case, count: spacing, punctuation and line endings don't make a copy any different. */
+            if (c < 0x80)
+            {
+                if (!std::isalnum(c))
+                    continue;
+
+                c = std::tolower(c);
+            }
+
+            hash = std::rotl(hash, 1) ^ keys[c];
+
+            if (filled == TEXT_KGRAM_LENGTH)
+                hash ^= std::rotl(keys[kgram[oldest]], TEXT_KGRAM_LENGTH % 64);
+            else
+                filled++;
+
+            kgram[oldest] = c;
+            oldest = (oldest + 1) % TEXT_KGRAM_LENGTH;
+
+            if (filled < TEXT_KGRAM_LENGTH)
+                continue;
+
+            /* The rightmost of equal ones is kept, like in the winnowing paper. */
+            while (!window.empty() && window.back().first >= hash)
+                window.pop_back();
+
+            window.push_back({hash, kgrams});
+
+            if (window.front().second + TEXT_WINDOW_LENGTH <= kgrams)
+                window.pop_front();
+
+            kgrams++;
+
+            if (kgrams >= TEXT_WINDOW_LENGTH && window.front().second != recorded)
+            {
+                points.push_back(window.front().first);
+                recorded = window.front().second;
+            }
+        }
+
+        /* Not even one whole window: its smallest k-gram stands for it. */
+        if (kgrams != 0 && kgrams < TEXT_WINDOW_LENGTH)
+            points.push_back(window.front().first);
+
+        std::sort(points.begin(), points.end());
+        points.erase(std::unique(points.begin(), points.end()), points.end());
+
+        return points;
     }
 
-    void Texts::compute_perceptual_hash(const char *text)
+    std::optional<std::vector<uint64_t>> Text::compute_perceptual_hash(int fd)
     {
+        struct stat info;
+
+        if (fstat(fd, &info) < 0 || info.st_size == 0)
+            return std::nullopt;
+
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapped == MAP_FAILED)
+        {
+            std::cerr << "Failed to map a document: " << std::strerror(errno) << "\n";
+            return std::nullopt;
+        }
+
+        /* It's read once, front to back. */
+        madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+
+        std::vector<uint64_t> points = compute_perceptual_hash((const char*) mapped, info.st_size);
+        munmap(mapped, info.st_size);
+
+        if (points.empty())
+            return std::nullopt;
+
+        return points;
+    }
+
+    double Text::similarity(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b)
+    {
+        if (a.empty() || b.empty())
+            return 0;
+
+        size_t shared = 0;
+
+        for (size_t i = 0, j = 0; i < a.size() && j < b.size(); )
+        {
+            if (a[i] < b[j])
+                i++;
+            else if (b[j] < a[i])
+                j++;
+            else
+            {
+                shared++;
+                i++;
+                j++;
+            }
+        }
+
+        return (double) shared / std::min(a.size(), b.size());
+    }
+
+    std::vector<std::vector<Text*>*> Text::find_similar_texts(std::vector<Text*> &texts, double min_similarity)
+    {
+        TextIndex index(texts);
+        std::vector<std::vector<Text*>*> results;
+
+        for (uint32_t t = 0; t < texts.size(); t++)
+        {
+            /* How many hash points each later document shares with this one. */
+            std::unordered_map<uint32_t, uint32_t> shared;
+
+            for (uint64_t point : texts[t]->points)
+                for (const TextIndex::Posting &posting : index.lookup(point))
+                    if (posting.text > t)
+                        shared[posting.text]++;
+
+            std::map<uint32_t, uint32_t> sorted(shared.begin(), shared.end());
+            std::vector<Text*> *set = new std::vector<Text*>({texts[t]});
+
+            for (auto &[other, count] : sorted)
+            {
+                size_t fewer = std::min(texts[t]->points.size(), texts[other]->points.size());
+
+                if ((double) count / fewer >= min_similarity)
+                    set->push_back(texts[other]);
+            }
+
+            if (set->size() < 2)
+            {
+                delete set;
+                continue;
+            }
+
+            results.push_back(set);
+        }
+
+        return results;
+    }
+
+    std::string Text::abspath()
+    {
+        return concatenate_folder(path, filename);
+    }
+
+    TextIndex::TextIndex(const std::vector<Text*> &texts)
+    {
+        for (uint32_t t = 0; t < texts.size(); t++)
+            for (uint64_t point : texts[t]->points)
+                postings.push_back({point, t});
+
+        std::sort(postings.begin(), postings.end(), [](const Posting &x, const Posting &y) -> bool {
+            return x.point != y.point ? x.point < y.point : x.text < y.text;
+        });
+    }
+
+    std::span<const TextIndex::Posting> TextIndex::lookup(uint64_t point) const
+    {
+        std::vector<Posting>::const_iterator first = std::lower_bound(postings.begin(), postings.end(), point,
+            [](const Posting &posting, uint64_t p) -> bool { return posting.point < p; });
+
+        std::vector<Posting>::const_iterator last = std::upper_bound(first, postings.end(), point,
+            [](uint64_t p, const Posting &posting) -> bool { return p < posting.point; });
+
+        if (last - first > TEXT_INDEX_MAX_BUCKET)
+            return {};
 
+        return std::span<const Posting>(first, last);
     }
-}
\ No newline at end of file
+}
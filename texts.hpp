@@ -2,17 +2,88 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <span>
+#include <optional>
+#include <algorithm>
+#include <unordered_map>
 
-#include "phash/pHash.h"
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sha256.hpp"
+#include "utils.hpp"
+
+#include "config.hpp"
 
 namespace SimpicServerLib
 {
-    class Texts
+    enum class TextTypes
+    {
+        TXT,
+        Markdown,
+        CSV,
+        TeX,
+        RST,
+        Undefined // <~~ The file isn't a supported file type.
+    };
+
+    class Text
+    {
+    public:
+        uint64_t length;
+
+        /* The document's hash points (see compute_perceptual_hash()), sorted and without repeats: where they were in the document doesn't matter to how alike two documents are. */
+        std::vector<uint64_t> points;
+
+        std::string filename;
+        std::string path;
+
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+
+        /* Given an extension (without the .), return the text type. */
+        static TextTypes type_from_extension(const std::string &extension);
+
+        /* pHash's ph_texthash(), without copying the document: a rolling hash of every TEXT_KGRAM_LENGTH letters and digits (lowercase, skipping everything else but UTF-8), of which the smallest of every TEXT_WINDOW_LENGTH in a row is a hash point (winnowing). Returns them sorted, without repeats. */
+        static std::vector<uint64_t> compute_perceptual_hash(const char *text, size_t length);
+
+        /* The same, for the document already opened as fd, which is mapped into memory rather than read. Returns nothing if it can't be mapped or has no hash points at all (it's shorter than a k-gram). */
+        static std::optional<std::vector<uint64_t>> compute_perceptual_hash(int fd);
+
+        /* How many hash points two documents share, over how many the one with fewer of them has: 1 if one is entirely within the other. */
+        static double similarity(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b);
+
+        /* Group similar documents together, the first of each group being what the others are similar to, like Video::find_similar_videos(). Instead of comparing every pair (ph_compare_text_hashes() over all of them), the hash points go into a TextIndex, and a document is only compared to those it shares a hash point with, which it gets the count of from the index on the way. */
+        static std::vector<std::vector<Text*>*> find_similar_texts(std::vector<Text*> &texts, double min_similarity);
+
+        Text();
+
+        std::string abspath();
+    };
+
+    /* Every hash point of some documents, sorted by value, each with the document it's from, so that the documents with a hash point are a binary search away. */
+    class TextIndex
     {
-    private:
     public:
-        static void compute_perceptual_hash(std::string &text);
-        static void compute_perceptual_hash(const char *text);
-        
+        struct Posting
+        {
+            uint64_t point;
+            uint32_t text; // its index in the vector the TextIndex was made from.
+        };
+
+        TextIndex(const std::vector<Text*> &texts);
+
+        /* Every document with this hash point. Nothing, if more than TEXT_INDEX_MAX_BUCKET have it: what that many documents share is boilerplate (a license, a letterhead), not a sign that they're copies. */
+        std::span<const Posting> lookup(uint64_t point) const;
+
+    private:
+        std::vector<Posting> postings;
     };
-}
\ No newline at end of file
+}
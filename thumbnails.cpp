@@ -0,0 +1,202 @@
+#include "thumbnails.hpp"
+
+namespace SimpicServerLib
+{
+    ThumbnailSampler::ThumbnailSampler(uint16_t _max_edge)
+    {
+        max_edge = _max_edge;
+        width = 0;
+        height = 0;
+        next = -1;
+        current = 0;
+    }
+
+    void ThumbnailSampler::start(int _width, int _height)
+    {
+        width = _width;
+        height = _height;
+        next = 0;
+        current = 0;
+
+        int longest = std::max(width, height);
+        int thumb_width = width;
+        int thumb_height = height;
+
+        /* Never upscale, only shrink. */
+        if (longest > max_edge)
+        {
+            thumb_width = std::max(1, (int)((uint64_t) width * max_edge / longest));
+            thumb_height = std::max(1, (int)((uint64_t) height * max_edge / longest));
+        }
+
+        thumb = CImg<uint8_t>(thumb_width, thumb_height, 1, 3);
+
+        column_of.resize(width);
+
+        for (int x = 0; x < width; x++)
+            column_of[x] = (int)((uint64_t) x * thumb_width / width);
+
+        sums.assign((size_t) thumb_width * 3, 0);
+        counts.assign(thumb_width, 0);
+    }
+
+    void ThumbnailSampler::add_row(int y, const uint8_t *row, int channels)
+    {
+        if (next < 0 || y != next)
+        {
+            next = -1;
+            return;
+        }
+
+        int thumb_y = (int)((uint64_t) y * thumb.height() / height);
+
+        if (thumb_y != current)
+        {
+            flush();
+            current = thumb_y;
+        }
+
+        for (int x = 0; x < width; x++)
+        {
+            const uint8_t *pixel = row + (size_t) x * channels;
+            uint32_t *sum = &sums[(size_t) column_of[x] * 3];
+
+            for (int c = 0; c < 3; c++)
+                sum[c] += pixel[channels >= 3 ? c : 0];
+
+            counts[column_of[x]]++;
+        }
+
+        if (++next == height)
+            flush();
+    }
+
+    void ThumbnailSampler::flush()
+    {
+        for (int x = 0; x < thumb.width(); x++)
+        {
+            uint32_t count = std::max(counts[x], (uint32_t) 1);
+
+            for (int c = 0; c < 3; c++)
+                thumb(x, current, 0, c) = (sums[(size_t) x * 3 + c] + count / 2) / count;
+        }
+
+        std::fill(sums.begin(), sums.end(), 0);
+        std::fill(counts.begin(), counts.end(), 0);
+    }
+
+    bool ThumbnailSampler::complete() const
+    {
+        return height > 0 && next == height;
+    }
+
+    const CImg<uint8_t> &ThumbnailSampler::image() const
+    {
+        return thumb;
+    }
+
+    ThumbnailCache::ThumbnailCache(const std::string &_location)
+    {
+        location = _location;
+    }
+
+    std::string ThumbnailCache::path_for(const sha256_t *hash, uint16_t max_edge)
+    {
+        return location + sha256_hex(hash) + "_" + std::to_string(max_edge) + ".jpg";
+    }
+
+    uint16_t ThumbnailCache::clamp_edge(uint16_t max_edge)
+    {
+        if (max_edge < THUMBNAIL_MIN_EDGE)
+            return THUMBNAIL_MIN_EDGE;
+
+        if (max_edge > THUMBNAIL_MAX_EDGE)
+            return THUMBNAIL_MAX_EDGE;
+
+        return max_edge;
+    }
+
+    bool ThumbnailCache::save(const CImg<uint8_t> &decoded, const std::string &destination, uint16_t max_edge)
+    {
+        if (decoded.is_empty())
+            return false;
+
+        CImg<uint8_t> thumb = decoded;
+
+        /* JPEG has no alpha channel: grayscale + alpha and RGBA lose their last channel. */
+        if (thumb.spectrum() == 2)
+            thumb.channel(0);
+        else if (thumb.spectrum() > 3)
+            thumb.channels(0, 2);
+
+        int longest = std::max(thumb.width(), thumb.height());
+
+        /* Never upscale, only shrink. Interpolation type 2 is a moving average, which is the */
+        /* appropriate thing for large reductions in size. */
+        if (longest > max_edge)
+        {
+            int new_width = std::max(1, (int)((uint64_t) thumb.width() * max_edge / longest));
+            int new_height = std::max(1, (int)((uint64_t) thumb.height() * max_edge / longest));
+            thumb.resize(new_width, new_height, -100, -100, 2);
+        }
+
+        /* Write to a temporary name first and then rename(), so that a concurrent reader */
+        /* never sees a half-written thumbnail. */
+        std::string tmp = destination + "." + random_chars(RANDOM_CHARS_LENGTH) + ".tmp";
+
+        try
+        {
+            thumb.save_jpeg(tmp.c_str(), THUMBNAIL_QUALITY);
+        }
+        catch (CImgException &ex)
+        {
+            std::cerr << "Failed to write thumbnail '" << tmp << "': " << ex.what() << "\n";
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        if (rename(tmp.c_str(), destination.c_str()) < 0)
+        {
+            std::cerr << "Failed to move thumbnail into place: " << std::strerror(errno) << "\n";
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ThumbnailCache::generate(const CImg<uint8_t> &decoded, const sha256_t *hash, uint16_t max_edge)
+    {
+        return save(decoded, path_for(hash, max_edge), max_edge);
+    }
+
+    std::optional<std::string> ThumbnailCache::get(const sha256_t *hash, const std::string &source, uint16_t max_edge)
+    {
+        std::string destination = path_for(hash, max_edge);
+
+        /* Already generated by an earlier request. */
+        if (access(destination.c_str(), R_OK) == 0)
+            return destination;
+
+        /* The one made while it was hashed is a lot less to decode than the original, if it is big enough. */
+        std::string hashed = path_for(hash, THUMBNAIL_HASHING_EDGE);
+        bool from_hashed = max_edge <= THUMBNAIL_HASHING_EDGE && access(hashed.c_str(), R_OK) == 0;
+
+        CImg<uint8_t> decoded;
+
+        try
+        {
+            decoded.load(from_hashed ? hashed.c_str() : source.c_str());
+        }
+        catch (CImgException &ex)
+        {
+            std::cerr << "Failed to decode '" << (from_hashed ? hashed : source) << "' for a thumbnail: " << ex.what() << "\n";
+            return std::nullopt;
+        }
+
+        if (!generate(decoded, hash, max_edge))
+            return std::nullopt;
+
+        return destination;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <optional>
+#include <vector>
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sha256.hpp"
+#include "phash/pHash.h"
+#include "utils.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* A thumbnail made while an image is decoded for hashing, a row at a time, so that it doesn't have to be decoded again for one: each of its pixels is the average of the box of the original's that it covers. */
+    class ThumbnailSampler
+    {
+    public:
+        ThumbnailSampler(uint16_t _max_edge);
+
+        /* Start over, on an image of this size. */
+        void start(int _width, int _height);
+
+        /* Add row y of the original, in grey (1 channel) or colour (at least 3, of which any past the third are ignored). Every row has to come, top to bottom. */
+        void add_row(int y, const uint8_t *row, int channels);
+
+        /* Whether every row came. */
+        bool complete() const;
+
+        /* The thumbnail, once it is complete. */
+        const CImg<uint8_t> &image() const;
+
+    private:
+        uint16_t max_edge;
+        int width;
+        int height;
+        int next; // the row expected next, or -1 if one didn't come.
+
+        CImg<uint8_t> thumb;
+
+        /* The thumbnail's column of each of the original's, and the sums of the row of the thumbnail being made (by column, then channel). */
+        std::vector<int> column_of;
+        std::vector<uint32_t> sums;
+        std::vector<uint32_t> counts;
+        int current;
+
+        void flush();
+    };
+
+    /* Server-generated thumbnails, stored on disk (by default in ~/.simpic/thumbnails/) and keyed by the SHA256 hash of the original and the requested maximum edge. Since the key is the content and not the path, a thumbnail survives the original being moved or renamed. */
+    class ThumbnailCache
+    {
+    private:
+        std::string location;
+
+    public:
+        ThumbnailCache(const std::string &_location);
+
+        /* Where the thumbnail for this hash and size lives (or would live) on disk. */
+        std::string path_for(const sha256_t *hash, uint16_t max_edge);
+
+        /* Clamp a maximum edge requested by a client to something we're willing to generate. */
+        static uint16_t clamp_edge(uint16_t max_edge);
+
+        /* Write a thumbnail, no bigger than max_edge, of an image that has already been decoded, to destination. Returns whether it succeeded. */
+        static bool save(const CImg<uint8_t> &decoded, const std::string &destination, uint16_t max_edge);
+
+        /* Write a thumbnail from an image that has already been decoded, e.g., for hashing. Returns whether it succeeded. */
+        bool generate(const CImg<uint8_t> &decoded, const sha256_t *hash, uint16_t max_edge);
+
+        /* Returns the path to the thumbnail of the file at 'source', generating it if it is not on disk already: from the one made while the image was hashed (of THUMBNAIL_HASHING_EDGE) if it is big enough, otherwise by decoding the file. If the image cannot be decoded, nothing is returned. */
+        std::optional<std::string> get(const sha256_t *hash, const std::string &source, uint16_t max_edge);
+    };
+}
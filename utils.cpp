@@ -1,5 +1,7 @@
 #include "utils.hpp"
 
+extern char **environ;
+
 namespace SimpicServerLib
 {
     Logger::Logger()
@@ -77,6 +79,33 @@ namespace SimpicServerLib
         return true;
     }
 
+    bool path_is_within(const std::string &parent, const std::string &child)
+    {
+        if (child.size() < parent.size() || child.compare(0, parent.size(), parent) != 0)
+            return false;
+
+        /* /a/bc is not within /a/b. */
+        return child.size() == parent.size() || parent == "/" || child[parent.size()] == '/';
+    }
+
+    std::string normalize_path(const std::string &path)
+    {
+        std::string result;
+
+        for (char c : path)
+        {
+            if (c == '/' && !result.empty() && result.back() == '/')
+                continue;
+
+            result += c;
+        }
+
+        if (result.size() > 1 && result.back() == '/')
+            result.pop_back();
+
+        return result;
+    }
+
     std::vector<std::string> split_string(const std::string &str, const std::string &delimiter)
     {
         std::vector<std::string> result;
@@ -193,4 +222,83 @@ namespace SimpicServerLib
             token = tmp;
         }
     }
-}
\ No newline at end of file
+
+    int spawn_decoder(const std::vector<std::string> &argv, int fd, pid_t &pid)
+    {
+        int out[2];
+
+        if (pipe2(out, O_CLOEXEC) < 0)
+            return -1;
+
+        /* Moved out of the way first, so that putting it at 3 clears its FD_CLOEXEC even if it already was 3. */
+        int source = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+
+        if (source < 0)
+        {
+            close(out[0]);
+            close(out[1]);
+            return -1;
+        }
+
+        std::vector<char*> args;
+
+        for (const std::string &arg : argv)
+            args.push_back((char*) arg.c_str());
+
+        args.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+        posix_spawn_file_actions_adddup2(&actions, source, 3);
+
+        int error = posix_spawnp(&pid, args[0], &actions, nullptr, args.data(), environ);
+
+        posix_spawn_file_actions_destroy(&actions);
+        close(out[1]);
+        close(source);
+
+        if (error != 0)
+        {
+            std::cerr << "Failed to start '" << argv[0] << "': " << std::strerror(error) << "\n";
+            close(out[0]);
+            return -1;
+        }
+
+        return out[0];
+    }
+
+    size_t read_fully(int fd, void *buffer, size_t length)
+    {
+        size_t got = 0;
+
+        while (got < length)
+        {
+            ssize_t amnt = read(fd, (char*) buffer + got, length - got);
+
+            if (amnt < 0 && errno == EINTR)
+                continue;
+
+            if (amnt <= 0)
+                break;
+
+            got += amnt;
+        }
+
+        return got;
+    }
+
+    bool finish_decoder(int out, pid_t pid)
+    {
+        close(out);
+
+        int status = 0;
+
+        while (waitpid(pid, &status, 0) < 0)
+            if (errno != EINTR)
+                return false;
+
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+}
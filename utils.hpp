@@ -12,7 +12,10 @@
 #include <cstring>
 #include <cstdlib>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <ctime>
+#include <fcntl.h>
+#include <spawn.h>
 
 namespace SimpicServerLib
 {
@@ -35,6 +38,12 @@ namespace SimpicServerLib
     /* where dir1 is assumed parent and dir2 is assumed child, check if dir2 is actually a child. */
     bool dir_is_child(const std::string &dir1, const std::string &dir2);
 
+    /* Whether 'child' is 'parent' itself or somewhere below it, by comparing strings on path component boundaries. Both should be normalized. */
+    bool path_is_within(const std::string &parent, const std::string &child);
+
+    /* Remove repeated and trailing slashes, so that the same directory is always spelled the same way. */
+    std::string normalize_path(const std::string &path);
+
     /* Split an std::string by a delimiter--uses std::strtok. */
     std::vector<std::string> split_string(const std::string &str, const std::string &delimiter);
 
@@ -49,4 +58,13 @@ namespace SimpicServerLib
 
     std::string get_extension(std::string filename);
     std::string random_chars(uint8_t amount);
+
+    /* Start an external decoder (argv[0], looked up in the PATH) that reads the file already opened as fd as its own fd 3 (so argv should name /dev/fd/3 as its input) and writes what it decoded to a pipe. Returns the reading end of the pipe and sets pid, or returns -1 if it couldn't be started. */
+    int spawn_decoder(const std::vector<std::string> &argv, int fd, pid_t &pid);
+
+    /* Read until length bytes are read, or the end of the file (or an error). Returns how many were read. */
+    size_t read_fully(int fd, void *buffer, size_t length);
+
+    /* Close the pipe of a decoder started by spawn_decoder() and reap it. Returns whether it exited with 0 (it may have been cut short by the pipe closing, if not everything was read). */
+    bool finish_decoder(int out, pid_t pid);
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "verifier.hpp"
+
+namespace SimpicServerLib
+{
+    Verifier::Verifier(SimpicCache *_cache, HashingPool *_pool)
+    {
+        cache = _cache;
+        pool = _pool;
+    }
+
+    ImageMH *Verifier::compute(const sha256_t *sha256, const std::string &path)
+    {
+        std::FILE *fp = std::fopen(path.c_str(), "rb");
+
+        if (fp == nullptr)
+            return nullptr;
+
+        /* It is cached by these contents, so the file has to still have them: it is decoded from what was checked, */
+        /* through /proc/self/fd/, rather than whatever is at path by then. */
+        sha256_t current[SHA256_DIGEST_LENGTH];
+        calculate_sha256(fp, current);
+
+        if (std::memcmp(current, sha256, SHA256_DIGEST_LENGTH) != 0)
+        {
+            std::fclose(fp);
+            return nullptr;
+        }
+
+        std::string opened = "/proc/self/fd/" + std::to_string(fileno(fp));
+
+        int length = 0;
+        uint8_t *hash = ph_mh_imagehash(opened.c_str(), length);
+        std::fclose(fp);
+
+        if (hash == nullptr || length != MH_HASH_LENGTH)
+        {
+            std::free(hash);
+            return nullptr;
+        }
+
+        ImageMH *mh = new ImageMH();
+        std::memcpy(mh->sha256, sha256, SHA256_DIGEST_LENGTH);
+        mh->hash = MHHash::from_bytes(hash);
+        std::free(hash);
+
+        cache->insert(mh);
+        return mh;
+    }
+
+    SetList Verifier::verify(const ImageRecords &images, const SetList &sets, bool keep_alone)
+    {
+        /* Only the pairs the DCT hash isn't sure about need checking, and only their images need */
+        /* the slow hash: one of every image with the same contents, from wherever it is. */
+        std::unordered_map<std::string, uint32_t> needed;
+
+        for (size_t s = 0; s < sets.size(); s++)
+        {
+            uint32_t first = *sets.begin(s);
+
+            for (const uint32_t *id = sets.begin(s) + 1; id != sets.end(s); id++)
+            {
+                if (hamming_distance(images[first].phash, images[*id].phash) <= MH_VERIFY_ABOVE_HAM)
+                    continue;
+
+                for (uint32_t which : {first, *id})
+                {
+                    if (!images.filename(which).empty())
+                        needed.insert({std::string(images[which].sha256, SHA256_DIGEST_LENGTH), which});
+                }
+            }
+        }
+
+        /* The ones the cache doesn't know are decoded on the pool, all at once. */
+        std::unordered_map<std::string, ImageMH*> hashes;
+        std::mutex hashes_mutex;
+        HashingGroup group;
+
+        for (auto &[key, which] : needed)
+        {
+            ImageMH *mh = cache->get_mh((sha256ptr_t) images[which].sha256);
+
+            if (mh != nullptr)
+            {
+                hashes[key] = mh;
+                continue;
+            }
+
+            const sha256_t *sha256 = images[which].sha256;
+            std::string path = images.abspath(which);
+
+            group.submit(pool, [this, key, sha256, path, &hashes, &hashes_mutex]() -> void {
+                ImageMH *computed = compute(sha256, path);
+
+                std::lock_guard<std::mutex> lock(hashes_mutex);
+                hashes[key] = computed;
+            });
+        }
+
+        group.wait();
+
+        auto mh_of = [&hashes, &images](uint32_t id) -> ImageMH* {
+            std::unordered_map<std::string, ImageMH*>::iterator it =
+                hashes.find(std::string(images[id].sha256, SHA256_DIGEST_LENGTH));
+
+            return it == hashes.end() ? nullptr : it->second;
+        };
+
+        SetList verified;
+
+        for (size_t s = 0; s < sets.size(); s++)
+        {
+            uint32_t first = *sets.begin(s);
+            ImageMH *first_mh = mh_of(first);
+
+            verified.push(first);
+
+            for (const uint32_t *id = sets.begin(s) + 1; id != sets.end(s); id++)
+            {
+                ImageMH *mh = mh_of(*id);
+
+                if (hamming_distance(images[first].phash, images[*id].phash) <= MH_VERIFY_ABOVE_HAM ||
+                        first_mh == nullptr || mh == nullptr || hamming_distance(first_mh->hash, mh->hash) <= MH_VERIFY_MAX_HAM)
+                    verified.push(*id);
+            }
+
+            if (verified.pending() == 1 && !keep_alone)
+                verified.discard_set();
+            else
+                verified.end_set();
+        }
+
+        return verified;
+    }
+}
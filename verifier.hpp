@@ -0,0 +1,37 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "phash/pHash.h"
+#include "images.hpp"
+#include "simpic_cache.hpp"
+#include "hashing_pool.hpp"
+#include "utils.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* The second, slower stage of comparing images: the 64-bit DCT hash is cheap to compare but lets through plenty of images that only look alike to it, so matches that aren't very close by it are checked again with the Marr-Hildreth hash. That one is only worked out (once, then cached by SHA256) for images that are in such a match, which is a small part of any directory. */
+    class Verifier
+    {
+    private:
+        SimpicCache *cache;
+        HashingPool *pool;
+
+        /* Decode the image (with these contents, at path) again for its Marr-Hildreth hash, and cache it. Returns nullptr if it can't be, or if the file at path doesn't have these contents anymore. */
+        ImageMH *compute(const sha256_t *sha256, const std::string &path);
+
+    public:
+        Verifier(SimpicCache *_cache, HashingPool *_pool);
+
+        /* Go through sets of similar images (ids in images, the first of each being what the others were compared to, like from ImageRecords::find_similar()) and take out the images that the Marr-Hildreth hash says aren't alike after all. Sets with nothing but their first image left are dropped, unless keep_alone. If either image of a pair can't be decoded, the DCT hash has the last word. */
+        SetList verify(const ImageRecords &images, const SetList &sets, bool keep_alone);
+    };
+}
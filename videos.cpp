@@ -0,0 +1,190 @@
+#include "videos.hpp"
+
+namespace SimpicServerLib
+{
+    Video::Video()
+    {
+        length = 0;
+    }
+
+    VideoTypes Video::type_from_extension(const std::string &extension)
+    {
+        if (extension == "mp4" || extension == "m4v")
+            return VideoTypes::MP4;
+
+        if (extension == "mkv")
+            return VideoTypes::MKV;
+
+        if (extension == "webm")
+            return VideoTypes::WebM;
+
+        if (extension == "avi")
+            return VideoTypes::AVI;
+
+        if (extension == "mov")
+            return VideoTypes::MOV;
+
+        return VideoTypes::Undefined;
+    }
+
+    std::optional<std::vector<uint64_t>> Video::keyframe_hashes(int fd)
+    {
+        std::string filter = "fps=" + std::to_string(VIDEO_SAMPLE_FPS) + ",scale=" +
+            std::to_string(VIDEO_FRAME_EDGE) + ":" + std::to_string(VIDEO_FRAME_EDGE);
+
+        pid_t pid;
+        int out = spawn_decoder({
+            VIDEO_DECODER, "-nostdin", "-loglevel", "error", "-i", "/dev/fd/3",
+            "-an", "-vf", filter, "-pix_fmt", "gray", "-f", "rawvideo", "pipe:1"
+        }, fd, pid);
+
+        if (out < 0)
+            return std::nullopt;
+
+        const size_t frame_size = VIDEO_FRAME_EDGE * VIDEO_FRAME_EDGE;
+
+        std::vector<uint8_t> frame(frame_size);
+        std::vector<float> luma(frame_size);
+        std::vector<uint64_t> keyframes;
+
+        float previous[64] = {0};
+        bool first = true;
+
+        /* The frame of the current shot that changed the least from the one before it. */
+        bool in_shot = false;
+        uint64_t best = 0;
+        float best_change = 0;
+
+        while (true)
+        {
+            if (read_fully(out, frame.data(), frame_size) < frame_size)
+                break;
+
+            float histogram[64] = {0};
+
+            for (size_t i = 0; i < frame_size; i++)
+            {
+                luma[i] = frame[i];
+                histogram[frame[i] >> 2] += 1.0f / frame_size;
+            }
+
+            /* Half the L1 distance between histograms: 0 if they're the same, 1 if nothing overlaps. */
+            float change = 0;
+
+            for (int b = 0; b < 64; b++)
+                change += std::abs(histogram[b] - previous[b]) / 2;
+
+            if (first)
+                change = 0;
+
+            std::memcpy(previous, histogram, sizeof(previous));
+            first = false;
+
+            if (in_shot && change > VIDEO_CUT_THRESHOLD)
+            {
+                keyframes.push_back(best);
+                in_shot = false;
+            }
+
+            if (!in_shot || change < best_change)
+            {
+                std::vector<float> blurred = DCTBlock::blur(luma, VIDEO_FRAME_EDGE, VIDEO_FRAME_EDGE);
+                best = DCTBlock::of_blurred(blurred, VIDEO_FRAME_EDGE, VIDEO_FRAME_EDGE).hash();
+                best_change = change;
+                in_shot = true;
+            }
+        }
+
+        if (in_shot)
+            keyframes.push_back(best);
+
+        /* Whatever it decoded before it failed isn't the whole video, and isn't to be cached as if it were. */
+        if (!finish_decoder(out, pid))
+            return std::nullopt;
+
+        /* A video that ends early (but decodes fine up to there) still has the keyframes up to there. */
+        if (keyframes.empty())
+            return std::nullopt;
+
+        return keyframes;
+    }
+
+    double Video::similarity(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b, int threshold)
+    {
+        if (a.empty() || b.empty())
+            return 0;
+
+        /* A longest common subsequence, row by row. */
+        std::vector<uint32_t> above(b.size() + 1, 0);
+        std::vector<uint32_t> row(b.size() + 1, 0);
+
+        for (size_t i = 1; i <= a.size(); i++)
+        {
+            for (size_t j = 1; j <= b.size(); j++)
+            {
+                if (hamming_distance(a[i - 1], b[j - 1]) <= threshold)
+                    row[j] = above[j - 1] + 1;
+                else
+                    row[j] = std::max(above[j], row[j - 1]);
+            }
+
+            std::swap(above, row);
+        }
+
+        return (double) above[b.size()] / std::min(a.size(), b.size());
+    }
+
+    std::vector<std::vector<Video*>*> Video::find_similar_videos(std::vector<Video*> &videos, double min_similarity)
+    {
+        /* Every keyframe of every video, and which video it is from. */
+        std::vector<DCTHash> frames;
+        std::vector<uint32_t> owner;
+
+        for (uint32_t v = 0; v < videos.size(); v++)
+        {
+            for (uint64_t frame : videos[v]->frames)
+            {
+                frames.push_back(frame);
+                owner.push_back(v);
+            }
+        }
+
+        HammingIndex<DCTHash> index(frames);
+        std::vector<std::vector<Video*>*> results;
+
+        for (uint32_t v = 0; v < videos.size(); v++)
+        {
+            /* Only the videos after this one: those before it already compared themselves to it. */
+            std::unordered_set<uint32_t> candidates;
+
+            for (uint64_t frame : videos[v]->frames)
+                for (uint32_t id : index.search(frame, VIDEO_INDEX_MAX_HAM))
+                    if (owner[id] > v)
+                        candidates.insert(owner[id]);
+
+            std::vector<uint32_t> sorted(candidates.begin(), candidates.end());
+            std::sort(sorted.begin(), sorted.end());
+
+            std::vector<Video*> *set = new std::vector<Video*>({videos[v]});
+
+            for (uint32_t other : sorted)
+                if (similarity(videos[v]->frames, videos[other]->frames) >= min_similarity)
+                    set->push_back(videos[other]);
+
+            if (set->size() < 2)
+            {
+                delete set;
+                continue;
+            }
+
+            results.push_back(set);
+        }
+
+        return results;
+    }
+
+    std::string Video::abspath()
+    {
+        return concatenate_folder(path, filename);
+    }
+}
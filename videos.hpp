@@ -3,24 +3,62 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <optional>
+#include <algorithm>
+#include <unordered_set>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
 
 #include "sha256.hpp"
-#include "simpic_cache.hpp"
+#include "perceptual_hash.hpp"
+#include "hamming_index.hpp"
+#include "dihedral.hpp"
 #include "utils.hpp"
-#include "phash/pHash.h"
+
+#include "config.hpp"
 
 namespace SimpicServerLib
 {
     enum class VideoTypes
     {
-        MP4
+        MP4,
+        MKV,
+        WebM,
+        AVI,
+        MOV,
+        Undefined // <~~ The file isn't a supported file type.
     };
 
     class Video
     {
-    private:
+    public:
+        uint64_t length;
+
+        /* The DCT hash of one frame of every shot, in order: a video is compared by how many of these another one has, in the same order. */
+        std::vector<uint64_t> frames;
+
         std::string filename;
         std::string path;
 
+        sha256_t sha256[SHA256_DIGEST_LENGTH];
+
+        /* Given an extension (without the .), return the video type. */
+        static VideoTypes type_from_extension(const std::string &extension);
+
+        /* Decode the video (already opened as fd) and hash its keyframes. The frames are streamed one at a time, small and gray, out of an external decoder (VIDEO_DECODER), so only one of them is ever in memory however long the video is. A frame is the keyframe of its shot if it is the one that changed the least from the frame before it; a new shot starts when the histogram changes by more than VIDEO_CUT_THRESHOLD. Returns nothing if the video can't be decoded, or the decoder fails partway through. */
+        static std::optional<std::vector<uint64_t>> keyframe_hashes(int fd);
+
+        /* How alike two sequences of keyframe hashes are, between 0 and 1: the longest run of keyframes (not necessarily next to each other) that both have in the same order, two keyframes being the same if they're within threshold bits, over the length of the shorter one. This is pHash's ph_dct_videohash_dist(), with two rows instead of the whole table. */
+        static double similarity(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b, int threshold = VIDEO_FRAME_MAX_HAM);
+
+        /* Group similar videos together, the first of each group being what the others are similar to, like Image::find_similar_images(). Only videos that have at least one keyframe within VIDEO_INDEX_MAX_HAM bits of each other (found through an index of every keyframe) are compared at all. */
+        static std::vector<std::vector<Video*>*> find_similar_videos(std::vector<Video*> &videos, double min_similarity);
+
+        Video();
+
+        std::string abspath();
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,270 @@
+#include "watcher.hpp"
+
+namespace SimpicServerLib
+{
+    Watcher::Watcher(SimpicCache *_cache, Scanner *_scanner, HashingPool *_pool)
+    {
+        cache = _cache;
+        scanner = _scanner;
+        pool = _pool;
+
+        in_flight = 0;
+        hashed = false;
+        tokens = WATCH_RATE_LIMIT;
+
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (fd < 0)
+            std::cerr << "Failed to initialize inotify, nothing will be watched: " << std::strerror(errno) << "\n";
+    }
+
+    Watcher::~Watcher()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool Watcher::add_root(const std::string &dir)
+    {
+        struct stat info;
+
+        if (fd < 0 || stat(dir.c_str(), &info) < 0 || !S_ISDIR(info.st_mode))
+            return false;
+
+        roots.push_back(dir);
+        return true;
+    }
+
+    void Watcher::start()
+    {
+        if (fd < 0 || roots.empty())
+            return;
+
+        std::thread watching(&Watcher::run, this);
+        watching.detach();
+    }
+
+    void Watcher::watch_tree(const std::string &dir)
+    {
+        std::vector<std::string> stack = {dir};
+
+        while (!stack.empty())
+        {
+            std::string current = stack.back();
+            stack.pop_back();
+
+            /* Watching it before listing it, so nothing written in between is missed. */
+            int wd = inotify_add_watch(fd, current.c_str(),
+                    IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW);
+
+            if (wd < 0)
+            {
+                /* ENOSPC: out of watches, see /proc/sys/fs/inotify/max_user_watches. */
+                std::cerr << "Failed to watch '" << current << "': " << std::strerror(errno) << "\n";
+                continue;
+            }
+
+            watches[wd] = current;
+
+            DIR *d = opendir(current.c_str());
+
+            if (d == nullptr)
+                continue;
+
+            for (struct dirent *ent = readdir(d); ent != nullptr; ent = readdir(d))
+            {
+                /* Hidden directories (and . and ..) are skipped, like scans do. */
+                if (ent->d_name[0] == '.')
+                    continue;
+
+                std::string path = current + "/" + ent->d_name;
+                unsigned char type = ent->d_type;
+
+                if (type == DT_UNKNOWN)
+                {
+                    struct stat info;
+
+                    if (lstat(path.c_str(), &info) < 0)
+                        continue;
+
+                    type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+
+                if (type == DT_DIR)
+                    stack.push_back(path);
+                else if (type == DT_REG)
+                    touch(path);
+            }
+
+            closedir(d);
+        }
+    }
+
+    void Watcher::touch(const std::string &path)
+    {
+        if (SimpicCache::get_type_from_extension(get_extension(path)) == SimpicEntryTypes::Undefined)
+            return;
+
+        pending[path] = std::chrono::steady_clock::now();
+    }
+
+    void Watcher::read_events()
+    {
+        alignas(struct inotify_event) char buffer[BUFFER_SIZE * 8];
+
+        while (true)
+        {
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+
+            if (length <= 0)
+                return;
+
+            for (char *ptr = buffer; ptr < buffer + length; )
+            {
+                struct inotify_event *event = (struct inotify_event*) ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                /* Events were dropped: go through everything again, cached files are skipped anyway. */
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    std::cerr << "The inotify queue overflowed, going through the watched directories again.\n";
+
+                    for (const std::string &root : roots)
+                        watch_tree(root);
+
+                    continue;
+                }
+
+                /* The directory is gone (or unmounted). */
+                if (event->mask & IN_IGNORED)
+                {
+                    watches.erase(event->wd);
+                    continue;
+                }
+
+                std::unordered_map<int, std::string>::iterator it = watches.find(event->wd);
+
+                if (it == watches.end() || event->len == 0 || event->name[0] == '.')
+                    continue;
+
+                std::string path = it->second + "/" + event->name;
+
+                /* A new directory (or one moved in) has to be watched too, and might have files already. */
+                if (event->mask & IN_ISDIR)
+                {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                        watch_tree(path);
+
+                    continue;
+                }
+
+                /* Files are only interesting once they've been written and closed (or moved in whole). */
+                if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                    touch(path);
+            }
+        }
+    }
+
+    bool Watcher::is_cached(const std::string &path)
+    {
+        struct stat info;
+
+        /* If it's gone, there's nothing to do for it either. */
+        if (stat(path.c_str(), &info) < 0)
+            return true;
+
+        SHA256CachedObject *obj = cache->get_sha256(path, info.st_size, info.st_mtim.tv_sec);
+        return obj != nullptr && (cache->get_image(obj->hash) != nullptr || cache->get_video(obj->hash) != nullptr ||
+            cache->get_audio(obj->hash) != nullptr || cache->get_text(obj->hash) != nullptr);
+    }
+
+    void Watcher::dispatch(double elapsed)
+    {
+        tokens = std::min((double) WATCH_RATE_LIMIT, tokens + elapsed * WATCH_RATE_LIMIT);
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::map<std::string, std::chrono::steady_clock::time_point>::iterator it = pending.begin();
+
+        while (it != pending.end() && tokens >= 1 && in_flight < WATCH_MAX_IN_FLIGHT)
+        {
+            /* Still being written to (or copied over) as far as we know. */
+            if (now - it->second < std::chrono::milliseconds(WATCH_DEBOUNCE_MS))
+            {
+                it++;
+                continue;
+            }
+
+            std::string path = it->first;
+            it = pending.erase(it);
+
+            if (is_cached(path))
+                continue;
+
+            tokens -= 1;
+            in_flight++;
+
+            pool->submit([this, path]() -> void {
+                int ffd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                std::FILE *fp = ffd < 0 ? nullptr : fdopen(ffd, "rb");
+
+                if (fp == nullptr)
+                {
+                    if (ffd >= 0)
+                        close(ffd);
+                }
+                else
+                {
+                    struct stat fileinfo;
+                    fstat(ffd, &fileinfo);
+
+                    size_t slash = path.rfind('/');
+                    SHA256CachedObject *sha256_obj = cache->sha256_of(path, fp, fileinfo);
+                    scanner->load(path.substr(0, slash), path.substr(slash + 1), fp, sha256_obj->hash);
+
+                    std::fclose(fp);
+                    hashed = true;
+                }
+
+                in_flight--;
+            }, true);
+        }
+    }
+
+    void Watcher::run()
+    {
+        for (const std::string &root : roots)
+        {
+            std::cout << "Watching '" << root << "'." << std::endl;
+            watch_tree(root);
+        }
+
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point last_save = last;
+
+        while (true)
+        {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+
+            /* Wake up regularly even without events, to hand out what has settled down. */
+            if (poll(&pfd, 1, 250) > 0)
+                read_events();
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            dispatch(std::chrono::duration<double>(now - last).count());
+            last = now;
+
+            /* What was hashed in the background only lands on disk with the next save: do it once */
+            /* a burst of work is over, or every so often while it goes on. */
+            bool idle = pending.empty() && in_flight == 0;
+
+            if (hashed && (idle || now - last_save >= std::chrono::seconds(WATCH_SAVE_INTERVAL)))
+            {
+                hashed = false;
+                last_save = now;
+                cache->saveall();
+            }
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "simpic_cache.hpp"
+#include "hashing_pool.hpp"
+#include "scanner.hpp"
+#include "utils.hpp"
+
+#include "config.hpp"
+
+namespace SimpicServerLib
+{
+    /* Keeps the cache warm for a set of watched directory trees (given with -w/--watch), so that scanning them later is almost entirely cache hits. */
+    /* Every directory in the trees gets an inotify watch (inotify isn't recursive, and fanotify on whole mounts needs CAP_SYS_ADMIN). Media that is written or moved in is hashed on the pool's background queue, once nothing has happened to it for WATCH_DEBOUNCE_MS and at most WATCH_RATE_LIMIT files a second. */
+    class Watcher
+    {
+    private:
+        SimpicCache *cache;
+        Scanner *scanner;
+        HashingPool *pool;
+
+        int fd;
+        std::vector<std::string> roots;
+        std::unordered_map<int, std::string> watches; // inotify watch descriptor -> directory.
+
+        /* Files waiting for things to quiet down, and when they were last touched. */
+        std::map<std::string, std::chrono::steady_clock::time_point> pending;
+
+        std::atomic<int> in_flight;
+        std::atomic<bool> hashed;
+        double tokens;
+
+        /* Watch a directory and everything below it, and queue every supported file in it. */
+        void watch_tree(const std::string &dir);
+
+        /* Queue a file, if it's something we can hash. */
+        void touch(const std::string &path);
+
+        void read_events();
+
+        /* Hand the files that have settled down to the pool, as far as the rate limit allows. */
+        void dispatch(double elapsed);
+
+        /* Whether the cache already knows this file as it is now, so it needn't be queued at all. */
+        bool is_cached(const std::string &path);
+
+        void run();
+
+    public:
+        Watcher(SimpicCache *_cache, Scanner *_scanner, HashingPool *_pool);
+        ~Watcher();
+
+        /* Start watching the tree at dir (once start() is called). Returns false if it can't be watched. */
+        bool add_root(const std::string &dir);
+
+        /* Watch the roots and start warming the cache with what's already in them, in a thread of its own. */
+        void start();
+    };
+}